@@ -0,0 +1,313 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+// Micro-benchmarks for parsing and serializing stanzas.
+//
+// Each sample is parsed from its serialized form, as done by the stream:
+// the DOM is built with QDomDocument and handed to parse(). Serializing
+// writes the parsed object with toXml().
+//
+// Besides the usual QBENCHMARK results, a line is printed per benchmark:
+//
+//   RESULT parse:message-omemo 10523 ns/op 181 allocs/op 13876 bytes/op
+//
+// Allocations include the buffers of Qt's containers with glibc, see
+// AllocationCounter.
+
+#include "QXmppDataForm.h"
+#include "QXmppJingleIq.h"
+#include "QXmppMessage.h"
+#include "QXmppPresence.h"
+#include "QXmppPubSubBaseItem.h"
+#include "QXmppPubSubIq_p.h"
+#include "QXmppRosterIq.h"
+
+#include "AllocationCounter.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QDomDocument>
+#include <QElapsedTimer>
+#include <QXmlStreamWriter>
+#include <QtTest>
+
+using namespace QXmpp::Private;
+
+// minimum duration of the loop measuring ns/op and allocations/op
+constexpr qint64 MEASURE_NSECS = 200 * 1000 * 1000;
+
+struct Sample
+{
+    QByteArray name;
+    QByteArray xml;
+    // parses the DOM element into a new object
+    std::function<void(const QDomElement &)> parse;
+    // serializes the parsed sample
+    std::function<void(QXmlStreamWriter *)> serialize;
+};
+
+template<typename T>
+static Sample sample(const QByteArray &name, const QByteArray &xml)
+{
+    QDomDocument document;
+    document.setContent(xml, true);
+    auto parsed = std::make_shared<T>();
+    parsed->parse(document.documentElement());
+
+    return {
+        name,
+        xml,
+        [](const QDomElement &element) {
+            T object;
+            object.parse(element);
+        },
+        [parsed](QXmlStreamWriter *writer) {
+            parsed->toXml(writer);
+        },
+    };
+}
+
+static QByteArray rosterXml(int count)
+{
+    QByteArray xml = "<iq id=\"roster1\" to=\"juliet@example.com/balcony\" type=\"result\">"
+                     "<query xmlns=\"jabber:iq:roster\" ver=\"ver7\">";
+    for (int i = 0; i < count; ++i) {
+        const auto number = QByteArray::number(i);
+        xml += "<item jid=\"contact" + number + "@example.com\" name=\"Contact " + number + "\" subscription=\"both\">"
+               "<group>Friends</group>"
+               "</item>";
+    }
+    xml += "</query></iq>";
+    return xml;
+}
+
+static QByteArray pubSubItemsXml(int count)
+{
+    QByteArray xml = "<iq id=\"items1\" to=\"francisco@denmark.lit/barracks\" from=\"pubsub.shakespeare.lit\" type=\"result\">"
+                     "<pubsub xmlns=\"http://jabber.org/protocol/pubsub\">"
+                     "<items node=\"princely_musings\">";
+    for (int i = 0; i < count; ++i) {
+        xml += "<item id=\"368866411b877c30064a5f62b917cff" + QByteArray::number(i) + "\"/>";
+    }
+    xml += "</items></pubsub></iq>";
+    return xml;
+}
+
+static const std::vector<Sample> &samples()
+{
+    static const std::vector<Sample> samples = {
+        sample<QXmppMessage>(
+            "message",
+            "<message id=\"message1\" to=\"juliet@capulet.lit/balcony\" from=\"romeo@montague.lit/orchard\" type=\"chat\">"
+            "<body>Wherefore art thou, Romeo?</body>"
+            "</message>"),
+        sample<QXmppMessage>(
+            "message-receipt",
+            "<message id=\"message2\" to=\"juliet@capulet.lit/balcony\" from=\"romeo@montague.lit/orchard\" type=\"chat\">"
+            "<body>Wherefore art thou, Romeo?</body>"
+            "<request xmlns=\"urn:xmpp:receipts\"/>"
+            "</message>"),
+        sample<QXmppMessage>(
+            "message-marker",
+            "<message id=\"message3\" to=\"juliet@capulet.lit/balcony\" from=\"romeo@montague.lit/orchard\" type=\"chat\">"
+            "<thread>sleeping</thread>"
+            "<displayed xmlns=\"urn:xmpp:chat-markers:0\" id=\"message1\"/>"
+            "</message>"),
+        sample<QXmppMessage>(
+            "message-reaction",
+            "<message id=\"message4\" to=\"juliet@capulet.lit/balcony\" from=\"romeo@montague.lit/orchard\" type=\"chat\">"
+            "<reactions xmlns=\"urn:xmpp:reactions:0\" id=\"744f6e18-a57a-11e9-a656-4889e7820c76\">"
+            "<reaction>\xf0\x9f\x91\x8b</reaction>"
+            "<reaction>\xf0\x9f\x90\xa2</reaction>"
+            "</reactions>"
+            "<store xmlns=\"urn:xmpp:hints\"/>"
+            "</message>"),
+        sample<QXmppMessage>(
+            "message-omemo",
+            "<message id=\"message5\" to=\"juliet@capulet.lit\" from=\"romeo@montague.lit/orchard\" type=\"chat\">"
+            "<encrypted xmlns=\"urn:xmpp:omemo:2\">"
+            "<header sid=\"27183\">"
+            "<keys jid=\"juliet@capulet.lit\">"
+            "<key rid=\"31415\">Tm90IGFuIGFjdHVhbCBrZXkgYnV0IGxvbmcgZW5vdWdoIHRvIGxvb2sgbGlrZSBvbmU=</key>"
+            "</keys>"
+            "<keys jid=\"romeo@montague.lit\">"
+            "<key rid=\"1337\">QW5vdGhlciBrZXkgd2hpY2ggaXMgbm90IGFuIGFjdHVhbCBrZXkgZWl0aGVy</key>"
+            "<key kex=\"true\" rid=\"12321\">VGhpcyBvbmUgaXMgYSBrZXkgZXhjaGFuZ2UgbWVzc2FnZSwgd2hpY2ggaXMgbG9uZ2VyIHRoYW4gdGhlIG90aGVycw==</key>"
+            "</keys>"
+            "</header>"
+            "<payload>U2VhbGVkIHdpdGggYSBjaXBoZXIgdGhlIGJlbmNobWFyayBkb2VzIG5vdCBjYXJlIGFib3V0</payload>"
+            "</encrypted>"
+            "<encryption xmlns=\"urn:xmpp:eme:0\" namespace=\"urn:xmpp:omemo:2\" name=\"OMEMO\"/>"
+            "<store xmlns=\"urn:xmpp:hints\"/>"
+            "</message>"),
+        sample<QXmppPresence>(
+            "presence-caps",
+            "<presence from=\"romeo@montague.lit/orchard\">"
+            "<show>away</show>"
+            "<status>In the orchard</status>"
+            "<priority>5</priority>"
+            "<c xmlns=\"http://jabber.org/protocol/caps\" hash=\"sha-1\" node=\"https://qxmpp.org\" ver=\"QgayPKawpkPSDYmwT/WM94uAlu0=\"/>"
+            "</presence>"),
+        sample<QXmppPresence>(
+            "presence-muc-item",
+            "<presence to=\"pistol@shakespeare.lit/harfleur\" from=\"harfleur@henryv.shakespeare.lit/pistol\" type=\"unavailable\">"
+            "<x xmlns=\"http://jabber.org/protocol/muc#user\">"
+            "<item affiliation=\"none\" role=\"none\">"
+            "<actor jid=\"fluellen@shakespeare.lit\"/>"
+            "<reason>Avaunt, you cullion!</reason>"
+            "</item>"
+            "<status code=\"307\"/>"
+            "</x>"
+            "</presence>"),
+        sample<QXmppRosterIq>("roster-1k", rosterXml(1000)),
+        sample<QXmppRosterIq>("roster-10k", rosterXml(10000)),
+        sample<PubSubIq<>>("pubsub-items", pubSubItemsXml(20)),
+        sample<QXmppJingleIq>(
+            "jingle-session-initiate",
+            "<iq id=\"jingle1\" to=\"juliet@capulet.lit/balcony\" from=\"romeo@montague.lit/orchard\" type=\"set\">"
+            "<jingle xmlns=\"urn:xmpp:jingle:1\" action=\"session-initiate\" initiator=\"romeo@montague.lit/orchard\" sid=\"a73sjjvkla37jfea\">"
+            "<content creator=\"initiator\" name=\"voice\">"
+            "<description xmlns=\"urn:xmpp:jingle:apps:rtp:1\" media=\"audio\">"
+            "<payload-type id=\"96\" name=\"speex\" clockrate=\"16000\"/>"
+            "<payload-type id=\"97\" name=\"speex\" clockrate=\"8000\"/>"
+            "<payload-type id=\"18\" name=\"G729\"/>"
+            "<payload-type id=\"0\" name=\"PCMU\"/>"
+            "<payload-type id=\"103\" name=\"L16\" channels=\"2\" clockrate=\"16000\"/>"
+            "</description>"
+            "<transport xmlns=\"urn:xmpp:jingle:transports:ice-udp:1\" ufrag=\"8hhy\" pwd=\"asd88fgpdd777uzjYhagZg\">"
+            "<candidate component=\"1\" foundation=\"1\" generation=\"0\" id=\"el0747fg11\" ip=\"10.0.1.1\" network=\"1\" port=\"8998\" priority=\"2130706431\" protocol=\"udp\" type=\"host\"/>"
+            "<candidate component=\"1\" foundation=\"2\" generation=\"0\" id=\"y3s2b30v3r\" ip=\"192.0.2.3\" network=\"1\" port=\"45664\" priority=\"1694498815\" protocol=\"udp\" type=\"srflx\"/>"
+            "</transport>"
+            "</content>"
+            "</jingle>"
+            "</iq>"),
+        sample<QXmppDataForm>(
+            "data-form",
+            "<x xmlns=\"jabber:x:data\" type=\"form\">"
+            "<title>Bot Configuration</title>"
+            "<instructions>Fill out this form to configure your new bot!</instructions>"
+            "<field type=\"hidden\" var=\"FORM_TYPE\"><value>jabber:bot</value></field>"
+            "<field type=\"fixed\"><value>Section 1: Bot Info</value></field>"
+            "<field type=\"text-single\" label=\"The name of your bot\" var=\"botname\"/>"
+            "<field type=\"text-multi\" label=\"Helpful description of your bot\" var=\"description\"/>"
+            "<field type=\"boolean\" label=\"Public bot?\" var=\"public\"><required/></field>"
+            "<field type=\"text-private\" label=\"Password for special access\" var=\"password\"/>"
+            "<field type=\"list-multi\" label=\"What features will the bot support?\" var=\"features\">"
+            "<option label=\"Contests\"><value>contests</value></option>"
+            "<option label=\"News\"><value>news</value></option>"
+            "<option label=\"Polls\"><value>polls</value></option>"
+            "<option label=\"Reminders\"><value>reminders</value></option>"
+            "<option label=\"Search\"><value>search</value></option>"
+            "<value>news</value>"
+            "<value>search</value>"
+            "</field>"
+            "<field type=\"list-single\" label=\"Maximum number of subscribers\" var=\"maxsubs\">"
+            "<value>20</value>"
+            "<option label=\"10\"><value>10</value></option>"
+            "<option label=\"20\"><value>20</value></option>"
+            "<option label=\"30\"><value>30</value></option>"
+            "</field>"
+            "<field type=\"jid-multi\" label=\"People to invite\" var=\"invitelist\">"
+            "<desc>Tell all your friends about your new bot!</desc>"
+            "</field>"
+            "</x>"),
+    };
+    return samples;
+}
+
+class BenchParsing : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void parse_data();
+    Q_SLOT void parse();
+    Q_SLOT void serialize_data();
+    Q_SLOT void serialize();
+
+    static void addSamples();
+    template<typename Operation>
+    static void report(const char *kind, Operation operation);
+};
+
+void BenchParsing::addSamples()
+{
+    QTest::addColumn<int>("index");
+
+    const auto &all = samples();
+    for (int i = 0; i < int(all.size()); ++i) {
+        QTest::newRow(all[i].name.constData()) << i;
+    }
+}
+
+// Prints ns/op, allocations/op and bytes/op of the operation.
+template<typename Operation>
+void BenchParsing::report(const char *kind, Operation operation)
+{
+    qint64 iterations = 0;
+    QElapsedTimer timer;
+    AllocationCounter counter;
+    timer.start();
+    do {
+        operation();
+        iterations++;
+    } while (timer.nsecsElapsed() < MEASURE_NSECS);
+    const qint64 nsecs = timer.nsecsElapsed();
+
+    qInfo("RESULT %s:%s %lld ns/op %lld allocs/op %lld bytes/op",
+          kind,
+          QTest::currentDataTag(),
+          nsecs / iterations,
+          counter.allocations() / iterations,
+          counter.bytes() / iterations);
+}
+
+void BenchParsing::parse_data()
+{
+    addSamples();
+}
+
+void BenchParsing::parse()
+{
+    QFETCH(int, index);
+    const auto &sample = samples()[index];
+
+    const auto operation = [&sample]() {
+        QDomDocument document;
+        document.setContent(sample.xml, true);
+        sample.parse(document.documentElement());
+    };
+
+    QBENCHMARK {
+        operation();
+    }
+    report("parse", operation);
+}
+
+void BenchParsing::serialize_data()
+{
+    addSamples();
+}
+
+void BenchParsing::serialize()
+{
+    QFETCH(int, index);
+    const auto &sample = samples()[index];
+
+    const auto operation = [&sample]() {
+        QByteArray data;
+        QXmlStreamWriter writer(&data);
+        sample.serialize(&writer);
+    };
+
+    QBENCHMARK {
+        operation();
+    }
+    report("serialize", operation);
+}
+
+QTEST_MAIN(BenchParsing)
+#include "bench_parsing.moc"
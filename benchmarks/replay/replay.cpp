@@ -0,0 +1,379 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+// Replays captured client streams against QXmppServer.
+//
+// Starts an in-process server and opens one in-memory connection, see
+// QXmppServer::connectInMemory(), per capture written by
+// QXmppServer::setCaptureDirectory() or QXmppStream::setCaptureDevice(). The
+// inbound data of each capture is sent to the server, either with the captured
+// timing scaled by --speed or as fast as possible. In both cases data which
+// was sent in response to the server is held back until the server answered.
+// The results are printed as JSON:
+//
+//  - bytes sent and received, and throughput in MB/s
+//  - stanzas handled by the server per type, and stanzas/s
+//
+// The throughput is measured until the last data was sent or received, the
+// time waited for trailing responses with --drain is not included. Copies of
+// a capture replayed with --repeat bind distinct resources.
+//
+// The captures must not use TLS, the server accepts any PLAIN credentials.
+// Mechanisms relying on nonces such as SCRAM cannot be replayed.
+//
+// Only the client streams captured by the server are replayed. QXmppClient
+// doesn't expose its stream for capturing, and the server's side of a client
+// capture refers to the random IQ IDs and SASL nonces of the original client,
+// so it couldn't be fed to a new QXmppClient without rewriting them.
+
+#include "QXmppLogger.h"
+#include "QXmppMemoryTransport.h"
+#include "QXmppMetrics.h"
+#include "QXmppPasswordChecker.h"
+#include "QXmppServer.h"
+#include "QXmppStreamCapture.h"
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+
+namespace {
+
+const char *const STANZA_KIND_NAMES[] = { "message", "presence", "iq" };
+
+struct Options
+{
+    QStringList captures;
+    double speed = 0;
+    int repeat = 1;
+    int workerThreads = 0;
+    int drainMs = 1000;
+    QString domain = QStringLiteral("localhost");
+    QString output;
+};
+
+// Accepts any credentials, the captured passwords are not known.
+class AcceptingPasswordChecker : public QXmppPasswordChecker
+{
+public:
+    QXmppPasswordReply *checkPassword(const QXmppPasswordRequest &) override
+    {
+        auto *reply = new QXmppPasswordReply;
+        reply->finishLater();
+        return reply;
+    }
+};
+
+// Inbound data of a capture.
+struct Step
+{
+    // time since the first step in microseconds
+    qint64 timestamp = 0;
+    QByteArray data;
+    // whether the server sent data before this step was captured
+    bool awaitResponse = false;
+};
+
+bool readCapture(const QString &path, std::vector<Step> &steps)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning("Could not open %s", qPrintable(path));
+        return false;
+    }
+    QXmppStreamCaptureReader reader(&file);
+    if (!reader.isValid()) {
+        qWarning("%s is not a stream capture", qPrintable(path));
+        return false;
+    }
+
+    QXmppStreamCaptureReader::Record record;
+    bool responded = false;
+    qint64 first = -1;
+    while (reader.readNext(record)) {
+        if (record.direction == QXmppStreamCapture::Outbound) {
+            responded = true;
+            continue;
+        }
+        if (first < 0) {
+            first = record.timestamp;
+        }
+        steps.push_back({ record.timestamp - first, std::move(record.data), responded && !steps.empty() });
+        responded = false;
+    }
+    if (!file.atEnd()) {
+        qWarning("%s is truncated", qPrintable(path));
+    }
+    return true;
+}
+
+// Appends a suffix to the resources bound by the steps, so the copies of a
+// capture replayed concurrently don't replace each other's sessions.
+std::vector<Step> withResourceSuffix(const std::vector<Step> &steps, const QByteArray &suffix)
+{
+    auto copy = steps;
+    for (auto &step : copy) {
+        int start = 0;
+        while ((start = step.data.indexOf("<resource", start)) >= 0) {
+            const int end = step.data.indexOf("</resource>", start);
+            if (end < 0) {
+                break;
+            }
+            step.data.insert(end, suffix);
+            start = end + suffix.size();
+        }
+    }
+    return copy;
+}
+
+// Sends the steps of one capture over an in-memory connection.
+class Session : public QObject
+{
+public:
+    Session(const Options &options, std::vector<Step> steps, const QElapsedTimer &clock, QObject *parent)
+        : QObject(parent), m_options(options), m_steps(std::move(steps)), m_clock(clock)
+    {
+    }
+
+    void start(QXmppMemoryTransport *transport, std::function<void()> onFinished)
+    {
+        m_transport = transport;
+        m_transport->setParent(this);
+        m_onFinished = std::move(onFinished);
+
+        connect(m_transport, &QXmppTransport::readyRead, this, [this]() {
+            const auto size = m_transport->readAll().size();
+            if (size == 0) {
+                return;
+            }
+            bytesReceived += size;
+            lastActivity = m_clock.nsecsElapsed();
+            m_responded = true;
+            if (m_waiting) {
+                m_waiting = false;
+                sendNext();
+            }
+        });
+        connect(m_transport, &QXmppTransport::disconnected, this, &Session::finish);
+        sendNext();
+    }
+
+    qint64 bytesSent = 0;
+    qint64 bytesReceived = 0;
+    // time of the last data sent or received in nanoseconds
+    qint64 lastActivity = 0;
+    bool completed = false;
+
+private:
+    void sendNext()
+    {
+        m_scheduled = false;
+        while (m_next < m_steps.size() && m_transport->isConnected()) {
+            const auto &step = m_steps[m_next];
+            if (step.awaitResponse && !m_responded) {
+                m_waiting = true;
+                return;
+            }
+            if (m_options.speed > 0) {
+                const auto due = qint64(double(step.timestamp) / m_options.speed);
+                const auto delay = due - m_clock.nsecsElapsed() / 1000;
+                if (delay > 0) {
+                    m_scheduled = true;
+                    QTimer::singleShot(int((delay + 999) / 1000), this, [this]() {
+                        if (m_scheduled) {
+                            sendNext();
+                        }
+                    });
+                    return;
+                }
+            }
+            m_transport->write(step.data);
+            bytesSent += step.data.size();
+            lastActivity = m_clock.nsecsElapsed();
+            m_responded = false;
+            m_next++;
+        }
+
+        if (m_next == m_steps.size() && !completed) {
+            completed = true;
+            // let the server answer the last data
+            QTimer::singleShot(m_options.drainMs, this, [this]() { m_transport->disconnectFromHost(); });
+        }
+    }
+
+    void finish()
+    {
+        m_scheduled = false;
+        m_waiting = false;
+        if (m_onFinished) {
+            std::exchange(m_onFinished, {})();
+        }
+    }
+
+    const Options &m_options;
+    const std::vector<Step> m_steps;
+    const QElapsedTimer &m_clock;
+    QXmppMemoryTransport *m_transport = nullptr;
+    std::function<void()> m_onFinished;
+    size_t m_next = 0;
+    bool m_responded = false;
+    bool m_waiting = false;
+    bool m_scheduled = false;
+};
+
+bool parseOptions(const QCoreApplication &app, Options &options)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays captured client streams against QXmppServer"));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("captures"), QStringLiteral("Capture files to replay."), QStringLiteral("<file>..."));
+    parser.addOptions({
+        { "speed", "Factor applied to the captured timing, 0 replays as fast as possible.", "factor", QString::number(options.speed) },
+        { "repeat", "Number of times each capture is replayed concurrently.", "count", QString::number(options.repeat) },
+        { "workers", "Number of server worker threads.", "count", QString::number(options.workerThreads) },
+        { "drain", "Time to wait for responses after the last data of a capture was sent.", "ms", QString::number(options.drainMs) },
+        { "domain", "Domain of the server, must match the captures.", "domain", options.domain },
+        { "output", "Write the JSON results to a file instead of stdout.", "file" },
+    });
+    parser.process(app);
+
+    options.captures = parser.positionalArguments();
+    if (options.captures.isEmpty()) {
+        qWarning("No capture files given");
+        return false;
+    }
+    options.speed = std::max(0.0, parser.value("speed").toDouble());
+    options.repeat = std::max(1, parser.value("repeat").toInt());
+    options.workerThreads = std::max(0, parser.value("workers").toInt());
+    options.drainMs = std::max(0, parser.value("drain").toInt());
+    options.domain = parser.value("domain");
+    options.output = parser.value("output");
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(QStringLiteral("qxmpp-replay"));
+
+    Options options;
+    if (!parseOptions(app, options)) {
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::vector<Step>> captures(options.captures.size());
+    for (int i = 0; i < options.captures.size(); ++i) {
+        if (!readCapture(options.captures[i], captures[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the metrics of the server streams count the handled stanzas
+    QXmppLogger logger;
+    logger.setLoggingType(QXmppLogger::NoLogging);
+
+    AcceptingPasswordChecker passwordChecker;
+    QXmppServer server;
+    server.setDomain(options.domain);
+    server.setLogger(&logger);
+    server.setPasswordChecker(&passwordChecker);
+    server.setWorkerThreadCount(options.workerThreads);
+
+    QElapsedTimer clock;
+    std::vector<Session *> sessions;
+    for (const auto &steps : captures) {
+        for (int i = 0; i < options.repeat; ++i) {
+            auto copy = i == 0 ? steps : withResourceSuffix(steps, "-" + QByteArray::number(i));
+            sessions.push_back(new Session(options, std::move(copy), clock, &app));
+        }
+    }
+
+    auto running = sessions.size();
+
+    const auto finish = [&]() {
+        qint64 sent = 0;
+        qint64 received = 0;
+        qint64 lastActivity = 0;
+        int completed = 0;
+        for (const auto *session : sessions) {
+            sent += session->bytesSent;
+            received += session->bytesReceived;
+            lastActivity = std::max(lastActivity, session->lastActivity);
+            completed += session->completed ? 1 : 0;
+        }
+        const double secs = double(lastActivity) / 1e9;
+
+        const auto counters = logger.metrics()->snapshot().counters;
+        qint64 stanzas = 0;
+        QJsonObject stanzasByKind;
+        for (const char *kind : STANZA_KIND_NAMES) {
+            const auto count = counters.value(QStringLiteral("stream.stanzas-received.") + QString::fromLatin1(kind));
+            stanzas += count;
+            stanzasByKind.insert(kind, count);
+        }
+
+        const QJsonObject report {
+            { "config", QJsonObject {
+                            { "captures", int(options.captures.size()) },
+                            { "repeat", options.repeat },
+                            { "speed", options.speed },
+                            { "worker_threads", options.workerThreads },
+                            { "drain_ms", options.drainMs },
+                        } },
+            { "sessions", QJsonObject {
+                              { "started", int(sessions.size()) },
+                              { "completed", completed },
+                          } },
+            { "bytes", QJsonObject {
+                           { "sent", sent },
+                           { "received", received },
+                           { "mb_per_second", secs > 0 ? double(sent + received) / 1e6 / secs : 0.0 },
+                       } },
+            { "stanzas", QJsonObject {
+                             { "received", stanzas },
+                             { "by_type", stanzasByKind },
+                             { "per_second", secs > 0 ? stanzas / secs : 0.0 },
+                         } },
+            { "seconds", secs },
+        };
+
+        const auto json = QJsonDocument(report).toJson();
+        if (options.output.isEmpty()) {
+            QFile out;
+            out.open(stdout, QIODevice::WriteOnly);
+            out.write(json);
+        } else {
+            QFile out(options.output);
+            if (!out.open(QIODevice::WriteOnly)) {
+                qWarning("Could not write %s", qPrintable(options.output));
+            }
+            out.write(json);
+        }
+
+        server.close();
+        app.exit(completed == int(sessions.size()) ? EXIT_SUCCESS : EXIT_FAILURE);
+    };
+
+    clock.start();
+    for (auto *session : sessions) {
+        session->start(server.connectInMemory(), [&]() {
+            if (--running == 0) {
+                QTimer::singleShot(0, &app, finish);
+            }
+        });
+    }
+
+    return app.exec();
+}
@@ -0,0 +1,554 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+// Loopback load generator for QXmppServer.
+//
+// Starts an in-process server, connects a configurable number of clients
+// over loopback and lets them exchange a mix of messages, presences and IQs.
+// The results are printed as JSON:
+//
+//  - connections/s while establishing the client sessions
+//  - stanzas/s delivered during the load phase
+//  - p50/p99/max end-to-end latency per stanza type; for IQs this is the
+//    round trip of a version request answered by the peer client
+//
+// Each client needs two file descriptors, the file descriptor limit is raised
+// to its hard limit on startup.
+
+#include "QXmppClient.h"
+#include "QXmppConfiguration.h"
+#include "QXmppMessage.h"
+#include "QXmppPasswordChecker.h"
+#include "QXmppPresence.h"
+#include "QXmppServer.h"
+#include "QXmppVersionIq.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDomElement>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QThread>
+#include <QTimer>
+
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+constexpr auto SERVER_DOMAIN = "localhost";
+constexpr auto PASSWORD = "password";
+constexpr auto RESOURCE = "load";
+
+enum StanzaKind {
+    Message,
+    Presence,
+    Iq,
+    StanzaKindCount,
+};
+
+const char *const STANZA_KIND_NAMES[] = { "message", "presence", "iq" };
+
+struct Options
+{
+    int clients = 1000;
+    int clientThreads = 2;
+    int workerThreads = 0;
+    bool reusePort = false;
+    int connectConcurrency = 100;
+    int durationSecs = 10;
+    int intervalMs = 1000;
+    int drainMs = 2000;
+    std::array<int, StanzaKindCount> weights = { 80, 10, 10 };
+    QString mechanism = QStringLiteral("PLAIN");
+    quint16 port = 15222;
+    QString output;
+};
+
+// Accepts any user with the benchmark's password.
+class StubPasswordChecker : public QXmppPasswordChecker
+{
+public:
+    QXmppPasswordReply::Error getPassword(const QXmppPasswordRequest &, QString &password) override
+    {
+        password = QString::fromLatin1(PASSWORD);
+        return QXmppPasswordReply::NoError;
+    }
+
+    bool hasGetPassword() const override
+    {
+        return true;
+    }
+};
+
+struct Results
+{
+    int connected = 0;
+    int failed = 0;
+    int dropped = 0;
+    qint64 errors = 0;
+    std::array<qint64, StanzaKindCount> sent {};
+    std::array<qint64, StanzaKindCount> received {};
+    // latencies in nanoseconds
+    std::array<std::vector<qint64>, StanzaKindCount> latencies;
+
+    void merge(const Results &other)
+    {
+        connected += other.connected;
+        failed += other.failed;
+        dropped += other.dropped;
+        errors += other.errors;
+        for (int i = 0; i < StanzaKindCount; ++i) {
+            sent[i] += other.sent[i];
+            received[i] += other.received[i];
+            latencies[i].insert(latencies[i].end(), other.latencies[i].cbegin(), other.latencies[i].cend());
+        }
+    }
+};
+
+QString userJid(int index)
+{
+    return QStringLiteral("user%1@%2/%3").arg(QString::number(index), QString::fromLatin1(SERVER_DOMAIN), QString::fromLatin1(RESOURCE));
+}
+
+// Owns a share of the clients and drives them from its own thread.
+class Driver : public QObject
+{
+public:
+    Driver(const Options &options, int first, int last, const QElapsedTimer &clock)
+        : m_options(options), m_first(first), m_last(last), m_next(first), m_clock(clock)
+    {
+    }
+
+    // Connects the clients, then calls onDone from the driver thread.
+    void connectClients(std::function<void()> onDone)
+    {
+        m_onConnected = std::move(onDone);
+        connectNext();
+    }
+
+    void startLoad(qint64 loadStart)
+    {
+        m_loadStart = loadStart;
+        m_loadEnd = std::numeric_limits<qint64>::max();
+        for (auto *client : std::as_const(m_clients)) {
+            if (!client->isConnected()) {
+                continue;
+            }
+            auto *timer = new QTimer(client);
+            m_timers << timer;
+            timer->setInterval(m_options.intervalMs);
+            QObject::connect(timer, &QTimer::timeout, client, [this, client]() {
+                sendStanza(client);
+            });
+
+            // spread the clients over the interval
+            QTimer::singleShot(QRandomGenerator::global()->bounded(m_options.intervalMs), timer, [timer]() {
+                timer->start();
+            });
+        }
+        m_loading = true;
+    }
+
+    void stopLoad(qint64 loadEnd)
+    {
+        m_loading = false;
+        m_loadEnd = loadEnd;
+        for (auto *timer : std::as_const(m_timers)) {
+            timer->stop();
+        }
+    }
+
+    Results results;
+
+private:
+    void connectNext()
+    {
+        while (m_pending < m_options.connectConcurrency && m_next < m_last) {
+            const int index = m_next++;
+            auto *client = new QXmppClient(this);
+            client->setProperty("peer", userJid(m_first + (index - m_first + 1) % (m_last - m_first)));
+            m_clients << client;
+            m_pending++;
+
+            QObject::connect(client, &QXmppClient::connected, this, [this]() {
+                results.connected++;
+                connectionDone();
+            });
+            QObject::connect(client, &QXmppClient::disconnected, this, [this, client]() {
+                if (client->property("established").toBool()) {
+                    results.dropped++;
+                } else {
+                    results.failed++;
+                    connectionDone();
+                }
+            });
+            QObject::connect(client, &QXmppClient::connected, client, [client]() {
+                client->setProperty("established", true);
+            });
+            QObject::connect(client, &QXmppClient::messageReceived, this, [this](const QXmppMessage &message) {
+                if (message.type() != QXmppMessage::Error) {
+                    received(Message, message.body());
+                }
+            });
+            QObject::connect(client, &QXmppClient::presenceReceived, this, [this](const QXmppPresence &presence) {
+                if (presence.type() == QXmppPresence::Available) {
+                    received(Presence, presence.statusText());
+                }
+            });
+
+            QXmppConfiguration config;
+            config.setDomain(QString::fromLatin1(SERVER_DOMAIN));
+            config.setHost(QStringLiteral("127.0.0.1"));
+            config.setPort(m_options.port);
+            config.setUser(QStringLiteral("user%1").arg(index));
+            config.setPassword(QString::fromLatin1(PASSWORD));
+            config.setResource(QString::fromLatin1(RESOURCE));
+            config.setSaslAuthMechanism(m_options.mechanism);
+            config.setStreamSecurityMode(QXmppConfiguration::TLSDisabled);
+            config.setAutoReconnectionEnabled(false);
+            client->connectToServer(config);
+        }
+    }
+
+    void connectionDone()
+    {
+        m_pending--;
+        connectNext();
+        if (m_onConnected && results.connected + results.failed == m_last - m_first) {
+            std::exchange(m_onConnected, {})();
+        }
+    }
+
+    int pickKind() const
+    {
+        const auto &weights = m_options.weights;
+        int value = QRandomGenerator::global()->bounded(std::max(1, weights[Message] + weights[Presence] + weights[Iq]));
+        for (int kind = 0; kind < StanzaKindCount; ++kind) {
+            if (value < weights[kind]) {
+                return kind;
+            }
+            value -= weights[kind];
+        }
+        return Message;
+    }
+
+    void sendStanza(QXmppClient *client)
+    {
+        if (!m_loading || !client->isConnected()) {
+            return;
+        }
+
+        const auto peer = client->property("peer").toString();
+        const qint64 sentAt = m_clock.nsecsElapsed();
+        const auto timestamp = QString::number(sentAt);
+        const int kind = pickKind();
+
+        switch (kind) {
+        case Message:
+            client->sendPacket(QXmppMessage({}, peer, timestamp));
+            break;
+        case Presence: {
+            QXmppPresence presence;
+            presence.setTo(peer);
+            presence.setStatusText(timestamp);
+            client->sendPacket(presence);
+            break;
+        }
+        case Iq: {
+            QXmppVersionIq iq;
+            iq.setType(QXmppIq::Get);
+            iq.setTo(peer);
+            client->sendIq(std::move(iq)).then(this, [this, sentAt](QXmppClient::IqResult &&result) {
+                if (std::holds_alternative<QDomElement>(result)) {
+                    record(Iq, sentAt);
+                } else {
+                    results.errors++;
+                }
+            });
+            break;
+        }
+        }
+        results.sent[kind]++;
+    }
+
+    void received(StanzaKind kind, const QString &timestamp)
+    {
+        bool ok = false;
+        const qint64 sentAt = timestamp.toLongLong(&ok);
+        if (ok) {
+            record(kind, sentAt);
+        }
+    }
+
+    void record(StanzaKind kind, qint64 sentAt)
+    {
+        // only count stanzas sent during the load phase
+        if (sentAt < m_loadStart || sentAt > m_loadEnd) {
+            return;
+        }
+        results.received[kind]++;
+        results.latencies[kind].push_back(m_clock.nsecsElapsed() - sentAt);
+    }
+
+    const Options m_options;
+    const int m_first;
+    const int m_last;
+    int m_next;
+    int m_pending = 0;
+    const QElapsedTimer &m_clock;
+    QList<QXmppClient *> m_clients;
+    QList<QTimer *> m_timers;
+    std::function<void()> m_onConnected;
+    bool m_loading = false;
+    qint64 m_loadStart = 0;
+    qint64 m_loadEnd = 0;
+};
+
+QJsonObject latencyStats(std::vector<qint64> latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    const auto percentile = [&latencies](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        const auto rank = std::max<size_t>(1, size_t(std::ceil(p * double(latencies.size()))));
+        return double(latencies[rank - 1]) / 1e6;
+    };
+
+    return QJsonObject {
+        { "count", qint64(latencies.size()) },
+        { "p50", percentile(0.50) },
+        { "p99", percentile(0.99) },
+        { "max", latencies.empty() ? 0.0 : double(latencies.back()) / 1e6 },
+    };
+}
+
+void raiseFileLimit()
+{
+#if defined(Q_OS_UNIX)
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+bool parseOptions(const QCoreApplication &app, Options &options)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Loopback load generator for QXmppServer"));
+    parser.addHelpOption();
+    parser.addOptions({
+        { "clients", "Number of client connections.", "count", QString::number(options.clients) },
+        { "client-threads", "Number of threads running the clients.", "count", QString::number(options.clientThreads) },
+        { "workers", "Number of server worker threads.", "count", QString::number(options.workerThreads) },
+        { "reuse-port", "Accept connections on one SO_REUSEPORT socket per worker." },
+        { "connect-concurrency", "Maximum number of concurrent connection attempts per client thread.", "count", QString::number(options.connectConcurrency) },
+        { "duration", "Duration of the load phase in seconds.", "seconds", QString::number(options.durationSecs) },
+        { "interval", "Interval between two stanzas of a client in milliseconds.", "ms", QString::number(options.intervalMs) },
+        { "mix", "Weights of messages, presences and IQs.", "message,presence,iq", QStringLiteral("80,10,10") },
+        { "mechanism", "SASL mechanism used by the clients.", "mechanism", options.mechanism },
+        { "port", "Port the server listens on.", "port", QString::number(options.port) },
+        { "output", "Write the JSON results to a file instead of stdout.", "file" },
+    });
+    parser.process(app);
+
+    const auto mix = parser.value("mix").split(u',');
+    if (mix.size() != StanzaKindCount) {
+        qWarning("Invalid stanza mix: %s", qPrintable(parser.value("mix")));
+        return false;
+    }
+    for (int i = 0; i < StanzaKindCount; ++i) {
+        options.weights[i] = std::max(0, mix[i].toInt());
+    }
+
+    options.clients = std::max(2, parser.value("clients").toInt());
+    options.clientThreads = std::clamp(parser.value("client-threads").toInt(), 1, options.clients / 2);
+    options.workerThreads = std::max(0, parser.value("workers").toInt());
+    options.reusePort = parser.isSet("reuse-port");
+    options.connectConcurrency = std::max(1, parser.value("connect-concurrency").toInt());
+    options.durationSecs = std::max(1, parser.value("duration").toInt());
+    options.intervalMs = std::max(1, parser.value("interval").toInt());
+    options.mechanism = parser.value("mechanism");
+    options.port = quint16(parser.value("port").toUInt());
+    options.output = parser.value("output");
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(QStringLiteral("qxmpp-serverload"));
+
+    Options options;
+    if (!parseOptions(app, options)) {
+        return EXIT_FAILURE;
+    }
+    raiseFileLimit();
+
+    QElapsedTimer clock;
+    clock.start();
+
+    StubPasswordChecker passwordChecker;
+    QXmppServer server;
+    server.setDomain(QString::fromLatin1(SERVER_DOMAIN));
+    server.setPasswordChecker(&passwordChecker);
+    server.setWorkerThreadCount(options.workerThreads);
+    server.setReusePortEnabled(options.reusePort);
+    if (!server.listenForClients(QHostAddress::LocalHost, options.port)) {
+        qWarning("Could not listen on port %d", options.port);
+        return EXIT_FAILURE;
+    }
+
+    // distribute the clients across the client threads, peers are in the same thread
+    std::vector<std::unique_ptr<QThread>> threads;
+    std::vector<Driver *> drivers;
+    for (int i = 0; i < options.clientThreads; ++i) {
+        const int first = options.clients * i / options.clientThreads;
+        const int last = options.clients * (i + 1) / options.clientThreads;
+        auto *driver = new Driver(options, first, last, clock);
+        auto thread = std::make_unique<QThread>();
+        driver->moveToThread(thread.get());
+        thread->start();
+        drivers.push_back(driver);
+        threads.push_back(std::move(thread));
+    }
+
+    qint64 connectStart = clock.nsecsElapsed();
+    qint64 connectEnd = 0;
+    qint64 loadStart = 0;
+    qint64 loadEnd = 0;
+    int connecting = int(drivers.size());
+
+    const auto finish = [&]() {
+        Results results;
+        for (auto *driver : drivers) {
+            QMetaObject::invokeMethod(
+                driver, [&results, driver]() {
+                    results.merge(driver->results);
+                    delete driver;
+                },
+                Qt::BlockingQueuedConnection);
+        }
+        for (auto &thread : threads) {
+            thread->quit();
+            thread->wait();
+        }
+
+        const double connectSecs = double(connectEnd - connectStart) / 1e9;
+        const double loadSecs = double(loadEnd - loadStart) / 1e9;
+
+        qint64 sent = 0;
+        qint64 received = 0;
+        std::vector<qint64> allLatencies;
+        QJsonObject latency;
+        QJsonObject mix;
+        for (int i = 0; i < StanzaKindCount; ++i) {
+            sent += results.sent[i];
+            received += results.received[i];
+            allLatencies.insert(allLatencies.end(), results.latencies[i].cbegin(), results.latencies[i].cend());
+            latency.insert(STANZA_KIND_NAMES[i], latencyStats(results.latencies[i]));
+            mix.insert(STANZA_KIND_NAMES[i], options.weights[i]);
+        }
+        latency.insert("all", latencyStats(std::move(allLatencies)));
+
+        const QJsonObject report {
+            { "config", QJsonObject {
+                            { "clients", options.clients },
+                            { "client_threads", options.clientThreads },
+                            { "worker_threads", options.workerThreads },
+                            { "reuse_port", options.reusePort },
+                            { "duration_s", options.durationSecs },
+                            { "interval_ms", options.intervalMs },
+                            { "mechanism", options.mechanism },
+                            { "mix", mix },
+                        } },
+            { "connections", QJsonObject {
+                                 { "established", results.connected },
+                                 { "failed", results.failed },
+                                 { "dropped", results.dropped },
+                                 { "seconds", connectSecs },
+                                 { "per_second", connectSecs > 0 ? results.connected / connectSecs : 0.0 },
+                             } },
+            { "stanzas", QJsonObject {
+                             { "sent", sent },
+                             { "received", received },
+                             { "errors", results.errors },
+                             { "per_second", loadSecs > 0 ? received / loadSecs : 0.0 },
+                         } },
+            { "latency_ms", latency },
+        };
+
+        const auto json = QJsonDocument(report).toJson();
+        if (options.output.isEmpty()) {
+            QFile out;
+            out.open(stdout, QIODevice::WriteOnly);
+            out.write(json);
+        } else {
+            QFile out(options.output);
+            if (!out.open(QIODevice::WriteOnly)) {
+                qWarning("Could not write %s", qPrintable(options.output));
+            }
+            out.write(json);
+        }
+
+        server.close();
+        app.exit(results.connected == options.clients ? EXIT_SUCCESS : EXIT_FAILURE);
+    };
+
+    const auto stopLoad = [&]() {
+        loadEnd = clock.nsecsElapsed();
+        for (auto *driver : drivers) {
+            QMetaObject::invokeMethod(driver, [driver, loadEnd]() { driver->stopLoad(loadEnd); }, Qt::QueuedConnection);
+        }
+        // let in-flight stanzas arrive
+        QTimer::singleShot(options.drainMs, &app, finish);
+    };
+
+    const auto startLoad = [&]() {
+        connectEnd = clock.nsecsElapsed();
+        loadStart = connectEnd;
+        for (auto *driver : drivers) {
+            QMetaObject::invokeMethod(driver, [driver, loadStart]() { driver->startLoad(loadStart); }, Qt::QueuedConnection);
+        }
+        QTimer::singleShot(options.durationSecs * 1000, &app, stopLoad);
+    };
+
+    for (auto *driver : drivers) {
+        QMetaObject::invokeMethod(
+            driver, [&, driver]() {
+                driver->connectClients([&]() {
+                    QMetaObject::invokeMethod(
+                        &app, [&]() {
+                            if (--connecting == 0) {
+                                startLoad();
+                            }
+                        },
+                        Qt::QueuedConnection);
+                });
+            },
+            Qt::QueuedConnection);
+    }
+
+    return app.exec();
+}
@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppLogWriter_p.h"
+
+#include <QDateTime>
+#include <QThread>
+
+namespace QXmpp::Private {
+
+// maximum size of the data handed to the output at once
+constexpr int MAX_BATCH_SIZE = 64 * 1024;
+// the idle thread also wakes up periodically, in case a wake-up was missed
+constexpr unsigned long IDLE_WAIT_MSECS = 500;
+
+LogFile::LogFile(const QString &path, qint64 maxSize, int rotationInterval, int maxRotatedFiles)
+    : m_file(path),
+      m_maxSize(maxSize),
+      m_rotationIntervalMsecs(qint64(rotationInterval) * 1000),
+      m_maxRotatedFiles(qMax(0, maxRotatedFiles))
+{
+}
+
+void LogFile::write(const QByteArray &data)
+{
+    if (!open()) {
+        return;
+    }
+
+    // never rotate an empty file, so that oversized data is still written
+    const qint64 size = m_file.size();
+    const bool tooLarge = m_maxSize > 0 && size > 0 && size + data.size() > m_maxSize;
+    const bool tooOld = m_rotationIntervalMsecs > 0 && size > 0 &&
+        QDateTime::currentMSecsSinceEpoch() - m_openedAt >= m_rotationIntervalMsecs;
+    if (tooLarge || tooOld) {
+        rotate();
+        if (!open()) {
+            return;
+        }
+    }
+
+    m_file.write(data);
+    m_file.flush();
+}
+
+bool LogFile::open()
+{
+    if (m_file.isOpen()) {
+        return true;
+    }
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return false;
+    }
+    m_openedAt = QDateTime::currentMSecsSinceEpoch();
+    return true;
+}
+
+void LogFile::rotate()
+{
+    m_file.close();
+
+    const QString path = m_file.fileName();
+    if (m_maxRotatedFiles == 0) {
+        QFile::remove(path);
+        return;
+    }
+
+    const auto rotatedPath = [&path](int index) {
+        return path + QLatin1Char('.') + QString::number(index);
+    };
+    QFile::remove(rotatedPath(m_maxRotatedFiles));
+    for (int i = m_maxRotatedFiles - 1; i >= 1; --i) {
+        QFile::rename(rotatedPath(i), rotatedPath(i + 1));
+    }
+    QFile::rename(path, rotatedPath(1));
+}
+
+static quint64 ringCapacity(int capacity)
+{
+    quint64 size = 2;
+    while (size < quint64(qMax(capacity, 2))) {
+        size <<= 1;
+    }
+    return size;
+}
+
+AsyncLogWriter::AsyncLogWriter(Output output, int capacity, bool blockOnOverflow)
+    : m_output(std::move(output)),
+      m_blockOnOverflow(blockOnOverflow),
+      m_slots(new Slot[ringCapacity(capacity)]),
+      m_mask(ringCapacity(capacity) - 1)
+{
+    for (quint64 i = 0; i <= m_mask; ++i) {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    m_thread = QThread::create([this]() { run(); });
+    m_thread->setObjectName(QStringLiteral("QXmppLogWriter"));
+    m_thread->start(QThread::LowPriority);
+}
+
+AsyncLogWriter::~AsyncLogWriter()
+{
+    // the thread drains the ring before exiting
+    m_stopping.store(true);
+    {
+        QMutexLocker locker(&m_mutex);
+        m_wakeCondition.wakeOne();
+    }
+    m_thread->wait();
+    delete m_thread;
+}
+
+// Queues a line, returns false if it was dropped because the ring is full.
+bool AsyncLogWriter::push(QByteArray &&line)
+{
+    while (!tryPush(line)) {
+        if (!m_blockOnOverflow) {
+            m_droppedTotal.fetch_add(1, std::memory_order_relaxed);
+            m_droppedUnreported.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        wake();
+        QThread::yieldCurrentThread();
+    }
+    wake();
+    return true;
+}
+
+// Waits until the lines pushed so far have been written.
+void AsyncLogWriter::flush()
+{
+    const quint64 target = m_enqueuePos.load();
+
+    QMutexLocker locker(&m_mutex);
+    while (m_writtenPos < target) {
+        m_wakeCondition.wakeOne();
+        m_writtenCondition.wait(&m_mutex);
+    }
+}
+
+bool AsyncLogWriter::tryPush(QByteArray &line)
+{
+    quint64 pos = m_enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot &slot = m_slots[pos & m_mask];
+        const quint64 sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto diff = qint64(sequence - pos);
+        if (diff == 0) {
+            if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.data = std::move(line);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // full
+            return false;
+        } else {
+            pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool AsyncLogWriter::tryPop(QByteArray &line)
+{
+    Slot &slot = m_slots[m_dequeuePos & m_mask];
+    if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePos + 1) {
+        return false;
+    }
+    line = std::move(slot.data);
+    slot.data = QByteArray();
+    slot.sequence.store(m_dequeuePos + m_mask + 1, std::memory_order_release);
+    m_dequeuePos++;
+    return true;
+}
+
+bool AsyncLogWriter::isEmpty() const
+{
+    return m_slots[m_dequeuePos & m_mask].sequence.load() != m_dequeuePos + 1;
+}
+
+// Wakes the thread up if it is idle.
+void AsyncLogWriter::wake()
+{
+    // pairs with the fence in run(): either the thread sees the new line or
+    // we see that it is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.exchange(false)) {
+        QMutexLocker locker(&m_mutex);
+        m_wakeCondition.wakeOne();
+    }
+}
+
+void AsyncLogWriter::run()
+{
+    QByteArray line;
+    for (;;) {
+        QByteArray batch;
+        while (batch.size() < MAX_BATCH_SIZE && tryPop(line)) {
+            batch += line;
+        }
+        if (const auto dropped = m_droppedUnreported.exchange(0)) {
+            batch += QByteArray::number(dropped) + " log messages were dropped\n";
+        }
+
+        if (!batch.isEmpty()) {
+            m_output(batch);
+
+            QMutexLocker locker(&m_mutex);
+            m_writtenPos = m_dequeuePos;
+            m_writtenCondition.wakeAll();
+            continue;
+        }
+
+        if (m_stopping.load()) {
+            break;
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (isEmpty() && !m_stopping.load()) {
+            m_wakeCondition.wait(&m_mutex, IDLE_WAIT_MSECS);
+        }
+        m_sleeping.store(false);
+    }
+}
+
+}  // namespace QXmpp::Private
@@ -0,0 +1,110 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPLOGWRITER_P_H
+#define QXMPPLOGWRITER_P_H
+
+#include "QXmppGlobal.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+
+class QThread;
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.  It exists for the convenience
+// of QXmpp's own classes.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+// A log file which is rotated when it exceeds a size or an age.
+//
+// The current file is renamed to "<path>.1", older files are shifted to
+// "<path>.2" and so on, and files beyond maxRotatedFiles are removed.
+class LogFile
+{
+public:
+    LogFile(const QString &path, qint64 maxSize, int rotationInterval, int maxRotatedFiles);
+
+    void write(const QByteArray &data);
+
+private:
+    bool open();
+    void rotate();
+
+    QFile m_file;
+    qint64 m_maxSize;
+    qint64 m_rotationIntervalMsecs;
+    int m_maxRotatedFiles;
+    qint64 m_openedAt = 0;
+};
+
+// Writes log lines on a background thread.
+//
+// Producers format their lines and push them to a bounded lock-free ring, the
+// thread drains the ring and hands the lines to the output in batches.
+class AsyncLogWriter
+{
+public:
+    using Output = std::function<void(const QByteArray &batch)>;
+
+    AsyncLogWriter(Output output, int capacity, bool blockOnOverflow);
+    ~AsyncLogWriter();
+
+    bool push(QByteArray &&line);
+    void flush();
+    qint64 droppedCount() const { return m_droppedTotal.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<quint64> sequence;
+        QByteArray data;
+    };
+
+    bool tryPush(QByteArray &line);
+    bool tryPop(QByteArray &line);
+    bool isEmpty() const;
+    void wake();
+    void run();
+
+    Output m_output;
+    const bool m_blockOnOverflow;
+
+    // ring buffer, see Dmitry Vyukov's bounded MPMC queue
+    std::unique_ptr<Slot[]> m_slots;
+    const quint64 m_mask;
+    std::atomic<quint64> m_enqueuePos { 0 };
+    quint64 m_dequeuePos = 0;
+
+    std::atomic<qint64> m_droppedTotal { 0 };
+    std::atomic<qint64> m_droppedUnreported { 0 };
+
+    // wake-up of the idle thread and flushing
+    QMutex m_mutex;
+    QWaitCondition m_wakeCondition;
+    QWaitCondition m_writtenCondition;
+    std::atomic<bool> m_sleeping { false };
+    std::atomic<bool> m_stopping { false };
+    quint64 m_writtenPos = 0;
+
+    QThread *m_thread;
+};
+
+}  // namespace QXmpp::Private
+
+#endif  // QXMPPLOGWRITER_P_H
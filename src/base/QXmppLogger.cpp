@@ -5,13 +5,25 @@
 
 #include "QXmppLogger.h"
 
+#include "QXmppLogWriter_p.h"
+#include "QXmppMetrics.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <iostream>
+#include <utility>
 
 #include <QChildEvent>
 #include <QDateTime>
-#include <QFile>
+#include <QMetaMethod>
 #include <QMetaType>
-#include <QTextStream>
+#include <QMutex>
+#include <QPointer>
+#include <QThread>
+#include <QVector>
+
+using namespace QXmpp::Private;
 
 QXmppLogger *QXmppLogger::m_logger = nullptr;
 
@@ -35,19 +47,206 @@ static const char *typeName(QXmppLogger::MessageType type)
 
 static QString formatted(QXmppLogger::MessageType type, const QString &text)
 {
-    return QDateTime::currentDateTime().toString() + " " +
+    // the date only has a precision of one second, so format it once per second
+    thread_local qint64 cachedSecond = -1;
+    thread_local QString cachedDate;
+    const qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+    if (msecs / 1000 != cachedSecond) {
+        cachedSecond = msecs / 1000;
+        cachedDate = QDateTime::fromMSecsSinceEpoch(cachedSecond * 1000).toString();
+    }
+
+    return cachedDate + " " +
         QString::fromLatin1(typeName(type)) + " " +
         text;
 }
 
-static void relaySignals(QXmppLoggable *from, QXmppLoggable *to)
+static const std::array<QMetaMethod, 4> &loggingSignals()
+{
+    static const auto methods = std::array {
+        QMetaMethod::fromSignal(&QXmppLoggable::logMessage),
+        QMetaMethod::fromSignal(&QXmppLoggable::setGauge),
+        QMetaMethod::fromSignal(&QXmppLoggable::updateCounter),
+        QMetaMethod::fromSignal(&QXmppLoggable::recordValue),
+    };
+    return methods;
+}
+
+static bool isLoggingSignal(const QMetaMethod &signal)
+{
+    const auto &methods = loggingSignals();
+    return std::find(methods.cbegin(), methods.cend(), signal) != methods.cend();
+}
+
+class QXmppLoggablePrivate
+{
+public:
+    // Where the messages and metrics of a loggable go.
+    struct Context
+    {
+        QPointer<QXmppLogger> sink;
+        // the loggable and its ancestors with receivers connected to the signals
+        QVector<QPointer<QXmppLoggable>> listeners;
+    };
+
+    explicit QXmppLoggablePrivate(QXmppLoggable *qq) : q(qq) { }
+
+    static bool hasReceivers(const QXmppLoggable *loggable);
+    Context resolveContext() const;
+    const Context &cachedContext();
+    template<typename Deliver, typename Relay>
+    void forward(const Deliver &deliver, const Relay &relay);
+    template<typename Deliver, typename Relay>
+    static void dispatch(const Context &context, const Deliver &deliver, const Relay &relay);
+    static void invalidate(QXmppLoggable *loggable);
+    void removeLoggingChild(const QXmppLoggable *child);
+
+    // guards the configuration, which may be changed from any thread
+    QMutex mutex;
+    QPointer<QXmppLogger> sink;
+    QPointer<QXmppLoggable> loggingParent;
+    QVector<QPointer<QXmppLoggable>> loggingChildren;
+
+    // The context is cached for the loggable's thread and invalidated with
+    // the subtree of the loggable whose configuration or receivers changed.
+    std::atomic<bool> contextValid { false };
+    Context context;
+
+private:
+    QXmppLoggable *q;
+};
+
+// Returns whether any of the logging signals of the loggable has receivers.
+bool QXmppLoggablePrivate::hasReceivers(const QXmppLoggable *loggable)
 {
-    QObject::connect(from, &QXmppLoggable::logMessage,
-                     to, &QXmppLoggable::logMessage);
-    QObject::connect(from, &QXmppLoggable::setGauge,
-                     to, &QXmppLoggable::setGauge);
-    QObject::connect(from, &QXmppLoggable::updateCounter,
-                     to, &QXmppLoggable::updateCounter);
+    const auto &methods = loggingSignals();
+    return std::any_of(methods.cbegin(), methods.cend(), [loggable](const QMetaMethod &signal) {
+        return loggable->isSignalConnected(signal);
+    });
+}
+
+QXmppLoggablePrivate::Context QXmppLoggablePrivate::resolveContext() const
+{
+    // Walk up the loggable parents, following the logging parent links of
+    // loggables without a loggable parent. Only one lock is held at a time.
+    Context context;
+    const QXmppLoggable *loggable = q;
+    while (loggable) {
+        QXmppLoggable *loggingParent;
+        {
+            QMutexLocker locker(&loggable->d->mutex);
+            if (!context.sink) {
+                context.sink = loggable->d->sink;
+            }
+            loggingParent = loggable->d->loggingParent;
+        }
+
+        if (hasReceivers(loggable)) {
+            context.listeners << const_cast<QXmppLoggable *>(loggable);
+        }
+
+        if (auto *parent = qobject_cast<QXmppLoggable *>(loggable->parent())) {
+            loggable = parent;
+        } else {
+            loggable = loggingParent;
+        }
+    }
+    return context;
+}
+
+// Returns the context cached for the loggable's thread, in which this must be
+// called.
+const QXmppLoggablePrivate::Context &QXmppLoggablePrivate::cachedContext()
+{
+    // an invalidation while resolving is kept for the next message
+    if (!contextValid.load(std::memory_order_acquire)) {
+        contextValid.store(true, std::memory_order_release);
+        context = resolveContext();
+    }
+    return context;
+}
+
+// Passes a message or metric to the sink and the listeners.
+template<typename Deliver, typename Relay>
+void QXmppLoggablePrivate::forward(const Deliver &deliver, const Relay &relay)
+{
+    if (QThread::currentThread() == q->thread()) {
+        dispatch(cachedContext(), deliver, relay);
+    } else {
+        dispatch(resolveContext(), deliver, relay);
+    }
+}
+
+// Calls deliver with the sink and relay with the listeners, each in its thread.
+template<typename Deliver, typename Relay>
+void QXmppLoggablePrivate::dispatch(const Context &context, const Deliver &deliver, const Relay &relay)
+{
+    if (QXmppLogger *logger = context.sink) {
+        if (logger->thread() == QThread::currentThread()) {
+            deliver(logger);
+        } else {
+            QMetaObject::invokeMethod(
+                logger, [logger, deliver]() { deliver(logger); }, Qt::QueuedConnection);
+        }
+    }
+
+    if (context.listeners.isEmpty()) {
+        return;
+    }
+
+    // the receivers may change the context
+    const auto listeners = context.listeners;
+    for (const auto &pointer : listeners) {
+        if (QXmppLoggable *listener = pointer) {
+            if (listener->thread() == QThread::currentThread()) {
+                relay(listener);
+            } else {
+                QMetaObject::invokeMethod(
+                    listener, [listener, relay]() { relay(listener); }, Qt::QueuedConnection);
+            }
+        }
+    }
+}
+
+// Invalidates the cached contexts of the loggable and its descendants.
+void QXmppLoggablePrivate::invalidate(QXmppLoggable *loggable)
+{
+    loggable->d->contextValid.store(false, std::memory_order_release);
+
+    const auto children = loggable->children();
+    for (auto *child : children) {
+        if (auto *loggableChild = qobject_cast<QXmppLoggable *>(child)) {
+            invalidate(loggableChild);
+        }
+    }
+
+    QVector<QPointer<QXmppLoggable>> loggingChildren;
+    {
+        QMutexLocker locker(&loggable->d->mutex);
+        loggingChildren = loggable->d->loggingChildren;
+    }
+    for (const auto &pointer : std::as_const(loggingChildren)) {
+        if (QXmppLoggable *child = pointer) {
+            if (child->thread() == QThread::currentThread()) {
+                invalidate(child);
+            } else {
+                // the descendants are walked in their own thread
+                child->d->contextValid.store(false, std::memory_order_release);
+                QMetaObject::invokeMethod(
+                    child, [child]() { invalidate(child); }, Qt::QueuedConnection);
+            }
+        }
+    }
+}
+
+// Removes the child and the destroyed children from the logging children.
+void QXmppLoggablePrivate::removeLoggingChild(const QXmppLoggable *child)
+{
+    QMutexLocker locker(&mutex);
+    loggingChildren.erase(std::remove_if(loggingChildren.begin(), loggingChildren.end(), [child](const QPointer<QXmppLoggable> &pointer) {
+                              return pointer.isNull() || pointer.data() == child;
+                          }),
+                          loggingChildren.end());
 }
 
 /// Constructs a new QXmppLoggable.
@@ -55,31 +254,165 @@ static void relaySignals(QXmppLoggable *from, QXmppLoggable *to)
 /// \param parent
 
 QXmppLoggable::QXmppLoggable(QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+      d(std::make_unique<QXmppLoggablePrivate>(this))
+{
+}
+
+QXmppLoggable::~QXmppLoggable()
 {
-    auto *logParent = qobject_cast<QXmppLoggable *>(parent);
-    if (logParent) {
-        relaySignals(this, logParent);
+    QXmppLoggable *loggingParent;
+    {
+        QMutexLocker locker(&d->mutex);
+        loggingParent = d->loggingParent;
+    }
+    if (loggingParent) {
+        loggingParent->d->removeLoggingChild(this);
     }
 }
 
+///
+/// Returns the logger receiving the messages and metrics of this object, i.e.
+/// the sink of this object or of its nearest loggable ancestor.
+///
+/// \since QXmpp 1.6
+///
+QXmppLogger *QXmppLoggable::loggingSink() const
+{
+    if (QThread::currentThread() == thread()) {
+        return d->cachedContext().sink;
+    }
+    return d->resolveContext().sink;
+}
+
+///
+/// Sets the logger receiving the messages and metrics of this object and of
+/// its loggable descendants which have no sink of their own.
+///
+/// If the logger lives in another thread, messages and metrics are queued to
+/// it.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::setLoggingSink(QXmppLogger *logger)
+{
+    {
+        QMutexLocker locker(&d->mutex);
+        d->sink = logger;
+    }
+    QXmppLoggablePrivate::invalidate(this);
+}
+
+///
+/// Sets the loggable whose sink and listeners are used if this object has no
+/// loggable parent.
+///
+/// This connects objects without a QObject parent, e.g. because they live in
+/// another thread, to a sink. The signals of the logging parent are emitted
+/// in its own thread.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::setLoggingParent(QXmppLoggable *parent)
+{
+    QXmppLoggable *previous;
+    {
+        QMutexLocker locker(&d->mutex);
+        previous = d->loggingParent;
+        d->loggingParent = parent;
+    }
+    if (previous) {
+        previous->d->removeLoggingChild(this);
+    }
+    if (parent) {
+        parent->d->removeLoggingChild(this);
+        QMutexLocker locker(&parent->d->mutex);
+        parent->d->loggingChildren << this;
+    }
+    QXmppLoggablePrivate::invalidate(this);
+}
+
+///
+/// Logs a message of the given type.
+///
+/// The message is passed to the logging sink, and logMessage() is emitted
+/// by this object and its loggable ancestors if they have receivers.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::log(QXmppLogger::MessageType type, const QString &message)
+{
+    d->forward([type, message](QXmppLogger *logger) { logger->log(type, message); },
+               [type, message](QXmppLoggable *listener) { Q_EMIT listener->logMessage(type, message); });
+}
+
+///
+/// Sets the given \a gauge to \a value.
+///
+/// The value is passed to the logging sink, and setGauge() is emitted
+/// by this object and its loggable ancestors if they have receivers.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::reportGauge(const QString &gauge, double value)
+{
+    d->forward([gauge, value](QXmppLogger *logger) { logger->setGauge(gauge, value); },
+               [gauge, value](QXmppLoggable *listener) { Q_EMIT listener->setGauge(gauge, value); });
+}
+
+///
+/// Updates the given \a counter by \a amount.
+///
+/// The value is passed to the logging sink, and updateCounter() is emitted
+/// by this object and its loggable ancestors if they have receivers.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::reportCounter(const QString &counter, qint64 amount)
+{
+    d->forward([counter, amount](QXmppLogger *logger) { logger->updateCounter(counter, amount); },
+               [counter, amount](QXmppLoggable *listener) { Q_EMIT listener->updateCounter(counter, amount); });
+}
+
+///
+/// Records \a value in the given \a histogram.
+///
+/// The value is passed to the logging sink, and recordValue() is emitted
+/// by this object and its loggable ancestors if they have receivers.
+///
+/// \since QXmpp 1.6
+///
+void QXmppLoggable::reportValue(const QString &histogram, qint64 value)
+{
+    d->forward([histogram, value](QXmppLogger *logger) { logger->recordValue(histogram, value); },
+               [histogram, value](QXmppLoggable *listener) { Q_EMIT listener->recordValue(histogram, value); });
+}
+
 /// \cond
 void QXmppLoggable::childEvent(QChildEvent *event)
 {
-    auto *child = qobject_cast<QXmppLoggable *>(event->child());
-    if (!child) {
-        return;
+    // children which are still being constructed are not loggables yet and
+    // have no cached context
+    if (event->added() || event->removed()) {
+        if (auto *child = qobject_cast<QXmppLoggable *>(event->child())) {
+            QXmppLoggablePrivate::invalidate(child);
+        }
     }
+}
 
-    if (event->added()) {
-        relaySignals(child, this);
-    } else if (event->removed()) {
-        disconnect(child, &QXmppLoggable::logMessage,
-                   this, &QXmppLoggable::logMessage);
-        disconnect(child, &QXmppLoggable::setGauge,
-                   this, &QXmppLoggable::setGauge);
-        disconnect(child, &QXmppLoggable::updateCounter,
-                   this, &QXmppLoggable::updateCounter);
+void QXmppLoggable::connectNotify(const QMetaMethod &signal)
+{
+    if (isLoggingSignal(signal)) {
+        QXmppLoggablePrivate::invalidate(this);
+    }
+}
+
+void QXmppLoggable::disconnectNotify(const QMetaMethod &signal)
+{
+    // an invalid method means that all signals were disconnected from a
+    // receiver, the receivers are checked again with the next message
+    if (!signal.isValid() || isLoggingSignal(signal)) {
+        QXmppLoggablePrivate::invalidate(this);
     }
 }
 /// \endcond
@@ -89,15 +422,69 @@ class QXmppLoggerPrivate
 public:
     QXmppLoggerPrivate();
 
+    LogFile *openLogFile();
+    AsyncLogWriter *openWriter();
+
     QXmppLogger::LoggingType loggingType;
-    QFile *logFile;
     QString logFilePath;
     QXmppLogger::MessageTypes messageTypes;
+    QXmppMetrics metrics;
+
+    // rotation
+    qint64 maxLogFileSize;
+    int rotationInterval;
+    int maxRotatedFiles;
+    std::unique_ptr<LogFile> logFile;
+
+    // asynchronous logging
+    bool asynchronous;
+    int bufferCapacity;
+    QXmppLogger::OverflowPolicy overflowPolicy;
+    qint64 droppedMessages;
+    std::unique_ptr<AsyncLogWriter> writer;
 };
 
 QXmppLoggerPrivate::QXmppLoggerPrivate()
-    : loggingType(QXmppLogger::NoLogging), logFile(nullptr), logFilePath("QXmppClientLog.log"), messageTypes(QXmppLogger::AnyMessage)
+    : loggingType(QXmppLogger::NoLogging),
+      logFilePath("QXmppClientLog.log"),
+      messageTypes(QXmppLogger::AnyMessage),
+      maxLogFileSize(0),
+      rotationInterval(0),
+      maxRotatedFiles(5),
+      asynchronous(false),
+      bufferCapacity(8192),
+      overflowPolicy(QXmppLogger::DropOnOverflow),
+      droppedMessages(0)
+{
+}
+
+LogFile *QXmppLoggerPrivate::openLogFile()
 {
+    if (!logFile) {
+        logFile = std::make_unique<LogFile>(logFilePath, maxLogFileSize, rotationInterval, maxRotatedFiles);
+    }
+    return logFile.get();
+}
+
+AsyncLogWriter *QXmppLoggerPrivate::openWriter()
+{
+    if (!writer) {
+        AsyncLogWriter::Output output;
+        if (loggingType == QXmppLogger::FileLogging) {
+            // the file is only used by the writer's thread from now on
+            std::shared_ptr<LogFile> file(new LogFile(logFilePath, maxLogFileSize, rotationInterval, maxRotatedFiles));
+            output = [file](const QByteArray &batch) {
+                file->write(batch);
+            };
+        } else {
+            output = [](const QByteArray &batch) {
+                std::cout.write(batch.constData(), batch.size());
+                std::cout.flush();
+            };
+        }
+        writer = std::make_unique<AsyncLogWriter>(std::move(output), bufferCapacity, overflowPolicy == QXmppLogger::BlockOnOverflow);
+    }
+    return writer.get();
 }
 
 /// Constructs a new QXmppLogger.
@@ -113,6 +500,8 @@ QXmppLogger::QXmppLogger(QObject *parent)
 
 QXmppLogger::~QXmppLogger()
 {
+    // write the pending messages
+    reopen();
     delete d;
 }
 
@@ -159,6 +548,189 @@ void QXmppLogger::setMessageTypes(QXmppLogger::MessageTypes types)
     d->messageTypes = types;
 }
 
+/// Returns whether file and standard output logging is asynchronous.
+///
+/// \since QXmpp 1.6
+
+bool QXmppLogger::isAsynchronous() const
+{
+    return d->asynchronous;
+}
+
+/// Sets whether file and standard output logging is asynchronous.
+///
+/// When enabled, log() only formats the message and queues it in a ring
+/// buffer of bufferCapacity() messages. A background thread writes the
+/// queued messages in batches, so logging sent and received stanzas does not
+/// block the thread handling them on I/O. Use flush() to wait until the
+/// queued messages have been written.
+///
+/// The default is false.
+///
+/// \param asynchronous
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setAsynchronous(bool asynchronous)
+{
+    if (d->asynchronous != asynchronous) {
+        reopen();
+        d->asynchronous = asynchronous;
+    }
+}
+
+/// Returns the number of messages which can be queued for asynchronous
+/// logging.
+///
+/// \since QXmpp 1.6
+
+int QXmppLogger::bufferCapacity() const
+{
+    return d->bufferCapacity;
+}
+
+/// Sets the number of messages which can be queued for asynchronous logging,
+/// rounded up to a power of two. The default is 8192.
+///
+/// \param messages
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setBufferCapacity(int messages)
+{
+    if (d->bufferCapacity != messages) {
+        reopen();
+        d->bufferCapacity = messages;
+    }
+}
+
+/// Returns what happens to messages logged asynchronously while the buffer
+/// is full.
+///
+/// \since QXmpp 1.6
+
+QXmppLogger::OverflowPolicy QXmppLogger::overflowPolicy() const
+{
+    return d->overflowPolicy;
+}
+
+/// Sets what happens to messages logged asynchronously while the buffer is
+/// full. The default is DropOnOverflow.
+///
+/// \param policy
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setOverflowPolicy(QXmppLogger::OverflowPolicy policy)
+{
+    if (d->overflowPolicy != policy) {
+        reopen();
+        d->overflowPolicy = policy;
+    }
+}
+
+/// Returns the size in bytes above which the log file is rotated, 0 if the
+/// log file is not rotated by size.
+///
+/// \since QXmpp 1.6
+
+qint64 QXmppLogger::maxLogFileSize() const
+{
+    return d->maxLogFileSize;
+}
+
+/// Sets the size in bytes above which the log file is rotated.
+///
+/// When the log file is rotated, it is renamed to "<logFilePath>.1", the
+/// previously rotated files are renamed to "<logFilePath>.2" and so on, and
+/// files beyond maxRotatedFiles() are removed.
+///
+/// The default is 0, which disables rotation by size.
+///
+/// \param bytes
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setMaxLogFileSize(qint64 bytes)
+{
+    if (d->maxLogFileSize != bytes) {
+        reopen();
+        d->maxLogFileSize = bytes;
+    }
+}
+
+/// Returns the interval in seconds after which the log file is rotated, 0 if
+/// the log file is not rotated by age.
+///
+/// \since QXmpp 1.6
+
+int QXmppLogger::rotationInterval() const
+{
+    return d->rotationInterval;
+}
+
+/// Sets the interval in seconds after which the log file is rotated.
+///
+/// The default is 0, which disables rotation by age.
+///
+/// \param seconds
+///
+/// \sa setMaxLogFileSize()
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setRotationInterval(int seconds)
+{
+    if (d->rotationInterval != seconds) {
+        reopen();
+        d->rotationInterval = seconds;
+    }
+}
+
+/// Returns the number of rotated log files which are kept.
+///
+/// \since QXmpp 1.6
+
+int QXmppLogger::maxRotatedFiles() const
+{
+    return d->maxRotatedFiles;
+}
+
+/// Sets the number of rotated log files which are kept. The default is 5.
+///
+/// \param count
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::setMaxRotatedFiles(int count)
+{
+    if (d->maxRotatedFiles != count) {
+        reopen();
+        d->maxRotatedFiles = count;
+    }
+}
+
+/// Returns the number of messages which were dropped because the buffer of
+/// asynchronous logging was full.
+///
+/// \since QXmpp 1.6
+
+qint64 QXmppLogger::droppedMessageCount() const
+{
+    return d->droppedMessages + (d->writer ? d->writer->droppedCount() : 0);
+}
+
+/// Waits until the messages logged asynchronously have been written.
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::flush()
+{
+    if (d->writer) {
+        d->writer->flush();
+    }
+}
+
 /// Add a logging message.
 ///
 /// \param type
@@ -173,14 +745,14 @@ void QXmppLogger::log(QXmppLogger::MessageType type, const QString &text)
 
     switch (d->loggingType) {
     case QXmppLogger::FileLogging:
-        if (!d->logFile) {
-            d->logFile = new QFile(d->logFilePath);
-            d->logFile->open(QIODevice::WriteOnly | QIODevice::Append);
-        }
-        QTextStream(d->logFile) << formatted(type, text) << "\n";
-        break;
     case QXmppLogger::StdoutLogging:
-        std::cout << qPrintable(formatted(type, text)) << std::endl;
+        if (d->asynchronous) {
+            d->openWriter()->push(formatted(type, text).toUtf8() + '\n');
+        } else if (d->loggingType == QXmppLogger::FileLogging) {
+            d->openLogFile()->write(formatted(type, text).toUtf8() + '\n');
+        } else {
+            std::cout << qPrintable(formatted(type, text)) << std::endl;
+        }
         break;
     case QXmppLogger::SignalLogging:
         Q_EMIT message(type, text);
@@ -190,24 +762,43 @@ void QXmppLogger::log(QXmppLogger::MessageType type, const QString &text)
     }
 }
 
+/// Returns the registry holding the metrics reported to this logger.
+///
+/// Streams update their traffic metrics in this registry directly, without
+/// calling updateCounter() or recordValue().
+///
+/// \since QXmpp 1.6
+
+QXmppMetrics *QXmppLogger::metrics() const
+{
+    return &d->metrics;
+}
+
 /// Sets the given \a gauge to \a value.
 ///
-/// NOTE: the base implementation does nothing.
+/// The base implementation updates the gauge in metrics().
 
 void QXmppLogger::setGauge(const QString &gauge, double value)
 {
-    Q_UNUSED(gauge);
-    Q_UNUSED(value);
+    d->metrics.gauge(gauge)->set(value);
 }
 
 /// Updates the given \a counter by \a amount.
 ///
-/// NOTE: the base implementation does nothing.
+/// The base implementation updates the counter in metrics().
 
 void QXmppLogger::updateCounter(const QString &counter, qint64 amount)
 {
-    Q_UNUSED(counter);
-    Q_UNUSED(amount);
+    d->metrics.counter(counter)->add(amount);
+}
+
+/// Records \a value in the given \a histogram of metrics().
+///
+/// \since QXmpp 1.6
+
+void QXmppLogger::recordValue(const QString &histogram, qint64 value)
+{
+    d->metrics.histogram(histogram)->record(value);
 }
 
 QString QXmppLogger::logFilePath()
@@ -234,8 +825,10 @@ void QXmppLogger::setLogFilePath(const QString &path)
 
 void QXmppLogger::reopen()
 {
-    if (d->logFile) {
-        delete d->logFile;
-        d->logFile = nullptr;
+    d->logFile.reset();
+    if (d->writer) {
+        // waits for the pending messages to be written
+        d->droppedMessages += d->writer->droppedCount();
+        d->writer.reset();
     }
 }
@@ -8,6 +8,8 @@
 
 #include "QXmppGlobal.h"
 
+#include <memory>
+
 #include <QObject>
 
 #ifdef QXMPP_LOGGABLE_TRACE
@@ -16,7 +18,9 @@
 #define qxmpp_loggable_trace(x) (x)
 #endif
 
+class QXmppLoggablePrivate;
 class QXmppLoggerPrivate;
+class QXmppMetrics;
 
 ///
 /// \brief The QXmppLogger class represents a sink for logging messages.
@@ -57,6 +61,16 @@ public:
     };
     Q_DECLARE_FLAGS(MessageTypes, MessageType)
 
+    /// This enum describes what happens to messages logged asynchronously
+    /// while the buffer is full.
+    ///
+    /// \since QXmpp 1.6
+    enum OverflowPolicy {
+        DropOnOverflow,   ///< Messages are dropped and the number of dropped messages is logged
+        BlockOnOverflow,  ///< The logging thread waits until there is space in the buffer
+    };
+    Q_ENUM(OverflowPolicy)
+
     QXmppLogger(QObject *parent = nullptr);
     ~QXmppLogger() override;
 
@@ -81,9 +95,33 @@ public:
     QXmppLogger::MessageTypes messageTypes();
     void setMessageTypes(QXmppLogger::MessageTypes types);
 
+    QXmppMetrics *metrics() const;
+
+    bool isAsynchronous() const;
+    void setAsynchronous(bool asynchronous);
+
+    int bufferCapacity() const;
+    void setBufferCapacity(int messages);
+
+    OverflowPolicy overflowPolicy() const;
+    void setOverflowPolicy(OverflowPolicy policy);
+
+    qint64 maxLogFileSize() const;
+    void setMaxLogFileSize(qint64 bytes);
+
+    int rotationInterval() const;
+    void setRotationInterval(int seconds);
+
+    int maxRotatedFiles() const;
+    void setMaxRotatedFiles(int count);
+
+    qint64 droppedMessageCount() const;
+    void flush();
+
 public Q_SLOTS:
     virtual void setGauge(const QString &gauge, double value);
     virtual void updateCounter(const QString &counter, qint64 amount);
+    void recordValue(const QString &histogram, qint64 value);
 
     void log(QXmppLogger::MessageType type, const QString &text);
     void reopen();
@@ -99,6 +137,17 @@ private:
 
 /// \brief The QXmppLoggable class represents a source of logging messages.
 ///
+/// Log messages and metrics reported with log() and the report*() functions
+/// are passed directly to the logger set with setLoggingSink() on the object
+/// or its nearest loggable ancestor. The logMessage(), setGauge(),
+/// updateCounter() and recordValue() signals are emitted by the object and
+/// its loggable ancestors which have receivers connected to them, each in its
+/// own thread. Emitting these signals directly only notifies their receivers.
+///
+/// The sink and the listening ancestors are cached per object and only
+/// looked up again when the configuration or the receivers of the object or
+/// one of its ancestors change.
+///
 /// \ingroup Core
 
 class QXMPP_EXPORT QXmppLoggable : public QObject
@@ -107,10 +156,22 @@ class QXMPP_EXPORT QXmppLoggable : public QObject
 
 public:
     QXmppLoggable(QObject *parent = nullptr);
+    ~QXmppLoggable() override;
+
+    QXmppLogger *loggingSink() const;
+    void setLoggingSink(QXmppLogger *logger);
+    void setLoggingParent(QXmppLoggable *parent);
+
+    void log(QXmppLogger::MessageType type, const QString &message);
+    void reportGauge(const QString &gauge, double value);
+    void reportCounter(const QString &counter, qint64 amount = 1);
+    void reportValue(const QString &histogram, qint64 value);
 
 protected:
     /// \cond
     void childEvent(QChildEvent *event) override;
+    void connectNotify(const QMetaMethod &signal) override;
+    void disconnectNotify(const QMetaMethod &signal) override;
     /// \endcond
 
     /// Logs a debugging message.
@@ -119,7 +180,7 @@ protected:
 
     void debug(const QString &message)
     {
-        Q_EMIT logMessage(QXmppLogger::DebugMessage, qxmpp_loggable_trace(message));
+        log(QXmppLogger::DebugMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs an informational message.
@@ -128,7 +189,7 @@ protected:
 
     void info(const QString &message)
     {
-        Q_EMIT logMessage(QXmppLogger::InformationMessage, qxmpp_loggable_trace(message));
+        log(QXmppLogger::InformationMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a warning message.
@@ -137,7 +198,7 @@ protected:
 
     void warning(const QString &message)
     {
-        Q_EMIT logMessage(QXmppLogger::WarningMessage, qxmpp_loggable_trace(message));
+        log(QXmppLogger::WarningMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a received packet.
@@ -146,7 +207,7 @@ protected:
 
     void logReceived(const QString &message)
     {
-        Q_EMIT logMessage(QXmppLogger::ReceivedMessage, qxmpp_loggable_trace(message));
+        log(QXmppLogger::ReceivedMessage, qxmpp_loggable_trace(message));
     }
 
     /// Logs a sent packet.
@@ -155,7 +216,7 @@ protected:
 
     void logSent(const QString &message)
     {
-        Q_EMIT logMessage(QXmppLogger::SentMessage, qxmpp_loggable_trace(message));
+        log(QXmppLogger::SentMessage, qxmpp_loggable_trace(message));
     }
 
 Q_SIGNALS:
@@ -167,6 +228,15 @@ Q_SIGNALS:
 
     /// Updates the given \a counter by \a amount.
     void updateCounter(const QString &counter, qint64 amount = 1);
+
+    /// Records \a value in the given \a histogram.
+    ///
+    /// \since QXmpp 1.6
+    void recordValue(const QString &histogram, qint64 value);
+
+private:
+    friend class QXmppLoggablePrivate;
+    const std::unique_ptr<QXmppLoggablePrivate> d;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(QXmppLogger::MessageTypes)
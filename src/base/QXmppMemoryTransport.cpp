@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppMemoryTransport.h"
+
+#include <array>
+
+#include <QMutex>
+
+// The state shared by both ends of a pair, guarded by the mutex.
+struct MemoryPipe
+{
+    QMutex mutex;
+    bool open = true;
+    // ends which have not been destroyed yet
+    std::array<QXmppMemoryTransport *, 2> ends = { nullptr, nullptr };
+    // data to be read by each end
+    std::array<QByteArray, 2> buffers;
+    // whether a readyRead() notification is pending for each end
+    std::array<bool, 2> notified = { false, false };
+};
+
+class QXmppMemoryTransportPrivate
+{
+public:
+    // must be called with the pipe's mutex locked
+    void notifyReadyRead(int end);
+    void notifyDisconnected(int end);
+    static void emitDisconnected(QXmppMemoryTransport *transport);
+
+    std::shared_ptr<MemoryPipe> pipe;
+    int end = 0;
+};
+
+// Posts a readyRead() notification to the given end, unless one is pending.
+void QXmppMemoryTransportPrivate::notifyReadyRead(int end)
+{
+    auto *transport = pipe->ends[end];
+    if (!transport || pipe->notified[end]) {
+        return;
+    }
+    pipe->notified[end] = true;
+
+    // the event is discarded if the transport is destroyed, which can only
+    // happen after the mutex has been released
+    QMetaObject::invokeMethod(
+        transport, [transport]() {
+            const auto pipe = transport->d->pipe;
+            {
+                QMutexLocker locker(&pipe->mutex);
+                pipe->notified[transport->d->end] = false;
+                if (pipe->buffers[transport->d->end].isEmpty()) {
+                    return;
+                }
+            }
+            Q_EMIT transport->readyRead();
+        },
+        Qt::QueuedConnection);
+}
+
+// Posts the disconnection to the given end.
+void QXmppMemoryTransportPrivate::notifyDisconnected(int end)
+{
+    if (auto *transport = pipe->ends[end]) {
+        QMetaObject::invokeMethod(
+            transport, [transport]() { emitDisconnected(transport); }, Qt::QueuedConnection);
+    }
+}
+
+void QXmppMemoryTransportPrivate::emitDisconnected(QXmppMemoryTransport *transport)
+{
+    Q_EMIT transport->stateChanged(QAbstractSocket::UnconnectedState);
+    Q_EMIT transport->disconnected();
+}
+
+QXmppMemoryTransport::QXmppMemoryTransport()
+    : d(std::make_unique<QXmppMemoryTransportPrivate>())
+{
+}
+
+QXmppMemoryTransport::~QXmppMemoryTransport()
+{
+    QMutexLocker locker(&d->pipe->mutex);
+    d->pipe->ends[d->end] = nullptr;
+    if (d->pipe->open) {
+        d->pipe->open = false;
+        d->notifyDisconnected(1 - d->end);
+    }
+}
+
+///
+/// Creates two connected transports without a parent.
+///
+std::pair<QXmppMemoryTransport *, QXmppMemoryTransport *> QXmppMemoryTransport::createPair()
+{
+    auto pipe = std::make_shared<MemoryPipe>();
+
+    auto *first = new QXmppMemoryTransport;
+    first->d->pipe = pipe;
+    first->d->end = 0;
+    pipe->ends[0] = first;
+
+    auto *second = new QXmppMemoryTransport;
+    second->d->pipe = pipe;
+    second->d->end = 1;
+    pipe->ends[1] = second;
+
+    return { first, second };
+}
+
+QAbstractSocket::SocketState QXmppMemoryTransport::state() const
+{
+    QMutexLocker locker(&d->pipe->mutex);
+    return d->pipe->open ? QAbstractSocket::ConnectedState : QAbstractSocket::UnconnectedState;
+}
+
+QString QXmppMemoryTransport::peerName() const
+{
+    return QStringLiteral("memory");
+}
+
+QString QXmppMemoryTransport::errorString() const
+{
+    return state() == QAbstractSocket::ConnectedState ? QString() : QStringLiteral("The connection is closed");
+}
+
+QByteArray QXmppMemoryTransport::readAll()
+{
+    QMutexLocker locker(&d->pipe->mutex);
+    return std::exchange(d->pipe->buffers[d->end], QByteArray());
+}
+
+qint64 QXmppMemoryTransport::write(const QByteArray &data)
+{
+    QMutexLocker locker(&d->pipe->mutex);
+    if (!d->pipe->open) {
+        return -1;
+    }
+
+    const int peer = 1 - d->end;
+    d->pipe->buffers[peer] += data;
+    d->notifyReadyRead(peer);
+    return data.size();
+}
+
+///
+/// Returns the number of bytes written which have not been read by the other
+/// end yet.
+///
+qint64 QXmppMemoryTransport::bytesToWrite() const
+{
+    QMutexLocker locker(&d->pipe->mutex);
+    return d->pipe->buffers[1 - d->end].size();
+}
+
+void QXmppMemoryTransport::disconnectFromHost()
+{
+    {
+        QMutexLocker locker(&d->pipe->mutex);
+        if (!d->pipe->open) {
+            return;
+        }
+        d->pipe->open = false;
+        // queued after the data written so far
+        d->notifyDisconnected(1 - d->end);
+    }
+    d->emitDisconnected(this);
+}
@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPMEMORYTRANSPORT_H
+#define QXMPPMEMORYTRANSPORT_H
+
+#include "QXmppTransport.h"
+
+#include <memory>
+#include <utility>
+
+class QXmppMemoryTransportPrivate;
+
+///
+/// \brief The QXmppMemoryTransport class connects two streams in the same
+/// process without a socket.
+///
+/// Transports are created as connected pairs with createPair(). Data written
+/// to one end is read by the other end once the event loop of its thread
+/// runs, so the ends may live in different threads. Closing or destroying one
+/// end disconnects the other one.
+///
+/// \code
+/// auto [clientEnd, serverEnd] = QXmppMemoryTransport::createPair();
+/// server.addIncomingClient(new QXmppIncomingClient(serverEnd, server.domain(), &server));
+/// client.connectToServer(config, clientEnd);
+/// \endcode
+///
+/// QXmppServer::connectInMemory() does the server part of this.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppMemoryTransport : public QXmppTransport
+{
+    Q_OBJECT
+
+public:
+    ~QXmppMemoryTransport() override;
+
+    static std::pair<QXmppMemoryTransport *, QXmppMemoryTransport *> createPair();
+
+    QAbstractSocket::SocketState state() const override;
+    QString peerName() const override;
+    QString errorString() const override;
+
+    QByteArray readAll() override;
+    qint64 write(const QByteArray &data) override;
+    qint64 bytesToWrite() const override;
+    void disconnectFromHost() override;
+
+private:
+    QXmppMemoryTransport();
+
+    friend class QXmppMemoryTransportPrivate;
+    const std::unique_ptr<QXmppMemoryTransportPrivate> d;
+};
+
+#endif  // QXMPPMEMORYTRANSPORT_H
@@ -0,0 +1,254 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppMetrics.h"
+
+#include <cmath>
+#include <map>
+
+#include <QReadWriteLock>
+#include <QtAlgorithms>
+
+// each power of two is split into 2^SUB_BUCKET_BITS buckets
+constexpr int SUB_BUCKET_BITS = 3;
+constexpr int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+
+static QByteArray prometheusName(const QString &prefix, const QString &name)
+{
+    QByteArray result = prefix.toUtf8();
+    if (!result.isEmpty()) {
+        result += '_';
+    }
+    for (const QChar c : name) {
+        const ushort u = c.unicode();
+        const bool valid = (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') ||
+            (u >= '0' && u <= '9') || u == '_' || u == ':';
+        result += valid ? char(u) : '_';
+    }
+    return result;
+}
+
+static QByteArray prometheusValue(double value)
+{
+    if (std::isnan(value)) {
+        return QByteArrayLiteral("NaN");
+    } else if (std::isinf(value)) {
+        return value > 0 ? QByteArrayLiteral("+Inf") : QByteArrayLiteral("-Inf");
+    }
+    return QByteArray::number(value, 'g', 17);
+}
+
+class QXmppMetricsPrivate
+{
+public:
+    template<typename T>
+    T *find(std::map<QString, std::unique_ptr<T>> &metrics, const QString &name);
+
+    mutable QReadWriteLock lock;
+    std::map<QString, std::unique_ptr<QXmppMetrics::Counter>> counters;
+    std::map<QString, std::unique_ptr<QXmppMetrics::Gauge>> gauges;
+    std::map<QString, std::unique_ptr<QXmppMetrics::Histogram>> histograms;
+};
+
+template<typename T>
+T *QXmppMetricsPrivate::find(std::map<QString, std::unique_ptr<T>> &metrics, const QString &name)
+{
+    {
+        QReadLocker locker(&lock);
+        const auto itr = metrics.find(name);
+        if (itr != metrics.end()) {
+            return itr->second.get();
+        }
+    }
+
+    QWriteLocker locker(&lock);
+    auto &metric = metrics[name];
+    if (!metric) {
+        metric = std::make_unique<T>();
+    }
+    return metric.get();
+}
+
+///
+/// Records a value, negative values are counted as zero.
+///
+/// \param value
+///
+void QXmppMetrics::Histogram::record(qint64 value)
+{
+    value = qMax<qint64>(value, 0);
+    m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    qint64 max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+///
+/// Returns the index of the bucket counting \a value.
+///
+int QXmppMetrics::Histogram::bucketIndex(qint64 value)
+{
+    if (value < SUB_BUCKET_COUNT) {
+        return int(qMax<qint64>(value, 0));
+    }
+    const int exponent = 63 - qCountLeadingZeroBits(quint64(value));
+    const int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKET_COUNT + int((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+///
+/// Returns the smallest value counted by the bucket at \a index.
+///
+qint64 QXmppMetrics::Histogram::bucketLowerBound(int index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    const int shift = index / SUB_BUCKET_COUNT - 1;
+    return qint64(quint64(SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT) << shift);
+}
+
+///
+/// Returns the largest value counted by the bucket at \a index.
+///
+qint64 QXmppMetrics::Histogram::bucketUpperBound(int index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    const int shift = index / SUB_BUCKET_COUNT - 1;
+    return qint64((quint64(SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT + 1) << shift) - 1);
+}
+
+///
+/// Returns an upper bound of the given percentile of the recorded values,
+/// or 0 if no values were recorded.
+///
+/// \param percent The percentile, between 0 and 100.
+///
+qint64 QXmppMetrics::HistogramSnapshot::percentile(double percent) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    const auto rank = qMax<qint64>(1, qint64(std::ceil(qBound(0.0, percent, 100.0) / 100.0 * double(count))));
+    qint64 seen = 0;
+    for (const auto &bucket : buckets) {
+        seen += bucket.second;
+        if (seen >= rank) {
+            return qMin(bucket.first, max);
+        }
+    }
+    return max;
+}
+
+QXmppMetrics::QXmppMetrics()
+    : d(std::make_unique<QXmppMetricsPrivate>())
+{
+}
+
+QXmppMetrics::~QXmppMetrics() = default;
+
+///
+/// Returns the counter with the given name, creating it if needed.
+///
+QXmppMetrics::Counter *QXmppMetrics::counter(const QString &name)
+{
+    return d->find(d->counters, name);
+}
+
+///
+/// Returns the gauge with the given name, creating it if needed.
+///
+QXmppMetrics::Gauge *QXmppMetrics::gauge(const QString &name)
+{
+    return d->find(d->gauges, name);
+}
+
+///
+/// Returns the histogram with the given name, creating it if needed.
+///
+QXmppMetrics::Histogram *QXmppMetrics::histogram(const QString &name)
+{
+    return d->find(d->histograms, name);
+}
+
+///
+/// Returns the current values of all metrics.
+///
+/// Metrics may be updated while the snapshot is taken, so the values of
+/// different metrics are not guaranteed to be consistent with each other.
+///
+QXmppMetrics::Snapshot QXmppMetrics::snapshot() const
+{
+    Snapshot snapshot;
+
+    QReadLocker locker(&d->lock);
+    for (const auto &[name, counter] : d->counters) {
+        snapshot.counters.insert(name, counter->value());
+    }
+    for (const auto &[name, gauge] : d->gauges) {
+        snapshot.gauges.insert(name, gauge->value());
+    }
+    for (const auto &[name, histogram] : d->histograms) {
+        HistogramSnapshot values;
+        for (int i = 0; i < Histogram::BucketCount; ++i) {
+            if (const auto count = histogram->m_buckets[i].load(std::memory_order_relaxed)) {
+                values.buckets.append({ Histogram::bucketUpperBound(i), count });
+                values.count += count;
+            }
+        }
+        values.sum = histogram->m_sum.load(std::memory_order_relaxed);
+        values.max = histogram->m_max.load(std::memory_order_relaxed);
+        snapshot.histograms.insert(name, values);
+    }
+    return snapshot;
+}
+
+///
+/// Returns the current values of all metrics in the Prometheus text
+/// exposition format.
+///
+/// Metric names are prefixed with \a prefix and characters which are not
+/// allowed are replaced by underscores, so "incoming-client.count" becomes
+/// "qxmpp_incoming_client_count". Counters get a "_total" suffix. Histograms
+/// only list their non-empty buckets.
+///
+/// \param prefix
+///
+QByteArray QXmppMetrics::toPrometheus(const QString &prefix) const
+{
+    const auto values = snapshot();
+    QByteArray output;
+
+    for (auto itr = values.counters.cbegin(); itr != values.counters.cend(); ++itr) {
+        const QByteArray name = prometheusName(prefix, itr.key()) + "_total";
+        output += "# TYPE " + name + " counter\n";
+        output += name + ' ' + QByteArray::number(itr.value()) + '\n';
+    }
+
+    for (auto itr = values.gauges.cbegin(); itr != values.gauges.cend(); ++itr) {
+        const QByteArray name = prometheusName(prefix, itr.key());
+        output += "# TYPE " + name + " gauge\n";
+        output += name + ' ' + prometheusValue(itr.value()) + '\n';
+    }
+
+    for (auto itr = values.histograms.cbegin(); itr != values.histograms.cend(); ++itr) {
+        const QByteArray name = prometheusName(prefix, itr.key());
+        const auto &histogram = itr.value();
+        output += "# TYPE " + name + " histogram\n";
+        qint64 cumulative = 0;
+        for (const auto &bucket : histogram.buckets) {
+            cumulative += bucket.second;
+            output += name + "_bucket{le=\"" + QByteArray::number(bucket.first) + "\"} " + QByteArray::number(cumulative) + '\n';
+        }
+        output += name + "_bucket{le=\"+Inf\"} " + QByteArray::number(histogram.count) + '\n';
+        output += name + "_sum " + QByteArray::number(histogram.sum) + '\n';
+        output += name + "_count " + QByteArray::number(histogram.count) + '\n';
+    }
+
+    return output;
+}
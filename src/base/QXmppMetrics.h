@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPMETRICS_H
+#define QXMPPMETRICS_H
+
+#include "QXmppGlobal.h"
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include <QMap>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+class QXmppMetricsPrivate;
+
+///
+/// \brief The QXmppMetrics class is a registry of counters, gauges and
+/// latency histograms.
+///
+/// Metrics are created on first use and live as long as the registry, so the
+/// pointers returned by counter(), gauge() and histogram() can be kept to
+/// update a metric without looking up its name again. Updating a metric is
+/// lock-free and may be done from any thread.
+///
+/// snapshot() returns the current values and toPrometheus() renders them in
+/// the Prometheus text exposition format.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppMetrics
+{
+public:
+    /// \brief A monotonically increasing 64-bit counter.
+    class QXMPP_EXPORT Counter
+    {
+    public:
+        /// Adds \a amount to the counter.
+        void add(qint64 amount = 1) { m_value.fetch_add(amount, std::memory_order_relaxed); }
+        /// Returns the value of the counter.
+        qint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<qint64> m_value { 0 };
+    };
+
+    /// \brief A value which can go up and down.
+    class QXMPP_EXPORT Gauge
+    {
+    public:
+        /// Sets the gauge to \a value.
+        void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+        /// Returns the value of the gauge.
+        double value() const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<double> m_value { 0.0 };
+    };
+
+    ///
+    /// \brief A histogram of non-negative integer values, such as latencies
+    /// in microseconds.
+    ///
+    /// Values are counted in log-linear buckets: each power of two is split
+    /// into eight buckets, so the relative error of a bucket bound is below
+    /// 12.5 % over the whole 64-bit range.
+    ///
+    class QXMPP_EXPORT Histogram
+    {
+    public:
+        /// Number of buckets.
+        static constexpr int BucketCount = 488;
+
+        void record(qint64 value);
+
+        static int bucketIndex(qint64 value);
+        static qint64 bucketLowerBound(int index);
+        static qint64 bucketUpperBound(int index);
+
+    private:
+        friend class QXmppMetrics;
+
+        std::array<std::atomic<qint64>, BucketCount> m_buckets = {};
+        std::atomic<qint64> m_sum { 0 };
+        std::atomic<qint64> m_max { 0 };
+    };
+
+    /// \brief The values of a histogram at a point in time.
+    struct QXMPP_EXPORT HistogramSnapshot
+    {
+        /// Number of recorded values.
+        qint64 count = 0;
+        /// Sum of the recorded values.
+        qint64 sum = 0;
+        /// Largest recorded value.
+        qint64 max = 0;
+        /// Inclusive upper bound and number of values of the non-empty
+        /// buckets, in ascending order.
+        QVector<QPair<qint64, qint64>> buckets;
+
+        qint64 percentile(double percent) const;
+    };
+
+    /// \brief The values of all metrics at a point in time.
+    struct QXMPP_EXPORT Snapshot
+    {
+        /// Counters by name.
+        QMap<QString, qint64> counters;
+        /// Gauges by name.
+        QMap<QString, double> gauges;
+        /// Histograms by name.
+        QMap<QString, HistogramSnapshot> histograms;
+    };
+
+    QXmppMetrics();
+    ~QXmppMetrics();
+
+    Counter *counter(const QString &name);
+    Gauge *gauge(const QString &name);
+    Histogram *histogram(const QString &name);
+
+    Snapshot snapshot() const;
+    QByteArray toPrometheus(const QString &prefix = QStringLiteral("qxmpp")) const;
+
+private:
+    Q_DISABLE_COPY(QXmppMetrics)
+    const std::unique_ptr<QXmppMetricsPrivate> d;
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include "QXmppGlobal.h"
 #include "QXmppPromise.h"
 #include "QXmppSendResult.h"
+#include "QXmppStanzaTrace.h"
 
 #include <memory>
 
@@ -28,10 +29,16 @@ public:
 
     void reportFinished(QXmpp::SendResult &&);
 
+    bool hasTrace() const { return bool(m_trace); }
+    void setTrace(QXmpp::Private::StanzaTraceHandle trace) { m_trace = std::move(trace); }
+    QXmpp::Private::StanzaTraceHandle takeTrace() { return std::move(m_trace); }
+
 private:
     QXmppPromise<QXmpp::SendResult> m_promise;
     QByteArray m_data;
     bool m_isXmppStanza;
+    // the trace of a sampled outgoing stanza until it is written
+    QXmpp::Private::StanzaTraceHandle m_trace;
 };
 
 #endif  // QXMPPPACKET_H
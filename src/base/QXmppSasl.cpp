@@ -5,6 +5,7 @@
 
 #include "QXmppSasl_p.h"
 #include "QXmppUtils.h"
+#include "QXmppUtils_p.h"
 
 #include <cstdlib>
 
@@ -83,6 +84,12 @@ static QByteArray generateNonce()
     return nonce.toBase64();
 }
 
+// Decodes a SCRAM username, see RFC 5802, section 5.1
+static QByteArray unescapeScramUsername(QByteArray username)
+{
+    return username.replace("=2C", ",").replace("=3D", "=");
+}
+
 static QMap<char, QByteArray> parseGS2(const QByteArray &ba)
 {
     QMap<char, QByteArray> map;
@@ -665,7 +672,9 @@ QXmppSaslServer::~QXmppSaslServer()
 
 QXmppSaslServer *QXmppSaslServer::create(const QString &mechanism, QObject *parent)
 {
-    if (mechanism == QStringLiteral("PLAIN")) {
+    if (mechanism == QStringLiteral("SCRAM-SHA-1") || mechanism == QStringLiteral("SCRAM-SHA-256")) {
+        return new QXmppSaslServerScram(SCRAM_ALGORITHMS.value(mechanism), parent);
+    } else if (mechanism == QStringLiteral("PLAIN")) {
         return new QXmppSaslServerPlain(parent);
     } else if (mechanism == QStringLiteral("DIGEST-MD5")) {
         return new QXmppSaslServerDigestMd5(parent);
@@ -826,6 +835,106 @@ QXmppSaslServer::Response QXmppSaslServerDigestMd5::respond(const QByteArray &re
     }
 }
 
+QXmppSaslServerScram::QXmppSaslServerScram(QCryptographicHash::Algorithm algorithm, QObject *parent)
+    : QXmppSaslServer(parent),
+      m_algorithm(algorithm),
+      m_step(0),
+      m_iterations(0)
+{
+}
+
+QString QXmppSaslServerScram::mechanism() const
+{
+    return SCRAM_ALGORITHMS.key(m_algorithm);
+}
+
+QCryptographicHash::Algorithm QXmppSaslServerScram::algorithm() const
+{
+    return m_algorithm;
+}
+
+// Sets the user's stored SCRAM keys, see RFC 5802, section 3.
+void QXmppSaslServerScram::setKeys(const QByteArray &salt, int iterations, const QByteArray &storedKey, const QByteArray &serverKey)
+{
+    m_salt = salt;
+    m_iterations = iterations;
+    m_storedKey = storedKey;
+    m_serverKey = serverKey;
+}
+
+QXmppSaslServer::Response QXmppSaslServerScram::respond(const QByteArray &request, QByteArray &response)
+{
+    if (m_step == 0) {
+        if (m_clientFirstMessageBare.isEmpty()) {
+            // parse GS2 header, channel binding and authorization identities are not supported
+            const int cbflagEnd = request.indexOf(',');
+            const int authzidEnd = request.indexOf(',', cbflagEnd + 1);
+            const QByteArray cbflag = request.left(cbflagEnd);
+            if (cbflagEnd < 0 || authzidEnd != cbflagEnd + 1 || (cbflag != "n" && cbflag != "y")) {
+                warning(QStringLiteral("QXmppSaslServerScram : Invalid GS2 header"));
+                return Failed;
+            }
+            m_gs2Header = request.left(authzidEnd + 1);
+            m_clientFirstMessageBare = request.mid(authzidEnd + 1);
+
+            const QMap<char, QByteArray> input = parseGS2(m_clientFirstMessageBare);
+            m_clientNonce = input.value('r');
+            if (m_clientNonce.isEmpty() || input.value('n').isEmpty()) {
+                warning(QStringLiteral("QXmppSaslServerScram : Invalid input"));
+                return Failed;
+            }
+            setUsername(QString::fromUtf8(unescapeScramUsername(input.value('n'))));
+        }
+
+        if (m_storedKey.isEmpty() || m_serverKey.isEmpty() || m_salt.isEmpty() || m_iterations < 1) {
+            return InputNeeded;
+        }
+
+        m_nonce = m_clientNonce + generateNonce();
+        m_serverFirstMessage = QByteArrayLiteral("r=") + m_nonce +
+            QByteArrayLiteral(",s=") + m_salt.toBase64() +
+            QByteArrayLiteral(",i=") + QByteArray::number(m_iterations);
+
+        m_step++;
+        response = m_serverFirstMessage;
+        return Challenge;
+    } else if (m_step == 1) {
+        const int proofIndex = request.lastIndexOf(",p=");
+        const QMap<char, QByteArray> input = parseGS2(request);
+        if (proofIndex < 0 ||
+            input.value('c') != m_gs2Header.toBase64() ||
+            input.value('r') != m_nonce) {
+            warning(QStringLiteral("QXmppSaslServerScram : Invalid input"));
+            return Failed;
+        }
+
+        // recover the client key from the proof and check it against the stored key
+        const QByteArray clientFinalMessageBare = request.left(proofIndex);
+        const QByteArray authMessage = m_clientFirstMessageBare + ',' + m_serverFirstMessage + ',' + clientFinalMessageBare;
+        const QByteArray clientSignature = QMessageAuthenticationCode::hash(authMessage, m_storedKey, m_algorithm);
+        QByteArray clientKey = QByteArray::fromBase64(input.value('p'));
+        if (clientKey.size() != clientSignature.size()) {
+            return Failed;
+        }
+        std::transform(clientKey.cbegin(), clientKey.cend(), clientSignature.cbegin(),
+                       clientKey.begin(), std::bit_xor<char>());
+        if (!QXmpp::Private::constantTimeEquals(QCryptographicHash::hash(clientKey, m_algorithm), m_storedKey)) {
+            return Failed;
+        }
+
+        m_step++;
+        response = QByteArrayLiteral("v=") + QMessageAuthenticationCode::hash(authMessage, m_serverKey, m_algorithm).toBase64();
+        return Challenge;
+    } else if (m_step == 2) {
+        m_step++;
+        response = QByteArray();
+        return Succeeded;
+    } else {
+        warning(QStringLiteral("QXmppSaslServerScram : Invalid step"));
+        return Failed;
+    }
+}
+
 QXmppSaslServerPlain::QXmppSaslServerPlain(QObject *parent)
     : QXmppSaslServer(parent), m_step(0)
 {
@@ -861,6 +970,21 @@ QXmppSaslServer::Response QXmppSaslServerPlain::respond(const QByteArray &reques
     }
 }
 
+namespace QXmpp::Private {
+
+// Derives the keys a server stores for SCRAM authentication, see RFC 5802, section 3.
+ScramKeys deriveScramKeys(QCryptographicHash::Algorithm algorithm, const QByteArray &password, const QByteArray &salt, int iterations)
+{
+    const QByteArray saltedPassword = deriveKeyPbkdf2(algorithm, password, salt, iterations, QCryptographicHash::hashLength(algorithm));
+    const QByteArray clientKey = QMessageAuthenticationCode::hash(QByteArrayLiteral("Client Key"), saltedPassword, algorithm);
+    return {
+        QCryptographicHash::hash(clientKey, algorithm),
+        QMessageAuthenticationCode::hash(QByteArrayLiteral("Server Key"), saltedPassword, algorithm),
+    };
+}
+
+}  // namespace QXmpp::Private
+
 void QXmppSaslDigestMd5::setNonce(const QByteArray &nonce)
 {
     forcedNonce = nonce;
@@ -92,6 +92,18 @@ private:
     QXmppSaslServerPrivate *d;
 };
 
+namespace QXmpp::Private {
+
+struct ScramKeys
+{
+    QByteArray storedKey;
+    QByteArray serverKey;
+};
+
+QXMPP_AUTOTEST_EXPORT ScramKeys deriveScramKeys(QCryptographicHash::Algorithm algorithm, const QByteArray &password, const QByteArray &salt, int iterations);
+
+}  // namespace QXmpp::Private
+
 class QXMPP_AUTOTEST_EXPORT QXmppSaslDigestMd5
 {
 public:
@@ -300,6 +312,31 @@ private:
     int m_step;
 };
 
+class QXMPP_AUTOTEST_EXPORT QXmppSaslServerScram : public QXmppSaslServer
+{
+public:
+    QXmppSaslServerScram(QCryptographicHash::Algorithm algorithm, QObject *parent = nullptr);
+    QString mechanism() const override;
+
+    QCryptographicHash::Algorithm algorithm() const;
+    void setKeys(const QByteArray &salt, int iterations, const QByteArray &storedKey, const QByteArray &serverKey);
+
+    Response respond(const QByteArray &challenge, QByteArray &response) override;
+
+private:
+    QCryptographicHash::Algorithm m_algorithm;
+    int m_step;
+    QByteArray m_gs2Header;
+    QByteArray m_clientFirstMessageBare;
+    QByteArray m_serverFirstMessage;
+    QByteArray m_clientNonce;
+    QByteArray m_nonce;
+    QByteArray m_salt;
+    int m_iterations;
+    QByteArray m_storedKey;
+    QByteArray m_serverKey;
+};
+
 class QXmppSaslServerFacebook : public QXmppSaslServer
 {
 public:
@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppStanzaTrace_p.h"
+
+#include <chrono>
+
+///
+/// Returns the time from the start of the trace to the end of its last
+/// completed stage in nanoseconds.
+///
+qint64 QXmppStanzaTrace::duration() const
+{
+    qint64 end = start;
+    for (const auto &span : spans) {
+        end = qMax(end, span.end);
+    }
+    return end - start;
+}
+
+namespace QXmpp::Private {
+
+StanzaTrace::StanzaTrace(QXmppStanzaTraceSink sink, QXmppStanzaTrace::Direction direction, const QString &tagName, const QString &id)
+    : m_sink(std::move(sink))
+{
+    m_trace.direction = direction;
+    m_trace.tagName = tagName;
+    m_trace.id = id;
+    m_trace.start = now();
+}
+
+StanzaTrace::~StanzaTrace()
+{
+    m_sink(m_trace);
+}
+
+qint64 StanzaTrace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds a span ending now and returns the end.
+qint64 StanzaTrace::addSpan(QXmppStanzaTrace::Stage stage, qint64 start, const QString &label)
+{
+    const auto end = now();
+    addSpan(stage, start, end, label);
+    return end;
+}
+
+void StanzaTrace::addSpan(QXmppStanzaTrace::Stage stage, qint64 start, qint64 end, const QString &label)
+{
+    // stages before the stanza was identified, like reading the socket
+    m_trace.start = qMin(m_trace.start, start);
+    m_trace.spans.append({ stage, start, end, label });
+}
+
+// Returns the end of the last span or the start of the trace.
+qint64 StanzaTrace::lastEnd() const
+{
+    return m_trace.spans.isEmpty() ? m_trace.start : m_trace.spans.constLast().end;
+}
+
+void StanzaTracer::setSink(QXmppStanzaTraceSink sink, int sampleInterval)
+{
+    m_sink = std::move(sink);
+    m_sampleInterval = quint64(qMax(1, sampleInterval));
+    m_counts = {};
+    m_currentIncoming.reset();
+    m_pendingOutgoing.reset();
+}
+
+// Starts a trace if the stanza is sampled, returns null otherwise.
+StanzaTraceHandle StanzaTracer::start(QXmppStanzaTrace::Direction direction, const QString &tagName, const QString &id)
+{
+    if (!m_sink || m_counts[direction]++ % m_sampleInterval != 0) {
+        return {};
+    }
+    return std::make_shared<StanzaTrace>(m_sink, direction, tagName, id);
+}
+
+}  // namespace QXmpp::Private
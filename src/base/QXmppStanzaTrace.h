@@ -0,0 +1,97 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSTANZATRACE_H
+#define QXMPPSTANZATRACE_H
+
+#include "QXmppGlobal.h"
+
+#include <functional>
+#include <memory>
+
+#include <QString>
+#include <QVector>
+
+///
+/// \brief The QXmppStanzaTrace struct contains the time a stanza spent in each
+/// stage of processing.
+///
+/// Incoming stanzas are traced from reading the socket to the completion of
+/// the stanza handlers, outgoing stanzas from the send call to writing the
+/// socket. All timestamps are nanoseconds of the monotonic clock
+/// (std::chrono::steady_clock), so traces of different streams can be
+/// compared.
+///
+/// Stages may overlap: a Dispatch span contains the Handler spans of the
+/// extensions and IqResponse contains the Decryption of the response. A
+/// Decryption span may also end after the other spans, if the decryption
+/// finished asynchronously.
+///
+/// \sa QXmppStream::setStanzaTraceSink(), QXmppClient::setStanzaTraceSink()
+///
+/// \since QXmpp 1.6
+///
+struct QXMPP_EXPORT QXmppStanzaTrace
+{
+    /// Direction of the stanza.
+    enum Direction {
+        Incoming,  ///< The stanza was received
+        Outgoing,  ///< The stanza was sent
+    };
+
+    /// Processing stages.
+    enum Stage {
+        SocketRead,        ///< Reading the socket, from the first read of the stanza's data
+        Parse,             ///< Parsing the XML, shared by the stanzas of the same read
+        StreamManagement,  ///< XEP-0198: Stream Management bookkeeping
+        IqResponse,        ///< Matching an IQ response and running the request's continuation
+        Decryption,        ///< End-to-end decryption
+        Dispatch,          ///< Handling the stanza by the stream, contains the Handler spans
+        Handler,           ///< A stanza handler, the label is the class name of the extension
+        Encryption,        ///< End-to-end encryption
+        Queue,             ///< Waiting for the rate limit, see QXmppStream::setRateLimit()
+        SocketWrite,       ///< Writing the socket
+    };
+
+    /// A stage of processing.
+    struct Span
+    {
+        /// The stage.
+        Stage stage;
+        /// Start of the stage in nanoseconds.
+        qint64 start;
+        /// End of the stage in nanoseconds.
+        qint64 end;
+        /// Additional information, e.g. the name of the handler.
+        QString label;
+    };
+
+    /// Direction of the stanza.
+    Direction direction = Incoming;
+    /// Tag name of the stanza, e.g. "message".
+    QString tagName;
+    /// ID of the stanza.
+    QString id;
+    /// Start of the trace in nanoseconds.
+    qint64 start = 0;
+    /// Spans of the stages in the order they completed.
+    QVector<Span> spans;
+
+    qint64 duration() const;
+};
+
+/// Receives completed stanza traces.
+///
+/// \since QXmpp 1.6
+using QXmppStanzaTraceSink = std::function<void(const QXmppStanzaTrace &)>;
+
+/// \cond
+namespace QXmpp::Private {
+class StanzaTrace;
+class StanzaTracer;
+using StanzaTraceHandle = std::shared_ptr<StanzaTrace>;
+}  // namespace QXmpp::Private
+/// \endcond
+
+#endif
@@ -0,0 +1,74 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSTANZATRACE_P_H
+#define QXMPPSTANZATRACE_P_H
+
+#include "QXmppStanzaTrace.h"
+
+#include <array>
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.  It exists for the convenience
+// of QXmpp's own classes.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+// Collects the spans of one sampled stanza.
+//
+// The trace is handed to the sink when the last handle is released, so that
+// asynchronous stages like decryption can still add their spans.
+class StanzaTrace
+{
+public:
+    StanzaTrace(QXmppStanzaTraceSink sink, QXmppStanzaTrace::Direction direction, const QString &tagName, const QString &id);
+    ~StanzaTrace();
+
+    static qint64 now();
+
+    qint64 addSpan(QXmppStanzaTrace::Stage stage, qint64 start, const QString &label = {});
+    void addSpan(QXmppStanzaTrace::Stage stage, qint64 start, qint64 end, const QString &label = {});
+    qint64 lastEnd() const;
+
+private:
+    QXmppStanzaTraceSink m_sink;
+    QXmppStanzaTrace m_trace;
+};
+
+// Decides which stanzas of a stream are traced and passes traces between the
+// stream and the client.
+class StanzaTracer
+{
+public:
+    void setSink(QXmppStanzaTraceSink sink, int sampleInterval);
+    bool isEnabled() const { return bool(m_sink); }
+
+    StanzaTraceHandle start(QXmppStanzaTrace::Direction direction, const QString &tagName, const QString &id);
+
+    // the incoming stanza being handled
+    const StanzaTraceHandle &currentIncoming() const { return m_currentIncoming; }
+    void setCurrentIncoming(StanzaTraceHandle trace) { m_currentIncoming = std::move(trace); }
+
+    // the trace of the next packet sent, started before encryption
+    void setPendingOutgoing(StanzaTraceHandle trace) { m_pendingOutgoing = std::move(trace); }
+    StanzaTraceHandle takePendingOutgoing() { return std::move(m_pendingOutgoing); }
+
+private:
+    QXmppStanzaTraceSink m_sink;
+    quint64 m_sampleInterval = 1;
+    std::array<quint64, 2> m_counts = {};
+    StanzaTraceHandle m_currentIncoming;
+    StanzaTraceHandle m_pendingOutgoing;
+};
+
+}  // namespace QXmpp::Private
+
+#endif  // QXMPPSTANZATRACE_P_H
@@ -9,23 +9,37 @@
 #include "QXmppFutureUtils_p.h"
 #include "QXmppIq.h"
 #include "QXmppLogger.h"
+#include "QXmppMetrics.h"
 #include "QXmppPacket_p.h"
 #include "QXmppStanza.h"
+#include "QXmppStanzaTrace_p.h"
+#include "QXmppStreamCapture.h"
 #include "QXmppStreamManagement_p.h"
+#include "QXmppStream_p.h"
+#include "QXmppTransport_p.h"
 #include "QXmppUtils.h"
+#include "QXmppUtils_p.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
 
 #include <QBuffer>
 #include <QDomDocument>
+#include <QElapsedTimer>
 #include <QFuture>
 #include <QFutureInterface>
 #include <QFutureWatcher>
-#include <QHostAddress>
 #include <QMap>
+#include <QPointer>
 #include <QRegularExpression>
 #include <QSslSocket>
 #include <QStringList>
 #include <QTime>
+#include <QTimer>
+#include <QXmlStreamReader>
 #include <QXmlStreamWriter>
+#include <QtMath>
 
 using namespace QXmpp::Private;
 
@@ -33,30 +47,235 @@ struct IqState
 {
     QXmppPromise<QXmppStream::IqResult> interface;
     QString jid;
+    QElapsedTimer timer;
 };
 
+// Token bucket limiting the outgoing packets of one traffic class
+struct TrafficShaper
+{
+    bool isLimited() const { return rate > 0; }
+
+    void refill(qint64 now)
+    {
+        tokens = qMin(capacity, tokens + (now - lastRefill) * rate / 1000.0);
+        lastRefill = now;
+    }
+
+    qint64 msecsUntilNextToken() const
+    {
+        return tokens >= 1 ? 0 : qCeil((1 - tokens) * 1000.0 / rate);
+    }
+
+    // packets per second, zero means unlimited
+    double rate = 0;
+    double capacity = 0;
+    double tokens = 0;
+    qint64 lastRefill = 0;
+    QList<QXmppPacket> queue;
+};
+
+static QXmppStream::TrafficClass trafficClass(const QXmppPacket &packet)
+{
+    if (!packet.isXmppStanza()) {
+        return QXmppStream::OtherTraffic;
+    }
+
+    const auto data = packet.data();
+    if (data.startsWith("<message")) {
+        return QXmppStream::MessageTraffic;
+    }
+    if (data.startsWith("<presence")) {
+        return QXmppStream::PresenceTraffic;
+    }
+    if (data.startsWith("<iq")) {
+        return QXmppStream::IqTraffic;
+    }
+    return QXmppStream::OtherTraffic;
+}
+
+// Kinds of stanzas counted in the "stream.stanzas-received" metrics
+static const char *const STANZA_KINDS[] = { "iq", "message", "presence" };
+
+// The metrics of a stream in the registry of its logging sink. They are
+// looked up once per sink, so updating them doesn't build or look up names.
+struct StreamMetrics
+{
+    QPointer<QXmppLogger> sink;
+    QXmppMetrics::Counter *bytesReceived = nullptr;
+    QXmppMetrics::Counter *bytesSent = nullptr;
+    std::array<QXmppMetrics::Counter *, 3> stanzasReceived = {};
+    QXmppMetrics::Histogram *iqRoundTrip = nullptr;
+};
+
+static int stanzaKindIndex(const QString &tagName)
+{
+    for (int i = 0; i < 3; ++i) {
+        if (tagName == QLatin1String(STANZA_KINDS[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the tag name and ID of a serialized stanza.
+static std::pair<QString, QString> stanzaNameAndId(const QByteArray &data)
+{
+    const auto head = data.left(data.indexOf('>'));
+    int nameEnd = 1;
+    while (nameEnd < head.size() && head[nameEnd] != ' ' && head[nameEnd] != '/') {
+        nameEnd++;
+    }
+
+    QString id;
+    for (const char quote : { '"', '\'' }) {
+        const QByteArray attribute = QByteArray(" id=") + quote;
+        if (const int start = head.indexOf(attribute); start >= 0) {
+            const int valueStart = start + attribute.size();
+            id = QString::fromUtf8(head.mid(valueStart, head.indexOf(quote, valueStart) - valueStart));
+            break;
+        }
+    }
+    return { QString::fromUtf8(head.mid(1, nameEnd - 1)), id };
+}
+
+// Returns the raw XML of the stream's top-level elements, so they can be
+// forwarded without serializing them again. Elements relying on a default
+// namespace or namespace prefixes declared outside of them are returned empty.
+static QStringList topLevelElementsXml(const QString &xml)
+{
+    QStringList elements;
+    QStringList declaredPrefixes;
+    bool selfContained = true;
+    qint64 start = 0;
+    qint64 lastOffset = 0;
+    int depth = 0;
+
+    QXmlStreamReader reader(xml);
+    while (!reader.atEnd()) {
+        const auto token = reader.readNext();
+        if (token == QXmlStreamReader::StartElement) {
+            depth++;
+            const auto declarations = reader.namespaceDeclarations();
+            if (depth == 2) {
+                start = lastOffset;
+                selfContained = std::none_of(declarations.cbegin(), declarations.cend(), [](const auto &declaration) {
+                    return declaration.prefix().isEmpty();
+                });
+                declaredPrefixes.clear();
+            }
+            if (depth >= 2) {
+                for (const auto &declaration : declarations) {
+                    declaredPrefixes << declaration.prefix().toString();
+                }
+                auto isDeclared = [&](const auto &prefix) {
+                    return prefix.isEmpty() || prefix == QLatin1String("xml") || declaredPrefixes.contains(prefix.toString());
+                };
+                const auto attributes = reader.attributes();
+                selfContained = selfContained && isDeclared(reader.prefix()) &&
+                    std::all_of(attributes.cbegin(), attributes.cend(), [&](const auto &attribute) {
+                        return isDeclared(attribute.prefix());
+                    });
+            }
+        } else if (token == QXmlStreamReader::EndElement) {
+            if (depth == 2) {
+                elements << (selfContained ? xml.mid(start, reader.characterOffset() - start) : QString());
+            }
+            depth--;
+        }
+        lastOffset = reader.characterOffset();
+    }
+
+    if (reader.hasError()) {
+        return {};
+    }
+    return elements;
+}
+
 class QXmppStreamPrivate
 {
 public:
     QXmppStreamPrivate(QXmppStream *stream);
 
     QString dataBuffer;
-    QSslSocket *socket;
+    // maximum size of dataBuffer in bytes, 0 for no limit
+    qint64 receiveBufferLimit;
+    QXmppTransport *transport;
+    // the transport created by setSocket()
+    QXmppTransport *socketTransport;
 
     // incoming stream state
     QString streamOpenElement;
 
+    // raw data of the incoming stanza being handled
+    bool rawStanzaCaptureEnabled;
+    QString rawStanzaLocalDomain;
+    QByteArray rawStanzaData;
+
+    // recording of the traffic
+    std::unique_ptr<QXmppStreamCapture> capture;
+
+    // stanza tracing, the data of a stanza is traced from its first read
+    StanzaTracer tracer;
+    qint64 readStart;
+    qint64 readEnd;
+
     // stream management
     QXmppStreamManager streamManager;
 
     // iq response handling
     QMap<QString, IqState> runningIqs;
+
+    // outgoing traffic shaping
+    std::array<TrafficShaper, 4> shapers;
+    QElapsedTimer shapingClock;
+    QTimer *shapingTimer;
+
+    StreamMetrics metrics;
+
+    int queuedPacketCount() const;
+    const StreamMetrics *metricsOf(QXmppLogger *sink);
 };
 
 QXmppStreamPrivate::QXmppStreamPrivate(QXmppStream *stream)
-    : socket(nullptr),
-      streamManager(stream)
+    : receiveBufferLimit(0),
+      transport(nullptr),
+      socketTransport(nullptr),
+      rawStanzaCaptureEnabled(false),
+      readStart(-1),
+      readEnd(0),
+      streamManager(stream),
+      shapingTimer(nullptr)
+{
+    shapingClock.start();
+}
+
+int QXmppStreamPrivate::queuedPacketCount() const
 {
+    int count = 0;
+    for (const auto &shaper : shapers) {
+        count += shaper.queue.size();
+    }
+    return count;
+}
+
+// Returns the metrics of the stream in the registry of the given sink, or
+// nullptr if there is no sink.
+const StreamMetrics *QXmppStreamPrivate::metricsOf(QXmppLogger *sink)
+{
+    if (!sink) {
+        return nullptr;
+    }
+    if (metrics.sink != sink) {
+        auto *registry = sink->metrics();
+        metrics.sink = sink;
+        metrics.bytesReceived = registry->counter(QStringLiteral("stream.bytes-received"));
+        metrics.bytesSent = registry->counter(QStringLiteral("stream.bytes-sent"));
+        for (std::size_t kind = 0; kind < metrics.stanzasReceived.size(); ++kind) {
+            metrics.stanzasReceived[kind] = registry->counter(QStringLiteral("stream.stanzas-received.") + QLatin1String(STANZA_KINDS[kind]));
+        }
+        metrics.iqRoundTrip = registry->histogram(QStringLiteral("stream.iq-round-trip-us"));
+    }
+    return &metrics;
 }
 
 ///
@@ -79,6 +298,9 @@ QXmppStream::QXmppStream(QObject *parent)
     : QXmppLoggable(parent),
       d(new QXmppStreamPrivate(this))
 {
+    d->shapingTimer = new QTimer(this);
+    d->shapingTimer->setSingleShot(true);
+    connect(d->shapingTimer, &QTimer::timeout, this, &QXmppStream::sendQueuedPackets);
 }
 
 ///
@@ -86,6 +308,7 @@ QXmppStream::QXmppStream(QObject *parent)
 ///
 QXmppStream::~QXmppStream()
 {
+    abortQueuedPackets();
     cancelOngoingIqs();
     delete d;
 }
@@ -95,16 +318,17 @@ QXmppStream::~QXmppStream()
 ///
 void QXmppStream::disconnectFromHost()
 {
+    abortQueuedPackets();
     d->streamManager.handleDisconnect();
 
-    if (d->socket) {
-        if (d->socket->state() == QAbstractSocket::ConnectedState) {
+    if (d->transport) {
+        if (d->transport->isConnected()) {
             sendData(QByteArrayLiteral("</stream:stream>"));
-            d->socket->flush();
+            d->transport->flush();
         }
         // FIXME: according to RFC 6120 section 4.4, we should wait for
         // the incoming stream to end before closing the socket
-        d->socket->disconnectFromHost();
+        d->transport->disconnectFromHost();
     }
 }
 
@@ -116,6 +340,7 @@ void QXmppStream::disconnectFromHost()
 ///
 void QXmppStream::handleStart()
 {
+    abortQueuedPackets();
     d->streamManager.handleStart();
     d->dataBuffer.clear();
     d->streamOpenElement.clear();
@@ -126,8 +351,148 @@ void QXmppStream::handleStart()
 ///
 bool QXmppStream::isConnected() const
 {
-    return d->socket &&
-        d->socket->state() == QAbstractSocket::ConnectedState;
+    return d->transport && d->transport->isConnected();
+}
+
+///
+/// Limits the rate at which packets of the given traffic class are written to
+/// the socket.
+///
+/// Each traffic class has a token bucket which allows sending \a burst packets
+/// at once and is refilled with \a packetsPerSecond tokens per second. Packets
+/// exceeding the budget are queued and written as soon as the budget allows
+/// it, so bulk operations (e.g. publishing many PubSub items or paging through
+/// a MAM archive) do not trigger the server's traffic shaping, which would
+/// delay all other traffic on the connection as well.
+///
+/// Packets of the same traffic class are always sent in order, packets of
+/// different classes may overtake each other.
+///
+/// sendPacket() returns true for packets which are held back, as they are
+/// written once the budget allows it. Use queuedPacketCount() to find out how
+/// many packets have not been written yet.
+///
+/// \param trafficClass The class of packets to limit.
+/// \param packetsPerSecond The sustained rate, zero or less disables limiting.
+/// \param burst The number of packets that can be sent at once.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setRateLimit(TrafficClass trafficClass, double packetsPerSecond, int burst)
+{
+    auto &shaper = d->shapers[trafficClass];
+    shaper.rate = qMax(0.0, packetsPerSecond);
+    shaper.capacity = qMax(1, burst);
+    shaper.tokens = shaper.capacity;
+    shaper.lastRefill = d->shapingClock.elapsed();
+
+    if (!shaper.isLimited()) {
+        // release packets queued with the old limit
+        shaper.tokens = shaper.queue.size();
+    }
+    sendQueuedPackets();
+}
+
+///
+/// Returns the number of packets that are held back by the rate limits.
+///
+/// The queue size is also reported using the "outgoing-queue.count" gauge.
+///
+/// \sa setRateLimit()
+///
+/// \since QXmpp 1.6
+///
+int QXmppStream::queuedPacketCount() const
+{
+    return d->queuedPacketCount();
+}
+
+///
+/// Returns the memory held by the buffers and queues of the stream.
+///
+/// \since QXmpp 1.6
+///
+QXmppStream::MemoryUsage QXmppStream::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.receiveBuffer = (d->dataBuffer.capacity() + d->streamOpenElement.capacity()) * qint64(sizeof(QChar)) +
+        d->rawStanzaData.capacity();
+    usage.unacknowledgedStanzas = d->streamManager.unacknowledgedBytes();
+
+    for (const auto &shaper : d->shapers) {
+        for (const auto &packet : shaper.queue) {
+            usage.pendingOutbound += packet.data().size();
+        }
+    }
+    if (d->transport) {
+        usage.pendingOutbound += d->transport->bytesToWrite();
+    }
+
+    for (auto it = d->runningIqs.cbegin(); it != d->runningIqs.cend(); ++it) {
+        usage.runningIqs += qint64(sizeof(IqState)) + (it.key().capacity() + it->jid.capacity()) * qint64(sizeof(QChar));
+    }
+    usage.runningIqCount = d->runningIqs.size();
+    return usage;
+}
+
+///
+/// Returns the maximum size of the receive buffer in bytes, 0 if there is no
+/// limit.
+///
+/// \since QXmpp 1.6
+///
+qint64 QXmppStream::receiveBufferLimit() const
+{
+    return d->receiveBufferLimit;
+}
+
+///
+/// Sets the maximum size of the receive buffer in bytes, 0 disables the
+/// limit.
+///
+/// The receive buffer holds the data of stanzas which have not been received
+/// completely. If it grows beyond the limit, the buffered data is dropped
+/// and receiveBufferLimitExceeded() is emitted, the caller is expected to
+/// close the stream.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setReceiveBufferLimit(qint64 bytes)
+{
+    d->receiveBufferLimit = qMax<qint64>(0, bytes);
+}
+
+///
+/// Releases memory the stream does not need while it is idle.
+///
+/// The spare capacity of the receive buffer and of the outgoing queues is
+/// released. The stream header received from the peer is kept, as it is
+/// needed to parse the following stanzas; its data is shared between the
+/// streams of a thread. The released size is reported using the
+/// "stream.compacted-bytes" counter.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::compactMemory()
+{
+    const auto before = memoryUsage().total();
+
+    // keep the data of a partially received stanza
+    if (d->dataBuffer.isEmpty()) {
+        d->dataBuffer = QString();
+    } else {
+        d->dataBuffer.squeeze();
+    }
+    d->rawStanzaData = QByteArray();
+    for (auto &shaper : d->shapers) {
+        if (shaper.queue.isEmpty()) {
+            shaper.queue = QList<QXmppPacket>();
+        }
+    }
+
+    if (const auto released = before - memoryUsage().total(); released > 0) {
+        reportCounter(QStringLiteral("stream.compacted-bytes"), released);
+    }
 }
 
 ///
@@ -138,15 +503,27 @@ bool QXmppStream::isConnected() const
 bool QXmppStream::sendData(const QByteArray &data)
 {
     logSent(QString::fromUtf8(data));
-    if (!d->socket || d->socket->state() != QAbstractSocket::ConnectedState) {
+    if (!d->transport || !d->transport->isConnected()) {
         return false;
     }
-    return d->socket->write(data) == data.size();
+    const qint64 written = d->transport->write(data);
+    if (d->capture && written > 0) {
+        d->capture->record(QXmppStreamCapture::Outbound, written == data.size() ? data : data.left(int(written)));
+    }
+    if (written > 0) {
+        if (const auto *metrics = d->metricsOf(loggingSink())) {
+            metrics->bytesSent->add(written);
+        }
+    }
+    return written == data.size();
 }
 
 ///
 /// Sends an XMPP packet to the peer.
 ///
+/// Returns true if the packet has been written to the socket or has been
+/// queued by the rate limits, see setRateLimit().
+///
 /// \param nonza
 ///
 bool QXmppStream::sendPacket(const QXmppNonza &nonza)
@@ -180,9 +557,39 @@ QXmppTask<QXmpp::SendResult> QXmppStream::send(QXmppPacket &&packet)
 
 QXmppTask<QXmpp::SendResult> QXmppStream::send(QXmppPacket &&packet, bool &writtenToSocket)
 {
+    if (d->tracer.isEnabled() && packet.isXmppStanza() && !packet.hasTrace()) {
+        // traces started before encryption are passed on by the client
+        if (auto trace = d->tracer.takePendingOutgoing()) {
+            packet.setTrace(std::move(trace));
+        } else {
+            const auto [tagName, id] = stanzaNameAndId(packet.data());
+            packet.setTrace(d->tracer.start(QXmppStanzaTrace::Outgoing, tagName, id));
+        }
+    }
+
+    // hold the packet back if its traffic class has exceeded its budget
+    auto &shaper = d->shapers[trafficClass(packet)];
+    if (shaper.isLimited() && d->transport && d->transport->isConnected()) {
+        shaper.refill(d->shapingClock.elapsed());
+        if (!shaper.queue.isEmpty() || shaper.tokens < 1) {
+            auto task = packet.task();
+            shaper.queue.append(packet);
+            writtenToSocket = true;
+
+            reportGauge(QStringLiteral("outgoing-queue.count"), d->queuedPacketCount());
+            // the timer may be armed for a class with a longer wait
+            const auto wait = shaper.msecsUntilNextToken();
+            if (!d->shapingTimer->isActive() || d->shapingTimer->remainingTime() > wait) {
+                d->shapingTimer->start(int(wait));
+            }
+            return task;
+        }
+        shaper.tokens -= 1;
+    }
+
     // the writtenToSocket parameter is just for backwards compat (see
     // QXmppStream::sendPacket())
-    writtenToSocket = sendData(packet.data());
+    writtenToSocket = writePacket(packet, false);
 
     // handle stream management
     d->streamManager.handlePacketSent(packet, writtenToSocket);
@@ -190,6 +597,76 @@ QXmppTask<QXmpp::SendResult> QXmppStream::send(QXmppPacket &&packet, bool &writt
     return packet.task();
 }
 
+void QXmppStream::sendQueuedPackets()
+{
+    if (d->queuedPacketCount() == 0) {
+        return;
+    }
+
+    const auto now = d->shapingClock.elapsed();
+    qint64 nextToken = -1;
+    for (auto &shaper : d->shapers) {
+        if (shaper.isLimited()) {
+            shaper.refill(now);
+        }
+        while (!shaper.queue.isEmpty() && shaper.tokens >= 1) {
+            shaper.tokens -= 1;
+            auto packet = shaper.queue.takeFirst();
+            const bool writtenToSocket = writePacket(packet, true);
+            d->streamManager.handlePacketSent(packet, writtenToSocket);
+        }
+        if (!shaper.queue.isEmpty()) {
+            const auto wait = shaper.msecsUntilNextToken();
+            nextToken = nextToken < 0 ? wait : qMin(nextToken, wait);
+        }
+    }
+
+    reportGauge(QStringLiteral("outgoing-queue.count"), d->queuedPacketCount());
+    if (nextToken >= 0) {
+        d->shapingTimer->start(nextToken);
+    } else {
+        d->shapingTimer->stop();
+    }
+}
+
+// Writes a packet to the socket and completes its trace.
+bool QXmppStream::writePacket(QXmppPacket &packet, bool queued)
+{
+    // the packet is cached for stream management, which must not keep the
+    // trace from being completed
+    const auto trace = packet.takeTrace();
+    if (!trace) {
+        return sendData(packet.data());
+    }
+
+    const auto start = StanzaTrace::now();
+    if (queued) {
+        trace->addSpan(QXmppStanzaTrace::Queue, trace->lastEnd(), start);
+    }
+    const bool written = sendData(packet.data());
+    trace->addSpan(QXmppStanzaTrace::SocketWrite, start);
+    return written;
+}
+
+void QXmppStream::abortQueuedPackets()
+{
+    if (d->queuedPacketCount() == 0) {
+        return;
+    }
+
+    // The packets have never been written to the old stream. With stream
+    // management they are cached for resending, otherwise an error is reported.
+    for (auto &shaper : d->shapers) {
+        for (auto &packet : shaper.queue) {
+            d->streamManager.handlePacketSent(packet, false);
+        }
+        shaper.queue.clear();
+        shaper.tokens = shaper.capacity;
+    }
+    d->shapingTimer->stop();
+    reportGauge(QStringLiteral("outgoing-queue.count"), 0);
+}
+
 ///
 /// Sends an IQ packet and returns the response asynchronously.
 ///
@@ -255,7 +732,8 @@ QXmppTask<QXmppStream::IqResult> QXmppStream::sendIq(QXmppPacket &&packet, const
         });
     }
 
-    IqState state { {}, to };
+    IqState state { {}, to, {} };
+    state.timer.start();
     auto task = state.interface.task();
     d->runningIqs.insert(id, std::move(state));
     return task;
@@ -299,12 +777,52 @@ void QXmppStream::resetPacketCache()
     d->streamManager.resetCache();
 }
 
+///
+/// Records the data read from and written to the socket to \a device, in the
+/// format described in QXmppStreamCapture.
+///
+/// The device must be open for writing and stay valid until the capture is
+/// stopped by passing nullptr or the stream is destroyed. Replacing the
+/// device starts a new capture.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setCaptureDevice(QIODevice *device)
+{
+    d->capture.reset(device ? new QXmppStreamCapture(device) : nullptr);
+}
+
+///
+/// Traces the processing of incoming and outgoing stanzas and passes the
+/// traces to \a sink.
+///
+/// Every \a sampleInterval th stanza in each direction is traced. A trace
+/// contains a span with monotonic timestamps for each stage of processing,
+/// see QXmppStanzaTrace. Traces are passed to the sink in the stream's thread
+/// once all stages have completed.
+///
+/// Passing an empty sink disables tracing.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setStanzaTraceSink(QXmppStanzaTraceSink sink, int sampleInterval)
+{
+    d->tracer.setSink(std::move(sink), sampleInterval);
+}
+
+/// \cond
+StanzaTracer &StreamTracing::tracer(const QXmppStream *stream)
+{
+    return stream->d->tracer;
+}
+/// \endcond
+
 ///
 /// Returns the QSslSocket used for this stream.
 ///
 QSslSocket *QXmppStream::socket() const
 {
-    return d->socket;
+    return d->transport ? d->transport->sslSocket() : nullptr;
 }
 
 ///
@@ -312,21 +830,55 @@ QSslSocket *QXmppStream::socket() const
 ///
 void QXmppStream::setSocket(QSslSocket *socket)
 {
-    d->socket = socket;
-    if (!d->socket) {
+    auto *transport = socket ? new SslSocketTransport(socket, this) : nullptr;
+    setTransport(transport);
+    d->socketTransport = transport;
+}
+
+///
+/// Returns the transport used for this stream.
+///
+/// \since QXmpp 1.6
+///
+QXmppTransport *QXmppStream::transport() const
+{
+    return d->transport;
+}
+
+///
+/// Sets the transport used for this stream.
+///
+/// The stream is started when the transport emits connected() or
+/// encrypted(). If the transport is already connected, handleStart() needs
+/// to be called explicitly.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setTransport(QXmppTransport *transport)
+{
+    if (d->transport) {
+        disconnect(d->transport, nullptr, this, nullptr);
+    }
+    if (d->socketTransport && d->socketTransport != transport) {
+        d->socketTransport->deleteLater();
+        d->socketTransport = nullptr;
+    }
+
+    d->transport = transport;
+    if (!d->transport) {
         return;
     }
 
-    // socket events
-    connect(socket, &QAbstractSocket::connected, this, &QXmppStream::_q_socketConnected);
-    connect(socket, &QSslSocket::encrypted, this, &QXmppStream::_q_socketEncrypted);
-    connect(socket, &QSslSocket::errorOccurred, this, &QXmppStream::_q_socketError);
-    connect(socket, &QIODevice::readyRead, this, &QXmppStream::_q_socketReadyRead);
+    // transport events
+    connect(transport, &QXmppTransport::connected, this, &QXmppStream::_q_socketConnected);
+    connect(transport, &QXmppTransport::encrypted, this, &QXmppStream::_q_socketEncrypted);
+    connect(transport, &QXmppTransport::errorOccurred, this, &QXmppStream::_q_socketError);
+    connect(transport, &QXmppTransport::readyRead, this, &QXmppStream::_q_socketReadyRead);
 }
 
 void QXmppStream::_q_socketConnected()
 {
-    info(QStringLiteral("Socket connected to %1 %2").arg(d->socket->peerAddress().toString(), QString::number(d->socket->peerPort())));
+    info(QStringLiteral("Socket connected to %1").arg(d->transport->peerName()));
     handleStart();
 }
 
@@ -339,12 +891,37 @@ void QXmppStream::_q_socketEncrypted()
 void QXmppStream::_q_socketError(QAbstractSocket::SocketError socketError)
 {
     Q_UNUSED(socketError);
-    warning(QStringLiteral("Socket error: ") + socket()->errorString());
+    warning(QStringLiteral("Socket error: ") + d->transport->errorString());
 }
 
 void QXmppStream::_q_socketReadyRead()
 {
-    processData(QString::fromUtf8(d->socket->readAll()));
+    const qint64 readStart = d->tracer.isEnabled() ? StanzaTrace::now() : 0;
+    const QByteArray data = d->transport->readAll();
+    if (d->tracer.isEnabled()) {
+        if (d->readStart < 0) {
+            d->readStart = readStart;
+        }
+        d->readEnd = StanzaTrace::now();
+    }
+    if (d->capture) {
+        d->capture->record(QXmppStreamCapture::Inbound, data);
+    }
+    if (const auto *metrics = d->metricsOf(loggingSink())) {
+        metrics->bytesReceived->add(data.size());
+    }
+    processData(QString::fromUtf8(data));
+}
+
+// Removes the attributes of a stream header which differ between sessions,
+// so that the headers of most sessions are equal and can be shared. The
+// header is only kept to parse the following stanzas.
+static QString normalizedStreamHeader(const QString &header)
+{
+    static const QRegularExpression sessionAttributes(QStringLiteral(R"(\s(?:from|id)\s*=\s*(?:'[^']*'|"[^"]*"))"));
+    QString normalized = header;
+    normalized.remove(sessionAttributes);
+    return normalized;
 }
 
 void QXmppStream::processData(const QString &data)
@@ -362,11 +939,21 @@ void QXmppStream::processData(const QString &data)
     // parsing the content.
     d->dataBuffer.append(data);
 
+    // a peer must not grow the buffer without bounds with an unterminated stanza
+    if (d->receiveBufferLimit > 0 && d->dataBuffer.size() * qint64(sizeof(QChar)) > d->receiveBufferLimit) {
+        warning(QStringLiteral("Receive buffer exceeds the limit of %1 bytes").arg(d->receiveBufferLimit));
+        d->dataBuffer = QString();
+        d->readStart = -1;
+        Q_EMIT receiveBufferLimitExceeded();
+        return;
+    }
+
     //
     // Check for whitespace pings
     //
     if (d->dataBuffer.isEmpty() || d->dataBuffer.trimmed().isEmpty()) {
         d->dataBuffer.clear();
+        d->readStart = -1;
 
         logReceived({});
         handleStanza({});
@@ -419,10 +1006,12 @@ void QXmppStream::processData(const QString &data)
     //
     // Try to parse the wrapped XML
     //
+    const qint64 parseStart = d->tracer.isEnabled() ? StanzaTrace::now() : 0;
     QDomDocument doc;
     if (!doc.setContent(wrappedStanzas, true)) {
         return;
     }
+    const qint64 parseEnd = d->tracer.isEnabled() ? StanzaTrace::now() : 0;
 
     //
     // Success: We can clear the buffer and send a 'received' log message
@@ -432,20 +1021,80 @@ void QXmppStream::processData(const QString &data)
 
     // process stream start
     if (hasStreamOpen) {
-        d->streamOpenElement = streamOpenMatch.captured();
+        // without the session attributes, most peers send the same header,
+        // so it is shared across the streams of a thread
+        d->streamOpenElement = sharedString(normalizedStreamHeader(streamOpenMatch.captured()));
         handleStream(doc.documentElement());
     }
 
+    // find raw stanza data for forwarding, unless all stanzas are handled
+    // locally
+    QStringList rawStanzas;
+    if (d->rawStanzaCaptureEnabled) {
+        bool forwarded = d->rawStanzaLocalDomain.isEmpty();
+        for (auto stanza = doc.documentElement().firstChildElement(); !forwarded && !stanza.isNull(); stanza = stanza.nextSiblingElement()) {
+            const QString to = stanza.attribute(QStringLiteral("to"));
+            forwarded = !to.isEmpty() && to != d->rawStanzaLocalDomain;
+        }
+        if (forwarded) {
+            rawStanzas = topLevelElementsXml(wrappedStanzas);
+        }
+    }
+
     // process stanzas
+    std::array<qint64, 3> receivedStanzas = {};
     auto stanza = doc.documentElement().firstChildElement();
-    for (; !stanza.isNull(); stanza = stanza.nextSiblingElement()) {
+    for (int index = 0; !stanza.isNull(); stanza = stanza.nextSiblingElement(), ++index) {
+        if (const int kind = stanzaKindIndex(stanza.tagName()); kind >= 0) {
+            receivedStanzas[kind]++;
+        }
+
+        auto trace = d->tracer.isEnabled()
+            ? d->tracer.start(QXmppStanzaTrace::Incoming, stanza.tagName(), stanza.attribute(QStringLiteral("id")))
+            : StanzaTraceHandle();
+        qint64 start = 0;
+        if (trace) {
+            if (d->readStart >= 0) {
+                trace->addSpan(QXmppStanzaTrace::SocketRead, d->readStart, d->readEnd);
+            }
+            trace->addSpan(QXmppStanzaTrace::Parse, parseStart, parseEnd);
+            start = StanzaTrace::now();
+        }
+        d->tracer.setCurrentIncoming(trace);
+
         // handle possible stream management packets first
-        if (d->streamManager.handleStanza(stanza) || handleIqResponse(stanza)) {
-            continue;
+        bool handled = d->streamManager.handleStanza(stanza);
+        if (trace) {
+            start = trace->addSpan(QXmppStanzaTrace::StreamManagement, start);
+        }
+        if (!handled) {
+            handled = handleIqResponse(stanza);
+            if (trace) {
+                start = trace->addSpan(QXmppStanzaTrace::IqResponse, start);
+            }
         }
 
         // process all other kinds of packets
-        handleStanza(stanza);
+        if (!handled) {
+            d->rawStanzaData = rawStanzas.value(index).toUtf8();
+            handleStanza(stanza);
+            d->rawStanzaData.clear();
+            if (trace) {
+                trace->addSpan(QXmppStanzaTrace::Dispatch, start);
+            }
+        }
+
+        // the trace is completed with the last handle, unless a stage is
+        // still running
+        d->tracer.setCurrentIncoming({});
+    }
+    d->readStart = -1;
+    if (const auto *metrics = d->metricsOf(loggingSink())) {
+        for (std::size_t kind = 0; kind < receivedStanzas.size(); ++kind) {
+            if (receivedStanzas[kind]) {
+                metrics->stanzasReceived[kind]->add(receivedStanzas[kind]);
+            }
+        }
     }
 
     // process stream end
@@ -481,6 +1130,9 @@ bool QXmppStream::handleIqResponse(const QDomElement &stanza)
             return false;
         }
 
+        if (const auto *metrics = d->metricsOf(loggingSink())) {
+            metrics->iqRoundTrip->record(itr.value().timer.nsecsElapsed() / 1000);
+        }
         itr.value().interface.finish(stanza);
 
         d->runningIqs.erase(itr);
@@ -490,6 +1142,43 @@ bool QXmppStream::handleIqResponse(const QDomElement &stanza)
     return false;
 }
 
+///
+/// Enables capturing the raw XML of incoming stanzas, which is then available
+/// from rawStanzaData() while a stanza is handled.
+///
+/// QDom does not report where elements start and end, so the received data
+/// is parsed a second time with QXmlStreamReader to find the boundaries of
+/// the stanzas. This roughly adds the cost of a streaming parse to each
+/// received chunk, which pays off when most stanzas are forwarded and would
+/// otherwise be serialized again from the DOM.
+///
+/// If \a localDomain is set, the data is only parsed again if it contains a
+/// stanza addressed to another JID than \a localDomain, as stanzas without a
+/// recipient or addressed to the local domain are not forwarded.
+///
+/// \since QXmpp 1.6
+///
+void QXmppStream::setRawStanzaCaptureEnabled(bool enabled, const QString &localDomain)
+{
+    d->rawStanzaCaptureEnabled = enabled;
+    d->rawStanzaLocalDomain = localDomain;
+}
+
+///
+/// Returns the raw XML of the incoming stanza currently being handled, as it
+/// was received.
+///
+/// The data is empty if raw stanza capture is disabled, if no stanza of the
+/// received data is forwarded or if the stanza can't be forwarded verbatim,
+/// because it relies on namespace declarations of the stream.
+///
+/// \since QXmpp 1.6
+///
+QByteArray QXmppStream::rawStanzaData() const
+{
+    return d->rawStanzaData;
+}
+
 ///
 /// Enables Stream Management acks / reqs (\xep{0198}).
 ///
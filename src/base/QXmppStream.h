@@ -8,6 +8,7 @@
 
 #include "QXmppLogger.h"
 #include "QXmppSendResult.h"
+#include "QXmppStanzaTrace.h"
 
 #include <memory>
 #include <variant>
@@ -22,12 +23,20 @@ template<typename T>
 class QFuture;
 template<typename T>
 class QFutureInterface;
+class QIODevice;
 class QSslSocket;
 class QXmppIq;
 class QXmppNonza;
 class QXmppPacket;
 class QXmppStanza;
 class QXmppStreamPrivate;
+class QXmppTransport;
+
+/// \cond
+namespace QXmpp::Private {
+class StreamTracing;
+}  // namespace QXmpp::Private
+/// \endcond
 
 ///
 /// \brief The QXmppStream class is the base class for all XMPP streams.
@@ -37,11 +46,52 @@ class QXMPP_EXPORT QXmppStream : public QXmppLoggable
     Q_OBJECT
 
 public:
+    /// Classes of outgoing packets that are rate limited independently.
+    enum TrafficClass {
+        MessageTraffic,   ///< Message stanzas
+        PresenceTraffic,  ///< Presence stanzas
+        IqTraffic,        ///< IQ stanzas
+        OtherTraffic,     ///< Nonzas
+    };
+    Q_ENUM(TrafficClass)
+
+    ///
+    /// \brief The MemoryUsage struct describes the memory held by the buffers
+    /// and queues of a stream.
+    ///
+    /// Sizes are in bytes and include the reserved capacity.
+    ///
+    /// \since QXmpp 1.6
+    ///
+    struct MemoryUsage
+    {
+        /// Incoming data which has not been parsed yet and the stream header
+        qint64 receiveBuffer = 0;
+        /// Stanzas waiting for a \xep{0198}: Stream Management acknowledgement
+        qint64 unacknowledgedStanzas = 0;
+        /// Packets held back by rate limits and data not sent by the transport
+        qint64 pendingOutbound = 0;
+        /// State of the IQ requests waiting for a response
+        qint64 runningIqs = 0;
+        /// Number of IQ requests waiting for a response
+        int runningIqCount = 0;
+
+        /// Returns the total size.
+        qint64 total() const { return receiveBuffer + unacknowledgedStanzas + pendingOutbound + runningIqs; }
+    };
+
     QXmppStream(QObject *parent);
     ~QXmppStream() override;
 
     virtual bool isConnected() const;
 
+    void setRateLimit(TrafficClass trafficClass, double packetsPerSecond, int burst);
+    int queuedPacketCount() const;
+    MemoryUsage memoryUsage() const;
+    void compactMemory();
+    qint64 receiveBufferLimit() const;
+    void setReceiveBufferLimit(qint64 bytes);
+
     bool sendPacket(const QXmppNonza &);
     QXmppTask<QXmpp::SendResult> send(QXmppNonza &&);
     QXmppTask<QXmpp::SendResult> send(QXmppPacket &&);
@@ -54,6 +104,10 @@ public:
 
     void resetPacketCache();
 
+    void setCaptureDevice(QIODevice *device);
+
+    void setStanzaTraceSink(QXmppStanzaTraceSink sink, int sampleInterval = 1);
+
 Q_SIGNALS:
     /// This signal is emitted when the stream is connected.
     void connected();
@@ -61,10 +115,18 @@ Q_SIGNALS:
     /// This signal is emitted when the stream is disconnected.
     void disconnected();
 
+    /// This signal is emitted when the receive buffer grew beyond the limit
+    /// set with setReceiveBufferLimit().
+    ///
+    /// \since QXmpp 1.6
+    void receiveBufferLimitExceeded();
+
 protected:
     // Access to underlying socket
     QSslSocket *socket() const;
     void setSocket(QSslSocket *socket);
+    QXmppTransport *transport() const;
+    void setTransport(QXmppTransport *transport);
 
     // Overridable methods
     virtual void handleStart();
@@ -79,6 +141,10 @@ protected:
     /// \param element
     virtual void handleStream(const QDomElement &element) = 0;
 
+    // Raw stanza data for forwarding
+    void setRawStanzaCaptureEnabled(bool enabled, const QString &localDomain = {});
+    QByteArray rawStanzaData() const;
+
     // XEP-0198: Stream Management
     void enableStreamManagement(bool resetSequenceNumber);
     unsigned int lastIncomingSequenceNumber() const;
@@ -96,10 +162,14 @@ private Q_SLOTS:
 
 private:
     friend class QXmppStreamManager;
+    friend class QXmpp::Private::StreamTracing;
     friend class tst_QXmppStream;
     friend class TestClient;
 
     QXmppTask<QXmpp::SendResult> send(QXmppPacket &&, bool &);
+    void sendQueuedPackets();
+    void abortQueuedPackets();
+    bool writePacket(QXmppPacket &packet, bool queued);
     void processData(const QString &data);
     bool handleIqResponse(const QDomElement &);
 
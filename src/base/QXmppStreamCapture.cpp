@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppStreamCapture.h"
+
+#include <limits>
+
+#include <QElapsedTimer>
+#include <QIODevice>
+
+static const char CAPTURE_MAGIC[] = "QXCP";
+constexpr int CAPTURE_MAGIC_SIZE = 4;
+constexpr char CAPTURE_VERSION = 1;
+
+static void appendVarint(QByteArray &buffer, quint64 value)
+{
+    while (value >= 0x80) {
+        buffer += char((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer += char(value);
+}
+
+static bool readVarint(QIODevice *device, quint64 &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char byte;
+        if (!device->getChar(&byte)) {
+            return false;
+        }
+        value |= quint64(uchar(byte) & 0x7f) << shift;
+        if (!(uchar(byte) & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class QXmppStreamCapturePrivate
+{
+public:
+    QIODevice *device;
+    QElapsedTimer timer;
+    qint64 lastRecord = 0;
+};
+
+///
+/// Constructs a capture writing to \a device, which must be open for
+/// writing.
+///
+/// The capture header is written immediately.
+///
+QXmppStreamCapture::QXmppStreamCapture(QIODevice *device)
+    : d(std::make_unique<QXmppStreamCapturePrivate>())
+{
+    d->device = device;
+    d->timer.start();
+
+    QByteArray header(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    header += CAPTURE_VERSION;
+    d->device->write(header);
+}
+
+QXmppStreamCapture::~QXmppStreamCapture() = default;
+
+///
+/// Records a chunk of data read from or written to the socket.
+///
+/// \param direction
+/// \param data
+///
+void QXmppStreamCapture::record(Direction direction, const QByteArray &data)
+{
+    const qint64 now = d->timer.nsecsElapsed() / 1000;
+
+    QByteArray header;
+    header += char(direction);
+    appendVarint(header, quint64(now - d->lastRecord));
+    appendVarint(header, quint64(data.size()));
+    d->lastRecord = now;
+
+    d->device->write(header);
+    d->device->write(data);
+}
+
+class QXmppStreamCaptureReaderPrivate
+{
+public:
+    QIODevice *device;
+    bool valid = false;
+    qint64 timestamp = 0;
+};
+
+///
+/// Constructs a reader for the capture in \a device, which must be open for
+/// reading.
+///
+QXmppStreamCaptureReader::QXmppStreamCaptureReader(QIODevice *device)
+    : d(std::make_unique<QXmppStreamCaptureReaderPrivate>())
+{
+    d->device = device;
+    const QByteArray header = device->read(CAPTURE_MAGIC_SIZE + 1);
+    d->valid = header.size() == CAPTURE_MAGIC_SIZE + 1 &&
+        header.startsWith(QByteArray(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) &&
+        header.at(CAPTURE_MAGIC_SIZE) == CAPTURE_VERSION;
+}
+
+QXmppStreamCaptureReader::~QXmppStreamCaptureReader() = default;
+
+///
+/// Returns true if the device contains a capture in a supported version.
+///
+bool QXmppStreamCaptureReader::isValid() const
+{
+    return d->valid;
+}
+
+///
+/// Reads the next record, returns false at the end of the capture or if the
+/// capture is truncated.
+///
+/// \param record
+///
+bool QXmppStreamCaptureReader::readNext(Record &record)
+{
+    if (!d->valid) {
+        return false;
+    }
+
+    char direction;
+    quint64 delta, length;
+    if (!d->device->getChar(&direction) || uchar(direction) > QXmppStreamCapture::Outbound ||
+        !readVarint(d->device, delta) || !readVarint(d->device, length) ||
+        length > quint64(std::numeric_limits<int>::max())) {
+        return false;
+    }
+
+    record.data = d->device->read(qint64(length));
+    if (record.data.size() != int(length)) {
+        return false;
+    }
+    d->timestamp += qint64(delta);
+    record.direction = QXmppStreamCapture::Direction(uchar(direction));
+    record.timestamp = d->timestamp;
+    return true;
+}
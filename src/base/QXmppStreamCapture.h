@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSTREAMCAPTURE_H
+#define QXMPPSTREAMCAPTURE_H
+
+#include "QXmppGlobal.h"
+
+#include <memory>
+
+#include <QByteArray>
+
+class QIODevice;
+class QXmppStreamCapturePrivate;
+class QXmppStreamCaptureReaderPrivate;
+
+///
+/// \brief The QXmppStreamCapture class records the raw data of a stream.
+///
+/// The capture starts with the 4 bytes "QXCP" and a version byte. It is
+/// followed by one record per chunk of data read from or written to the
+/// socket:
+///
+///  - one byte for the direction, 0 for inbound and 1 for outbound data
+///  - the time since the previous record in microseconds, as a varint
+///  - the length of the data, as a varint
+///  - the data
+///
+/// Varints are encoded in little-endian groups of 7 bits, the high bit of
+/// each byte being set if more bytes follow.
+///
+/// Captures are read with QXmppStreamCaptureReader.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppStreamCapture
+{
+public:
+    /// Direction of the captured data.
+    enum Direction {
+        Inbound = 0,   ///< Data read from the socket
+        Outbound = 1,  ///< Data written to the socket
+    };
+
+    explicit QXmppStreamCapture(QIODevice *device);
+    ~QXmppStreamCapture();
+
+    void record(Direction direction, const QByteArray &data);
+
+private:
+    const std::unique_ptr<QXmppStreamCapturePrivate> d;
+};
+
+///
+/// \brief The QXmppStreamCaptureReader class reads the records of a capture
+/// written by QXmppStreamCapture.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppStreamCaptureReader
+{
+public:
+    /// A chunk of captured data.
+    struct Record
+    {
+        /// Direction of the data.
+        QXmppStreamCapture::Direction direction = QXmppStreamCapture::Inbound;
+        /// Time since the start of the capture in microseconds.
+        qint64 timestamp = 0;
+        /// The data.
+        QByteArray data;
+    };
+
+    explicit QXmppStreamCaptureReader(QIODevice *device);
+    ~QXmppStreamCaptureReader();
+
+    bool isValid() const;
+    bool readNext(Record &record);
+
+private:
+    const std::unique_ptr<QXmppStreamCaptureReaderPrivate> d;
+};
+
+#endif
@@ -331,6 +331,16 @@ bool QXmppStreamManager::enabled() const
     return m_enabled;
 }
 
+// Returns the size of the stanzas waiting for an acknowledgement.
+qint64 QXmppStreamManager::unacknowledgedBytes() const
+{
+    qint64 bytes = 0;
+    for (const auto &packet : m_unacknowledgedStanzas) {
+        bytes += packet.data().size();
+    }
+    return bytes;
+}
+
 unsigned int QXmppStreamManager::lastIncomingSequenceNumber() const
 {
     return m_lastIncomingSequenceNumber;
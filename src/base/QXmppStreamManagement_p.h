@@ -175,6 +175,7 @@ public:
 
     bool enabled() const;
     unsigned int lastIncomingSequenceNumber() const;
+    qint64 unacknowledgedBytes() const;
 
     void handleDisconnect();
     void handleStart();
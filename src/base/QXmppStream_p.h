@@ -0,0 +1,34 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSTREAM_P_H
+#define QXMPPSTREAM_P_H
+
+class QXmppStream;
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.  It exists for the convenience
+// of QXmpp's own classes.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+class StanzaTracer;
+
+// Gives the client access to the stanza tracer of its stream.
+class StreamTracing
+{
+public:
+    static StanzaTracer &tracer(const QXmppStream *stream);
+};
+
+}  // namespace QXmpp::Private
+
+#endif
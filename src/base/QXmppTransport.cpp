@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppTransport.h"
+
+#include "QXmppTransport_p.h"
+
+#include <QHostAddress>
+#include <QSslSocket>
+
+using namespace QXmpp::Private;
+
+///
+/// Constructs a new transport.
+///
+/// \param parent
+///
+QXmppTransport::QXmppTransport(QObject *parent)
+    : QObject(parent)
+{
+}
+
+QXmppTransport::~QXmppTransport() = default;
+
+///
+/// Returns true if the connection is established.
+///
+bool QXmppTransport::isConnected() const
+{
+    return state() == QAbstractSocket::ConnectedState;
+}
+
+///
+/// Returns the socket if the transport is a TCP connection which can be
+/// encrypted with TLS, nullptr otherwise.
+///
+QSslSocket *QXmppTransport::sslSocket() const
+{
+    return nullptr;
+}
+
+///
+/// Writes as much of the buffered data as possible without blocking.
+///
+/// The default implementation does nothing.
+///
+void QXmppTransport::flush()
+{
+}
+
+///
+/// Returns the number of bytes which have been written but not sent yet.
+///
+/// The default implementation returns 0.
+///
+qint64 QXmppTransport::bytesToWrite() const
+{
+    return 0;
+}
+
+SslSocketTransport::SslSocketTransport(QSslSocket *socket, QObject *parent)
+    : QXmppTransport(parent),
+      m_socket(socket)
+{
+    connect(socket, &QAbstractSocket::connected, this, &QXmppTransport::connected);
+    connect(socket, &QSslSocket::encrypted, this, &QXmppTransport::encrypted);
+    connect(socket, &QAbstractSocket::disconnected, this, &QXmppTransport::disconnected);
+    connect(socket, &QAbstractSocket::stateChanged, this, &QXmppTransport::stateChanged);
+    connect(socket, &QSslSocket::errorOccurred, this, &QXmppTransport::errorOccurred);
+    connect(socket, &QIODevice::readyRead, this, &QXmppTransport::readyRead);
+}
+
+QAbstractSocket::SocketState SslSocketTransport::state() const
+{
+    return m_socket->state();
+}
+
+QString SslSocketTransport::peerName() const
+{
+    return m_socket->peerAddress().toString() + u' ' + QString::number(m_socket->peerPort());
+}
+
+QString SslSocketTransport::errorString() const
+{
+    return m_socket->errorString();
+}
+
+QSslSocket *SslSocketTransport::sslSocket() const
+{
+    return m_socket;
+}
+
+QByteArray SslSocketTransport::readAll()
+{
+    return m_socket->readAll();
+}
+
+qint64 SslSocketTransport::write(const QByteArray &data)
+{
+    return m_socket->write(data);
+}
+
+void SslSocketTransport::flush()
+{
+    m_socket->flush();
+}
+
+qint64 SslSocketTransport::bytesToWrite() const
+{
+    return m_socket->bytesToWrite() + m_socket->encryptedBytesToWrite();
+}
+
+void SslSocketTransport::disconnectFromHost()
+{
+    m_socket->disconnectFromHost();
+}
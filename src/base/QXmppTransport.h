@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPTRANSPORT_H
+#define QXMPPTRANSPORT_H
+
+#include "QXmppGlobal.h"
+
+#include <QAbstractSocket>
+#include <QObject>
+
+class QSslSocket;
+
+///
+/// \brief The QXmppTransport class is the connection a QXmppStream exchanges
+/// its data over.
+///
+/// Streams use a TCP connection by default, see QXmppStream::setSocket().
+/// QXmppMemoryTransport connects two streams in the same process.
+///
+/// Implementations emit readyRead() when data can be read with readAll(),
+/// connected() and disconnected() when the connection is established or
+/// closed, and stateChanged() on every state change.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppTransport : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppTransport(QObject *parent = nullptr);
+    ~QXmppTransport() override;
+
+    bool isConnected() const;
+
+    /// Returns the state of the connection.
+    virtual QAbstractSocket::SocketState state() const = 0;
+    /// Returns a description of the peer for log messages.
+    virtual QString peerName() const = 0;
+    /// Returns a description of the last error.
+    virtual QString errorString() const = 0;
+    virtual QSslSocket *sslSocket() const;
+
+    /// Returns all data received so far.
+    virtual QByteArray readAll() = 0;
+    /// Writes \a data, returns the number of bytes written or -1 on error.
+    virtual qint64 write(const QByteArray &data) = 0;
+    virtual void flush();
+    virtual qint64 bytesToWrite() const;
+    /// Closes the connection.
+    virtual void disconnectFromHost() = 0;
+
+Q_SIGNALS:
+    /// This signal is emitted when the connection has been established.
+    void connected();
+
+    /// This signal is emitted when the connection has been encrypted.
+    void encrypted();
+
+    /// This signal is emitted when the connection has been closed.
+    void disconnected();
+
+    /// This signal is emitted when the state of the connection changes.
+    void stateChanged(QAbstractSocket::SocketState state);
+
+    /// This signal is emitted when an error occurred.
+    void errorOccurred(QAbstractSocket::SocketError error);
+
+    /// This signal is emitted when new data is available.
+    void readyRead();
+};
+
+#endif  // QXMPPTRANSPORT_H
@@ -0,0 +1,46 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPTRANSPORT_P_H
+#define QXMPPTRANSPORT_P_H
+
+#include "QXmppTransport.h"
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.  It exists for the convenience
+// of QXmpp's own classes.  This header file may change from version to
+// version without notice, or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+// The TCP transport, optionally encrypted with TLS.
+class SslSocketTransport : public QXmppTransport
+{
+public:
+    SslSocketTransport(QSslSocket *socket, QObject *parent);
+
+    QAbstractSocket::SocketState state() const override;
+    QString peerName() const override;
+    QString errorString() const override;
+    QSslSocket *sslSocket() const override;
+
+    QByteArray readAll() override;
+    qint64 write(const QByteArray &data) override;
+    void flush() override;
+    qint64 bytesToWrite() const override;
+    void disconnectFromHost() override;
+
+private:
+    QSslSocket *m_socket;
+};
+
+}  // namespace QXmpp::Private
+
+#endif  // QXMPPTRANSPORT_P_H
@@ -16,6 +16,7 @@
 #include <QDomElement>
 #include <QRandomGenerator>
 #include <QRegularExpression>
+#include <QSet>
 #include <QString>
 #include <QStringList>
 #include <QUuid>
@@ -386,4 +387,55 @@ float QXmpp::Private::calculateProgress(qint64 transferred, qint64 total)
 
     return 0;
 }
+
+//
+// Compares two byte arrays in a time only depending on their sizes, so that
+// secrets can't be guessed from the time the comparison takes.
+//
+bool QXmpp::Private::constantTimeEquals(const QByteArray &a, const QByteArray &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    char difference = 0;
+    for (int i = 0; i < a.size(); ++i) {
+        difference |= a.at(i) ^ b.at(i);
+    }
+    return difference == 0;
+}
+
+//
+// Returns a string sharing its data with an equal string passed before in
+// the same thread, so that immutable strings repeated across many streams,
+// like normalized stream headers, are only stored once.
+//
+// Each thread has its own pool, so no lock is needed. The pool is bounded
+// and cleared once full, so it follows the strings currently in use; strings
+// which were returned before stay valid.
+//
+// \param string string to be shared
+//
+QString QXmpp::Private::sharedString(const QString &string)
+{
+    constexpr int maxPoolSize = 64;
+    constexpr int maxStringSize = 1024;
+
+    static thread_local QSet<QString> pool;
+
+    if (string.isEmpty() || string.size() > maxStringSize) {
+        return string;
+    }
+
+    if (const auto it = pool.constFind(string); it != pool.constEnd()) {
+        return *it;
+    }
+    if (pool.size() >= maxPoolSize) {
+        pool.clear();
+    }
+    // don't keep any spare capacity of the original
+    QString shared = string;
+    shared.squeeze();
+    pool.insert(shared);
+    return shared;
+}
 /// \endcond
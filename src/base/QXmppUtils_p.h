@@ -11,12 +11,15 @@
 #include <stdint.h>
 
 #include <QByteArray>
+#include <QString>
 
 namespace QXmpp::Private {
 
 QXMPP_EXPORT QByteArray generateRandomBytes(uint32_t minimumByteCount, uint32_t maximumByteCount);
 QXMPP_EXPORT void generateRandomBytes(uint8_t *bytes, uint32_t byteCount);
 float calculateProgress(qint64 transferred, qint64 total);
+QXMPP_EXPORT QString sharedString(const QString &string);
+bool constantTimeEquals(const QByteArray &a, const QByteArray &b);
 
 }  // namespace QXmpp::Private
 
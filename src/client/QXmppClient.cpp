@@ -20,13 +20,19 @@
 #include "QXmppPacket_p.h"
 #include "QXmppPromise.h"
 #include "QXmppRosterManager.h"
+#include "QXmppStanzaTrace_p.h"
+#include "QXmppStream_p.h"
 #include "QXmppTask.h"
 #include "QXmppTlsManager_p.h"
+#include "QXmppTransport.h"
 #include "QXmppUtils.h"
 #include "QXmppVCardManager.h"
 #include "QXmppVersionManager.h"
 
+#include <algorithm>
+
 #include <QDomElement>
+#include <QElapsedTimer>
 #include <QSslSocket>
 #include <QTimer>
 
@@ -35,6 +41,9 @@ using MessageEncryptResult = QXmppE2eeExtension::MessageEncryptResult;
 using IqEncryptResult = QXmppE2eeExtension::IqEncryptResult;
 using IqDecryptResult = QXmppE2eeExtension::IqDecryptResult;
 
+// number of handler durations kept per extension for percentiles
+constexpr int HANDLER_SAMPLE_COUNT = 1024;
+
 static bool isIqResponse(const QDomElement &el)
 {
     auto type = el.attribute("type");
@@ -51,6 +60,7 @@ QXmppClientPrivate::QXmppClientPrivate(QXmppClient *qq)
       reconnectionTries(0),
       reconnectionTimer(nullptr),
       isActive(true),
+      iqCoalescingEnabled(false),
       q(qq)
 {
 }
@@ -78,6 +88,38 @@ int QXmppClientPrivate::getNextReconnectTime() const
     }
 }
 
+///
+/// Sends an IQ request or attaches to an identical request that is already in
+/// flight. Requests are identical if they only differ in their IDs.
+///
+QXmppTask<QXmppClient::IqResult> QXmppClientPrivate::sendCoalescedIq(QXmppIq &&iq)
+{
+    // serialize the request without its ID, so only target and payload are compared
+    const auto id = iq.id();
+    iq.setId({});
+    QByteArray key;
+    QXmlStreamWriter writer(&key);
+    iq.toXml(&writer);
+    iq.setId(id);
+
+    QXmppPromise<QXmppClient::IqResult> promise;
+    auto task = promise.task();
+
+    if (auto itr = coalescedIqs.find(key); itr != coalescedIqs.end()) {
+        itr->append(std::move(promise));
+        return task;
+    }
+
+    coalescedIqs.insert(key, { std::move(promise) });
+    stream->sendIq(std::move(iq)).then(q, [this, key](QXmppClient::IqResult &&result) {
+        const auto waiting = coalescedIqs.take(key);
+        for (auto promise : waiting) {
+            promise.finish(QXmppClient::IqResult(result));
+        }
+    });
+    return task;
+}
+
 QStringList QXmppClientPrivate::discoveryFeatures()
 {
     return {
@@ -119,17 +161,110 @@ QStringList QXmppClientPrivate::discoveryFeatures()
 }
 /// \endcond
 
+namespace QXmpp::Private {
+
+ExtensionStatistics::ExtensionStatistics(QXmppClient *client)
+    : client(client)
+{
+}
+
+void ExtensionStatistics::record(QXmppClientExtension *extension, qint64 nsecs, bool claimed)
+{
+    auto &cost = costs[extension];
+    if (cost.name.isEmpty()) {
+        // several instances of the same class are numbered so they do not
+        // overwrite each other's statistics
+        const auto className = QString::fromLatin1(extension->metaObject()->className());
+        const auto isTaken = [this](const QString &name) {
+            return std::any_of(costs.cbegin(), costs.cend(), [&](const HandlerCost &other) {
+                return other.name == name;
+            });
+        };
+        cost.name = className;
+        for (int instance = 2; isTaken(cost.name); ++instance) {
+            cost.name = className + u'#' + QString::number(instance);
+        }
+
+        const auto prefix = QStringLiteral("client.extension.") + cost.name;
+        cost.invocationsCounter = prefix + QStringLiteral(".invocations");
+        cost.handlerTimeCounter = prefix + QStringLiteral(".handler-time-ns");
+        cost.claimedCounter = prefix + QStringLiteral(".claimed");
+        cost.recentNsecs.reserve(HANDLER_SAMPLE_COUNT);
+    }
+
+    cost.invocations++;
+    cost.totalNsecs += nsecs;
+    if (cost.recentNsecs.size() < HANDLER_SAMPLE_COUNT) {
+        cost.recentNsecs.append(nsecs);
+    } else {
+        cost.recentNsecs[cost.nextSample] = nsecs;
+        cost.nextSample = (cost.nextSample + 1) % HANDLER_SAMPLE_COUNT;
+    }
+
+    client->reportCounter(cost.invocationsCounter);
+    client->reportCounter(cost.handlerTimeCounter, nsecs);
+    if (claimed) {
+        cost.claimed++;
+        client->reportCounter(cost.claimedCounter);
+    }
+}
+
+void ExtensionStatistics::remove(QXmppClientExtension *extension)
+{
+    costs.remove(extension);
+}
+
+QVariantMap ExtensionStatistics::toVariantMap() const
+{
+    const auto percentile = [](QVector<qint64> samples, double p) -> qint64 {
+        if (samples.isEmpty()) {
+            return 0;
+        }
+        const auto nth = samples.begin() + std::min<qsizetype>(samples.size() - 1, qsizetype(p * samples.size()));
+        std::nth_element(samples.begin(), nth, samples.end());
+        return *nth;
+    };
+
+    QVariantMap stats;
+    for (const auto &cost : costs) {
+        QVariantMap extensionStats;
+        extensionStats[QStringLiteral("invocations")] = cost.invocations;
+        extensionStats[QStringLiteral("claimed")] = cost.claimed;
+        extensionStats[QStringLiteral("total-time-us")] = cost.totalNsecs / 1000;
+        extensionStats[QStringLiteral("p50-time-us")] = percentile(cost.recentNsecs, 0.5) / 1000;
+        extensionStats[QStringLiteral("p99-time-us")] = percentile(cost.recentNsecs, 0.99) / 1000;
+        stats.insert(cost.name, extensionStats);
+    }
+    return stats;
+}
+
+}  // namespace QXmpp::Private
+
 namespace QXmpp::Private::StanzaPipeline {
 
-bool process(const QList<QXmppClientExtension *> &extensions, const QDomElement &element, const std::optional<QXmppE2eeMetadata> &e2eeMetadata)
+bool process(const QList<QXmppClientExtension *> &extensions, const QDomElement &element, const std::optional<QXmppE2eeMetadata> &e2eeMetadata, ExtensionStatistics *statistics, StanzaTrace *trace = nullptr)
 {
     const bool unencrypted = !e2eeMetadata.has_value();
+    QElapsedTimer timer;
     for (auto *extension : extensions) {
+        if (statistics) {
+            timer.start();
+        }
+        const qint64 start = trace ? StanzaTrace::now() : 0;
+
         // e2e encrypted stanzas are not passed to the old handleStanza() overload, because such
         // managers are likely not handling the encrypted contents correctly (e.g. sending
         // unencrypted replies and thereby leaking information).
-        if (extension->handleStanza(element, e2eeMetadata) ||
-            (unencrypted && extension->handleStanza(element))) {
+        const bool handled = extension->handleStanza(element, e2eeMetadata) ||
+            (unencrypted && extension->handleStanza(element));
+
+        if (statistics) {
+            statistics->record(extension, timer.nsecsElapsed(), handled);
+        }
+        if (trace) {
+            trace->addSpan(QXmppStanzaTrace::Handler, start, QString::fromLatin1(extension->metaObject()->className()));
+        }
+        if (handled) {
             return true;
         }
     }
@@ -140,11 +275,25 @@ bool process(const QList<QXmppClientExtension *> &extensions, const QDomElement
 
 namespace QXmpp::Private::MessagePipeline {
 
-bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extensions, QXmppMessage &&message)
+bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extensions, ExtensionStatistics *statistics, QXmppMessage &&message, StanzaTrace *trace = nullptr)
 {
+    QElapsedTimer timer;
     for (auto *extension : extensions) {
         if (auto *messageHandler = dynamic_cast<QXmppMessageHandler *>(extension)) {
-            if (messageHandler->handleMessage(message)) {
+            if (statistics) {
+                timer.start();
+            }
+            const qint64 start = trace ? StanzaTrace::now() : 0;
+
+            const bool handled = messageHandler->handleMessage(message);
+
+            if (statistics) {
+                statistics->record(extension, timer.nsecsElapsed(), handled);
+            }
+            if (trace) {
+                trace->addSpan(QXmppStanzaTrace::Handler, start, QString::fromLatin1(extension->metaObject()->className()));
+            }
+            if (handled) {
                 return true;
             }
         }
@@ -152,7 +301,7 @@ bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extension
     return false;
 }
 
-bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extensions, QXmppE2eeExtension *e2eeExt, const QDomElement &element)
+bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extensions, ExtensionStatistics *statistics, QXmppE2eeExtension *e2eeExt, const QDomElement &element, StanzaTrace *trace)
 {
     if (element.tagName() != "message") {
         return false;
@@ -163,7 +312,7 @@ bool process(QXmppClient *client, const QList<QXmppClientExtension *> &extension
     } else {
         message.parse(element);
     }
-    return process(client, extensions, std::move(message));
+    return process(client, extensions, statistics, std::move(message), trace);
 }
 
 }  // namespace QXmpp::Private::MessagePipeline
@@ -292,6 +441,9 @@ bool QXmppClient::removeExtension(QXmppClientExtension *extension)
 {
     if (d->extensions.contains(extension)) {
         d->extensions.removeAll(extension);
+        if (d->extensionStatistics) {
+            d->extensionStatistics->remove(extension);
+        }
         delete extension;
         return true;
     } else {
@@ -328,6 +480,152 @@ QList<QXmppClientExtension *> QXmppClient::extensions()
     return d->extensions;
 }
 
+///
+/// Returns whether identical IQ requests are coalesced while one of them is
+/// pending.
+///
+/// \sa setIqCoalescingEnabled()
+///
+/// \since QXmpp 1.6
+///
+bool QXmppClient::isIqCoalescingEnabled() const
+{
+    return d->iqCoalescingEnabled;
+}
+
+///
+/// Sets whether identical IQ requests sent via sendIq() are coalesced.
+///
+/// If enabled, an IQ request of type 'get' that has the same recipient and
+/// payload as a request that is still awaiting its response is not sent again.
+/// Instead, the task of the new request is finished with the response of the
+/// pending one. This avoids duplicate requests, e.g. when several managers
+/// request the service discovery information of the same entity on login.
+///
+/// IQ requests of type 'set' are never coalesced.
+///
+/// This is disabled by default.
+///
+/// \since QXmpp 1.6
+///
+void QXmppClient::setIqCoalescingEnabled(bool enabled)
+{
+    d->iqCoalescingEnabled = enabled;
+}
+
+///
+/// Returns whether the time spent in the stanza handlers of the extensions is
+/// recorded.
+///
+/// \sa setExtensionStatisticsEnabled()
+///
+/// \since QXmpp 1.6
+///
+bool QXmppClient::isExtensionStatisticsEnabled() const
+{
+    return d->extensionStatistics != nullptr;
+}
+
+///
+/// Sets whether the time spent in the stanza handlers of the extensions is
+/// recorded.
+///
+/// If enabled, every invocation of QXmppClientExtension::handleStanza() and
+/// QXmppMessageHandler::handleMessage() is timed. The results can be queried
+/// using extensionStatistics() and are also reported to the logger using the
+/// counters "client.extension.<class name>.invocations", ".claimed" and
+/// ".handler-time-ns".
+///
+/// Disabling the statistics discards the recorded data.
+///
+/// \since QXmpp 1.6
+///
+void QXmppClient::setExtensionStatisticsEnabled(bool enabled)
+{
+    if (!enabled) {
+        d->extensionStatistics.reset();
+    } else if (!d->extensionStatistics) {
+        d->extensionStatistics = std::make_unique<ExtensionStatistics>(this);
+    }
+}
+
+///
+/// Returns the recorded stanza handler statistics of the extensions.
+///
+/// The map is keyed by the class names of the extensions. If several
+/// extensions of the same class are registered, the later ones are keyed by
+/// the class name followed by "#2", "#3" and so on. Each value is a map
+/// containing the number of handler "invocations", the number of stanzas the
+/// extension "claimed" (i.e. handled), the cumulative handler time
+/// ("total-time-us") and the median and 99th percentile of the handler time of
+/// the most recent invocations ("p50-time-us" and "p99-time-us").
+///
+/// \sa setExtensionStatisticsEnabled()
+///
+/// \since QXmpp 1.6
+///
+QVariantMap QXmppClient::extensionStatistics() const
+{
+    if (d->extensionStatistics) {
+        return d->extensionStatistics->toVariantMap();
+    }
+    return {};
+}
+
+///
+/// Limits the rate at which stanzas of the given traffic class are sent.
+///
+/// Servers usually enforce per-connection rate limits and delay or disconnect
+/// clients sending bursts of stanzas. With a rate limit the client queues
+/// stanzas exceeding the budget and sends them as the budget allows, so bulk
+/// operations like QXmppPubSubManager::publishItems(), MAM paging or roster
+/// changes pace themselves automatically.
+///
+/// \param trafficClass The class of stanzas to limit.
+/// \param stanzasPerSecond The sustained rate, zero or less disables limiting.
+/// \param burst The number of stanzas that can be sent at once.
+///
+/// \sa QXmppStream::setRateLimit()
+///
+/// \since QXmpp 1.6
+///
+void QXmppClient::setRateLimit(QXmppStream::TrafficClass trafficClass, double stanzasPerSecond, int burst)
+{
+    d->stream->setRateLimit(trafficClass, stanzasPerSecond, burst);
+}
+
+///
+/// Returns the number of stanzas that are held back by the rate limits.
+///
+/// \sa setRateLimit()
+///
+/// \since QXmpp 1.6
+///
+int QXmppClient::queuedStanzaCount() const
+{
+    return d->stream->queuedPacketCount();
+}
+
+///
+/// Traces the processing of incoming and outgoing stanzas and passes the
+/// traces to \a sink.
+///
+/// In addition to the stages of the stream, the traces contain the time spent
+/// in the stanza handlers of the extensions and in end-to-end encryption and
+/// decryption, so that latency spikes can be attributed to a stage. Every
+/// \a sampleInterval th stanza in each direction is traced.
+///
+/// Passing an empty sink disables tracing.
+///
+/// \sa QXmppStream::setStanzaTraceSink()
+///
+/// \since QXmpp 1.6
+///
+void QXmppClient::setStanzaTraceSink(QXmppStanzaTraceSink sink, int sampleInterval)
+{
+    d->stream->setStanzaTraceSink(std::move(sink), sampleInterval);
+}
+
 /// Returns a modifiable reference to the current configuration of QXmppClient.
 /// \return Reference to the QXmppClient's configuration for the connection.
 
@@ -361,6 +659,31 @@ void QXmppClient::connectToServer(const QXmppConfiguration &config,
     d->stream->connectToHost();
 }
 
+///
+/// Starts a session over an established \a transport instead of connecting
+/// to the server over TCP, for example with QXmppServer::connectInMemory().
+///
+/// The client takes ownership of the transport. It does not reconnect
+/// automatically once the transport has been closed.
+///
+/// \since QXmpp 1.6
+///
+void QXmppClient::connectToServer(const QXmppConfiguration &config, QXmppTransport *transport)
+{
+    // reset package cache from last connection
+    if (d->stream->configuration().jidBare() != config.jidBare()) {
+        d->stream->resetPacketCache();
+    }
+
+    d->stream->configuration() = config;
+    d->addProperCapability(d->clientPresence);
+
+    connect(transport, &QXmppTransport::stateChanged,
+            this, &QXmppClient::_q_socketStateChanged);
+
+    d->stream->connectToTransport(transport);
+}
+
 /// Overloaded function to simply connect to an XMPP server with a JID and password.
 ///
 /// \param jid JID for the account.
@@ -416,19 +739,34 @@ bool QXmppClient::sendPacket(const QXmppNonza &packet)
 ///
 QXmppTask<QXmpp::SendResult> QXmppClient::sendSensitive(QXmppStanza &&stanza, const std::optional<QXmppSendStanzaParams> &params)
 {
-    const auto sendEncrypted = [this](auto &&task) {
+    // the trace includes the encryption
+    const auto startTrace = [this](const QString &tagName, const QXmppStanza &stanza) {
+        return StreamTracing::tracer(d->stream).isEnabled()
+            ? StreamTracing::tracer(d->stream).start(QXmppStanzaTrace::Outgoing, tagName, stanza.id())
+            : StanzaTraceHandle();
+    };
+
+    const auto sendEncrypted = [this](auto &&task, StanzaTraceHandle trace) {
+        const qint64 start = trace ? StanzaTrace::now() : 0;
         QXmppPromise<QXmpp::SendResult> interface;
-        task.then(this, [this, interface](auto &&result) mutable {
+        task.then(this, [this, interface, trace, start](auto &&result) mutable {
+            if (trace) {
+                trace->addSpan(QXmppStanzaTrace::Encryption, start);
+            }
             std::visit(overloaded {
                            [&](std::unique_ptr<QXmppMessage> &&message) {
                                QByteArray xml;
                                QXmlStreamWriter writer(&xml);
                                message->toXml(&writer, QXmpp::ScePublic);
 
-                               d->stream->send(QXmppPacket(xml, true, std::move(interface)));
+                               QXmppPacket packet(xml, true, std::move(interface));
+                               packet.setTrace(std::move(trace));
+                               d->stream->send(std::move(packet));
                            },
                            [&](std::unique_ptr<QXmppIq> &&iq) {
-                               d->stream->send(QXmppPacket(*iq, std::move(interface)));
+                               QXmppPacket packet(*iq, std::move(interface));
+                               packet.setTrace(std::move(trace));
+                               d->stream->send(std::move(packet));
                            },
                            [&](QXmppError &&error) {
                                interface.finish(std::move(error));
@@ -441,13 +779,17 @@ QXmppTask<QXmpp::SendResult> QXmppClient::sendSensitive(QXmppStanza &&stanza, co
 
     if (d->encryptionExtension) {
         if (dynamic_cast<QXmppMessage *>(&stanza)) {
+            auto trace = startTrace(QStringLiteral("message"), stanza);
             return sendEncrypted(
                 d->encryptionExtension->encryptMessage(
-                    std::move(dynamic_cast<QXmppMessage &&>(stanza)), params));
+                    std::move(dynamic_cast<QXmppMessage &&>(stanza)), params),
+                std::move(trace));
         } else if (dynamic_cast<QXmppIq *>(&stanza)) {
+            auto trace = startTrace(QStringLiteral("iq"), stanza);
             return sendEncrypted(
                 d->encryptionExtension->encryptIq(
-                    std::move(dynamic_cast<QXmppIq &&>(stanza)), params));
+                    std::move(dynamic_cast<QXmppIq &&>(stanza)), params),
+                std::move(trace));
         }
     }
     return d->stream->send(stanza);
@@ -498,6 +840,9 @@ QXmppTask<QXmpp::SendResult> QXmppClient::reply(QXmppStanza &&stanza, const std:
 ///
 /// This does not do any end-to-encryption on the IQ.
 ///
+/// If IQ coalescing is enabled, identical pending requests of type 'get' are
+/// only sent once (see setIqCoalescingEnabled()).
+///
 /// \sa sendSensitiveIq()
 ///
 /// \warning THIS API IS NOT FINALIZED YET!
@@ -506,6 +851,9 @@ QXmppTask<QXmpp::SendResult> QXmppClient::reply(QXmppStanza &&stanza, const std:
 ///
 QXmppTask<QXmppClient::IqResult> QXmppClient::sendIq(QXmppIq &&iq, const std::optional<QXmppSendStanzaParams> &)
 {
+    if (d->iqCoalescingEnabled && iq.type() == QXmppIq::Get) {
+        return d->sendCoalescedIq(std::move(iq));
+    }
     return d->stream->sendIq(std::move(iq));
 }
 
@@ -527,11 +875,23 @@ QXmppTask<QXmppClient::IqResult> QXmppClient::sendSensitiveIq(QXmppIq &&iq, cons
     if (d->encryptionExtension) {
         QXmppPromise<IqResult> p;
         auto task = p.task();
-        d->encryptionExtension->encryptIq(std::move(iq), params).then(this, [this, p = std::move(p)](IqEncryptResult result) mutable {
+        // the trace includes the encryption
+        auto trace = StreamTracing::tracer(d->stream).isEnabled()
+            ? StreamTracing::tracer(d->stream).start(QXmppStanzaTrace::Outgoing, QStringLiteral("iq"), iq.id())
+            : StanzaTraceHandle();
+        const qint64 start = trace ? StanzaTrace::now() : 0;
+        d->encryptionExtension->encryptIq(std::move(iq), params).then(this, [this, p = std::move(p), trace = std::move(trace), start](IqEncryptResult result) mutable {
+            if (trace) {
+                trace->addSpan(QXmppStanzaTrace::Encryption, start);
+            }
             std::visit(overloaded {
                            [&](std::unique_ptr<QXmppIq> &&iq) {
                                // success (encrypted)
-                               d->stream->sendIq(std::move(*iq)).then(this, [this, p = std::move(p)](auto &&result) mutable {
+                               StreamTracing::tracer(d->stream).setPendingOutgoing(std::move(trace));
+                               auto sendTask = d->stream->sendIq(std::move(*iq));
+                               // not taken if the IQ could not be sent
+                               StreamTracing::tracer(d->stream).setPendingOutgoing({});
+                               sendTask.then(this, [this, p = std::move(p)](auto &&result) mutable {
                                    // iq sent, response received
                                    std::visit(overloaded {
                                                   [&](QDomElement &&el) {
@@ -547,8 +907,14 @@ QXmppTask<QXmppClient::IqResult> QXmppClient::sendSensitiveIq(QXmppIq &&iq, cons
                                                               QXmpp::SendError::EncryptionError });
                                                           return;
                                                       }
-                                                      // try to decrypt the result (should be encrypted)
-                                                      d->encryptionExtension->decryptIq(el).then(this, [p = std::move(p), encryptedEl = el](IqDecryptResult result) mutable {
+                                                      // try to decrypt the result (should be encrypted), the
+                                                      // decryption is part of the response's trace
+                                                      auto trace = StreamTracing::tracer(d->stream).currentIncoming();
+                                                      const qint64 start = trace ? StanzaTrace::now() : 0;
+                                                      d->encryptionExtension->decryptIq(el).then(this, [p = std::move(p), encryptedEl = el, trace = std::move(trace), start](IqDecryptResult result) mutable {
+                                                          if (trace) {
+                                                              trace->addSpan(QXmppStanzaTrace::Decryption, start);
+                                                          }
                                                           std::visit(overloaded {
                                                                          [&](QDomElement &&decryptedEl) {
                                                                              p.finish(decryptedEl);
@@ -737,8 +1103,8 @@ QXmppClient::State QXmppClient::state() const
 {
     if (d->stream->isConnected()) {
         return QXmppClient::ConnectedState;
-    } else if (d->stream->socket()->state() != QAbstractSocket::UnconnectedState &&
-               d->stream->socket()->state() != QAbstractSocket::ClosingState) {
+    } else if (d->stream->transport()->state() != QAbstractSocket::UnconnectedState &&
+               d->stream->transport()->state() != QAbstractSocket::ClosingState) {
         return QXmppClient::ConnectingState;
     } else {
         return QXmppClient::DisconnectedState;
@@ -794,14 +1160,17 @@ void QXmppClient::setClientPresence(const QXmppPresence &presence)
 
 QAbstractSocket::SocketError QXmppClient::socketError()
 {
-    return d->stream->socket()->error();
+    if (auto *socket = d->stream->socket()) {
+        return socket->error();
+    }
+    return QAbstractSocket::UnknownSocketError;
 }
 
 /// Returns the human-readable description of the last socket error if error() is QXmppClient::SocketError.
 
 QString QXmppClient::socketErrorString() const
 {
-    return d->stream->socket()->errorString();
+    return d->stream->transport()->errorString();
 }
 
 /// Returns the XMPP stream error if QXmppClient::Error is QXmppClient::XmppStreamError.
@@ -840,7 +1209,7 @@ void QXmppClient::injectIq(const QDomElement &element, const std::optional<QXmpp
     if (element.tagName() != "iq") {
         return;
     }
-    if (!StanzaPipeline::process(d->extensions, element, e2eeMetadata)) {
+    if (!StanzaPipeline::process(d->extensions, element, e2eeMetadata, d->extensionStatistics.get())) {
         const auto iqType = element.attribute("type");
         if (iqType == "get" || iqType == "set") {
             // send error IQ
@@ -864,7 +1233,7 @@ void QXmppClient::injectIq(const QDomElement &element, const std::optional<QXmpp
 ///
 bool QXmppClient::injectMessage(QXmppMessage &&message)
 {
-    auto handled = MessagePipeline::process(this, d->extensions, std::move(message));
+    auto handled = MessagePipeline::process(this, d->extensions, d->extensionStatistics.get(), std::move(message));
     if (!handled) {
         // no extension handled the message
         Q_EMIT messageReceived(message);
@@ -879,13 +1248,15 @@ void QXmppClient::_q_elementReceived(const QDomElement &element, bool &handled)
 {
     // The stanza comes directly from the XMPP stream, so it's not end-to-end
     // encrypted and there's no e2ee metadata (std::nullopt).
-    handled = StanzaPipeline::process(d->extensions, element, std::nullopt) ||
-        MessagePipeline::process(this, d->extensions, d->encryptionExtension, element);
+    auto *trace = StreamTracing::tracer(d->stream).currentIncoming().get();
+    handled = StanzaPipeline::process(d->extensions, element, std::nullopt, d->extensionStatistics.get(), trace) ||
+        MessagePipeline::process(this, d->extensions, d->extensionStatistics.get(), d->encryptionExtension, element, trace);
 }
 
 void QXmppClient::_q_reconnect()
 {
-    if (d->stream->configuration().autoReconnectionEnabled()) {
+    // a closed transport passed to connectToServer() can't be reopened
+    if (d->stream->configuration().autoReconnectionEnabled() && d->stream->socket()) {
         debug("Reconnecting to server");
         d->stream->connectToHost();
     }
@@ -953,24 +1324,8 @@ QXmppLogger *QXmppClient::logger() const
 void QXmppClient::setLogger(QXmppLogger *logger)
 {
     if (logger != d->logger) {
-        if (d->logger) {
-            disconnect(this, &QXmppLoggable::logMessage,
-                       d->logger, &QXmppLogger::log);
-            disconnect(this, &QXmppLoggable::setGauge,
-                       d->logger, &QXmppLogger::setGauge);
-            disconnect(this, &QXmppLoggable::updateCounter,
-                       d->logger, &QXmppLogger::updateCounter);
-        }
-
         d->logger = logger;
-        if (d->logger) {
-            connect(this, &QXmppLoggable::logMessage,
-                    d->logger, &QXmppLogger::log);
-            connect(this, &QXmppLoggable::setGauge,
-                    d->logger, &QXmppLogger::setGauge);
-            connect(this, &QXmppLoggable::updateCounter,
-                    d->logger, &QXmppLogger::updateCounter);
-        }
+        setLoggingSink(logger);
 
         Q_EMIT loggerChanged(d->logger);
     }
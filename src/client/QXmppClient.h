@@ -10,6 +10,7 @@
 #include "QXmppPresence.h"
 #include "QXmppSendResult.h"
 #include "QXmppSendStanzaParams.h"
+#include "QXmppStream.h"
 
 #include <memory>
 #include <variant>
@@ -17,6 +18,7 @@
 #include <QAbstractSocket>
 #include <QObject>
 #include <QSslError>
+#include <QVariantMap>
 
 template<typename T>
 class QXmppTask;
@@ -28,6 +30,7 @@ class QXmppPresence;
 class QXmppMessage;
 class QXmppIq;
 class QXmppStream;
+class QXmppTransport;
 class QXmppInternalClientExtension;
 
 // managers
@@ -201,6 +204,18 @@ public:
 
     StreamManagementState streamManagementState() const;
 
+    bool isIqCoalescingEnabled() const;
+    void setIqCoalescingEnabled(bool enabled);
+
+    bool isExtensionStatisticsEnabled() const;
+    void setExtensionStatisticsEnabled(bool enabled);
+    QVariantMap extensionStatistics() const;
+
+    void setRateLimit(QXmppStream::TrafficClass trafficClass, double stanzasPerSecond, int burst);
+    int queuedStanzaCount() const;
+
+    void setStanzaTraceSink(QXmppStanzaTraceSink sink, int sampleInterval = 1);
+
     QXmppPresence clientPresence() const;
     void setClientPresence(const QXmppPresence &presence);
 
@@ -307,6 +322,8 @@ public Q_SLOTS:
                              QXmppPresence());
     void connectToServer(const QString &jid,
                          const QString &password);
+    void connectToServer(const QXmppConfiguration &config,
+                         QXmppTransport *transport);
     void disconnectFromServer();
     bool sendPacket(const QXmppNonza &);
     void sendMessage(const QString &bareJid, const QString &message);
@@ -18,7 +18,15 @@
 #ifndef QXMPPCLIENT_P_H
 #define QXMPPCLIENT_P_H
 
+#include "QXmppClient.h"
 #include "QXmppPresence.h"
+#include "QXmppPromise.h"
+
+#include <memory>
+
+#include <QDomElement>
+#include <QHash>
+#include <QVariantMap>
 
 class QXmppClient;
 class QXmppClientExtension;
@@ -27,6 +35,42 @@ class QXmppLogger;
 class QXmppOutgoingClient;
 class QTimer;
 
+namespace QXmpp::Private {
+
+//
+// Records how much time the client's extensions spend in their stanza handlers.
+//
+class ExtensionStatistics
+{
+public:
+    explicit ExtensionStatistics(QXmppClient *client);
+
+    void record(QXmppClientExtension *extension, qint64 nsecs, bool claimed);
+    void remove(QXmppClientExtension *extension);
+    QVariantMap toVariantMap() const;
+
+private:
+    struct HandlerCost
+    {
+        // unique among the extensions, built once with the counter names
+        QString name;
+        QString invocationsCounter;
+        QString handlerTimeCounter;
+        QString claimedCounter;
+        quint64 invocations = 0;
+        quint64 claimed = 0;
+        qint64 totalNsecs = 0;
+        // durations of the most recent invocations for percentiles
+        QVector<qint64> recentNsecs;
+        int nextSample = 0;
+    };
+
+    QXmppClient *client;
+    QHash<QXmppClientExtension *, HandlerCost> costs;
+};
+
+}  // namespace QXmpp::Private
+
 class QXmppClientPrivate
 {
 public:
@@ -49,8 +93,16 @@ public:
     // Client state indication
     bool isActive;
 
+    // IQ request coalescing
+    bool iqCoalescingEnabled;
+    QHash<QByteArray, QVector<QXmppPromise<QXmppClient::IqResult>>> coalescedIqs;
+
+    // extension handler instrumentation, null if disabled
+    std::unique_ptr<QXmpp::Private::ExtensionStatistics> extensionStatistics;
+
     void addProperCapability(QXmppPresence &presence);
     int getNextReconnectTime() const;
+    QXmppTask<QXmppClient::IqResult> sendCoalescedIq(QXmppIq &&iq);
 
     static QStringList discoveryFeatures();
 
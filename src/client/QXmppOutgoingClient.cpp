@@ -16,12 +16,14 @@
 #include "QXmppStreamFeatures.h"
 #include "QXmppStreamManagement_p.h"
 #include "QXmppTask.h"
+#include "QXmppTransport.h"
 #include "QXmppUtils.h"
 
 #include <QCryptographicHash>
 #include <QDnsLookup>
 #include <QFuture>
 #include <QNetworkProxy>
+#include <QPointer>
 #include <QSslConfiguration>
 #include <QSslSocket>
 #include <QUrl>
@@ -100,6 +102,10 @@ public:
     QTimer *pingTimer;
     QTimer *timeoutTimer;
 
+    // Transports
+    QSslSocket *socket;
+    QPointer<QXmppTransport> customTransport;
+
 private:
     QXmppOutgoingClient *q;
 };
@@ -121,6 +127,7 @@ QXmppOutgoingClientPrivate::QXmppOutgoingClientPrivate(QXmppOutgoingClient *qq)
       clientStateIndicationEnabled(false),
       pingTimer(nullptr),
       timeoutTimer(nullptr),
+      socket(nullptr),
       q(qq)
 {
 }
@@ -129,29 +136,39 @@ void QXmppOutgoingClientPrivate::connectToHost(const QString &host, quint16 port
 {
     q->info(QString("Connecting to %1:%2").arg(host, QString::number(port)));
 
+    // switch back from a transport set by connectToTransport()
+    if (customTransport) {
+        customTransport->disconnect(q);
+        customTransport->deleteLater();
+        customTransport = nullptr;
+    }
+    if (q->socket() != socket) {
+        q->setSocket(socket);
+    }
+
     // override CA certificates if requested
     if (!config.caCertificates().isEmpty()) {
         QSslConfiguration newSslConfig;
         newSslConfig.setCaCertificates(config.caCertificates());
-        q->socket()->setSslConfiguration(newSslConfig);
+        socket->setSslConfiguration(newSslConfig);
     }
 
     // respect proxy
-    q->socket()->setProxy(config.networkProxy());
+    socket->setProxy(config.networkProxy());
 
     // set the name the SSL certificate should match
-    q->socket()->setPeerVerifyName(config.domain());
+    socket->setPeerVerifyName(config.domain());
 
     // connect to host
     const QXmppConfiguration::StreamSecurityMode localSecurity = q->configuration().streamSecurityMode();
     if (localSecurity == QXmppConfiguration::LegacySSL) {
-        if (!q->socket()->supportsSsl()) {
+        if (!socket->supportsSsl()) {
             q->warning("Not connecting as legacy SSL was requested, but SSL support is not available");
             return;
         }
-        q->socket()->connectToHostEncrypted(host, port);
+        socket->connectToHostEncrypted(host, port);
     } else {
-        q->socket()->connectToHost(host, port);
+        socket->connectToHost(host, port);
     }
 }
 
@@ -172,6 +189,7 @@ QXmppOutgoingClient::QXmppOutgoingClient(QObject *parent)
 {
     // initialise socket
     auto *socket = new QSslSocket(this);
+    d->socket = socket;
     setSocket(socket);
 
     connect(socket, &QAbstractSocket::disconnected, this, &QXmppOutgoingClient::_q_socketDisconnected);
@@ -241,6 +259,38 @@ void QXmppOutgoingClient::connectToHost()
     d->nextSrvRecordIdx = 0;
 }
 
+///
+/// Starts a stream over \a transport instead of connecting to a host.
+///
+/// The stream takes ownership of the transport, which needs to be
+/// connected already. A later call to connectToHost() uses the TCP socket
+/// again.
+///
+/// \since QXmpp 1.6
+///
+void QXmppOutgoingClient::connectToTransport(QXmppTransport *transport)
+{
+    if (d->customTransport && d->customTransport != transport) {
+        d->customTransport->disconnect(this);
+        d->customTransport->deleteLater();
+    }
+    d->customTransport = transport;
+
+    transport->setParent(this);
+    setTransport(transport);
+    connect(transport, &QXmppTransport::disconnected, this, &QXmppOutgoingClient::_q_socketDisconnected);
+
+    // let the caller finish its setup before the stream starts
+    QMetaObject::invokeMethod(
+        this, [this, transport]() {
+            if (d->customTransport == transport && transport->isConnected()) {
+                info(QStringLiteral("Transport connected to %1").arg(transport->peerName()));
+                handleStart();
+            }
+        },
+        Qt::QueuedConnection);
+}
+
 ///
 /// Disconnects from the server and resets the stream management state.
 ///
@@ -355,7 +405,7 @@ void QXmppOutgoingClient::socketSslErrors(const QList<QSslError> &errors)
 
     // if configured, ignore the errors
     if (configuration().ignoreSslErrors()) {
-        socket()->ignoreSslErrors();
+        d->socket->ignoreSslErrors();
     }
 }
 
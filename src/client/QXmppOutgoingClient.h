@@ -33,6 +33,7 @@ public:
     ~QXmppOutgoingClient() override;
 
     void connectToHost();
+    void connectToTransport(QXmppTransport *transport);
     bool isAuthenticated() const;
     bool isConnected() const override;
     bool isClientStateIndicationEnabled() const;
@@ -42,6 +43,8 @@ public:
 
     /// Returns the used socket
     QSslSocket *socket() const { return QXmppStream::socket(); };
+    /// Returns the used transport
+    QXmppTransport *transport() const { return QXmppStream::transport(); };
     QXmppStanza::Error::Condition xmppStreamError();
 
     QXmppConfiguration &configuration();
@@ -18,14 +18,18 @@ QXmppTlsManager::QXmppTlsManager() = default;
 
 bool QXmppTlsManager::handleStanza(const QDomElement &stanza)
 {
-    if (QXmppStreamFeatures::isStreamFeatures(stanza) && !clientStream()->socket()->isEncrypted()) {
+    // transports other than TCP, like QXmppMemoryTransport, can't be encrypted
+    auto *socket = clientStream()->socket();
+    const bool supportsSsl = socket && socket->supportsSsl();
+
+    if (QXmppStreamFeatures::isStreamFeatures(stanza) && !(socket && socket->isEncrypted())) {
         QXmppStreamFeatures features;
         features.parse(stanza);
 
         // determine TLS mode to use
         const QXmppConfiguration::StreamSecurityMode localSecurity = client()->configuration().streamSecurityMode();
         const QXmppStreamFeatures::Mode remoteSecurity = features.tlsMode();
-        if (!clientStream()->socket()->supportsSsl() &&
+        if (!supportsSsl &&
             (localSecurity == QXmppConfiguration::TLSRequired ||
              remoteSecurity == QXmppStreamFeatures::Required)) {
             warning("Disconnecting since TLS is required, but SSL support is not available");
@@ -39,7 +43,7 @@ bool QXmppTlsManager::handleStanza(const QDomElement &stanza)
             return true;
         }
 
-        if (clientStream()->socket()->supportsSsl() &&
+        if (supportsSsl &&
             localSecurity != QXmppConfiguration::TLSDisabled &&
             remoteSecurity != QXmppStreamFeatures::Disabled) {
             // enable TLS since it is supported by both parties
@@ -48,9 +52,9 @@ bool QXmppTlsManager::handleStanza(const QDomElement &stanza)
         }
     }
 
-    if (QXmppStartTlsPacket::isStartTlsPacket(stanza, QXmppStartTlsPacket::Proceed)) {
+    if (QXmppStartTlsPacket::isStartTlsPacket(stanza, QXmppStartTlsPacket::Proceed) && socket) {
         debug("Starting encryption");
-        clientStream()->socket()->startClientEncryption();
+        socket->startClientEncryption();
         return true;
     }
 
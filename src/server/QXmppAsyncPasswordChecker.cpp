@@ -0,0 +1,446 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppAsyncPasswordChecker.h"
+
+#include "QXmppPasswordChecker_p.h"
+#include "QXmppSasl_p.h"
+#include "QXmppUtils_p.h"
+
+#include <atomic>
+#include <functional>
+#include <utility>
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QMessageAuthenticationCode>
+#include <QMutex>
+#include <QQueue>
+#include <QThreadPool>
+#include <QTimer>
+
+// maximum number of cached results
+constexpr int MAX_CACHE_SIZE = 10000;
+
+// The result of a lookup. Only the secrets derived from the password are
+// kept, never the password itself.
+struct Credentials
+{
+    QXmppPasswordReply::Error error = QXmppPasswordReply::TemporaryError;
+    // keyed password hash, MD5 digest or SCRAM StoredKey
+    QByteArray secret;
+    QByteArray serverKey;
+    QByteArray salt;
+};
+
+class QXmppAsyncPasswordCheckerOwner;
+
+class QXmppAsyncPasswordCheckerPrivate
+{
+public:
+    using Derive = std::function<void(Credentials &, const QXmppPasswordRequest &, const QString &)>;
+    using Handler = std::function<void(QXmppPasswordReply *, const Credentials &)>;
+
+    QXmppAsyncPasswordCheckerPrivate(QXmppAsyncPasswordChecker *qq);
+
+    QXmppPasswordReply *lookup(const QXmppPasswordRequest &request, const QString &kind, Derive &&derive, Handler &&handler);
+    void startLookup(const QXmppPasswordRequest &request, const QString &key, const Derive &derive, QFutureInterface<Credentials> interface);
+    void finishLookup(const QXmppPasswordRequest &request, const QString &key, const Credentials &credentials);
+
+    QXmppAsyncPasswordChecker *q;
+    // set if the checker has a QObject parent
+    QXmppAsyncPasswordCheckerOwner *owner = nullptr;
+    QThreadPool pool;
+    // key of the cached password hashes, so they are useless outside of the process
+    QByteArray hashKey;
+    // set by shutdown(), getPassword() is not called anymore afterwards
+    std::atomic<bool> shutDown { false };
+    int maxLookupsPerAddress = 4;
+    int cacheTimeout = 60000;
+    int negativeCacheTimeout = 10000;
+
+    // guards the state below, which is accessed from the streams' and the pool's threads
+    QMutex mutex;
+
+    struct CacheEntry
+    {
+        Credentials credentials;
+        qint64 expiry;
+    };
+    QHash<QString, CacheEntry> cache;
+    QElapsedTimer cacheClock;
+
+    // running and waiting lookups by cache key, joined by concurrent requests
+    QHash<QString, QFutureInterface<Credentials>> inFlightLookups;
+    QHash<QString, int> runningLookups;
+    QHash<QString, QQueue<std::function<void()>>> waitingLookups;
+};
+
+// Owns a checker that has a QObject parent. The lookups are stopped when the
+// parent is destroyed, before the checker and the members of subclasses are.
+class QXmppAsyncPasswordCheckerOwner : public QObject
+{
+public:
+    QXmppAsyncPasswordCheckerOwner(QXmppAsyncPasswordChecker *checker, QObject *parent)
+        : QObject(parent),
+          checker(checker)
+    {
+    }
+
+    ~QXmppAsyncPasswordCheckerOwner() override
+    {
+        if (auto *owned = std::exchange(checker, nullptr)) {
+            owned->d->owner = nullptr;
+            owned->shutdown();
+            delete owned;
+        }
+    }
+
+    QXmppAsyncPasswordChecker *checker;
+};
+
+// Results are cached separately for each kind of derived secret.
+static QString cacheKey(const QString &kind, const QXmppPasswordRequest &request)
+{
+    return kind + u':' + request.username() + u'@' + request.domain();
+}
+
+static QByteArray passwordHash(const QByteArray &key, const QString &password)
+{
+    return QMessageAuthenticationCode::hash(password.toUtf8(), key, QCryptographicHash::Sha256);
+}
+
+QXmppAsyncPasswordCheckerPrivate::QXmppAsyncPasswordCheckerPrivate(QXmppAsyncPasswordChecker *qq)
+    : q(qq)
+{
+    pool.setMaxThreadCount(4);
+    cacheClock.start();
+
+    hashKey.resize(32);
+    QXmpp::Private::generateRandomBytes(reinterpret_cast<uint8_t *>(hashKey.data()), uint32_t(hashKey.size()));
+}
+
+// Looks up the credentials from the cache or the backend and calls the handler
+// with the result in the caller's thread. The secrets are derived from the
+// password on the pool's threads.
+QXmppPasswordReply *QXmppAsyncPasswordCheckerPrivate::lookup(const QXmppPasswordRequest &request, const QString &kind, Derive &&derive, Handler &&handler)
+{
+    auto *reply = new QXmppPasswordReply;
+    const auto key = cacheKey(kind, request);
+
+    QMutexLocker locker(&mutex);
+    if (auto itr = cache.constFind(key); itr != cache.cend() && itr->expiry > cacheClock.elapsed()) {
+        // the reply's receiver is connected after returning
+        QTimer::singleShot(0, reply, [reply, handler = std::move(handler), credentials = itr->credentials]() {
+            handler(reply, credentials);
+        });
+        return reply;
+    }
+
+    // join a lookup of the same user that is already running or waiting
+    const auto inFlight = inFlightLookups.constFind(key);
+    const bool joined = inFlight != inFlightLookups.cend();
+    const auto interface = joined ? *inFlight : QFutureInterface<Credentials>(QFutureInterfaceBase::Started);
+
+    // deliver the result in this thread, the watcher is destroyed along with the reply
+    auto *watcher = new QFutureWatcher<Credentials>(reply);
+    QObject::connect(watcher, &QFutureWatcherBase::finished, reply, [reply, watcher, handler = std::move(handler)]() {
+        handler(reply, watcher->result());
+    });
+    watcher->setFuture(interface.future());
+
+    if (joined) {
+        return reply;
+    }
+    inFlightLookups.insert(key, interface);
+
+    // bound the concurrent lookups per address
+    const auto address = request.remoteAddress();
+    if (maxLookupsPerAddress > 0 && runningLookups.value(address) >= maxLookupsPerAddress) {
+        waitingLookups[address].enqueue([this, request, key, derive = std::move(derive), interface]() {
+            startLookup(request, key, derive, interface);
+        });
+    } else {
+        runningLookups[address]++;
+        startLookup(request, key, derive, interface);
+    }
+    return reply;
+}
+
+void QXmppAsyncPasswordCheckerPrivate::startLookup(const QXmppPasswordRequest &request, const QString &key, const Derive &derive, QFutureInterface<Credentials> interface)
+{
+    pool.start([this, request, key, derive, interface]() mutable {
+        Credentials credentials;
+        if (!shutDown) {
+            QString password;
+            credentials.error = q->getPassword(request, password);
+            if (credentials.error == QXmppPasswordReply::NoError) {
+                derive(credentials, request, password);
+            }
+        }
+
+        finishLookup(request, key, credentials);
+
+        interface.reportResult(credentials);
+        interface.reportFinished();
+    });
+}
+
+void QXmppAsyncPasswordCheckerPrivate::finishLookup(const QXmppPasswordRequest &request, const QString &key, const Credentials &credentials)
+{
+    QMutexLocker locker(&mutex);
+
+    // later requests use the cache or start a new lookup
+    inFlightLookups.remove(key);
+
+    // cache the result, temporary errors are not cached
+    const int timeout = credentials.error == QXmppPasswordReply::NoError ? cacheTimeout
+        : credentials.error == QXmppPasswordReply::AuthorizationError   ? negativeCacheTimeout
+                                                                         : 0;
+    if (timeout > 0) {
+        const auto now = cacheClock.elapsed();
+        if (cache.size() >= MAX_CACHE_SIZE) {
+            for (auto itr = cache.begin(); itr != cache.end();) {
+                itr = itr->expiry <= now ? cache.erase(itr) : std::next(itr);
+            }
+            if (cache.size() >= MAX_CACHE_SIZE) {
+                cache.clear();
+            }
+        }
+        cache.insert(key, { credentials, now + timeout });
+    }
+
+    // start the next lookup for the address
+    const auto address = request.remoteAddress();
+    if (auto itr = waitingLookups.find(address); itr != waitingLookups.end()) {
+        const auto next = itr->dequeue();
+        if (itr->isEmpty()) {
+            waitingLookups.erase(itr);
+        }
+        next();
+    } else if (--runningLookups[address] <= 0) {
+        runningLookups.remove(address);
+    }
+}
+
+/// Constructs a new asynchronous password checker.
+///
+/// If a \a parent is given, the checker is owned by it and destroyed along
+/// with it, after the running lookups have finished.
+///
+/// \param parent
+
+QXmppAsyncPasswordChecker::QXmppAsyncPasswordChecker(QObject *parent)
+    : d(std::make_unique<QXmppAsyncPasswordCheckerPrivate>(this))
+{
+    if (parent) {
+        d->owner = new QXmppAsyncPasswordCheckerOwner(this, parent);
+    }
+}
+
+/// Destroys the password checker.
+
+QXmppAsyncPasswordChecker::~QXmppAsyncPasswordChecker()
+{
+    if (d->owner) {
+        // destroyed directly, the parent does not own the checker anymore
+        d->owner->checker = nullptr;
+        delete d->owner;
+    }
+    shutdown();
+}
+
+/// Stops calling getPassword() and waits for running lookups to finish.
+///
+/// Pending and later requests fail with QXmppPasswordReply::TemporaryError.
+///
+/// This is done automatically for checkers owned by a QObject parent. A
+/// checker without a parent should be shut down before the members of
+/// subclasses used by getPassword() are destroyed.
+
+void QXmppAsyncPasswordChecker::shutdown()
+{
+    // waiting lookups are started as running ones finish and fail immediately
+    d->shutDown = true;
+    d->pool.waitForDone();
+}
+
+/// Returns the maximum number of threads used for backend lookups.
+
+int QXmppAsyncPasswordChecker::maxThreadCount() const
+{
+    return d->pool.maxThreadCount();
+}
+
+/// Sets the maximum number of threads used for backend lookups.
+///
+/// The default is 4.
+///
+/// \param count
+
+void QXmppAsyncPasswordChecker::setMaxThreadCount(int count)
+{
+    d->pool.setMaxThreadCount(count);
+}
+
+/// Returns the maximum number of concurrent lookups for requests from the
+/// same remote address.
+
+int QXmppAsyncPasswordChecker::maxLookupsPerAddress() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->maxLookupsPerAddress;
+}
+
+/// Sets the maximum number of concurrent lookups for requests from the same
+/// remote address. Further requests wait for a running lookup to finish, so
+/// a single host can not occupy the whole pool.
+///
+/// The default is 4, zero disables the limit.
+///
+/// \param count
+
+void QXmppAsyncPasswordChecker::setMaxLookupsPerAddress(int count)
+{
+    QMutexLocker locker(&d->mutex);
+    d->maxLookupsPerAddress = count;
+}
+
+/// Returns the time in milliseconds successful lookups are cached.
+
+int QXmppAsyncPasswordChecker::cacheTimeout() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->cacheTimeout;
+}
+
+/// Sets the time in milliseconds successful lookups are cached.
+///
+/// The default is 60 seconds, zero disables caching.
+///
+/// \param msecs
+
+void QXmppAsyncPasswordChecker::setCacheTimeout(int msecs)
+{
+    QMutexLocker locker(&d->mutex);
+    d->cacheTimeout = msecs;
+}
+
+/// Returns the time in milliseconds lookups of unknown users are cached.
+
+int QXmppAsyncPasswordChecker::negativeCacheTimeout() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->negativeCacheTimeout;
+}
+
+/// Sets the time in milliseconds lookups of unknown users, which failed with
+/// QXmppPasswordReply::AuthorizationError, are cached.
+///
+/// The default is 10 seconds, zero disables caching.
+///
+/// \param msecs
+
+void QXmppAsyncPasswordChecker::setNegativeCacheTimeout(int msecs)
+{
+    QMutexLocker locker(&d->mutex);
+    d->negativeCacheTimeout = msecs;
+}
+
+/// Removes all cached lookup results, e.g. after passwords changed.
+
+void QXmppAsyncPasswordChecker::clearCache()
+{
+    QMutexLocker locker(&d->mutex);
+    d->cache.clear();
+}
+
+/// Checks that the given credentials are valid.
+///
+/// \param request
+
+QXmppPasswordReply *QXmppAsyncPasswordChecker::checkPassword(const QXmppPasswordRequest &request)
+{
+    auto derive = [hashKey = d->hashKey](Credentials &credentials, const QXmppPasswordRequest &, const QString &password) {
+        credentials.secret = passwordHash(hashKey, password);
+    };
+    auto handler = [hash = passwordHash(d->hashKey, request.password())](QXmppPasswordReply *reply, const Credentials &credentials) {
+        if (credentials.error != QXmppPasswordReply::NoError) {
+            reply->setError(credentials.error);
+        } else if (!QXmpp::Private::constantTimeEquals(credentials.secret, hash)) {
+            reply->setError(QXmppPasswordReply::AuthorizationError);
+        }
+        reply->finish();
+    };
+    return d->lookup(request, QStringLiteral("password"), std::move(derive), std::move(handler));
+}
+
+/// Retrieves the MD5 digest for the given username.
+///
+/// \param request
+
+QXmppPasswordReply *QXmppAsyncPasswordChecker::getDigest(const QXmppPasswordRequest &request)
+{
+    auto derive = [](Credentials &credentials, const QXmppPasswordRequest &user, const QString &password) {
+        credentials.secret = QCryptographicHash::hash(
+            (user.username() + ":" + user.domain() + ":" + password).toUtf8(),
+            QCryptographicHash::Md5);
+    };
+    auto handler = [](QXmppPasswordReply *reply, const Credentials &credentials) {
+        if (credentials.error != QXmppPasswordReply::NoError) {
+            reply->setError(credentials.error);
+        } else {
+            reply->setDigest(credentials.secret);
+        }
+        reply->finish();
+    };
+    return d->lookup(request, QStringLiteral("digest"), std::move(derive), std::move(handler));
+}
+
+/// Retrieves the SCRAM keys for the given username, derived from the
+/// password on the thread pool.
+///
+/// \param request
+/// \param algorithm
+
+QXmppPasswordReply *QXmppAsyncPasswordChecker::getScramKeys(const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm)
+{
+    using namespace QXmpp::Private;
+
+    auto derive = [algorithm](Credentials &credentials, const QXmppPasswordRequest &user, const QString &password) {
+        credentials.salt = scramSalt(user);
+        const auto keys = deriveScramKeys(algorithm, password.toUtf8(), credentials.salt, SCRAM_ITERATIONS);
+        credentials.secret = keys.storedKey;
+        credentials.serverKey = keys.serverKey;
+    };
+    auto handler = [](QXmppPasswordReply *reply, const Credentials &credentials) {
+        if (credentials.error != QXmppPasswordReply::NoError) {
+            reply->setError(credentials.error);
+        } else {
+            reply->setSalt(credentials.salt);
+            reply->setIterationCount(SCRAM_ITERATIONS);
+            reply->setStoredKey(credentials.secret);
+            reply->setServerKey(credentials.serverKey);
+        }
+        reply->finish();
+    };
+    return d->lookup(request, QStringLiteral("scram-%1").arg(int(algorithm)), std::move(derive), std::move(handler));
+}
+
+/// Returns true, as the password checker is based on getPassword().
+
+bool QXmppAsyncPasswordChecker::hasGetPassword() const
+{
+    return true;
+}
+
+/// Returns true, as the SCRAM keys are derived on the thread pool and cached.
+
+bool QXmppAsyncPasswordChecker::hasGetScramKeys() const
+{
+    return true;
+}
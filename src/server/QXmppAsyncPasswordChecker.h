@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPASYNCPASSWORDCHECKER_H
+#define QXMPPASYNCPASSWORDCHECKER_H
+
+#include "QXmppPasswordChecker.h"
+
+#include <memory>
+
+class QXmppAsyncPasswordCheckerPrivate;
+
+///
+/// \brief The QXmppAsyncPasswordChecker class is a password checker running
+/// the backend lookups on a thread pool.
+///
+/// Reimplement getPassword() to look up the password in a (possibly slow)
+/// backend. The lookups are run on a bounded pool of threads, so they do not
+/// block the streams, and the results are cached per user for a while. Only
+/// hashes and keys derived from the password are cached, never the password
+/// itself.
+///
+/// As getPassword() is called from the pool's threads, it must be thread-safe.
+/// Give the checker a QObject parent, such as the server, to own it: the
+/// lookups are then stopped before the checker, including the members of
+/// subclasses, is destroyed along with the parent.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppAsyncPasswordChecker : public QXmppPasswordChecker
+{
+public:
+    explicit QXmppAsyncPasswordChecker(QObject *parent = nullptr);
+    ~QXmppAsyncPasswordChecker();
+
+    int maxThreadCount() const;
+    void setMaxThreadCount(int count);
+
+    int maxLookupsPerAddress() const;
+    void setMaxLookupsPerAddress(int count);
+
+    int cacheTimeout() const;
+    void setCacheTimeout(int msecs);
+
+    int negativeCacheTimeout() const;
+    void setNegativeCacheTimeout(int msecs);
+
+    void clearCache();
+    void shutdown();
+
+    QXmppPasswordReply *checkPassword(const QXmppPasswordRequest &request) override;
+    QXmppPasswordReply *getDigest(const QXmppPasswordRequest &request) override;
+    QXmppPasswordReply *getScramKeys(const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm) override;
+    bool hasGetPassword() const override;
+    bool hasGetScramKeys() const override;
+
+private:
+    friend class QXmppAsyncPasswordCheckerPrivate;
+    friend class QXmppAsyncPasswordCheckerOwner;
+    const std::unique_ptr<QXmppAsyncPasswordCheckerPrivate> d;
+};
+
+#endif
@@ -8,30 +8,56 @@
 #include "QXmppConstants_p.h"
 #include "QXmppMessage.h"
 #include "QXmppPasswordChecker.h"
+#include "QXmppPasswordChecker_p.h"
 #include "QXmppSasl_p.h"
 #include "QXmppSessionIq.h"
 #include "QXmppStartTlsPacket.h"
 #include "QXmppStreamFeatures.h"
+#include "QXmppTransport.h"
 #include "QXmppUtils.h"
 
 #include <QDomElement>
+#include <QElapsedTimer>
 #include <QHostAddress>
 #include <QSslKey>
 #include <QSslSocket>
 #include <QTimer>
 
+// Adds an attribute to the start tag of raw stanza data.
+//
+// If the start tag already has the attribute (e.g. with an empty value), the
+// raw data is dropped, so that the stanza is serialized again instead of
+// being forwarded with a duplicate attribute.
+static void insertAttribute(QByteArray &data, const QDomElement &element, const QString &name, const QString &value)
+{
+    const QByteArray startTag = '<' + element.tagName().toUtf8();
+    if (element.hasAttribute(name) || !data.startsWith(startTag)) {
+        data.clear();
+        return;
+    }
+    data.insert(startTag.size(), ' ' + name.toUtf8() + "=\"" + value.toHtmlEscaped().toUtf8() + '"');
+}
+
 class QXmppIncomingClientPrivate
 {
 public:
     QXmppIncomingClientPrivate(QXmppIncomingClient *qq);
     QTimer *idleTimer;
 
+    // compaction of idle streams, the timer is only restarted when it fires
+    QTimer *compactionTimer;
+    int compactionTimeout;
+    QElapsedTimer lastActivity;
+
     QString domain;
     QString jid;
     QString resource;
     QXmppPasswordChecker *passwordChecker;
     QXmppSaslServer *saslServer;
 
+    void init();
+    void recordActivity(bool keepAlive = false);
+    void compactIfIdle();
     void checkCredentials(const QByteArray &response);
     QString origin() const;
 
@@ -40,7 +66,7 @@ private:
 };
 
 QXmppIncomingClientPrivate::QXmppIncomingClientPrivate(QXmppIncomingClient *qq)
-    : idleTimer(nullptr), passwordChecker(nullptr), saslServer(nullptr), q(qq)
+    : idleTimer(nullptr), compactionTimer(nullptr), compactionTimeout(0), passwordChecker(nullptr), saslServer(nullptr), q(qq)
 {
 }
 
@@ -49,6 +75,9 @@ void QXmppIncomingClientPrivate::checkCredentials(const QByteArray &response)
     QXmppPasswordRequest request;
     request.setDomain(domain);
     request.setUsername(saslServer->username());
+    if (auto *socket = q->socket()) {
+        request.setRemoteAddress(socket->peerAddress().toString());
+    }
 
     if (saslServer->mechanism() == "PLAIN") {
         request.setPassword(saslServer->password());
@@ -64,19 +93,76 @@ void QXmppIncomingClientPrivate::checkCredentials(const QByteArray &response)
         reply->setProperty("__sasl_raw", response);
         QObject::connect(reply, &QXmppPasswordReply::finished,
                          q, &QXmppIncomingClient::onDigestReply);
+    } else if (auto *scramServer = dynamic_cast<QXmppSaslServerScram *>(saslServer)) {
+        QXmppPasswordReply *reply = passwordChecker->getScramKeys(request, scramServer->algorithm());
+        reply->setParent(q);
+        reply->setProperty("__sasl_raw", response);
+        QObject::connect(reply, &QXmppPasswordReply::finished,
+                         q, &QXmppIncomingClient::onScramReply);
     }
 }
 
 QString QXmppIncomingClientPrivate::origin() const
 {
-    QSslSocket *socket = q->socket();
-    if (socket) {
-        return socket->peerAddress().toString() + " " + QString::number(socket->peerPort());
+    if (auto *transport = q->transport()) {
+        return transport->peerName();
     } else {
         return "<unknown>";
     }
 }
 
+void QXmppIncomingClientPrivate::init()
+{
+    if (auto *transport = q->transport()) {
+        QObject::connect(transport, &QXmppTransport::disconnected,
+                         q, &QXmppIncomingClient::onSocketDisconnected);
+    }
+    // stanzas to the server are handled locally, only capture routed stanzas
+    q->setRawStanzaCaptureEnabled(true, domain);
+
+    q->info(QString("Incoming client connection from %1").arg(origin()));
+
+    // create inactivity timer
+    idleTimer = new QTimer(q);
+    idleTimer->setSingleShot(true);
+    QObject::connect(idleTimer, &QTimer::timeout,
+                     q, &QXmppIncomingClient::onTimeout);
+
+    // create compaction timer
+    compactionTimer = new QTimer(q);
+    compactionTimer->setSingleShot(true);
+    QObject::connect(compactionTimer, &QTimer::timeout,
+                     q, [this]() { compactIfIdle(); });
+    lastActivity.start();
+}
+
+void QXmppIncomingClientPrivate::recordActivity(bool keepAlive)
+{
+    if (idleTimer->interval()) {
+        idleTimer->start();
+    }
+
+    // whitespace keep-alives don't need any buffers
+    if (keepAlive) {
+        return;
+    }
+    lastActivity.restart();
+    if (compactionTimeout && !compactionTimer->isActive()) {
+        compactionTimer->start(compactionTimeout);
+    }
+}
+
+void QXmppIncomingClientPrivate::compactIfIdle()
+{
+    const auto idle = lastActivity.elapsed();
+    if (idle < compactionTimeout) {
+        compactionTimer->start(int(compactionTimeout - idle));
+        return;
+    }
+
+    q->compactMemory();
+}
+
 /// Constructs a new incoming client stream.
 ///
 /// \param socket The socket for the XMPP stream.
@@ -92,19 +178,32 @@ QXmppIncomingClient::QXmppIncomingClient(QSslSocket *socket, const QString &doma
     d->domain = domain;
 
     if (socket) {
-        connect(socket, &QAbstractSocket::disconnected,
-                this, &QXmppIncomingClient::onSocketDisconnected);
-
         setSocket(socket);
     }
+    d->init();
+}
 
-    info(QString("Incoming client connection from %1").arg(d->origin()));
+///
+/// Constructs a new incoming client stream over an established transport,
+/// for example one end of a QXmppMemoryTransport pair.
+///
+/// The stream takes ownership of the transport.
+///
+/// \param transport The transport for the XMPP stream.
+/// \param domain The local domain.
+/// \param parent The parent QObject for the stream (optional).
+///
+/// \since QXmpp 1.6
+///
+QXmppIncomingClient::QXmppIncomingClient(QXmppTransport *transport, const QString &domain, QObject *parent)
+    : QXmppStream(parent)
+{
+    d = new QXmppIncomingClientPrivate(this);
+    d->domain = domain;
 
-    // create inactivity timer
-    d->idleTimer = new QTimer(this);
-    d->idleTimer->setSingleShot(true);
-    connect(d->idleTimer, &QTimer::timeout,
-            this, &QXmppIncomingClient::onTimeout);
+    transport->setParent(this);
+    setTransport(transport);
+    d->init();
 }
 
 /// Destroys the current stream.
@@ -146,6 +245,21 @@ void QXmppIncomingClient::setInactivityTimeout(int secs)
     }
 }
 
+/// Sets the number of seconds without incoming traffic after which the
+/// stream releases memory it does not need while idle, see
+/// QXmppStream::compactMemory(). A value of 0 disables the compaction.
+///
+/// \since QXmpp 1.6
+
+void QXmppIncomingClient::setCompactionTimeout(int secs)
+{
+    d->compactionTimeout = qMax(0, secs) * 1000;
+    d->compactionTimer->stop();
+    if (d->compactionTimeout) {
+        d->compactionTimer->start(d->compactionTimeout);
+    }
+}
+
 /// Sets the password checker used to verify client credentials.
 ///
 /// \param checker
@@ -159,9 +273,7 @@ void QXmppIncomingClient::setPasswordChecker(QXmppPasswordChecker *checker)
 /// \cond
 void QXmppIncomingClient::handleStream(const QDomElement &streamElement)
 {
-    if (d->idleTimer->interval()) {
-        d->idleTimer->start();
-    }
+    d->recordActivity();
     if (d->saslServer != nullptr) {
         delete d->saslServer;
         d->saslServer = nullptr;
@@ -203,6 +315,10 @@ void QXmppIncomingClient::handleStream(const QDomElement &streamElement)
         features.setSessionMode(QXmppStreamFeatures::Enabled);
     } else if (d->passwordChecker) {
         QStringList mechanisms;
+        if (d->passwordChecker->hasGetScramKeys()) {
+            mechanisms << "SCRAM-SHA-256"
+                       << "SCRAM-SHA-1";
+        }
         mechanisms << "PLAIN";
         if (d->passwordChecker->hasGetPassword()) {
             mechanisms << "DIGEST-MD5";
@@ -216,11 +332,15 @@ void QXmppIncomingClient::handleStanza(const QDomElement &nodeRecv)
 {
     const QString ns = nodeRecv.namespaceURI();
 
-    if (d->idleTimer->interval()) {
-        d->idleTimer->start();
-    }
+    d->recordActivity(nodeRecv.isNull());
 
     if (QXmppStartTlsPacket::isStartTlsPacket(nodeRecv, QXmppStartTlsPacket::StartTls)) {
+        if (!socket()) {
+            // the transport can't be encrypted
+            sendPacket(QXmppStartTlsPacket(QXmppStartTlsPacket::Failure));
+            disconnectFromHost();
+            return;
+        }
         sendPacket(QXmppStartTlsPacket(QXmppStartTlsPacket::Proceed));
         socket()->flush();
         socket()->startServerEncryption();
@@ -276,11 +396,13 @@ void QXmppIncomingClient::handleStanza(const QDomElement &nodeRecv)
             if (result == QXmppSaslServer::InputNeeded) {
                 // check credentials
                 d->checkCredentials(response.value());
+            } else if (result == QXmppSaslServer::Challenge) {
+                sendPacket(QXmppSaslChallenge(challenge));
             } else if (result == QXmppSaslServer::Succeeded) {
                 // authentication succeeded
                 d->jid = QString("%1@%2").arg(d->saslServer->username(), d->domain);
                 info(QString("Authentication succeeded for '%1' from %2").arg(d->jid, d->origin()));
-                Q_EMIT updateCounter("incoming-client.auth.success");
+                reportCounter("incoming-client.auth.success");
                 sendPacket(QXmppSaslSuccess());
                 handleStart();
             } else {
@@ -335,25 +457,28 @@ void QXmppIncomingClient::handleStanza(const QDomElement &nodeRecv)
             nodeRecv.tagName() == QLatin1String("message") ||
             nodeRecv.tagName() == QLatin1String("presence")) {
             QDomElement nodeFull(nodeRecv);
+            QByteArray data = rawStanzaData();
 
             // if the sender is empty, set it to the appropriate JID
             if (nodeFull.attribute("from").isEmpty()) {
-                if (nodeFull.tagName() == QLatin1String("presence") &&
-                    (nodeFull.attribute("type") == QLatin1String("subscribe") ||
-                     nodeFull.attribute("type") == QLatin1String("subscribed"))) {
-                    nodeFull.setAttribute("from", QXmppUtils::jidToBareJid(d->jid));
-                } else {
-                    nodeFull.setAttribute("from", d->jid);
-                }
+                const auto from = nodeFull.tagName() == QLatin1String("presence") &&
+                        (nodeFull.attribute("type") == QLatin1String("subscribe") ||
+                         nodeFull.attribute("type") == QLatin1String("subscribed"))
+                    ? QXmppUtils::jidToBareJid(d->jid)
+                    : d->jid;
+                insertAttribute(data, nodeFull, QStringLiteral("from"), from);
+                nodeFull.setAttribute("from", from);
             }
 
             // if the recipient is empty, set it to the local domain
             if (nodeFull.attribute("to").isEmpty()) {
+                insertAttribute(data, nodeFull, QStringLiteral("to"), d->domain);
                 nodeFull.setAttribute("to", d->domain);
             }
 
             // emit stanza for processing by server
             Q_EMIT elementReceived(nodeFull);
+            Q_EMIT stanzaReceived(nodeFull, data);
         }
     }
 }
@@ -369,7 +494,7 @@ void QXmppIncomingClient::onDigestReply()
 
     if (reply->error() == QXmppPasswordReply::TemporaryError) {
         warning(QString("Temporary authentication failure for '%1' from %2").arg(d->saslServer->username(), d->origin()));
-        Q_EMIT updateCounter("incoming-client.auth.temporary-auth-failure");
+        reportCounter("incoming-client.auth.temporary-auth-failure");
         sendPacket(QXmppSaslFailure("temporary-auth-failure"));
         disconnectFromHost();
         return;
@@ -381,7 +506,7 @@ void QXmppIncomingClient::onDigestReply()
     QXmppSaslServer::Response result = d->saslServer->respond(reply->property("__sasl_raw").toByteArray(), challenge);
     if (result != QXmppSaslServer::Challenge) {
         warning(QString("Authentication failed for '%1' from %2").arg(d->saslServer->username(), d->origin()));
-        Q_EMIT updateCounter("incoming-client.auth.not-authorized");
+        reportCounter("incoming-client.auth.not-authorized");
         sendPacket(QXmppSaslFailure("not-authorized"));
         disconnectFromHost();
         return;
@@ -391,6 +516,47 @@ void QXmppIncomingClient::onDigestReply()
     sendPacket(QXmppSaslChallenge(challenge));
 }
 
+void QXmppIncomingClient::onScramReply()
+{
+    auto *reply = qobject_cast<QXmppPasswordReply *>(sender());
+    auto *scramServer = dynamic_cast<QXmppSaslServerScram *>(d->saslServer);
+    if (!reply || !scramServer) {
+        return;
+    }
+    reply->deleteLater();
+
+    if (reply->error() == QXmppPasswordReply::TemporaryError) {
+        warning(QString("Temporary authentication failure for '%1' from %2").arg(d->saslServer->username(), d->origin()));
+        reportCounter("incoming-client.auth.temporary-auth-failure");
+        sendPacket(QXmppSaslFailure("temporary-auth-failure"));
+        disconnectFromHost();
+        return;
+    }
+
+    // unknown users fail with the client's proof like wrong passwords, so
+    // that they can't be told apart
+    if (reply->error() == QXmppPasswordReply::AuthorizationError) {
+        QXmppPasswordRequest request;
+        request.setDomain(d->domain);
+        request.setUsername(scramServer->username());
+        QXmpp::Private::setFakeScramKeys(reply, request, scramServer->algorithm());
+    }
+
+    QByteArray challenge;
+    scramServer->setKeys(reply->salt(), reply->iterationCount(), reply->storedKey(), reply->serverKey());
+    const auto result = scramServer->respond(reply->property("__sasl_raw").toByteArray(), challenge);
+    if (result != QXmppSaslServer::Challenge) {
+        warning(QString("Authentication failed for '%1' from %2").arg(d->saslServer->username(), d->origin()));
+        reportCounter("incoming-client.auth.not-authorized");
+        sendPacket(QXmppSaslFailure("not-authorized"));
+        disconnectFromHost();
+        return;
+    }
+
+    // send server-first-message
+    sendPacket(QXmppSaslChallenge(challenge));
+}
+
 void QXmppIncomingClient::onPasswordReply()
 {
     auto *reply = qobject_cast<QXmppPasswordReply *>(sender());
@@ -404,19 +570,19 @@ void QXmppIncomingClient::onPasswordReply()
     case QXmppPasswordReply::NoError:
         d->jid = jid;
         info(QString("Authentication succeeded for '%1' from %2").arg(d->jid, d->origin()));
-        Q_EMIT updateCounter("incoming-client.auth.success");
+        reportCounter("incoming-client.auth.success");
         sendPacket(QXmppSaslSuccess());
         handleStart();
         break;
     case QXmppPasswordReply::AuthorizationError:
         warning(QString("Authentication failed for '%1' from %2").arg(jid, d->origin()));
-        Q_EMIT updateCounter("incoming-client.auth.not-authorized");
+        reportCounter("incoming-client.auth.not-authorized");
         sendPacket(QXmppSaslFailure("not-authorized"));
         disconnectFromHost();
         break;
     case QXmppPasswordReply::TemporaryError:
         warning(QString("Temporary authentication failure for '%1' from %2").arg(jid, d->origin()));
-        Q_EMIT updateCounter("incoming-client.auth.temporary-auth-failure");
+        reportCounter("incoming-client.auth.temporary-auth-failure");
         sendPacket(QXmppSaslFailure("temporary-auth-failure"));
         disconnectFromHost();
         break;
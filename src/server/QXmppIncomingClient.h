@@ -23,18 +23,27 @@ class QXMPP_EXPORT QXmppIncomingClient : public QXmppStream
 
 public:
     QXmppIncomingClient(QSslSocket *socket, const QString &domain, QObject *parent = nullptr);
+    QXmppIncomingClient(QXmppTransport *transport, const QString &domain, QObject *parent = nullptr);
     ~QXmppIncomingClient() override;
 
     bool isConnected() const override;
     QString jid() const;
 
     void setInactivityTimeout(int secs);
+    void setCompactionTimeout(int secs);
     void setPasswordChecker(QXmppPasswordChecker *checker);
 
 Q_SIGNALS:
     /// This signal is emitted when an element is received.
     void elementReceived(const QDomElement &element);
 
+    /// This signal is emitted along with elementReceived() and additionally
+    /// carries the stanza's XML as received, which is empty if the stanza
+    /// needs to be serialized again for forwarding.
+    ///
+    /// \since QXmpp 1.6
+    void stanzaReceived(const QDomElement &element, const QByteArray &data);
+
 protected:
     /// \cond
     void handleStream(const QDomElement &element) override;
@@ -44,6 +53,7 @@ protected:
 private Q_SLOTS:
     void onDigestReply();
     void onPasswordReply();
+    void onScramReply();
     void onSocketDisconnected();
     void onTimeout();
 
@@ -6,6 +6,7 @@
 
 #include "QXmppConstants_p.h"
 #include "QXmppDialback.h"
+#include "QXmppIncomingServer_p.h"
 #include "QXmppOutgoingServer.h"
 #include "QXmppStartTlsPacket.h"
 #include "QXmppStreamFeatures.h"
@@ -16,22 +17,67 @@
 #include <QSslKey>
 #include <QSslSocket>
 
-class QXmppIncomingServerPrivate
+namespace QXmpp::Private {
+
+bool DialbackKeyCache::isVerified(const QString &streamId, const QString &domain, const QString &key) const
+{
+    const auto stream = streams.constFind(streamId);
+    return stream != streams.cend() && stream->verified.value(domain) == key;
+}
+
+bool DialbackKeyCache::isPending(const QString &streamId, const QString &domain, const QString &key) const
+{
+    const auto stream = streams.constFind(streamId);
+    return stream != streams.cend() && stream->pending.value(domain).key == key;
+}
+
+void DialbackKeyCache::setPending(const QString &streamId, const QString &domain, const QString &key, QXmppOutgoingServer *verifier)
+{
+    streams[streamId].pending.insert(domain, { key, verifier });
+}
+
+void DialbackKeyCache::setVerified(const QString &streamId, const QString &domain, QXmppOutgoingServer *verifier)
+{
+    const auto stream = streams.find(streamId);
+    if (stream == streams.end()) {
+        return;
+    }
+
+    // only the stream verifying the latest key may mark it as verified
+    const auto pending = stream->pending.find(domain);
+    if (pending != stream->pending.end() && pending->verifier == verifier) {
+        stream->verified.insert(domain, pending->key);
+        stream->pending.erase(pending);
+    }
+}
+
+void DialbackKeyCache::removePending(const QString &streamId, const QString &domain, QXmppOutgoingServer *verifier)
 {
-public:
-    QXmppIncomingServerPrivate(QXmppIncomingServer *qq);
-    QString origin() const;
+    const auto stream = streams.find(streamId);
+    if (stream == streams.end()) {
+        return;
+    }
 
-    QSet<QString> authenticated;
-    QString domain;
-    QString localStreamId;
+    // a newer key may have replaced the one verified by this stream
+    const auto pending = stream->pending.find(domain);
+    if (pending != stream->pending.end() && pending->verifier == verifier) {
+        stream->pending.erase(pending);
+    }
+    if (stream->pending.isEmpty() && stream->verified.isEmpty()) {
+        streams.erase(stream);
+    }
+}
+
+void DialbackKeyCache::removeStream(const QString &streamId)
+{
+    streams.remove(streamId);
+}
 
-private:
-    QXmppIncomingServer *q;
-};
+}  // namespace QXmpp::Private
 
 QXmppIncomingServerPrivate::QXmppIncomingServerPrivate(QXmppIncomingServer *qq)
-    : q(qq)
+    : dialbackKeys(std::make_shared<QXmpp::Private::DialbackKeyCache>()),
+      q(qq)
 {
 }
 
@@ -65,6 +111,8 @@ QXmppIncomingServer::QXmppIncomingServer(QSslSocket *socket, const QString &doma
 
         setSocket(socket);
     }
+    // stanzas to the server are handled locally, only capture routed stanzas
+    setRawStanzaCaptureEnabled(true, domain);
 
     info(QString("Incoming server connection from %1").arg(d->origin()));
 }
@@ -73,6 +121,7 @@ QXmppIncomingServer::QXmppIncomingServer(QSslSocket *socket, const QString &doma
 
 QXmppIncomingServer::~QXmppIncomingServer()
 {
+    d->dialbackKeys->removeStream(d->localStreamId);
     delete d;
 }
 
@@ -92,7 +141,8 @@ void QXmppIncomingServer::handleStream(const QDomElement &streamElement)
         info(QString("Incoming server stream from %1 on %2").arg(from, d->origin()));
     }
 
-    // start stream
+    // start stream, the keys received on a previous stream are not valid anymore
+    d->dialbackKeys->removeStream(d->localStreamId);
     d->localStreamId = QXmppUtils::generateStanzaHash().toLatin1();
     QString data = QString("<?xml version='1.0'?><stream:stream"
                            " xmlns='%1' xmlns:db='%2' xmlns:stream='%3'"
@@ -135,10 +185,30 @@ void QXmppIncomingServer::handleStanza(const QDomElement &stanza)
         if (request.command() == QXmppDialback::Result) {
             debug(QString("Received a dialback result from '%1' on %2").arg(domain, d->origin()));
 
+            // the key was verified for this stream already
+            if (d->dialbackKeys->isVerified(d->localStreamId, domain, request.key())) {
+                QXmppDialback response;
+                response.setCommand(QXmppDialback::Result);
+                response.setTo(domain);
+                response.setFrom(d->domain);
+                response.setType(QStringLiteral("valid"));
+                sendPacket(response);
+                return;
+            }
+
+            // a verification of the key is in progress
+            if (d->dialbackKeys->isPending(d->localStreamId, domain, request.key())) {
+                return;
+            }
+
             // establish dialback connection
             auto *stream = new QXmppOutgoingServer(d->domain, this);
+            d->dialbackKeys->setPending(d->localStreamId, domain, request.key(), stream);
             connect(stream, &QXmppOutgoingServer::dialbackResponseReceived,
                     this, &QXmppIncomingServer::slotDialbackResponseReceived);
+            connect(stream, &QXmppStream::disconnected, this, [this, domain, stream]() {
+                d->dialbackKeys->removePending(d->localStreamId, domain, stream);
+            });
             stream->setVerify(d->localStreamId, request.key());
             stream->connectToHost(domain);
         } else if (request.command() == QXmppDialback::Verify) {
@@ -149,6 +219,7 @@ void QXmppIncomingServer::handleStanza(const QDomElement &stanza)
     } else if (d->authenticated.contains(QXmppUtils::jidToDomain(stanza.attribute("from")))) {
         // relay stanza if the remote party is authenticated
         Q_EMIT elementReceived(stanza);
+        Q_EMIT stanzaReceived(stanza, rawStanzaData());
     } else {
         warning(QString("Received an element from unverified domain '%1' on %2").arg(QXmppUtils::jidToDomain(stanza.attribute("from")), d->origin()));
         disconnectFromHost();
@@ -193,11 +264,13 @@ void QXmppIncomingServer::slotDialbackResponseReceived(const QXmppDialback &dial
         info(QString("Verified incoming domain '%1' on %2").arg(dialback.from(), d->origin()));
         const bool wasConnected = !d->authenticated.isEmpty();
         d->authenticated.insert(dialback.from());
+        d->dialbackKeys->setVerified(d->localStreamId, dialback.from(), stream);
         if (!wasConnected) {
             Q_EMIT connected();
         }
     } else {
         warning(QString("Failed to verify incoming domain '%1' on %2").arg(dialback.from(), d->origin()));
+        d->dialbackKeys->removePending(d->localStreamId, dialback.from(), stream);
         disconnectFromHost();
     }
 
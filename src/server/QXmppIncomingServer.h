@@ -33,6 +33,13 @@ Q_SIGNALS:
     /// This signal is emitted when an element is received.
     void elementReceived(const QDomElement &element);
 
+    /// This signal is emitted along with elementReceived() and additionally
+    /// carries the stanza's XML as received, which is empty if the stanza
+    /// needs to be serialized again for forwarding.
+    ///
+    /// \since QXmpp 1.6
+    void stanzaReceived(const QDomElement &element, const QByteArray &data);
+
 protected:
     /// \cond
     void handleStanza(const QDomElement &stanzaElement) override;
@@ -47,6 +54,7 @@ private:
     Q_DISABLE_COPY(QXmppIncomingServer)
     QXmppIncomingServerPrivate *d;
     friend class QXmppIncomingServerPrivate;
+    friend class QXmppServer;
 };
 
 #endif
@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPINCOMINGSERVER_P_H
+#define QXMPPINCOMINGSERVER_P_H
+
+#include <memory>
+
+#include <QHash>
+#include <QSet>
+#include <QString>
+
+class QXmppIncomingServer;
+class QXmppOutgoingServer;
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.
+//
+// This header file may change from version to version without notice,
+// or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+//
+// Dialback keys received on incoming S2S streams, by local stream id and
+// remote domain. The server shares one cache between its incoming streams.
+//
+class DialbackKeyCache
+{
+public:
+    bool isVerified(const QString &streamId, const QString &domain, const QString &key) const;
+    bool isPending(const QString &streamId, const QString &domain, const QString &key) const;
+    void setPending(const QString &streamId, const QString &domain, const QString &key, QXmppOutgoingServer *verifier);
+    void setVerified(const QString &streamId, const QString &domain, QXmppOutgoingServer *verifier);
+    void removePending(const QString &streamId, const QString &domain, QXmppOutgoingServer *verifier);
+    void removeStream(const QString &streamId);
+
+private:
+    struct PendingKey
+    {
+        QString key;
+        // the stream verifying the key with the authoritative server
+        QXmppOutgoingServer *verifier = nullptr;
+    };
+    struct StreamKeys
+    {
+        QHash<QString, PendingKey> pending;
+        QHash<QString, QString> verified;
+    };
+
+    QHash<QString, StreamKeys> streams;
+};
+
+}  // namespace QXmpp::Private
+
+class QXmppIncomingServerPrivate
+{
+public:
+    QXmppIncomingServerPrivate(QXmppIncomingServer *qq);
+    QString origin() const;
+
+    QSet<QString> authenticated;
+    QString domain;
+    QString localStreamId;
+
+    // shared with the server's other incoming streams if set up by QXmppServer
+    std::shared_ptr<QXmpp::Private::DialbackKeyCache> dialbackKeys;
+
+private:
+    QXmppIncomingServer *q;
+};
+
+#endif
@@ -12,16 +12,38 @@
 
 #include <QDnsLookup>
 #include <QDomElement>
+#include <QElapsedTimer>
 #include <QList>
 #include <QSslError>
 #include <QSslKey>
 #include <QSslSocket>
 #include <QTimer>
 
+// maximum amount of queued data written per event loop iteration
+constexpr qint64 FLUSH_CHUNK_SIZE = 64 * 1024;
+
 class QXmppOutgoingServerPrivate
 {
 public:
-    QList<QByteArray> dataQueue;
+    struct QueuedData
+    {
+        QByteArray data;
+        qint64 deadline;
+        bool droppable;
+    };
+
+    void dropData(QXmppOutgoingServer *q, int index, QXmppStanza::Error::Condition condition);
+    void dropQueue(QXmppOutgoingServer *q);
+    void scheduleFlush(QXmppOutgoingServer *q);
+
+    QList<QueuedData> dataQueue;
+    qint64 queuedBytes = 0;
+    qint64 queueLimit = 1024 * 1024;
+    int queueTimeout = 60000;
+    QElapsedTimer queueClock;
+    QTimer *expiryTimer;
+    bool flushScheduled = false;
+
     QDnsLookup dns;
     QString localDomain;
     QString localStreamKey;
@@ -32,6 +54,32 @@ public:
     bool ready;
 };
 
+void QXmppOutgoingServerPrivate::dropData(QXmppOutgoingServer *q, int index, QXmppStanza::Error::Condition condition)
+{
+    const auto queued = dataQueue.takeAt(index);
+    queuedBytes -= queued.data.size();
+    q->reportCounter(QStringLiteral("outgoing-server.dropped"));
+    Q_EMIT q->queuedDataDropped(queued.data, condition);
+}
+
+// Drops the data which could not be delivered when the connection failed.
+void QXmppOutgoingServerPrivate::dropQueue(QXmppOutgoingServer *q)
+{
+    expiryTimer->stop();
+    while (!dataQueue.isEmpty()) {
+        dropData(q, 0, QXmppStanza::Error::RemoteServerNotFound);
+    }
+}
+
+// Sends the next chunk of queued data in the next event loop iteration.
+void QXmppOutgoingServerPrivate::scheduleFlush(QXmppOutgoingServer *q)
+{
+    if (!dataQueue.isEmpty() && !flushScheduled) {
+        flushScheduled = true;
+        QTimer::singleShot(0, q, &QXmppOutgoingServer::sendQueuedData);
+    }
+}
+
 /// Constructs a new outgoing server-to-server stream.
 ///
 /// \param domain the local domain
@@ -57,6 +105,11 @@ QXmppOutgoingServer::QXmppOutgoingServer(const QString &domain, QObject *parent)
     d->dialbackTimer->setSingleShot(true);
     connect(d->dialbackTimer, &QTimer::timeout, this, &QXmppOutgoingServer::sendDialback);
 
+    d->expiryTimer = new QTimer(this);
+    d->expiryTimer->setSingleShot(true);
+    connect(d->expiryTimer, &QTimer::timeout, this, &QXmppOutgoingServer::dropExpiredData);
+    d->queueClock.start();
+
     d->localDomain = domain;
     d->ready = false;
 
@@ -115,6 +168,7 @@ void QXmppOutgoingServer::_q_dnsLookupFinished()
 void QXmppOutgoingServer::_q_socketDisconnected()
 {
     debug("Socket disconnected");
+    d->dropQueue(this);
     Q_EMIT disconnected();
 }
 
@@ -192,10 +246,8 @@ void QXmppOutgoingServer::handleStanza(const QDomElement &stanza)
                 d->ready = true;
 
                 // send queued data
-                for (const auto &data : std::as_const(d->dataQueue)) {
-                    sendData(data);
-                }
-                d->dataQueue.clear();
+                d->expiryTimer->stop();
+                sendQueuedData();
 
                 // emit signal
                 Q_EMIT connected();
@@ -242,16 +294,92 @@ void QXmppOutgoingServer::setVerify(const QString &id, const QString &key)
     d->verifyKey = key;
 }
 
+/// Returns the maximum size in bytes of the data queued until the stream
+/// is connected.
+///
+/// \since QXmpp 1.6
+
+qint64 QXmppOutgoingServer::queueLimit() const
+{
+    return d->queueLimit;
+}
+
+/// Sets the maximum size in bytes of the data queued until the stream is
+/// connected.
+///
+/// When the limit is reached, queued presences are dropped first. Data that
+/// does not fit is dropped and queuedDataDropped() is emitted.
+///
+/// The default is 1 MiB.
+///
+/// \param bytes
+///
+/// \since QXmpp 1.6
+
+void QXmppOutgoingServer::setQueueLimit(qint64 bytes)
+{
+    d->queueLimit = bytes;
+}
+
+/// Returns the time in milliseconds after which queued data expires.
+///
+/// \since QXmpp 1.6
+
+int QXmppOutgoingServer::queueTimeout() const
+{
+    return d->queueTimeout;
+}
+
+/// Sets the time in milliseconds after which data that could not be sent
+/// expires. Expired data is dropped and queuedDataDropped() is emitted.
+///
+/// The default is 60 seconds.
+///
+/// \param msecs
+///
+/// \since QXmpp 1.6
+
+void QXmppOutgoingServer::setQueueTimeout(int msecs)
+{
+    d->queueTimeout = msecs;
+}
+
 /// Sends or queues data until connected.
 ///
 /// \param data
 
 void QXmppOutgoingServer::queueData(const QByteArray &data)
 {
-    if (isConnected()) {
+    // keep the order with data that is still queued
+    if (isConnected() && d->dataQueue.isEmpty()) {
         sendData(data);
-    } else {
-        d->dataQueue.append(data);
+        return;
+    }
+
+    // make room by dropping presences, which will be outdated soon anyway
+    for (int i = 0; i < d->dataQueue.size() && d->queuedBytes + data.size() > d->queueLimit;) {
+        if (d->dataQueue.at(i).droppable) {
+            d->dropData(this, i, QXmppStanza::Error::ResourceConstraint);
+        } else {
+            ++i;
+        }
+    }
+
+    if (d->queuedBytes + data.size() > d->queueLimit) {
+        warning(QString("Dropping data for %1, the queue is full").arg(d->remoteDomain));
+        reportCounter(QStringLiteral("outgoing-server.dropped"));
+        Q_EMIT queuedDataDropped(data, QXmppStanza::Error::ResourceConstraint);
+        return;
+    }
+
+    d->dataQueue.append({ data, d->queueClock.elapsed() + d->queueTimeout, data.startsWith("<presence") });
+    d->queuedBytes += data.size();
+
+    if (isConnected()) {
+        // sent in order by the scheduled flush
+        d->scheduleFlush(this);
+    } else if (!d->expiryTimer->isActive()) {
+        d->expiryTimer->start(d->queueTimeout);
     }
 }
 
@@ -286,6 +414,40 @@ void QXmppOutgoingServer::sendDialback()
     }
 }
 
+void QXmppOutgoingServer::sendQueuedData()
+{
+    d->flushScheduled = false;
+
+    // write a chunk of data and continue in the next event loop iteration,
+    // so other streams are not blocked by a large queue
+    qint64 written = 0;
+    while (!d->dataQueue.isEmpty() && written < FLUSH_CHUNK_SIZE) {
+        const auto queued = d->dataQueue.takeFirst();
+        d->queuedBytes -= queued.data.size();
+        written += queued.data.size();
+        sendData(queued.data);
+    }
+
+    d->scheduleFlush(this);
+}
+
+void QXmppOutgoingServer::dropExpiredData()
+{
+    if (isConnected()) {
+        return;
+    }
+
+    // data is queued in order, so expired data is at the front
+    const auto now = d->queueClock.elapsed();
+    while (!d->dataQueue.isEmpty() && d->dataQueue.constFirst().deadline <= now) {
+        d->dropData(this, 0, QXmppStanza::Error::RemoteServerTimeout);
+    }
+
+    if (!d->dataQueue.isEmpty()) {
+        d->expiryTimer->start(int(d->dataQueue.constFirst().deadline - now));
+    }
+}
+
 void QXmppOutgoingServer::slotSslErrors(const QList<QSslError> &errors)
 {
     warning("SSL errors");
@@ -298,5 +460,6 @@ void QXmppOutgoingServer::slotSslErrors(const QList<QSslError> &errors)
 void QXmppOutgoingServer::socketError(QAbstractSocket::SocketError error)
 {
     Q_UNUSED(error);
+    d->dropQueue(this);
     Q_EMIT disconnected();
 }
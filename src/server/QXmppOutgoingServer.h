@@ -5,6 +5,7 @@
 #ifndef QXMPPOUTGOINGSERVER_H
 #define QXMPPOUTGOINGSERVER_H
 
+#include "QXmppStanza.h"
 #include "QXmppStream.h"
 
 #include <QAbstractSocket>
@@ -34,10 +35,26 @@ public:
 
     QString remoteDomain() const;
 
+    qint64 queueLimit() const;
+    void setQueueLimit(qint64 bytes);
+    int queueTimeout() const;
+    void setQueueTimeout(int msecs);
+
 Q_SIGNALS:
     /// This signal is emitted when a dialback verify response is received.
     void dialbackResponseReceived(const QXmppDialback &response);
 
+    /// This signal is emitted when queued data is dropped before it could
+    /// be sent, because the queue was full, the data expired or the
+    /// connection failed.
+    ///
+    /// \param data The dropped data.
+    /// \param condition The reason for dropping the data, suitable for an
+    /// error response to the sender.
+    ///
+    /// \since QXmpp 1.6
+    void queuedDataDropped(const QByteArray &data, QXmppStanza::Error::Condition condition);
+
 protected:
     /// \cond
     void handleStart() override;
@@ -53,11 +70,14 @@ private Q_SLOTS:
     void _q_dnsLookupFinished();
     void _q_socketDisconnected();
     void sendDialback();
+    void sendQueuedData();
+    void dropExpiredData();
     void slotSslErrors(const QList<QSslError> &errors);
     void socketError(QAbstractSocket::SocketError error);
 
 private:
     Q_DISABLE_COPY(QXmppOutgoingServer)
+    friend class QXmppOutgoingServerPrivate;
     QXmppOutgoingServerPrivate *const d;
 };
 
@@ -4,15 +4,46 @@
 
 #include "QXmppPasswordChecker.h"
 
+#include "QXmppPasswordChecker_p.h"
+#include "QXmppSasl_p.h"
+#include "QXmppUtils_p.h"
+
 #include <QCryptographicHash>
+#include <QMessageAuthenticationCode>
 #include <QString>
 #include <QTimer>
 
+class QXmppPasswordRequestPrivate : public QSharedData
+{
+public:
+    QString domain;
+    QString password;
+    QString username;
+    QString remoteAddress;
+};
+
+/// Constructs an empty password request.
+
+QXmppPasswordRequest::QXmppPasswordRequest()
+    : d(new QXmppPasswordRequestPrivate)
+{
+}
+
+/// Default copy-constructor
+QXmppPasswordRequest::QXmppPasswordRequest(const QXmppPasswordRequest &) = default;
+/// Default move-constructor
+QXmppPasswordRequest::QXmppPasswordRequest(QXmppPasswordRequest &&) noexcept = default;
+QXmppPasswordRequest::~QXmppPasswordRequest() = default;
+/// Default assignment operator
+QXmppPasswordRequest &QXmppPasswordRequest::operator=(const QXmppPasswordRequest &) = default;
+/// Default move-assignment operator
+QXmppPasswordRequest &QXmppPasswordRequest::operator=(QXmppPasswordRequest &&) noexcept = default;
+
 /// Returns the requested domain.
 
 QString QXmppPasswordRequest::domain() const
 {
-    return m_domain;
+    return d->domain;
 }
 
 /// Sets the requested \a domain.
@@ -21,28 +52,28 @@ QString QXmppPasswordRequest::domain() const
 
 void QXmppPasswordRequest::setDomain(const QString &domain)
 {
-    m_domain = domain;
+    d->domain = domain;
 }
 
 /// Returns the given password.
 
 QString QXmppPasswordRequest::password() const
 {
-    return m_password;
+    return d->password;
 }
 
 /// Sets the given \a password.
 
 void QXmppPasswordRequest::setPassword(const QString &password)
 {
-    m_password = password;
+    d->password = password;
 }
 
 /// Returns the requested username.
 
 QString QXmppPasswordRequest::username() const
 {
-    return m_username;
+    return d->username;
 }
 
 /// Sets the requested \a username.
@@ -51,25 +82,59 @@ QString QXmppPasswordRequest::username() const
 
 void QXmppPasswordRequest::setUsername(const QString &username)
 {
-    m_username = username;
+    d->username = username;
+}
+
+/// Returns the address of the host the request originates from.
+///
+/// \since QXmpp 1.6
+
+QString QXmppPasswordRequest::remoteAddress() const
+{
+    return d->remoteAddress;
+}
+
+/// Sets the address of the host the request originates from.
+///
+/// \param address
+///
+/// \since QXmpp 1.6
+
+void QXmppPasswordRequest::setRemoteAddress(const QString &address)
+{
+    d->remoteAddress = address;
 }
 
+class QXmppPasswordReplyPrivate
+{
+public:
+    QByteArray digest;
+    QString password;
+    QByteArray salt;
+    int iterationCount = 0;
+    QByteArray storedKey;
+    QByteArray serverKey;
+    QXmppPasswordReply::Error error = QXmppPasswordReply::NoError;
+    bool isFinished = false;
+};
+
 /// Constructs a new QXmppPasswordReply.
 ///
 /// \param parent
 
 QXmppPasswordReply::QXmppPasswordReply(QObject *parent)
     : QObject(parent),
-      m_error(QXmppPasswordReply::NoError),
-      m_isFinished(false)
+      d(std::make_unique<QXmppPasswordReplyPrivate>())
 {
 }
 
+QXmppPasswordReply::~QXmppPasswordReply() = default;
+
 /// Returns the received MD5 digest.
 
 QByteArray QXmppPasswordReply::digest() const
 {
-    return m_digest;
+    return d->digest;
 }
 
 /// Sets the received MD5 digest.
@@ -78,7 +143,87 @@ QByteArray QXmppPasswordReply::digest() const
 
 void QXmppPasswordReply::setDigest(const QByteArray &digest)
 {
-    m_digest = digest;
+    d->digest = digest;
+}
+
+/// Returns the salt used to derive the SCRAM keys.
+///
+/// \since QXmpp 1.6
+
+QByteArray QXmppPasswordReply::salt() const
+{
+    return d->salt;
+}
+
+/// Sets the salt used to derive the SCRAM keys.
+///
+/// \param salt
+///
+/// \since QXmpp 1.6
+
+void QXmppPasswordReply::setSalt(const QByteArray &salt)
+{
+    d->salt = salt;
+}
+
+/// Returns the PBKDF2 iteration count used to derive the SCRAM keys.
+///
+/// \since QXmpp 1.6
+
+int QXmppPasswordReply::iterationCount() const
+{
+    return d->iterationCount;
+}
+
+/// Sets the PBKDF2 iteration count used to derive the SCRAM keys.
+///
+/// \param count
+///
+/// \since QXmpp 1.6
+
+void QXmppPasswordReply::setIterationCount(int count)
+{
+    d->iterationCount = count;
+}
+
+/// Returns the SCRAM StoredKey, H(HMAC(SaltedPassword, "Client Key")).
+///
+/// \since QXmpp 1.6
+
+QByteArray QXmppPasswordReply::storedKey() const
+{
+    return d->storedKey;
+}
+
+/// Sets the SCRAM StoredKey, H(HMAC(SaltedPassword, "Client Key")).
+///
+/// \param key
+///
+/// \since QXmpp 1.6
+
+void QXmppPasswordReply::setStoredKey(const QByteArray &key)
+{
+    d->storedKey = key;
+}
+
+/// Returns the SCRAM ServerKey, HMAC(SaltedPassword, "Server Key").
+///
+/// \since QXmpp 1.6
+
+QByteArray QXmppPasswordReply::serverKey() const
+{
+    return d->serverKey;
+}
+
+/// Sets the SCRAM ServerKey, HMAC(SaltedPassword, "Server Key").
+///
+/// \param key
+///
+/// \since QXmpp 1.6
+
+void QXmppPasswordReply::setServerKey(const QByteArray &key)
+{
+    d->serverKey = key;
 }
 
 /// Returns the error that was found during the processing of this request.
@@ -87,21 +232,21 @@ void QXmppPasswordReply::setDigest(const QByteArray &digest)
 
 QXmppPasswordReply::Error QXmppPasswordReply::error() const
 {
-    return m_error;
+    return d->error;
 }
 
 /// Returns the error that was found during the processing of this request.
 ///
 void QXmppPasswordReply::setError(QXmppPasswordReply::Error error)
 {
-    m_error = error;
+    d->error = error;
 }
 
 /// Mark reply as finished.
 
 void QXmppPasswordReply::finish()
 {
-    m_isFinished = true;
+    d->isFinished = true;
     Q_EMIT finished();
 }
 
@@ -116,14 +261,14 @@ void QXmppPasswordReply::finishLater()
 
 bool QXmppPasswordReply::isFinished() const
 {
-    return m_isFinished;
+    return d->isFinished;
 }
 
 /// Returns the received password.
 
 QString QXmppPasswordReply::password() const
 {
-    return m_password;
+    return d->password;
 }
 
 /// Sets the received password.
@@ -132,7 +277,7 @@ QString QXmppPasswordReply::password() const
 
 void QXmppPasswordReply::setPassword(const QString &password)
 {
-    m_password = password;
+    d->password = password;
 }
 
 /// Checks that the given credentials are valid.
@@ -148,7 +293,7 @@ QXmppPasswordReply *QXmppPasswordChecker::checkPassword(const QXmppPasswordReque
     QString secret;
     QXmppPasswordReply::Error error = getPassword(request, secret);
     if (error == QXmppPasswordReply::NoError) {
-        if (request.password() != secret) {
+        if (!QXmpp::Private::constantTimeEquals(request.password().toUtf8(), secret.toUtf8())) {
             reply->setError(QXmppPasswordReply::AuthorizationError);
         }
     } else {
@@ -186,6 +331,54 @@ QXmppPasswordReply *QXmppPasswordChecker::getDigest(const QXmppPasswordRequest &
     return reply;
 }
 
+/// Retrieves the SCRAM keys for the given username (RFC 5802).
+///
+/// The reply contains the salt, the iteration count, the StoredKey and the
+/// ServerKey for the given hash algorithm. Reimplement this method if your
+/// backend stores these, so the server never needs to know the password or
+/// to run the expensive key derivation during login.
+///
+/// The base implementation derives the keys from getPassword(). This runs
+/// PBKDF2 in the calling thread for each login, so it is only used if
+/// hasGetScramKeys() is reimplemented to return true.
+/// QXmppAsyncPasswordChecker derives the keys on its thread pool instead.
+///
+/// \param request
+/// \param algorithm The hash algorithm of the SCRAM mechanism.
+///
+/// \since QXmpp 1.6
+
+QXmppPasswordReply *QXmppPasswordChecker::getScramKeys(const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm)
+{
+    auto *reply = new QXmppPasswordReply;
+
+    QString secret;
+    QXmppPasswordReply::Error error = getPassword(request, secret);
+    if (error == QXmppPasswordReply::NoError) {
+        QXmpp::Private::setScramKeysFromPassword(reply, request, algorithm, secret);
+    } else {
+        reply->setError(error);
+    }
+
+    // reply is finished
+    reply->finishLater();
+    return reply;
+}
+
+/// Returns true if the getScramKeys() method is implemented.
+///
+/// The SCRAM mechanisms are only offered to clients if this returns true.
+///
+/// The base implementation returns false, as deriving the keys from
+/// getPassword() would block the stream for each login.
+///
+/// \since QXmpp 1.6
+
+bool QXmppPasswordChecker::hasGetScramKeys() const
+{
+    return false;
+}
+
 /// Retrieves the password for the given username.
 ///
 /// The simplest way to write a password checker is to reimplement this method.
@@ -207,3 +400,50 @@ bool QXmppPasswordChecker::hasGetPassword() const
 {
     return false;
 }
+
+namespace QXmpp::Private {
+
+// Returns the SCRAM salt of a user.
+//
+// The salt is a keyed hash of the user's address with a random key created
+// for the process, so it can't be precomputed, differs for each user and
+// stays the same across logins.
+QByteArray scramSalt(const QXmppPasswordRequest &request)
+{
+    static const QByteArray key = [] {
+        QByteArray bytes(32, '\0');
+        generateRandomBytes(reinterpret_cast<uint8_t *>(bytes.data()), uint32_t(bytes.size()));
+        return bytes;
+    }();
+    return QMessageAuthenticationCode::hash((request.username() + u'@' + request.domain()).toUtf8(),
+                                            key,
+                                            QCryptographicHash::Sha256)
+        .left(16);
+}
+
+// Derives the SCRAM keys from a plain password.
+void setScramKeysFromPassword(QXmppPasswordReply *reply, const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm, const QString &password)
+{
+    const QByteArray salt = scramSalt(request);
+    const auto keys = deriveScramKeys(algorithm, password.toUtf8(), salt, SCRAM_ITERATIONS);
+
+    reply->setSalt(salt);
+    reply->setIterationCount(SCRAM_ITERATIONS);
+    reply->setStoredKey(keys.storedKey);
+    reply->setServerKey(keys.serverKey);
+}
+
+// Sets keys no password matches, with the salt an existing user would have,
+// so that the authentication of unknown users only fails with the client's
+// proof and they can't be told apart from existing ones.
+void setFakeScramKeys(QXmppPasswordReply *reply, const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm)
+{
+    const auto keySize = uint32_t(QCryptographicHash::hashLength(algorithm));
+
+    reply->setSalt(scramSalt(request));
+    reply->setIterationCount(SCRAM_ITERATIONS);
+    reply->setStoredKey(generateRandomBytes(keySize, keySize + 1));
+    reply->setServerKey(generateRandomBytes(keySize, keySize + 1));
+}
+
+}  // namespace QXmpp::Private
@@ -7,7 +7,14 @@
 
 #include "QXmppGlobal.h"
 
+#include <QCryptographicHash>
 #include <QObject>
+#include <QSharedDataPointer>
+
+#include <memory>
+
+class QXmppPasswordReplyPrivate;
+class QXmppPasswordRequestPrivate;
 
 /// \brief The QXmppPasswordRequest class represents a password request.
 ///
@@ -19,6 +26,9 @@ public:
         CheckPassword = 0
     };
 
+    QXmppPasswordRequest();
+    QXMPP_PRIVATE_DECLARE_RULE_OF_SIX(QXmppPasswordRequest)
+
     QString domain() const;
     void setDomain(const QString &domain);
 
@@ -28,10 +38,11 @@ public:
     QString username() const;
     void setUsername(const QString &username);
 
+    QString remoteAddress() const;
+    void setRemoteAddress(const QString &address);
+
 private:
-    QString m_domain;
-    QString m_password;
-    QString m_username;
+    QSharedDataPointer<QXmppPasswordRequestPrivate> d;
 };
 
 /// \brief The QXmppPasswordReply class represents a password reply.
@@ -49,6 +60,7 @@ public:
     };
 
     QXmppPasswordReply(QObject *parent = nullptr);
+    ~QXmppPasswordReply() override;
 
     QByteArray digest() const;
     void setDigest(const QByteArray &digest);
@@ -56,6 +68,18 @@ public:
     QString password() const;
     void setPassword(const QString &password);
 
+    QByteArray salt() const;
+    void setSalt(const QByteArray &salt);
+
+    int iterationCount() const;
+    void setIterationCount(int count);
+
+    QByteArray storedKey() const;
+    void setStoredKey(const QByteArray &key);
+
+    QByteArray serverKey() const;
+    void setServerKey(const QByteArray &key);
+
     QXmppPasswordReply::Error error() const;
     void setError(QXmppPasswordReply::Error error);
 
@@ -70,10 +94,7 @@ Q_SIGNALS:
     void finished();
 
 private:
-    QByteArray m_digest;
-    QString m_password;
-    QXmppPasswordReply::Error m_error;
-    bool m_isFinished;
+    const std::unique_ptr<QXmppPasswordReplyPrivate> d;
 };
 
 /// \brief The QXmppPasswordChecker class represents an abstract password checker.
@@ -86,6 +107,9 @@ public:
     virtual QXmppPasswordReply *getDigest(const QXmppPasswordRequest &request);
     virtual bool hasGetPassword() const;
 
+    virtual QXmppPasswordReply *getScramKeys(const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm);
+    virtual bool hasGetScramKeys() const;
+
 protected:
     virtual QXmppPasswordReply::Error getPassword(const QXmppPasswordRequest &request, QString &password);
 };
@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPPASSWORDCHECKER_P_H
+#define QXMPPPASSWORDCHECKER_P_H
+
+#include <QCryptographicHash>
+
+class QString;
+class QXmppPasswordReply;
+class QXmppPasswordRequest;
+
+//
+//  W A R N I N G
+//  -------------
+//
+// This file is not part of the QXmpp API.
+//
+// This header file may change from version to version without notice,
+// or even be removed.
+//
+// We mean it.
+//
+
+namespace QXmpp::Private {
+
+// iteration count of the SCRAM keys derived by QXmpp
+constexpr int SCRAM_ITERATIONS = 4096;
+
+QByteArray scramSalt(const QXmppPasswordRequest &request);
+void setScramKeysFromPassword(QXmppPasswordReply *reply, const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm, const QString &password);
+void setFakeScramKeys(QXmppPasswordReply *reply, const QXmppPasswordRequest &request, QCryptographicHash::Algorithm algorithm);
+
+}  // namespace QXmpp::Private
+
+#endif  // QXMPPPASSWORDCHECKER_P_H
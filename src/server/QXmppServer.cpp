@@ -8,21 +8,55 @@
 #include "QXmppDialback.h"
 #include "QXmppIncomingClient.h"
 #include "QXmppIncomingServer.h"
+#include "QXmppIncomingServer_p.h"
 #include "QXmppIq.h"
+#include "QXmppMemoryTransport.h"
 #include "QXmppOutgoingServer.h"
 #include "QXmppPresence.h"
 #include "QXmppServerExtension.h"
 #include "QXmppServerPlugin.h"
 #include "QXmppUtils.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <optional>
+#include <utility>
+
 #include <QCoreApplication>
+#include <QDomDocument>
 #include <QDomElement>
+#include <QDir>
+#include <QFile>
 #include <QFileInfo>
+#include <QMutex>
 #include <QPluginLoader>
+#include <QReadWriteLock>
 #include <QSslCertificate>
 #include <QSslConfiguration>
 #include <QSslKey>
 #include <QSslSocket>
+#include <QThread>
+#include <QTimer>
+#include <QVarLengthArray>
+
+#if defined(Q_OS_UNIX)
+#include <cstring>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#if defined(SO_REUSEPORT)
+#define QXMPP_HAS_REUSEPORT
+#endif
+#endif
+
+// interval of the memory accounting passes in milliseconds
+constexpr int DEFAULT_ACCOUNTING_INTERVAL = 10000;
+// number of connections listed in the memory statistics
+constexpr int LARGEST_CONNECTION_COUNT = 10;
+// seconds without traffic after which client streams release spare memory
+constexpr int DEFAULT_IDLE_COMPACTION_TIMEOUT = 60;
 
 static void helperToXmlAddDomElement(QXmlStreamWriter *stream, const QDomElement &element, const QStringList &omitNamespaces)
 {
@@ -52,20 +86,343 @@ static void helperToXmlAddDomElement(QXmlStreamWriter *stream, const QDomElement
     stream->writeEndElement();
 }
 
+#ifdef QXMPP_HAS_REUSEPORT
+// Opens a listening TCP socket which shares its address with other sockets
+// through SO_REUSEPORT, so that the kernel balances connections across them.
+static qintptr openReusePortSocket(const QHostAddress &address, quint16 port)
+{
+    sockaddr_storage storage;
+    std::memset(&storage, 0, sizeof(storage));
+    socklen_t length;
+    int family;
+
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        auto *sin = reinterpret_cast<sockaddr_in *>(&storage);
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sin->sin_addr.s_addr = htonl(address.toIPv4Address());
+        family = AF_INET;
+        length = sizeof(sockaddr_in);
+    } else {
+        // IPv6, or dual-stack for QHostAddress::Any
+        auto *sin6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        if (address.protocol() == QAbstractSocket::IPv6Protocol) {
+            const Q_IPV6ADDR ip6 = address.toIPv6Address();
+            std::memcpy(&sin6->sin6_addr, &ip6, sizeof(ip6));
+        }
+        family = AF_INET6;
+        length = sizeof(sockaddr_in6);
+    }
+
+    const int fd = ::socket(family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int enable = 1;
+    const int v6only = address.protocol() == QAbstractSocket::IPv6Protocol ? 1 : 0;
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ||
+        (family == AF_INET6 && ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) ||
+        ::bind(fd, reinterpret_cast<sockaddr *>(&storage), length) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+// Lock-free multi-producer single-consumer queue (Dmitry Vyukov's algorithm)
+template<typename T>
+class MpscQueue
+{
+public:
+    MpscQueue()
+        : m_tail(new Node)
+    {
+        m_head.store(m_tail);
+    }
+
+    ~MpscQueue()
+    {
+        while (pop()) {
+        }
+        delete m_tail;
+    }
+
+    // may be called from any thread
+    void push(T &&value)
+    {
+        auto *node = new Node;
+        node->value = std::move(value);
+        auto *prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // must only be called from the consumer thread
+    std::optional<T> pop()
+    {
+        auto *next = m_tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return std::nullopt;
+        }
+        std::optional<T> value(std::move(next->value));
+        delete m_tail;
+        m_tail = next;
+        return value;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next { nullptr };
+        T value;
+    };
+
+    std::atomic<Node *> m_head;
+    Node *m_tail;
+};
+
+// Event loop thread hosting a share of the server's client connections.
+//
+// Streams are handed over to the worker and commands are delivered to them
+// through a lock-free mailbox, which is drained in the worker thread.
+class QXmppServerWorker
+{
+public:
+    enum Command {
+        Adopt,
+        SendData,
+        Disconnect,
+    };
+
+    explicit QXmppServerWorker(int index);
+    ~QXmppServerWorker();
+
+    void adopt(quint64 id, QXmppStream *stream);
+    void post(quint64 id, Command command, const QByteArray &data = {});
+
+    // Runs a function in the worker thread and waits for it to finish.
+    // Must not be called from the worker thread.
+    template<typename Function>
+    void run(Function &&function)
+    {
+        QMetaObject::invokeMethod(m_context, std::forward<Function>(function), Qt::BlockingQueuedConnection);
+    }
+
+    QThread *thread() { return &m_thread; }
+
+    // number of assigned connections
+    std::atomic<int> load { 0 };
+
+private:
+    struct Mail
+    {
+        quint64 id = 0;
+        Command command = SendData;
+        QByteArray data;
+        QXmppStream *stream = nullptr;
+    };
+
+    void push(Mail &&mail);
+    void drain();
+
+    QThread m_thread;
+    QObject *m_context;
+    MpscQueue<Mail> m_mailbox;
+    std::atomic<bool> m_drainScheduled { false };
+    // streams owned by this worker, only accessed from the worker thread
+    QHash<quint64, QXmppStream *> m_streams;
+};
+
+QXmppServerWorker::QXmppServerWorker(int index)
+    : m_context(new QObject)
+{
+    m_thread.setObjectName(QStringLiteral("QXmppServerWorker-%1").arg(index));
+    m_context->moveToThread(&m_thread);
+    m_thread.start();
+}
+
+QXmppServerWorker::~QXmppServerWorker()
+{
+    // deliver pending commands and destroy the remaining streams in their thread
+    QMetaObject::invokeMethod(
+        m_context, [this]() {
+            drain();
+            const auto streams = std::exchange(m_streams, {});
+            qDeleteAll(streams);
+        },
+        Qt::BlockingQueuedConnection);
+
+    m_thread.quit();
+    m_thread.wait();
+    delete m_context;
+}
+
+// Moves the stream to the worker thread. Must be called from the stream's thread,
+// which may be the worker thread itself.
+void QXmppServerWorker::adopt(quint64 id, QXmppStream *stream)
+{
+    stream->moveToThread(&m_thread);
+    push({ id, Adopt, {}, stream });
+}
+
+// Delivers a command to a stream of this worker. May be called from any thread.
+void QXmppServerWorker::post(quint64 id, Command command, const QByteArray &data)
+{
+    push({ id, command, data, nullptr });
+}
+
+void QXmppServerWorker::push(Mail &&mail)
+{
+    m_mailbox.push(std::move(mail));
+
+    // wake up the worker unless a drain is pending already
+    if (!m_drainScheduled.exchange(true)) {
+        QMetaObject::invokeMethod(m_context, [this]() { drain(); }, Qt::QueuedConnection);
+    }
+}
+
+void QXmppServerWorker::drain()
+{
+    m_drainScheduled.store(false);
+
+    while (auto mail = m_mailbox.pop()) {
+        switch (mail->command) {
+        case Adopt:
+            m_streams.insert(mail->id, mail->stream);
+            QObject::connect(mail->stream, &QObject::destroyed, m_context, [this, id = mail->id]() {
+                m_streams.remove(id);
+            });
+            break;
+        case SendData:
+            if (auto *stream = m_streams.value(mail->id)) {
+                stream->sendData(mail->data);
+            }
+            break;
+        case Disconnect:
+            if (auto *stream = m_streams.value(mail->id)) {
+                stream->disconnectFromHost();
+            }
+            break;
+        }
+    }
+}
+
+// Returns the index of a stanza type in the dispatch index, or -1.
+static int stanzaTypeIndex(const QString &tagName)
+{
+    if (tagName == QLatin1String("iq")) {
+        return 0;
+    } else if (tagName == QLatin1String("message")) {
+        return 1;
+    } else if (tagName == QLatin1String("presence")) {
+        return 2;
+    }
+    return -1;
+}
+
+static QXmppServerExtension::Target stanzaTarget(const QString &to, const QString &domain)
+{
+    if (to.isEmpty() || to == domain) {
+        return QXmppServerExtension::ServerTarget;
+    } else if (QXmppUtils::jidToDomain(to) == domain) {
+        return QXmppServerExtension::LocalTarget;
+    }
+    return QXmppServerExtension::RemoteTarget;
+}
+
+// A node of a stanza, to find out whether an extension modified a stanza whose
+// XML as received is about to be forwarded. The strings are shared with the
+// document, so taking a snapshot doesn't copy any text.
+struct StanzaNode
+{
+    // the QDomNode::NodeType, or -1 for the end of an element
+    int type;
+    QString name;
+    QString namespaceUri;
+    QString value;
+
+    bool operator==(const StanzaNode &other) const
+    {
+        return type == other.type && name == other.name && namespaceUri == other.namespaceUri && value == other.value;
+    }
+    bool operator!=(const StanzaNode &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+using StanzaSnapshot = QVarLengthArray<StanzaNode, 32>;
+
+static void snapshotStanza(const QDomElement &element, StanzaSnapshot &snapshot)
+{
+    snapshot.append({ QDomNode::ElementNode, element.tagName(), element.namespaceURI(), {} });
+    const auto attributes = element.attributes();
+    for (int i = 0; i < attributes.length(); ++i) {
+        const auto attribute = attributes.item(i);
+        snapshot.append({ QDomNode::AttributeNode, attribute.nodeName(), attribute.namespaceURI(), attribute.nodeValue() });
+    }
+    for (auto child = element.firstChild(); !child.isNull(); child = child.nextSibling()) {
+        if (child.isElement()) {
+            snapshotStanza(child.toElement(), snapshot);
+        } else {
+            snapshot.append({ child.nodeType(), child.nodeName(), {}, child.nodeValue() });
+        }
+    }
+    snapshot.append({ -1, {}, {}, {} });
+}
+
 class QXmppServerPrivate
 {
 public:
     QXmppServerPrivate(QXmppServer *qq);
     void loadExtensions(QXmppServer *server);
+    void buildDispatchIndex();
     bool routeData(const QString &to, const QByteArray &data);
+    void bounceData(const QByteArray &data, QXmppStanza::Error::Condition condition);
+    void handleStanza(const QDomElement &element, const QByteArray &data);
+    void sendToClient(QXmppIncomingClient *stream, const QByteArray &data);
+    void disconnectClient(QXmppIncomingClient *stream);
+    void setupClient(QXmppIncomingClient *stream);
+    void clientConnected(QXmppIncomingClient *stream, const QString &jid);
+    void insertClient(QXmppIncomingClient *stream);
+    void startWorkers();
+    QXmppServerWorker *nextWorker();
+    void assignWorker(QXmppIncomingClient *stream, QXmppServerWorker *worker);
+    bool listenForClientsOnWorkers(const QHostAddress &address, quint16 port);
+    void acceptClient(QSslSocket *socket, QXmppServerWorker *worker);
+    void closeWorkerListeners();
+    template<typename Function>
+    void forEachSslServer(Function function);
     void startExtensions();
     void stopExtensions();
+    void accountMemory();
+    void accountClientMemory(QXmppIncomingClient *stream, quint64 id);
+    void closeOverMemoryLimit(QXmppIncomingClient *stream);
+    QXmppStream::MemoryUsage clientMemoryTotals() const;
+    QVariantMap memoryStatistics() const;
 
     void info(const QString &message);
     void warning(const QString &message);
 
     QString domain;
     QList<QXmppServerExtension *> extensions;
+
+    // extensions by stanza type (iq, message, presence) and payload namespace,
+    // in priority order, rebuilt when extensions are added
+    struct DispatchEntry
+    {
+        QXmppServerExtension *extension = nullptr;
+        int order = 0;
+        QXmppServerExtension::Targets targets;
+    };
+    std::array<QHash<QString, QVector<DispatchEntry>>, 3> dispatchIndex;
+    bool dispatchIndexValid;
+
     QXmppLogger *logger;
     QXmppPasswordChecker *passwordChecker;
 
@@ -73,12 +430,62 @@ public:
     QSet<QXmppIncomingClient *> incomingClients;
     QHash<QString, QXmppIncomingClient *> incomingClientsByJid;
     QHash<QString, QSet<QXmppIncomingClient *>> incomingClientsByBareJid;
+    // the JIDs the connected streams were routed under, streams in worker
+    // threads must not be queried from the server thread
+    QHash<QXmppIncomingClient *, QString> incomingClientJids;
     QSet<QXmppSslServer *> serversForClients;
 
+    // worker threads
+    struct WorkerSlot
+    {
+        QXmppServerWorker *worker = nullptr;
+        quint64 id = 0;
+    };
+    int workerThreadCount;
+    QList<QXmppServerWorker *> workers;
+    QHash<QXmppIncomingClient *, WorkerSlot> workerSlots;
+    quint64 lastStreamId;
+    // one SO_REUSEPORT listener per worker, living in the worker's thread
+    struct WorkerListener
+    {
+        QXmppServerWorker *worker = nullptr;
+        QXmppSslServer *server = nullptr;
+    };
+    bool reusePortEnabled;
+    QList<WorkerListener> workerListeners;
+    // guards the client routing tables, which are only modified in the server
+    // thread, and the worker slots, which are added by the worker threads
+    QReadWriteLock routingLock;
+
+    // recording of the client streams
+    QString captureDirectory;
+    std::atomic<quint64> captureCount;
+
+    // memory accounting, the usage of each client stream is reported from
+    // the stream's thread under the stream's accounting id
+    struct ClientMemoryUsage
+    {
+        QString jid;
+        QXmppStream::MemoryUsage usage;
+    };
+    QTimer *accountingTimer;
+    int accountingInterval;
+    int idleCompactionTimeout;
+    std::atomic<qint64> connectionMemoryLimit;
+    QHash<QXmppIncomingClient *, quint64> accountingIds;
+    quint64 lastAccountingId;
+    mutable QMutex accountingLock;
+    // ids of the connected streams, reports for other ids are dropped
+    QSet<quint64> accountedClients;
+    QHash<quint64, ClientMemoryUsage> clientMemoryUsage;
+
     // server-to-server
     QSet<QXmppIncomingServer *> incomingServers;
     QSet<QXmppOutgoingServer *> outgoingServers;
+    QHash<QString, QXmppOutgoingServer *> outgoingServersByDomain;
     QSet<QXmppSslServer *> serversForServers;
+    // dialback keys of the incoming streams, shared as they outlive the server
+    std::shared_ptr<QXmpp::Private::DialbackKeyCache> dialbackKeys;
 
     // ssl
     QList<QSslCertificate> caCertificates;
@@ -92,8 +499,19 @@ private:
 };
 
 QXmppServerPrivate::QXmppServerPrivate(QXmppServer *qq)
-    : logger(nullptr),
+    : dispatchIndexValid(false),
+      logger(nullptr),
       passwordChecker(nullptr),
+      workerThreadCount(0),
+      lastStreamId(0),
+      reusePortEnabled(false),
+      captureCount(0),
+      accountingTimer(nullptr),
+      accountingInterval(DEFAULT_ACCOUNTING_INTERVAL),
+      idleCompactionTimeout(DEFAULT_IDLE_COMPACTION_TIMEOUT),
+      connectionMemoryLimit(0),
+      lastAccountingId(0),
+      dialbackKeys(std::make_shared<QXmpp::Private::DialbackKeyCache>()),
       loaded(false),
       started(false),
       q(qq)
@@ -115,6 +533,8 @@ bool QXmppServerPrivate::routeData(const QString &to, const QByteArray &data)
     }
 
     if (toDomain == domain) {
+        QReadLocker locker(&routingLock);
+
         // look for a client connection
         QList<QXmppIncomingClient *> found;
         if (QXmppUtils::jidToResource(to).isEmpty()) {
@@ -131,19 +551,24 @@ bool QXmppServerPrivate::routeData(const QString &to, const QByteArray &data)
 
         // send data
         for (auto *conn : std::as_const(found)) {
-            QMetaObject::invokeMethod(conn, "sendData", Q_ARG(QByteArray, data));
+            sendToClient(conn, data);
         }
         return !found.isEmpty();
 
     } else if (!serversForServers.isEmpty()) {
 
+        // S2S streams are only handled in the server thread
+        if (QThread::currentThread() != q->thread()) {
+            QMetaObject::invokeMethod(
+                q, [this, to, data]() { routeData(to, data); }, Qt::QueuedConnection);
+            return true;
+        }
+
         // look for an outgoing S2S connection
-        for (auto *conn : std::as_const(outgoingServers)) {
-            if (conn->remoteDomain() == toDomain) {
-                // send or queue data
-                QMetaObject::invokeMethod(conn, "queueData", Q_ARG(QByteArray, data));
-                return true;
-            }
+        if (auto *conn = outgoingServersByDomain.value(toDomain)) {
+            // send or queue data
+            conn->queueData(data);
+            return true;
         }
 
         // if we did not find an outgoing server,
@@ -155,14 +580,19 @@ bool QXmppServerPrivate::routeData(const QString &to, const QByteArray &data)
 
         QObject::connect(conn, &QXmppStream::disconnected,
                          q, &QXmppServer::_q_outgoingServerDisconnected);
+        QObject::connect(conn, &QXmppOutgoingServer::queuedDataDropped,
+                         q, [this](const QByteArray &data, QXmppStanza::Error::Condition condition) {
+                             bounceData(data, condition);
+                         });
 
         // add stream
         outgoingServers.insert(conn);
-        Q_EMIT q->setGauge("outgoing-server.count", outgoingServers.size());
+        outgoingServersByDomain.insert(toDomain, conn);
+        q->reportGauge("outgoing-server.count", outgoingServers.size());
 
         // queue data and connect to remote server
-        QMetaObject::invokeMethod(conn, "queueData", Q_ARG(QByteArray, data));
-        QMetaObject::invokeMethod(conn, "connectToHost", Q_ARG(QString, toDomain));
+        conn->queueData(data);
+        conn->connectToHost(toDomain);
         return true;
 
     } else {
@@ -172,25 +602,552 @@ bool QXmppServerPrivate::routeData(const QString &to, const QByteArray &data)
     }
 }
 
-/// Handles an incoming XML element.
+/// Replies to an IQ request which could not be delivered to a remote server.
+///
+/// \param data
+/// \param condition
+
+void QXmppServerPrivate::bounceData(const QByteArray &data, QXmppStanza::Error::Condition condition)
+{
+    QDomDocument doc;
+    if (!doc.setContent(data) || doc.documentElement().tagName() != QLatin1String("iq")) {
+        return;
+    }
+
+    QXmppIq request;
+    request.parse(doc.documentElement());
+    if (request.type() == QXmppIq::Error || request.type() == QXmppIq::Result) {
+        return;
+    }
+
+    QXmppIq response(QXmppIq::Error);
+    response.setId(request.id());
+    response.setFrom(request.to());
+    response.setTo(request.from());
+    response.setError(QXmppStanza::Error(QXmppStanza::Error::Cancel, condition));
+    q->sendPacket(response);
+}
+
+/// Sends data to a client stream, possibly living in a worker thread.
+///
+/// The routing lock must be held, as the worker slots are modified by
+/// worker threads.
 ///
-/// \param server
 /// \param stream
-/// \param element
+/// \param data
+///
+
+void QXmppServerPrivate::sendToClient(QXmppIncomingClient *stream, const QByteArray &data)
+{
+    if (const auto slot = workerSlots.value(stream); slot.worker) {
+        slot.worker->post(slot.id, QXmppServerWorker::SendData, data);
+    } else if (QThread::currentThread() != stream->thread()) {
+        QMetaObject::invokeMethod(
+            stream, [stream, data]() { stream->sendData(data); }, Qt::QueuedConnection);
+    } else {
+        stream->sendData(data);
+    }
+}
+
+/// Disconnects a client stream, possibly living in a worker thread.
+///
+/// The routing lock must not be held, as streams in the server thread are
+/// removed from the routing tables synchronously.
+///
+/// \param stream
+///
+
+void QXmppServerPrivate::disconnectClient(QXmppIncomingClient *stream)
+{
+    WorkerSlot slot;
+    {
+        QReadLocker locker(&routingLock);
+        slot = workerSlots.value(stream);
+    }
+
+    if (slot.worker) {
+        slot.worker->post(slot.id, QXmppServerWorker::Disconnect);
+    } else {
+        stream->disconnectFromHost();
+    }
+}
+
+/// Connects the signals of a new client stream to the server.
+///
+/// This is thread-safe, the stream may live in a worker thread.
+///
+/// \param stream
+
+void QXmppServerPrivate::setupClient(QXmppIncomingClient *stream)
+{
+    stream->setPasswordChecker(passwordChecker);
+    stream->setCompactionTimeout(idleCompactionTimeout);
+    stream->setReceiveBufferLimit(connectionMemoryLimit);
+
+    if (!captureDirectory.isEmpty()) {
+        // the file is a child of the stream, so that it follows it to its thread
+        const auto number = captureCount.fetch_add(1) + 1;
+        auto *file = new QFile(QDir(captureDirectory).filePath(QStringLiteral("client-%1.qxcap").arg(number)), stream);
+        if (file->open(QIODevice::WriteOnly)) {
+            stream->setCaptureDevice(file);
+        } else {
+            q->log(QXmppLogger::WarningMessage,
+                   QStringLiteral("Could not open capture file %1").arg(file->fileName()));
+            delete file;
+        }
+    }
+
+    // the JID is read in the stream's thread and passed to the server thread
+    QObject::connect(stream, &QXmppStream::connected, stream, [this, stream]() {
+        const auto jid = stream->jid();
+        if (QThread::currentThread() == q->thread()) {
+            clientConnected(stream, jid);
+        } else {
+            QMetaObject::invokeMethod(
+                q, [this, stream, jid]() { clientConnected(stream, jid); }, Qt::QueuedConnection);
+        }
+    });
+
+    QObject::connect(stream, &QXmppStream::disconnected,
+                     q, &QXmppServer::_q_clientDisconnected);
+
+    QObject::connect(stream, &QXmppIncomingClient::stanzaReceived,
+                     q, &QXmppServer::_q_stanzaReceived);
+
+    // checked on every read, between the accounting passes
+    QObject::connect(stream, &QXmppStream::receiveBufferLimitExceeded, stream, [this, stream]() {
+        closeOverMemoryLimit(stream);
+    });
+}
+
+/// Handles a successful stream connection for a client. Must be called from
+/// the server thread.
+///
+/// \param stream
+/// \param jid the JID of the stream, read in the stream's thread
+
+void QXmppServerPrivate::clientConnected(QXmppIncomingClient *stream, const QString &jid)
+{
+    // the stream may have disconnected while the call was queued
+    if (!incomingClients.contains(stream)) {
+        return;
+    }
+
+    // check whether the connection conflicts with another one
+    QXmppIncomingClient *old = incomingClientsByJid.value(jid);
+    if (old && old != stream) {
+        {
+            QReadLocker locker(&routingLock);
+            sendToClient(old, "<stream:error><conflict xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams'>Replaced by new connection</text></stream:error>");
+        }
+        disconnectClient(old);
+    }
+
+    {
+        QWriteLocker locker(&routingLock);
+        incomingClientJids.insert(stream, jid);
+        incomingClientsByJid.insert(jid, stream);
+        incomingClientsByBareJid[QXmppUtils::jidToBareJid(jid)].insert(stream);
+    }
+
+    // emit signal
+    Q_EMIT q->clientConnected(jid);
+}
+
+/// Adds a client stream to the server's streams. Must be called from the
+/// server thread.
+///
+/// \param stream
+
+void QXmppServerPrivate::insertClient(QXmppIncomingClient *stream)
+{
+    incomingClients.insert(stream);
+    q->reportGauge("incoming-client.count", incomingClients.size());
+
+    const auto id = ++lastAccountingId;
+    accountingIds.insert(stream, id);
+    {
+        QMutexLocker locker(&accountingLock);
+        accountedClients.insert(id);
+    }
 
-static void handleStanza(QXmppServer *server, const QDomElement &element)
+    if (accountingInterval > 0 && !accountingTimer->isActive()) {
+        accountingTimer->start(accountingInterval);
+    }
+}
+
+/// Measures the memory used by the client streams.
+///
+/// Each stream is measured in its own thread, and disconnected if it
+/// exceeds the connection memory limit. The totals of the latest
+/// measurements and the memory used by the extensions are reported as
+/// gauges.
+
+void QXmppServerPrivate::accountMemory()
 {
-    // try extensions
-    const auto &extensions = server->extensions();
+    for (auto it = accountingIds.cbegin(); it != accountingIds.cend(); ++it) {
+        // runs directly for streams in the server thread
+        QMetaObject::invokeMethod(it.key(), [this, stream = it.key(), id = it.value()]() {
+            accountClientMemory(stream, id);
+        });
+    }
+
+    const auto totals = clientMemoryTotals();
+    q->reportGauge("incoming-client.memory.receive-buffers", totals.receiveBuffer);
+    q->reportGauge("incoming-client.memory.unacknowledged-stanzas", totals.unacknowledgedStanzas);
+    q->reportGauge("incoming-client.memory.pending-outbound", totals.pendingOutbound);
+    q->reportGauge("incoming-client.memory.running-iqs", totals.runningIqs);
+    q->reportGauge("incoming-client.memory.total", totals.total());
+
+    for (auto *extension : std::as_const(extensions)) {
+        const auto bytes = extension->memoryUsage();
+        if (bytes >= 0) {
+            q->reportGauge(QStringLiteral("extension.memory.") + extension->extensionName(), bytes);
+        }
+    }
+}
+
+/// Measures the memory used by a client stream. Must be called from the
+/// stream's thread.
+///
+/// \param stream
+/// \param id The accounting id of the stream, the measurement is dropped if
+/// the stream disconnected in the meantime.
+
+void QXmppServerPrivate::accountClientMemory(QXmppIncomingClient *stream, quint64 id)
+{
+    const auto usage = stream->memoryUsage();
+    stream->reportValue("incoming-client.memory", usage.total());
+    {
+        QMutexLocker locker(&accountingLock);
+        if (accountedClients.contains(id)) {
+            clientMemoryUsage.insert(id, { stream->jid(), usage });
+        }
+    }
+
+    const auto limit = connectionMemoryLimit.load(std::memory_order_relaxed);
+    if (limit > 0 && usage.total() > limit) {
+        closeOverMemoryLimit(stream);
+    }
+}
+
+/// Closes a client stream exceeding the connection memory limit. Must be
+/// called from the stream's thread.
+///
+/// \param stream
+
+void QXmppServerPrivate::closeOverMemoryLimit(QXmppIncomingClient *stream)
+{
+    const auto limit = connectionMemoryLimit.load(std::memory_order_relaxed);
+    stream->log(QXmppLogger::WarningMessage, QStringLiteral("Disconnecting '%1' using %2 bytes, the limit is %3 bytes").arg(stream->jid(), QString::number(stream->memoryUsage().total()), QString::number(limit)));
+    stream->reportCounter("incoming-client.memory-limit-exceeded");
+    stream->sendData("<stream:error><resource-constraint xmlns='urn:ietf:params:xml:ns:xmpp-streams'/></stream:error>");
+    stream->disconnectFromHost();
+}
+
+/// Returns the sum of the memory used by the client streams as of the last
+/// accounting pass.
+
+QXmppStream::MemoryUsage QXmppServerPrivate::clientMemoryTotals() const
+{
+    QXmppStream::MemoryUsage totals;
+    QMutexLocker locker(&accountingLock);
+    for (const auto &client : clientMemoryUsage) {
+        totals.receiveBuffer += client.usage.receiveBuffer;
+        totals.unacknowledgedStanzas += client.usage.unacknowledgedStanzas;
+        totals.pendingOutbound += client.usage.pendingOutbound;
+        totals.runningIqs += client.usage.runningIqs;
+        totals.runningIqCount += client.usage.runningIqCount;
+    }
+    return totals;
+}
+
+/// Returns the memory statistics of the last accounting pass and of the
+/// extensions.
+
+QVariantMap QXmppServerPrivate::memoryStatistics() const
+{
+    const auto totals = clientMemoryTotals();
+    QVector<ClientMemoryUsage> connections;
+    {
+        QMutexLocker locker(&accountingLock);
+        for (const auto &client : clientMemoryUsage) {
+            connections << client;
+        }
+    }
+
+    // list the connections using the most memory first
+    const auto count = std::min<qsizetype>(connections.size(), LARGEST_CONNECTION_COUNT);
+    std::partial_sort(connections.begin(), connections.begin() + count, connections.end(), [](const auto &a, const auto &b) {
+        return a.usage.total() > b.usage.total();
+    });
+    QVariantList largestConnections;
+    for (qsizetype i = 0; i < count; ++i) {
+        const auto &connection = connections.at(i);
+        largestConnections << QVariantMap {
+            { "jid", connection.jid },
+            { "receive-buffer", connection.usage.receiveBuffer },
+            { "unacknowledged-stanzas", connection.usage.unacknowledgedStanzas },
+            { "pending-outbound", connection.usage.pendingOutbound },
+            { "running-iqs", connection.usage.runningIqs },
+            { "running-iq-count", connection.usage.runningIqCount },
+            { "total", connection.usage.total() },
+        };
+    }
+
+    QVariantMap extensionUsage;
     for (auto *extension : extensions) {
-        if (extension->handleStanza(element)) {
-            return;
+        const auto bytes = extension->memoryUsage();
+        if (bytes >= 0) {
+            extensionUsage.insert(extension->extensionName(), bytes);
         }
     }
 
-    // default handlers
-    const QString domain = server->domain();
+    return {
+        { "receive-buffers", totals.receiveBuffer },
+        { "unacknowledged-stanzas", totals.unacknowledgedStanzas },
+        { "pending-outbound", totals.pendingOutbound },
+        { "running-iqs", totals.runningIqs },
+        { "running-iq-count", totals.runningIqCount },
+        { "total", totals.total() },
+        { "largest-connections", largestConnections },
+        { "extensions", extensionUsage },
+    };
+}
+
+/// Starts the worker threads unless they are running already.
+
+void QXmppServerPrivate::startWorkers()
+{
+    if (workers.isEmpty()) {
+        for (int i = 0; i < workerThreadCount; ++i) {
+            workers << new QXmppServerWorker(i);
+        }
+    }
+}
+
+/// Returns the least loaded worker thread or nullptr if connections are
+/// handled in the server thread.
+
+QXmppServerWorker *QXmppServerPrivate::nextWorker()
+{
+    startWorkers();
+    if (workers.isEmpty()) {
+        return nullptr;
+    }
+
+    return *std::min_element(workers.cbegin(), workers.cend(), [](auto *a, auto *b) {
+        return a->load < b->load;
+    });
+}
+
+/// Hands a new client stream over to a worker thread.
+///
+/// This must be called from the stream's thread.
+///
+/// \param stream
+/// \param worker
+
+void QXmppServerPrivate::assignWorker(QXmppIncomingClient *stream, QXmppServerWorker *worker)
+{
+    // the stream has no parent, so it uses the server's logging sink explicitly
+    stream->setLoggingParent(q);
+
+    QWriteLocker locker(&routingLock);
+    const auto id = ++lastStreamId;
+    workerSlots.insert(stream, { worker, id });
+    worker->load++;
+    worker->adopt(id, stream);
+}
+
+/// Opens one listening socket per worker thread on the same address using
+/// SO_REUSEPORT, so that the kernel distributes the incoming connections.
+///
+/// \param address
+/// \param port
+
+bool QXmppServerPrivate::listenForClientsOnWorkers(const QHostAddress &address, quint16 port)
+{
+#ifdef QXMPP_HAS_REUSEPORT
+    startWorkers();
+
+    QList<WorkerListener> listeners;
+    bool ok = true;
+    for (auto *worker : std::as_const(workers)) {
+        const qintptr fd = openReusePortSocket(address, port);
+        if (fd < 0) {
+            ok = false;
+            break;
+        }
+
+        auto *server = new QXmppSslServer;
+        server->addCaCertificates(caCertificates);
+        server->setLocalCertificate(localCertificate);
+        server->setPrivateKey(privateKey);
+        server->moveToThread(worker->thread());
+        listeners << WorkerListener { worker, server };
+
+        worker->run([this, worker, server, fd, &ok]() {
+            if (!server->setSocketDescriptor(fd)) {
+                ::close(fd);
+                ok = false;
+                return;
+            }
+            QObject::connect(server, &QXmppSslServer::newConnection, server, [this, worker](QSslSocket *socket) {
+                acceptClient(socket, worker);
+            });
+        });
+        if (!ok) {
+            break;
+        }
+
+        // with an ephemeral port, the other listeners share the first one's port
+        port = server->serverPort();
+    }
+
+    if (!ok) {
+        for (const auto &listener : std::as_const(listeners)) {
+            listener.worker->run([server = listener.server]() { delete server; });
+        }
+        return false;
+    }
+
+    workerListeners += listeners;
+    return true;
+#else
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    return false;
+#endif
+}
+
+/// Creates a client stream for a connection accepted by a worker's listener.
+/// This is called from the worker thread.
+///
+/// \param socket
+/// \param worker
+
+void QXmppServerPrivate::acceptClient(QSslSocket *socket, QXmppServerWorker *worker)
+{
+    // check the socket didn't die since the signal was emitted
+    if (socket->state() != QAbstractSocket::ConnectedState) {
+        delete socket;
+        return;
+    }
+
+    auto *stream = new QXmppIncomingClient(socket, domain, nullptr);
+    stream->setInactivityTimeout(120);
+    socket->setParent(stream);
+    setupClient(stream);
+    assignWorker(stream, worker);
+
+    // queued before any signal of the stream can reach the server thread
+    QMetaObject::invokeMethod(
+        q, [this, stream]() { insertClient(stream); }, Qt::QueuedConnection);
+}
+
+/// Closes and destroys the listeners running in worker threads.
+
+void QXmppServerPrivate::closeWorkerListeners()
+{
+    for (const auto &listener : std::as_const(workerListeners)) {
+        listener.worker->run([server = listener.server]() {
+            server->close();
+            delete server;
+        });
+    }
+    workerListeners.clear();
+}
+
+/// Calls a function for each listening server, in the server's thread.
+///
+/// \param function
+
+template<typename Function>
+void QXmppServerPrivate::forEachSslServer(Function function)
+{
+    for (auto *server : std::as_const(serversForClients)) {
+        function(server);
+    }
+    for (auto *server : std::as_const(serversForServers)) {
+        function(server);
+    }
+    for (const auto &listener : std::as_const(workerListeners)) {
+        listener.worker->run([&function, server = listener.server]() { function(server); });
+    }
+}
+
+/// Handles an incoming XML element.
+///
+/// \param element
+/// \param data The element's XML as received, which is forwarded verbatim if
+/// the element needs to be routed and no extension modified it. If empty, the
+/// element is serialized again.
+
+void QXmppServerPrivate::handleStanza(const QDomElement &element, const QByteArray &data)
+{
+    auto *server = q;
     const QString to = element.attribute("to");
+    QByteArray rawData = data;
+
+    // try the extensions whose filters match, in priority order
+    if (!dispatchIndexValid) {
+        buildDispatchIndex();
+    }
+    const int type = stanzaTypeIndex(element.tagName());
+    if (type >= 0) {
+        const auto &handlers = dispatchIndex[type];
+        QVarLengthArray<DispatchEntry, 16> candidates;
+        const auto addCandidates = [&](const QString &xmlns) {
+            const auto itr = handlers.constFind(xmlns);
+            if (itr != handlers.constEnd()) {
+                for (const auto &entry : *itr) {
+                    candidates.append(entry);
+                }
+            }
+        };
+        addCandidates(QString());
+        QString lastXmlns;
+        for (auto child = element.firstChildElement(); !child.isNull(); child = child.nextSiblingElement()) {
+            const QString xmlns = child.namespaceURI();
+            if (!xmlns.isEmpty() && xmlns != lastXmlns) {
+                addCandidates(xmlns);
+                lastXmlns = xmlns;
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [](const DispatchEntry &a, const DispatchEntry &b) {
+            return a.order < b.order;
+        });
+
+        // extensions may modify the stanza in place, which the received XML
+        // doesn't reflect
+        const auto target = stanzaTarget(to, domain);
+        StanzaSnapshot snapshot;
+        if (!rawData.isEmpty() && target != QXmppServerExtension::ServerTarget && !candidates.isEmpty()) {
+            snapshotStanza(element, snapshot);
+        }
+
+        int lastOrder = -1;
+        for (const auto &entry : std::as_const(candidates)) {
+            if (entry.order == lastOrder || !(entry.targets & target)) {
+                continue;
+            }
+            lastOrder = entry.order;
+            if (entry.extension->handleStanza(element)) {
+                return;
+            }
+        }
+
+        if (!snapshot.isEmpty()) {
+            StanzaSnapshot current;
+            snapshotStanza(element, current);
+            if (current != snapshot) {
+                rawData.clear();
+            }
+        }
+    }
+
+    // default handlers
     if (to == domain) {
         if (element.tagName() == QLatin1String("iq")) {
             // we do not support the given IQ
@@ -212,7 +1169,8 @@ static void handleStanza(QXmppServer *server, const QDomElement &element)
     } else {
 
         // route element or reply on behalf of missing peer
-        if (!server->sendElement(element) && element.tagName() == QLatin1String("iq")) {
+        const bool routed = rawData.isEmpty() ? server->sendElement(element) : routeData(to, rawData);
+        if (!routed && element.tagName() == QLatin1String("iq")) {
             QXmppIq request;
             request.parse(element);
 
@@ -242,6 +1200,29 @@ void QXmppServerPrivate::warning(const QString &message)
     }
 }
 
+/// Indexes the stanza filters of the server's extensions.
+
+void QXmppServerPrivate::buildDispatchIndex()
+{
+    loadExtensions(q);
+
+    for (auto &handlers : dispatchIndex) {
+        handlers.clear();
+    }
+    for (int i = 0; i < extensions.size(); ++i) {
+        auto *extension = extensions[i];
+        const auto filters = extension->stanzaFilters();
+        for (const auto &filter : filters) {
+            for (int type = 0; type < int(dispatchIndex.size()); ++type) {
+                if (filter.types & QXmppServerExtension::StanzaType(1 << type)) {
+                    dispatchIndex[type][filter.xmlns].append({ extension, i, filter.targets });
+                }
+            }
+        }
+    }
+    dispatchIndexValid = true;
+}
+
 /// Load the server's extensions.
 ///
 /// \param server
@@ -300,6 +1281,9 @@ QXmppServer::QXmppServer(QObject *parent)
     : QXmppLoggable(parent), d(new QXmppServerPrivate(this))
 {
     qRegisterMetaType<QDomElement>("QDomElement");
+
+    d->accountingTimer = new QTimer(this);
+    connect(d->accountingTimer, &QTimer::timeout, this, [this]() { d->accountMemory(); });
 }
 
 /// Destroys an XMPP server instance.
@@ -308,6 +1292,9 @@ QXmppServer::QXmppServer(QObject *parent)
 QXmppServer::~QXmppServer()
 {
     close();
+
+    // stops the worker threads and destroys the streams they host
+    qDeleteAll(d->workers);
     delete d;
 }
 
@@ -323,6 +1310,7 @@ void QXmppServer::addExtension(QXmppServerExtension *extension)
     d->info(QString("Added extension %1").arg(extension->extensionName()));
     extension->setParent(this);
     extension->setServer(this);
+    d->dispatchIndexValid = false;
 
     // keep extensions sorted by priority
     for (int i = 0; i < d->extensions.size(); ++i) {
@@ -373,24 +1361,8 @@ QXmppLogger *QXmppServer::logger()
 void QXmppServer::setLogger(QXmppLogger *logger)
 {
     if (logger != d->logger) {
-        if (d->logger) {
-            disconnect(this, &QXmppLoggable::logMessage,
-                       d->logger, &QXmppLogger::log);
-            disconnect(this, &QXmppLoggable::setGauge,
-                       d->logger, &QXmppLogger::setGauge);
-            disconnect(this, &QXmppLoggable::updateCounter,
-                       d->logger, &QXmppLogger::updateCounter);
-        }
-
         d->logger = logger;
-        if (d->logger) {
-            connect(this, &QXmppLoggable::logMessage,
-                    d->logger, &QXmppLogger::log);
-            connect(this, &QXmppLoggable::setGauge,
-                    d->logger, &QXmppLogger::setGauge);
-            connect(this, &QXmppLoggable::updateCounter,
-                    d->logger, &QXmppLogger::updateCounter);
-        }
+        setLoggingSink(logger);
 
         Q_EMIT loggerChanged(d->logger);
     }
@@ -414,7 +1386,191 @@ void QXmppServer::setPasswordChecker(QXmppPasswordChecker *checker)
     d->passwordChecker = checker;
 }
 
+/// Returns the number of worker threads used for client connections.
+///
+/// \since QXmpp 1.6
+
+int QXmppServer::workerThreadCount() const
+{
+    return d->workerThreadCount;
+}
+
+/// Sets the number of worker threads used for client connections.
+///
+/// By default all connections are handled in the server's thread. With worker
+/// threads, accepted client connections are distributed across the workers,
+/// each running its own event loop, so parsing and writing stream data scales
+/// with the number of cores. Routing and the server extensions keep running in
+/// the server's thread. Data is delivered to the connections through lock-free
+/// per-worker mailboxes.
+///
+/// When using worker threads the password checker must be thread-safe, as it
+/// is called from the worker threads.
+///
+/// This must be set before the server starts listening.
+///
+/// \param count The number of worker threads, zero disables worker threads.
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setWorkerThreadCount(int count)
+{
+    if (!d->workers.isEmpty()) {
+        d->warning("Cannot change the worker thread count while workers are running");
+        return;
+    }
+    d->workerThreadCount = qMax(0, count);
+}
+
+/// Returns whether each worker thread accepts client connections on its own
+/// listening socket.
+///
+/// \since QXmpp 1.6
+
+bool QXmppServer::isReusePortEnabled() const
+{
+    return d->reusePortEnabled;
+}
+
+/// Sets whether each worker thread accepts client connections on its own
+/// listening socket.
+///
+/// When enabled and worker threads are used, listenForClients() opens one
+/// socket per worker thread on the same address using SO_REUSEPORT. The
+/// kernel then balances incoming connections across the sockets, so that
+/// accepting connections and the TLS handshakes of reconnect storms are
+/// spread across all cores instead of passing through the server's thread.
+///
+/// This is only supported on platforms providing SO_REUSEPORT and must be set
+/// before the server starts listening.
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setReusePortEnabled(bool enabled)
+{
+#ifdef QXMPP_HAS_REUSEPORT
+    d->reusePortEnabled = enabled;
+#else
+    if (enabled) {
+        d->warning("SO_REUSEPORT is not supported on this platform");
+    }
+#endif
+}
+
+/// Returns the directory in which the client streams are recorded.
+///
+/// \since QXmpp 1.6
+
+QString QXmppServer::captureDirectory() const
+{
+    return d->captureDirectory;
+}
+
+/// Sets the directory in which the client streams are recorded.
+///
+/// When set, the traffic of each client stream accepted afterwards is written
+/// to a file "client-<n>.qxcap" in this directory, see QXmppStreamCapture.
+/// The captures can be replayed against a server with the qxmpp-replay tool.
+///
+/// Captures contain the unencrypted traffic including credentials, so they
+/// should only be enabled for testing.
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setCaptureDirectory(const QString &path)
+{
+    d->captureDirectory = path;
+}
+
+/// Returns the per-connection memory limit in bytes, 0 if there is none.
+///
+/// \since QXmpp 1.6
+
+qint64 QXmppServer::connectionMemoryLimit() const
+{
+    return d->connectionMemoryLimit;
+}
+
+/// Sets the per-connection memory limit in bytes, 0 disables the limit.
+///
+/// Client connections whose buffers and queues exceed the limit at a memory
+/// accounting pass are closed with a resource-constraint stream error, see
+/// setMemoryAccountingInterval(). The receive buffer of a connection is also
+/// checked whenever data is received, so that a single unterminated stanza
+/// can't exceed the limit between two passes.
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setConnectionMemoryLimit(qint64 bytes)
+{
+    d->connectionMemoryLimit = qMax<qint64>(0, bytes);
+    for (auto *stream : std::as_const(d->incomingClients)) {
+        QMetaObject::invokeMethod(stream, [stream, bytes = d->connectionMemoryLimit.load()]() {
+            stream->setReceiveBufferLimit(bytes);
+        });
+    }
+}
+
+/// Returns the interval of the memory accounting passes in milliseconds.
+///
+/// \since QXmpp 1.6
+
+int QXmppServer::memoryAccountingInterval() const
+{
+    return d->accountingInterval;
+}
+
+/// Sets the interval of the memory accounting passes in milliseconds, 0
+/// disables the accounting. The default is 10 seconds.
+///
+/// Each pass measures the memory held by the client streams in their
+/// threads, enforces the connection memory limit and reports the totals
+/// as "incoming-client.memory.*" gauges. The per-connection sizes are
+/// reported in the "incoming-client.memory" histogram.
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setMemoryAccountingInterval(int msecs)
+{
+    d->accountingInterval = qMax(0, msecs);
+    if (d->accountingInterval == 0) {
+        d->accountingTimer->stop();
+    } else if (!d->incomingClients.isEmpty()) {
+        d->accountingTimer->start(d->accountingInterval);
+    }
+}
+
+/// Returns the number of seconds without incoming traffic after which
+/// client streams release spare memory.
+///
+/// \since QXmpp 1.6
+
+int QXmppServer::idleCompactionTimeout() const
+{
+    return d->idleCompactionTimeout;
+}
+
+/// Sets the number of seconds without incoming traffic after which client
+/// streams release spare memory, 0 disables the compaction. The default is
+/// 60 seconds.
+///
+/// Whitespace keep-alives don't count as traffic, so the sessions of idle
+/// mobile clients are compacted as well. The setting applies to client
+/// streams accepted afterwards, see QXmppIncomingClient::setCompactionTimeout().
+///
+/// \since QXmpp 1.6
+
+void QXmppServer::setIdleCompactionTimeout(int secs)
+{
+    d->idleCompactionTimeout = qMax(0, secs);
+}
+
 /// Returns the statistics for the server.
+///
+/// Besides the connection counts, the "memory" entry contains the memory
+/// used by the client streams as of the last memory accounting pass: the
+/// totals per kind of buffer, the connections using the most memory and
+/// the memory reported by the extensions, see QXmppServerExtension::memoryUsage().
 
 QVariantMap QXmppServer::statistics() const
 {
@@ -423,6 +1579,7 @@ QVariantMap QXmppServer::statistics() const
     stats["incoming-clients"] = d->incomingClients.size();
     stats["incoming-servers"] = d->incomingServers.size();
     stats["outgoing-servers"] = d->outgoingServers.size();
+    stats["memory"] = d->memoryStatistics();
     return stats;
 }
 
@@ -443,12 +1600,9 @@ void QXmppServer::addCaCertificates(const QString &path)
     }
 
     // reconfigure servers
-    for (auto *server : std::as_const(d->serversForClients)) {
-        server->addCaCertificates(d->caCertificates);
-    }
-    for (auto *server : std::as_const(d->serversForServers)) {
+    d->forEachSslServer([this](QXmppSslServer *server) {
         server->addCaCertificates(d->caCertificates);
-    }
+    });
 }
 
 /// Sets the path for the local SSL certificate.
@@ -470,12 +1624,9 @@ void QXmppServer::setLocalCertificate(const QString &path)
     }
 
     // reconfigure servers
-    for (auto *server : std::as_const(d->serversForClients)) {
+    d->forEachSslServer([this](QXmppSslServer *server) {
         server->setLocalCertificate(d->localCertificate);
-    }
-    for (auto *server : std::as_const(d->serversForServers)) {
-        server->setLocalCertificate(d->localCertificate);
-    }
+    });
 }
 
 ///
@@ -490,12 +1641,9 @@ void QXmppServer::setLocalCertificate(const QSslCertificate &certificate)
     d->localCertificate = certificate;
 
     // reconfigure servers
-    for (auto *server : std::as_const(d->serversForClients)) {
-        server->setLocalCertificate(d->localCertificate);
-    }
-    for (auto *server : std::as_const(d->serversForServers)) {
+    d->forEachSslServer([this](QXmppSslServer *server) {
         server->setLocalCertificate(d->localCertificate);
-    }
+    });
 }
 
 /// Sets the path for the local SSL private key.
@@ -517,12 +1665,9 @@ void QXmppServer::setPrivateKey(const QString &path)
     }
 
     // reconfigure servers
-    for (auto *server : std::as_const(d->serversForClients)) {
-        server->setPrivateKey(d->privateKey);
-    }
-    for (auto *server : std::as_const(d->serversForServers)) {
+    d->forEachSslServer([this](QXmppSslServer *server) {
         server->setPrivateKey(d->privateKey);
-    }
+    });
 }
 
 ///
@@ -537,12 +1682,9 @@ void QXmppServer::setPrivateKey(const QSslKey &key)
     d->privateKey = key;
 
     // reconfigure servers
-    for (auto *server : std::as_const(d->serversForClients)) {
+    d->forEachSslServer([this](QXmppSslServer *server) {
         server->setPrivateKey(d->privateKey);
-    }
-    for (auto *server : std::as_const(d->serversForServers)) {
-        server->setPrivateKey(d->privateKey);
-    }
+    });
 }
 
 /// Listen for incoming XMPP client connections.
@@ -560,22 +1702,30 @@ bool QXmppServer::listenForClients(const QHostAddress &address, quint16 port)
         return false;
     }
 
-    // create new server
-    auto *server = new QXmppSslServer(this);
-    server->addCaCertificates(d->caCertificates);
-    server->setLocalCertificate(d->localCertificate);
-    server->setPrivateKey(d->privateKey);
+    if (d->reusePortEnabled && d->workerThreadCount > 0) {
+        // accept connections directly in the worker threads
+        if (!d->listenForClientsOnWorkers(address, port)) {
+            d->warning(QString("Could not start listening for C2S on %1 %2").arg(address.toString(), QString::number(port)));
+            return false;
+        }
+    } else {
+        // create new server
+        auto *server = new QXmppSslServer(this);
+        server->addCaCertificates(d->caCertificates);
+        server->setLocalCertificate(d->localCertificate);
+        server->setPrivateKey(d->privateKey);
 
-    check = connect(server, SIGNAL(newConnection(QSslSocket *)),
-                    this, SLOT(_q_clientConnection(QSslSocket *)));
-    Q_ASSERT(check);
+        check = connect(server, SIGNAL(newConnection(QSslSocket *)),
+                        this, SLOT(_q_clientConnection(QSslSocket *)));
+        Q_ASSERT(check);
 
-    if (!server->listen(address, port)) {
-        d->warning(QString("Could not start listening for C2S on %1 %2").arg(address.toString(), QString::number(port)));
-        delete server;
-        return false;
+        if (!server->listen(address, port)) {
+            d->warning(QString("Could not start listening for C2S on %1 %2").arg(address.toString(), QString::number(port)));
+            delete server;
+            return false;
+        }
+        d->serversForClients.insert(server);
     }
-    d->serversForClients.insert(server);
 
     // start extensions
     d->loadExtensions(this);
@@ -583,6 +1733,37 @@ bool QXmppServer::listenForClients(const QHostAddress &address, quint16 port)
     return true;
 }
 
+///
+/// Connects a client to the server without a socket.
+///
+/// The server end of a new QXmppMemoryTransport pair is handled like an
+/// incoming TCP connection, the returned client end can be passed to
+/// QXmppClient::connectToServer(). The caller takes ownership of it.
+///
+/// Extensions are started if the server is not listening yet, so the server
+/// can be used in memory only, for example in tests and benchmarks.
+///
+/// \since QXmpp 1.6
+///
+QXmppMemoryTransport *QXmppServer::connectInMemory()
+{
+    d->loadExtensions(this);
+    d->startExtensions();
+
+    auto [clientEnd, serverEnd] = QXmppMemoryTransport::createPair();
+
+    // streams handled by a worker thread can't have a parent in the server thread
+    auto *worker = d->nextWorker();
+    auto *stream = new QXmppIncomingClient(serverEnd, d->domain, worker ? nullptr : this);
+    stream->setInactivityTimeout(120);
+    addIncomingClient(stream);
+
+    if (worker) {
+        d->assignWorker(stream, worker);
+    }
+    return clientEnd;
+}
+
 /// Closes the server.
 ///
 
@@ -599,14 +1780,15 @@ void QXmppServer::close()
     qDeleteAll(d->serversForServers);
     d->serversForClients.clear();
     d->serversForServers.clear();
+    d->closeWorkerListeners();
 
     // stop extensions
     d->stopExtensions();
 
-    // close XMPP streams
-    QSetIterator<QXmppIncomingClient *> itr(d->incomingClients);
-    while (itr.hasNext()) {
-        itr.next()->disconnectFromHost();
+    // close XMPP streams, they are removed from the set while iterating
+    const auto incomingClients = d->incomingClients;
+    for (auto *stream : incomingClients) {
+        d->disconnectClient(stream);
     }
     for (auto *stream : std::as_const(d->incomingServers)) {
         stream->disconnectFromHost();
@@ -656,6 +1838,8 @@ bool QXmppServer::listenForServers(const QHostAddress &address, quint16 port)
 
 /// Route an XMPP stanza.
 ///
+/// When using worker threads, this may be called from any thread.
+///
 /// \param element
 
 bool QXmppServer::sendElement(const QDomElement &element)
@@ -672,6 +1856,8 @@ bool QXmppServer::sendElement(const QDomElement &element)
 
 /// Route an XMPP packet.
 ///
+/// When using worker threads, this may be called from any thread.
+///
 /// \param packet
 
 bool QXmppServer::sendPacket(const QXmppStanza &packet)
@@ -685,6 +1871,23 @@ bool QXmppServer::sendPacket(const QXmppStanza &packet)
     return d->routeData(packet.to(), data);
 }
 
+/// Routes already serialized XMPP data to the given recipient.
+///
+/// The data may contain several stanzas, which are then delivered to each
+/// connection of the recipient with a single write.
+///
+/// When using worker threads, this may be called from any thread.
+///
+/// \param to The recipient's JID, a bare JID addresses all its connections.
+/// \param data
+///
+/// \since QXmpp 1.6
+
+bool QXmppServer::sendData(const QString &to, const QByteArray &data)
+{
+    return d->routeData(to, data);
+}
+
 /// Add a new incoming client \a stream.
 ///
 /// This method can be used for instance to implement BOSH support
@@ -692,21 +1895,30 @@ bool QXmppServer::sendPacket(const QXmppStanza &packet)
 
 void QXmppServer::addIncomingClient(QXmppIncomingClient *stream)
 {
+    d->setupClient(stream);
 
-    stream->setPasswordChecker(d->passwordChecker);
-
-    connect(stream, &QXmppStream::connected,
-            this, &QXmppServer::_q_clientConnected);
-
-    connect(stream, &QXmppStream::disconnected,
-            this, &QXmppServer::_q_clientDisconnected);
+    // add stream
+    d->insertClient(stream);
+}
 
-    connect(stream, &QXmppIncomingClient::elementReceived,
-            this, &QXmppServer::handleElement);
+/// Returns whether a client with the given JID is connected.
+///
+/// For a bare JID, this returns whether any resource of the user is
+/// connected.
+///
+/// When using worker threads, this may be called from any thread.
+///
+/// \param jid
+///
+/// \since QXmpp 1.6
 
-    // add stream
-    d->incomingClients.insert(stream);
-    Q_EMIT setGauge("incoming-client.count", d->incomingClients.size());
+bool QXmppServer::hasClientConnection(const QString &jid) const
+{
+    QReadLocker locker(&d->routingLock);
+    if (QXmppUtils::jidToResource(jid).isEmpty()) {
+        return d->incomingClientsByBareJid.contains(jid);
+    }
+    return d->incomingClientsByJid.contains(jid);
 }
 
 /// Handle a new incoming TCP connection from a client.
@@ -721,36 +1933,16 @@ void QXmppServer::_q_clientConnection(QSslSocket *socket)
         return;
     }
 
-    auto *stream = new QXmppIncomingClient(socket, d->domain, this);
+    // streams handled by a worker thread can't have a parent in the server thread
+    auto *worker = d->nextWorker();
+    auto *stream = new QXmppIncomingClient(socket, d->domain, worker ? nullptr : this);
     stream->setInactivityTimeout(120);
     socket->setParent(stream);
     addIncomingClient(stream);
-}
-
-/// Handle a successful stream connection for a client.
-///
-
-void QXmppServer::_q_clientConnected()
-{
-    auto *client = qobject_cast<QXmppIncomingClient *>(sender());
-    if (!client) {
-        return;
-    }
-
-    // FIXME: at this point the JID must contain a resource, assert it?
-    const QString jid = client->jid();
 
-    // check whether the connection conflicts with another one
-    QXmppIncomingClient *old = d->incomingClientsByJid.value(jid);
-    if (old && old != client) {
-        old->sendData("<stream:error><conflict xmlns='urn:ietf:params:xml:ns:xmpp-streams'/><text xmlns='urn:ietf:params:xml:ns:xmpp-streams'>Replaced by new connection</text></stream:error>");
-        old->disconnectFromHost();
+    if (worker) {
+        d->assignWorker(stream, worker);
     }
-    d->incomingClientsByJid.insert(jid, client);
-    d->incomingClientsByBareJid[QXmppUtils::jidToBareJid(jid)].insert(client);
-
-    // emit signal
-    Q_EMIT clientConnected(jid);
 }
 
 /// Handle a stream disconnection for a client.
@@ -763,8 +1955,10 @@ void QXmppServer::_q_clientDisconnected()
     }
 
     if (d->incomingClients.remove(client)) {
+        QWriteLocker locker(&d->routingLock);
+
         // remove stream from routing tables
-        const QString jid = client->jid();
+        const QString jid = d->incomingClientJids.take(client);
         if (!jid.isEmpty()) {
             if (d->incomingClientsByJid.value(jid) == client) {
                 d->incomingClientsByJid.remove(jid);
@@ -777,6 +1971,10 @@ void QXmppServer::_q_clientDisconnected()
                 }
             }
         }
+        if (const auto slot = d->workerSlots.take(client); slot.worker) {
+            slot.worker->load--;
+        }
+        locker.unlock();
 
         // destroy client
         client->deleteLater();
@@ -787,7 +1985,15 @@ void QXmppServer::_q_clientDisconnected()
         }
 
         // update counter
-        Q_EMIT setGauge("incoming-client.count", d->incomingClients.size());
+        reportGauge("incoming-client.count", d->incomingClients.size());
+
+        const auto id = d->accountingIds.take(client);
+        QMutexLocker accountingLocker(&d->accountingLock);
+        d->accountedClients.remove(id);
+        d->clientMemoryUsage.remove(id);
+        if (d->incomingClients.isEmpty()) {
+            d->accountingTimer->stop();
+        }
     }
 }
 
@@ -800,11 +2006,7 @@ void QXmppServer::_q_dialbackRequestReceived(const QXmppDialback &dialback)
 
     if (dialback.command() == QXmppDialback::Verify) {
         // handle a verify request
-        for (auto *out : std::as_const(d->outgoingServers)) {
-            if (out->remoteDomain() != dialback.from()) {
-                continue;
-            }
-
+        if (auto *out = d->outgoingServersByDomain.value(dialback.from())) {
             bool isValid = dialback.key() == out->localStreamKey();
             QXmppDialback verify;
             verify.setCommand(QXmppDialback::Verify);
@@ -813,7 +2015,6 @@ void QXmppServer::_q_dialbackRequestReceived(const QXmppDialback &dialback)
             verify.setFrom(d->domain);
             verify.setType(isValid ? "valid" : "invalid");
             stream->sendPacket(verify);
-            return;
         }
     }
 }
@@ -822,7 +2023,14 @@ void QXmppServer::_q_dialbackRequestReceived(const QXmppDialback &dialback)
 
 void QXmppServer::handleElement(const QDomElement &element)
 {
-    handleStanza(this, element);
+    d->handleStanza(element, {});
+}
+
+/// Handle an incoming stanza along with its XML as received.
+
+void QXmppServer::_q_stanzaReceived(const QDomElement &element, const QByteArray &data)
+{
+    d->handleStanza(element, data);
 }
 
 /// Handle a stream disconnection for an outgoing server.
@@ -835,8 +2043,12 @@ void QXmppServer::_q_outgoingServerDisconnected()
     }
 
     if (d->outgoingServers.remove(outgoing)) {
+        const QString domain = outgoing->remoteDomain();
+        if (d->outgoingServersByDomain.value(domain) == outgoing) {
+            d->outgoingServersByDomain.remove(domain);
+        }
         outgoing->deleteLater();
-        Q_EMIT setGauge("outgoing-server.count", d->outgoingServers.size());
+        reportGauge("outgoing-server.count", d->outgoingServers.size());
     }
 }
 
@@ -854,6 +2066,7 @@ void QXmppServer::_q_serverConnection(QSslSocket *socket)
     }
 
     auto *stream = new QXmppIncomingServer(socket, d->domain, this);
+    stream->d->dialbackKeys = d->dialbackKeys;
     socket->setParent(stream);
 
     connect(stream, &QXmppStream::disconnected,
@@ -862,12 +2075,12 @@ void QXmppServer::_q_serverConnection(QSslSocket *socket)
     connect(stream, &QXmppIncomingServer::dialbackRequestReceived,
             this, &QXmppServer::_q_dialbackRequestReceived);
 
-    connect(stream, &QXmppIncomingServer::elementReceived,
-            this, &QXmppServer::handleElement);
+    connect(stream, &QXmppIncomingServer::stanzaReceived,
+            this, &QXmppServer::_q_stanzaReceived);
 
     // add stream
     d->incomingServers.insert(stream);
-    Q_EMIT setGauge("incoming-server.count", d->incomingServers.size());
+    reportGauge("incoming-server.count", d->incomingServers.size());
 }
 
 /// Handle a stream disconnection for an incoming server.
@@ -881,7 +2094,7 @@ void QXmppServer::_q_serverDisconnected()
 
     if (d->incomingServers.remove(incoming)) {
         incoming->deleteLater();
-        Q_EMIT setGauge("incoming-server.count", d->incomingServers.size());
+        reportGauge("incoming-server.count", d->incomingServers.size());
     }
 }
 
@@ -17,6 +17,7 @@ class QSslSocket;
 
 class QXmppDialback;
 class QXmppIncomingClient;
+class QXmppMemoryTransport;
 class QXmppOutgoingServer;
 class QXmppPasswordChecker;
 class QXmppPresence;
@@ -61,6 +62,24 @@ public:
     QXmppPasswordChecker *passwordChecker();
     void setPasswordChecker(QXmppPasswordChecker *checker);
 
+    int workerThreadCount() const;
+    void setWorkerThreadCount(int count);
+
+    bool isReusePortEnabled() const;
+    void setReusePortEnabled(bool enabled);
+
+    QString captureDirectory() const;
+    void setCaptureDirectory(const QString &path);
+
+    qint64 connectionMemoryLimit() const;
+    void setConnectionMemoryLimit(qint64 bytes);
+
+    int memoryAccountingInterval() const;
+    void setMemoryAccountingInterval(int msecs);
+
+    int idleCompactionTimeout() const;
+    void setIdleCompactionTimeout(int secs);
+
     QVariantMap statistics() const;
 
     void addCaCertificates(const QString &caCertificates);
@@ -72,11 +91,14 @@ public:
     void close();
     bool listenForClients(const QHostAddress &address = QHostAddress::Any, quint16 port = 5222);
     bool listenForServers(const QHostAddress &address = QHostAddress::Any, quint16 port = 5269);
+    QXmppMemoryTransport *connectInMemory();
 
     bool sendElement(const QDomElement &element);
     bool sendPacket(const QXmppStanza &stanza);
+    bool sendData(const QString &to, const QByteArray &data);
 
     void addIncomingClient(QXmppIncomingClient *stream);
+    bool hasClientConnection(const QString &jid) const;
 
 Q_SIGNALS:
     /// This signal is emitted when a client has connected.
@@ -93,12 +115,12 @@ public Q_SLOTS:
 
 private Q_SLOTS:
     void _q_clientConnection(QSslSocket *socket);
-    void _q_clientConnected();
     void _q_clientDisconnected();
     void _q_dialbackRequestReceived(const QXmppDialback &dialback);
     void _q_outgoingServerDisconnected();
     void _q_serverConnection(QSslSocket *socket);
     void _q_serverDisconnected();
+    void _q_stanzaReceived(const QDomElement &element, const QByteArray &data);
 
 private:
     friend class QXmppServerPrivate;
@@ -0,0 +1,682 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppServerArchive.h"
+
+#include "QXmppConstants_p.h"
+#include "QXmppMamIq.h"
+#include "QXmppMessage.h"
+#include "QXmppServer.h"
+#include "QXmppUtils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDomElement>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QThreadPool>
+#include <QXmlStreamWriter>
+
+// Archive layout of a user, in <directory>/<sha1 of the bare JID>:
+//
+//  - data: serialized messages, appended one after the other
+//  - index: one ArchiveEntry per message, the position is the archive ID
+//  - with/<sha1 of the bare JID>: positions (quint64) of the messages
+//    exchanged with a conversation partner
+//
+// Timestamps are kept non-decreasing, so both the positions and the
+// timestamps of the index files are sorted.
+
+namespace {
+
+struct ArchiveEntry
+{
+    qint64 stamp;
+    qint64 offset;
+    qint64 length;
+};
+
+constexpr int DEFAULT_MAX_PAGE_SIZE = 100;
+const QByteArray CLIENT_MESSAGE_TAG = QByteArrayLiteral("<message xmlns=\"jabber:client\"");
+
+// A read-only memory map of a file of fixed-size items.
+template<typename T>
+class MappedArray
+{
+public:
+    explicit MappedArray(const QString &path)
+        : m_file(path)
+    {
+        if (m_file.open(QIODevice::ReadOnly) && m_file.size() >= qint64(sizeof(T))) {
+            m_size = m_file.size() / qint64(sizeof(T));
+            m_data = reinterpret_cast<const T *>(m_file.map(0, m_size * qint64(sizeof(T))));
+            if (!m_data) {
+                m_size = 0;
+            }
+        }
+    }
+
+    qint64 size() const { return m_size; }
+    const T &operator[](qint64 i) const { return m_data[i]; }
+
+private:
+    QFile m_file;
+    const T *m_data = nullptr;
+    qint64 m_size = 0;
+};
+
+// The messages of a query in archive order: all messages or those exchanged
+// with a conversation partner.
+class ArchiveView
+{
+public:
+    ArchiveView(const MappedArray<ArchiveEntry> &index, const MappedArray<quint64> *positions)
+        : m_index(index), m_positions(positions)
+    {
+    }
+
+    qint64 size() const
+    {
+        return m_positions ? m_positions->size() : m_index.size();
+    }
+
+    qint64 position(qint64 i) const
+    {
+        return m_positions ? qint64((*m_positions)[i]) : i;
+    }
+
+    const ArchiveEntry &entry(qint64 i) const
+    {
+        return m_index[position(i)];
+    }
+
+    // returns the first item for which the predicate is false
+    template<typename Predicate>
+    qint64 partitionPoint(Predicate predicate) const
+    {
+        qint64 low = 0, high = size();
+        while (low < high) {
+            const qint64 middle = low + (high - low) / 2;
+            if (predicate(middle)) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+private:
+    const MappedArray<ArchiveEntry> &m_index;
+    const MappedArray<quint64> *m_positions;
+};
+
+QString hashPath(const QString &jid)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(jid.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+}  // namespace
+
+class QXmppServerArchivePrivate
+{
+public:
+    QXmppServerArchivePrivate(QXmppServerArchive *qq);
+    ~QXmppServerArchivePrivate();
+
+    QString archiveDirectory(const QString &owner) const;
+    void archive(const QString &owner, const QString &with, const QByteArray &data);
+    void writePending();
+    bool handleQuery(const QDomElement &element);
+    void answerQuery(const QXmppMamQueryIq &request, bool pageBackwards);
+    void sendError(const QXmppIq &request, QXmppStanza::Error::Condition condition);
+
+    void warning(const QString &message);
+
+    struct ArchiveState
+    {
+        qint64 count = 0;
+        qint64 lastStamp = 0;
+    };
+
+    struct PendingMessage
+    {
+        QString owner;
+        QString with;
+        QByteArray data;
+        qint64 stamp;
+    };
+
+    QXmppServer *server;
+    QString directory;
+    QString domain;
+    int maxPageSize;
+
+    // guards the messages waiting to be written
+    QMutex pendingMutex;
+    QVector<PendingMessage> pending;
+    qint64 pendingBytes = 0;
+    // number of messages queued or being written by archive
+    QHash<QString, qint64> pendingCounts;
+    bool writeScheduled = false;
+
+    // number of queries waiting for the writer by archive, only accessed by
+    // the server thread
+    QHash<QString, int> deferredQueries;
+
+    // number of messages and last timestamp of the archives used since
+    // startup, only accessed by the writer
+    QHash<QString, ArchiveState> archives;
+    std::atomic<qint64> archivesBytes { 0 };
+
+    // a single thread, so the messages are appended in order
+    QThreadPool writer;
+
+private:
+    bool writeArchive(const QString &owner, const PendingMessage *const *messages, int count);
+
+    QXmppServerArchive *q;
+};
+
+QXmppServerArchivePrivate::QXmppServerArchivePrivate(QXmppServerArchive *qq)
+    : server(nullptr),
+      maxPageSize(DEFAULT_MAX_PAGE_SIZE),
+      q(qq)
+{
+    writer.setMaxThreadCount(1);
+}
+
+QXmppServerArchivePrivate::~QXmppServerArchivePrivate()
+{
+    writer.waitForDone();
+}
+
+QString QXmppServerArchivePrivate::archiveDirectory(const QString &owner) const
+{
+    return directory + u'/' + hashPath(owner);
+}
+
+/// Queues a message for the archive of a local user.
+///
+/// The messages are written in batches by the writer thread, so the server
+/// thread never waits for the disk while routing messages.
+
+void QXmppServerArchivePrivate::archive(const QString &owner, const QString &with, const QByteArray &data)
+{
+    QMutexLocker locker(&pendingMutex);
+    pending.append({ owner, with, data, QDateTime::currentMSecsSinceEpoch() });
+    pendingBytes += data.size();
+    pendingCounts[owner]++;
+    if (!writeScheduled) {
+        writeScheduled = true;
+        writer.start([this]() { writePending(); });
+    }
+}
+
+/// Writes the queued messages, runs on the writer thread.
+
+void QXmppServerArchivePrivate::writePending()
+{
+    QVector<PendingMessage> messages;
+    {
+        QMutexLocker locker(&pendingMutex);
+        messages.swap(pending);
+        pendingBytes = 0;
+        writeScheduled = false;
+    }
+
+    // group the batch by archive, keeping the order of each archive
+    QHash<QString, QVector<const PendingMessage *>> batches;
+    QStringList owners;
+    for (const auto &message : std::as_const(messages)) {
+        auto &batch = batches[message.owner];
+        if (batch.isEmpty()) {
+            owners << message.owner;
+        }
+        batch << &message;
+    }
+    for (const auto &owner : std::as_const(owners)) {
+        const auto &batch = batches[owner];
+        writeArchive(owner, batch.constData(), batch.size());
+
+        QMutexLocker locker(&pendingMutex);
+        const auto itr = pendingCounts.find(owner);
+        if (itr != pendingCounts.end() && (*itr -= batch.size()) <= 0) {
+            pendingCounts.erase(itr);
+        }
+    }
+}
+
+/// Appends a batch of messages to the archive of a local user, each file is
+/// opened and written once per batch.
+
+bool QXmppServerArchivePrivate::writeArchive(const QString &owner, const PendingMessage *const *messages, int count)
+{
+    const QDir dir(archiveDirectory(owner));
+    auto itr = archives.find(owner);
+    if (itr == archives.end()) {
+        if (!dir.mkpath(QStringLiteral("with"))) {
+            warning(QStringLiteral("Could not create archive for %1").arg(owner));
+            return false;
+        }
+
+        // drop an entry torn by a crash
+        QFile indexFile(dir.filePath(QStringLiteral("index")));
+        ArchiveState state;
+        if (indexFile.open(QIODevice::ReadWrite)) {
+            state.count = indexFile.size() / qint64(sizeof(ArchiveEntry));
+            if (indexFile.size() != state.count * qint64(sizeof(ArchiveEntry))) {
+                indexFile.resize(state.count * qint64(sizeof(ArchiveEntry)));
+            }
+            if (state.count > 0) {
+                ArchiveEntry last;
+                indexFile.seek((state.count - 1) * qint64(sizeof(ArchiveEntry)));
+                indexFile.read(reinterpret_cast<char *>(&last), sizeof(last));
+                state.lastStamp = last.stamp;
+            }
+        }
+        itr = archives.insert(owner, state);
+        archivesBytes += owner.capacity() * qint64(sizeof(QChar)) + qint64(sizeof(ArchiveState));
+    }
+
+    QFile dataFile(dir.filePath(QStringLiteral("data")));
+    QFile indexFile(dir.filePath(QStringLiteral("index")));
+    if (!dataFile.open(QIODevice::WriteOnly | QIODevice::Append) ||
+        !indexFile.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        warning(QStringLiteral("Could not open archive for %1").arg(owner));
+        return false;
+    }
+
+    // build the appended data of each file
+    QByteArray data;
+    QByteArray index;
+    QHash<QString, QByteArray> withPositions;
+    const qint64 dataOffset = dataFile.size();
+    ArchiveState state = *itr;
+    for (int i = 0; i < count; ++i) {
+        const auto &message = *messages[i];
+        const ArchiveEntry entry {
+            std::max(message.stamp, state.lastStamp),
+            dataOffset + data.size(),
+            message.data.size(),
+        };
+        const quint64 position = quint64(state.count);
+
+        data += message.data;
+        withPositions[message.with].append(reinterpret_cast<const char *>(&position), sizeof(position));
+        index.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+
+        state.count++;
+        state.lastStamp = entry.stamp;
+    }
+
+    // the index is written last, so a message is only visible once complete
+    if (dataFile.write(data) != data.size()) {
+        warning(QStringLiteral("Could not write archive for %1").arg(owner));
+        return false;
+    }
+    for (auto it = withPositions.cbegin(); it != withPositions.cend(); ++it) {
+        QFile withFile(dir.filePath(QStringLiteral("with/") + hashPath(it.key())));
+        if (!withFile.open(QIODevice::WriteOnly | QIODevice::Append) ||
+            withFile.write(it.value()) != it.value().size()) {
+            warning(QStringLiteral("Could not write archive for %1").arg(owner));
+            return false;
+        }
+    }
+    if (indexFile.write(index) != index.size()) {
+        warning(QStringLiteral("Could not write archive for %1").arg(owner));
+        return false;
+    }
+
+    *itr = state;
+    return true;
+}
+
+/// Handles a query of a local user for their archive.
+///
+/// The messages queued for the archive must be on disk to be found, so if
+/// any are still queued, the query is answered once the writer is done with
+/// them. The server thread never waits for the writer.
+
+bool QXmppServerArchivePrivate::handleQuery(const QDomElement &element)
+{
+    QXmppMamQueryIq request;
+    request.parse(element);
+    if (request.type() != QXmppIq::Set) {
+        return false;
+    }
+
+    // queries without 'to' are addressed to the domain by the incoming client
+    const QString requester = request.from();
+    const QString owner = QXmppUtils::jidToBareJid(requester);
+    if (!request.to().isEmpty() && request.to() != domain && request.to() != owner) {
+        sendError(request, QXmppStanza::Error::Forbidden);
+        return true;
+    }
+
+    const QDomElement setElement = element.firstChildElement(QStringLiteral("query")).firstChildElement(QStringLiteral("set"));
+    const bool pageBackwards = !setElement.firstChildElement(QStringLiteral("before")).isNull();
+
+    bool written;
+    {
+        QMutexLocker locker(&pendingMutex);
+        written = !pendingCounts.contains(owner);
+    }
+    // queries are answered in order
+    if (written && !deferredQueries.contains(owner)) {
+        answerQuery(request, pageBackwards);
+        return true;
+    }
+
+    // the writer runs its tasks in order, so this runs after the writes
+    deferredQueries[owner]++;
+    writer.start([this, request, pageBackwards]() {
+        QMetaObject::invokeMethod(q, [this, request, pageBackwards]() {
+            const QString owner = QXmppUtils::jidToBareJid(request.from());
+            if (--deferredQueries[owner] == 0) {
+                deferredQueries.remove(owner);
+            }
+            answerQuery(request, pageBackwards);
+        });
+    });
+    return true;
+}
+
+/// Answers a query of a local user with the messages written to their
+/// archive.
+
+void QXmppServerArchivePrivate::answerQuery(const QXmppMamQueryIq &request, bool pageBackwards)
+{
+    const QString requester = request.from();
+    const QString owner = QXmppUtils::jidToBareJid(requester);
+
+    // filters
+    QString with;
+    qint64 start = std::numeric_limits<qint64>::min();
+    qint64 end = std::numeric_limits<qint64>::max();
+    const auto fields = request.form().fields();
+    for (const auto &field : fields) {
+        const QString value = field.value().toString();
+        if (value.isEmpty()) {
+            continue;
+        }
+        if (field.key() == QLatin1String("with")) {
+            with = QXmppUtils::jidToBareJid(value);
+        } else if (field.key() == QLatin1String("start")) {
+            start = QXmppUtils::datetimeFromString(value).toMSecsSinceEpoch();
+        } else if (field.key() == QLatin1String("end")) {
+            end = QXmppUtils::datetimeFromString(value).toMSecsSinceEpoch();
+        }
+    }
+
+    const QDir dir(archiveDirectory(owner));
+    const MappedArray<ArchiveEntry> index(dir.filePath(QStringLiteral("index")));
+    std::unique_ptr<MappedArray<quint64>> positions;
+    if (!with.isEmpty()) {
+        positions = std::make_unique<MappedArray<quint64>>(dir.filePath(QStringLiteral("with/") + hashPath(with)));
+    }
+    const ArchiveView view(index, positions.get());
+
+    // positions which were written but whose index entry is missing are ignored
+    const qint64 viewSize = view.partitionPoint([&](qint64 i) { return view.position(i) < index.size(); });
+    const auto clamp = [viewSize](qint64 i) { return std::min(i, viewSize); };
+
+    // range matching the filters, found by binary search on the timestamps
+    const qint64 first = clamp(view.partitionPoint([&](qint64 i) { return view.entry(i).stamp < start; }));
+    const qint64 last = clamp(view.partitionPoint([&](qint64 i) { return view.entry(i).stamp <= end; }));
+
+    // page boundaries from the result set query
+    const auto rsm = request.resultSetQuery();
+    const int max = rsm.max() < 0 ? maxPageSize : std::min(rsm.max(), maxPageSize);
+
+    const auto parseId = [&](const QString &id, qint64 &position) {
+        bool ok = false;
+        position = id.toLongLong(&ok);
+        return ok && position >= 0 && position < index.size();
+    };
+
+    qint64 from = first;
+    qint64 to = last;
+    if (!rsm.after().isEmpty()) {
+        qint64 position;
+        if (!parseId(rsm.after(), position)) {
+            sendError(request, QXmppStanza::Error::ItemNotFound);
+            return;
+        }
+        from = std::max(from, clamp(view.partitionPoint([&](qint64 i) { return view.position(i) <= position; })));
+    }
+    if (!rsm.before().isEmpty()) {
+        qint64 position;
+        if (!parseId(rsm.before(), position)) {
+            sendError(request, QXmppStanza::Error::ItemNotFound);
+            return;
+        }
+        to = std::min(to, clamp(view.partitionPoint([&](qint64 i) { return view.position(i) < position; })));
+    }
+    if (pageBackwards) {
+        from = std::max(from, to - max);
+    } else {
+        if (rsm.index() >= 0) {
+            from = std::max(from, first + rsm.index());
+        }
+        to = std::min(to, from + max);
+    }
+    from = std::min(from, to);
+
+    // stream the results as they are read
+    QFile dataFile(dir.filePath(QStringLiteral("data")));
+    const uchar *data = nullptr;
+    if (from < to && dataFile.open(QIODevice::ReadOnly)) {
+        data = dataFile.map(0, dataFile.size());
+    }
+    if (data) {
+        const QByteArray prefix = QStringLiteral("<message to=\"%1\" from=\"%2\"><result xmlns=\"%3\" queryid=\"%4\" id=\"")
+                                      .arg(requester.toHtmlEscaped(), owner.toHtmlEscaped(), QString::fromLatin1(ns_mam), request.queryId().toHtmlEscaped())
+                                      .toUtf8();
+        for (qint64 i = from; i < to; ++i) {
+            const auto &entry = view.entry(i);
+            if (entry.offset + entry.length > dataFile.size()) {
+                continue;
+            }
+            const auto stamp = QXmppUtils::datetimeToString(QDateTime::fromMSecsSinceEpoch(entry.stamp, Qt::UTC));
+
+            QByteArray result = prefix;
+            result += QByteArray::number(view.position(i));
+            result += "\"><forwarded xmlns=\"";
+            result += ns_forwarding;
+            result += "\"><delay xmlns=\"";
+            result += ns_delayed_delivery;
+            result += "\" stamp=\"" + stamp.toUtf8() + "\"/>";
+            result.append(reinterpret_cast<const char *>(data + entry.offset), int(entry.length));
+            result += "</forwarded></result></message>";
+            server->sendData(requester, result);
+        }
+        dataFile.unmap(const_cast<uchar *>(data));
+    }
+
+    QXmppResultSetReply reply;
+    reply.setCount(int(last - first));
+    if (from < to) {
+        reply.setIndex(int(from - first));
+        reply.setFirst(QString::number(view.position(from)));
+        reply.setLast(QString::number(view.position(to - 1)));
+    }
+
+    QXmppMamResultIq response;
+    response.setType(QXmppIq::Result);
+    response.setId(request.id());
+    response.setFrom(owner);
+    response.setTo(requester);
+    response.setResultSetReply(reply);
+    response.setComplete(pageBackwards ? from == first : to == last);
+    server->sendPacket(response);
+}
+
+void QXmppServerArchivePrivate::sendError(const QXmppIq &request, QXmppStanza::Error::Condition condition)
+{
+    QXmppIq response(QXmppIq::Error);
+    response.setId(request.id());
+    response.setFrom(QXmppUtils::jidToBareJid(request.from()));
+    response.setTo(request.from());
+    response.setError(QXmppStanza::Error(QXmppStanza::Error::Cancel, condition));
+    server->sendPacket(response);
+}
+
+void QXmppServerArchivePrivate::warning(const QString &message)
+{
+    // the writer logs through the extension's thread
+    QMetaObject::invokeMethod(q, [q = q, message]() {
+        q->log(QXmppLogger::WarningMessage, message);
+    });
+}
+
+QXmppServerArchive::QXmppServerArchive()
+    : d(std::make_unique<QXmppServerArchivePrivate>(this))
+{
+}
+
+QXmppServerArchive::~QXmppServerArchive() = default;
+
+///
+/// Returns the directory in which the archives are stored.
+///
+QString QXmppServerArchive::directory() const
+{
+    return d->directory;
+}
+
+///
+/// Sets the directory in which the archives are stored.
+///
+/// This must be set before the extension is started.
+///
+/// \param directory
+///
+void QXmppServerArchive::setDirectory(const QString &directory)
+{
+    d->directory = directory;
+}
+
+///
+/// Returns the maximum number of results per page.
+///
+int QXmppServerArchive::maxPageSize() const
+{
+    return d->maxPageSize;
+}
+
+///
+/// Sets the maximum number of results per page, the default is 100.
+///
+/// This is also the page size of queries without a limit.
+///
+/// \param size
+///
+void QXmppServerArchive::setMaxPageSize(int size)
+{
+    d->maxPageSize = qMax(1, size);
+}
+
+///
+/// Returns the number of messages archived for a local user.
+///
+/// Only the messages written to disk are counted, as the index entry of a
+/// message is written once the message is complete. This doesn't wait for
+/// messages being written.
+///
+/// \param bareJid
+///
+qint64 QXmppServerArchive::archivedMessageCount(const QString &bareJid) const
+{
+    QFile indexFile(d->archiveDirectory(bareJid) + QStringLiteral("/index"));
+    return indexFile.exists() ? indexFile.size() / qint64(sizeof(ArchiveEntry)) : 0;
+}
+
+QStringList QXmppServerArchive::discoveryFeatures() const
+{
+    return QStringList() << ns_mam;
+}
+
+int QXmppServerArchive::extensionPriority() const
+{
+    // messages must be archived before other extensions handle them
+    return 20;
+}
+
+QVector<QXmppServerExtension::StanzaFilter> QXmppServerArchive::stanzaFilters() const
+{
+    return {
+        { IqStanza, ns_mam, ServerTarget | LocalTarget },
+        { MessageStanza, {}, AnyTarget },
+    };
+}
+
+bool QXmppServerArchive::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() == QLatin1String("iq")) {
+        return QXmppMamQueryIq::isMamQueryIq(element) &&
+            QXmppUtils::jidToDomain(element.attribute(QStringLiteral("from"))) == d->domain &&
+            d->handleQuery(element);
+    }
+
+    if (element.tagName() != QLatin1String("message") ||
+        element.firstChildElement(QStringLiteral("body")).isNull()) {
+        return false;
+    }
+    const QString type = element.attribute(QStringLiteral("type"));
+    if (!type.isEmpty() && type != QLatin1String("normal") && type != QLatin1String("chat")) {
+        return false;
+    }
+
+    const QString from = QXmppUtils::jidToBareJid(element.attribute(QStringLiteral("from")));
+    const QString to = QXmppUtils::jidToBareJid(element.attribute(QStringLiteral("to")));
+    const bool fromLocal = QXmppUtils::jidToDomain(from) == d->domain && !QXmppUtils::jidToUser(from).isEmpty();
+    const bool toLocal = QXmppUtils::jidToDomain(to) == d->domain && !QXmppUtils::jidToUser(to).isEmpty();
+    if (!fromLocal && !toLocal) {
+        return false;
+    }
+
+    // serialize once, in the client namespace for embedding in results
+    QXmppMessage message;
+    message.parse(element);
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    message.toXml(&writer);
+    data.replace(0, int(qstrlen("<message")), CLIENT_MESSAGE_TAG);
+
+    if (fromLocal) {
+        d->archive(from, to, data);
+    }
+    if (toLocal && to != from) {
+        d->archive(to, from, data);
+    }
+
+    // let the message be delivered
+    return false;
+}
+
+qint64 QXmppServerArchive::memoryUsage() const
+{
+    // the messages are stored on disk, only the archive states and the
+    // messages waiting to be written are kept in memory
+    QMutexLocker locker(&d->pendingMutex);
+    return d->archivesBytes + d->pendingBytes;
+}
+
+bool QXmppServerArchive::start()
+{
+    d->server = server();
+    d->domain = server()->domain();
+    if (d->directory.isEmpty()) {
+        warning(QStringLiteral("No archive directory was specified"));
+        return false;
+    }
+    return QDir().mkpath(d->directory);
+}
@@ -0,0 +1,62 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSERVERARCHIVE_H
+#define QXMPPSERVERARCHIVE_H
+
+#include "QXmppServerExtension.h"
+
+#include <memory>
+
+class QXmppServerArchivePrivate;
+
+///
+/// \brief The QXmppServerArchive class is a server extension implementing
+/// the server side of \xep{0313, Message Archive Management}.
+///
+/// Normal and chat messages with a body sent or received by local users are
+/// appended to the archives of the local parties in directory(). Each user's
+/// archive consists of a data file holding the messages and a fixed-size
+/// entry per message, sorted by archive ID and timestamp. A secondary index
+/// per conversation partner holds the positions of the messages exchanged
+/// with them. The messages are written in batches on a separate thread.
+///
+/// Queries are answered with \xep{0059, Result Set Management} paging. The
+/// page boundaries are found by binary search on the memory-mapped indexes,
+/// so a query never scans the archive, and the results are sent as they are
+/// read from disk.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppServerArchive : public QXmppServerExtension
+{
+    Q_OBJECT
+    Q_CLASSINFO("ExtensionName", "archive")
+
+public:
+    QXmppServerArchive();
+    ~QXmppServerArchive() override;
+
+    QString directory() const;
+    void setDirectory(const QString &directory);
+
+    int maxPageSize() const;
+    void setMaxPageSize(int size);
+
+    qint64 archivedMessageCount(const QString &bareJid) const;
+
+    /// \cond
+    QStringList discoveryFeatures() const override;
+    int extensionPriority() const override;
+    QVector<StanzaFilter> stanzaFilters() const override;
+    bool handleStanza(const QDomElement &element) override;
+    qint64 memoryUsage() const override;
+    bool start() override;
+    /// \endcond
+
+private:
+    const std::unique_ptr<QXmppServerArchivePrivate> d;
+};
+
+#endif
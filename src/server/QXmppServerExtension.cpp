@@ -69,10 +69,30 @@ int QXmppServerExtension::extensionPriority() const
     return 0;
 }
 
+/// Returns the stanzas this extension handles.
+///
+/// The server indexes the filters of its extensions when extensions are
+/// added, and only calls handleStanza() for stanzas matching one of the
+/// filters. The filters must therefore not change once the extension has
+/// been added to the server.
+///
+/// The default implementation returns a single filter matching all stanzas.
+///
+/// \since QXmpp 1.6
+
+QVector<QXmppServerExtension::StanzaFilter> QXmppServerExtension::stanzaFilters() const
+{
+    return { StanzaFilter() };
+}
+
 /// Handles an incoming XMPP stanza.
 ///
 /// Return true if no further processing should occur, false otherwise.
 ///
+/// Stanzas which are not handled are routed using the XML they were received
+/// with, unless an extension modified the stanza, which is then serialized
+/// again.
+///
 /// \param stanza The received stanza.
 
 bool QXmppServerExtension::handleStanza(const QDomElement &stanza)
@@ -101,6 +121,19 @@ QSet<QString> QXmppServerExtension::presenceSubscriptions(const QString &jid)
     return QSet<QString>();
 }
 
+/// Returns an estimate of the memory held by the extension's state in bytes,
+/// which is reported by QXmppServer::statistics().
+///
+/// The default implementation returns -1, meaning that the extension does not
+/// report its memory usage.
+///
+/// \since QXmpp 1.6
+
+qint64 QXmppServerExtension::memoryUsage() const
+{
+    return -1;
+}
+
 /// Starts the extension.
 ///
 /// Return true if the extension was started, false otherwise.
@@ -8,6 +8,7 @@
 #include "QXmppLogger.h"
 
 #include <QVariant>
+#include <QVector>
 
 class QDomElement;
 
@@ -23,6 +24,10 @@ class QXmppStream;
 /// and implement handleStanza(). You can then add your extension to the
 /// client instance using QXmppServer::addExtension().
 ///
+/// By default every stanza is offered to the extension. Extensions which only
+/// handle some stanzas should reimplement stanzaFilters(), so the server only
+/// offers them the matching stanzas.
+///
 /// \ingroup Core
 
 class QXMPP_EXPORT QXmppServerExtension : public QXmppLoggable
@@ -30,6 +35,47 @@ class QXMPP_EXPORT QXmppServerExtension : public QXmppLoggable
     Q_OBJECT
 
 public:
+    /// Kinds of stanzas an extension handles.
+    ///
+    /// \since QXmpp 1.6
+    enum StanzaType {
+        IqStanza = 0x1,        ///< iq stanzas
+        MessageStanza = 0x2,   ///< message stanzas
+        PresenceStanza = 0x4,  ///< presence stanzas
+        AnyStanza = IqStanza | MessageStanza | PresenceStanza,
+    };
+    Q_DECLARE_FLAGS(StanzaTypes, StanzaType)
+
+    /// Recipients of the stanzas an extension handles.
+    ///
+    /// \since QXmpp 1.6
+    enum Target {
+        ServerTarget = 0x1,  ///< the server itself, i.e. no recipient or the server's domain
+        LocalTarget = 0x2,   ///< any other JID of the server's domain
+        RemoteTarget = 0x4,  ///< any other domain, including sub-domains
+        AnyTarget = ServerTarget | LocalTarget | RemoteTarget,
+    };
+    Q_DECLARE_FLAGS(Targets, Target)
+
+    ///
+    /// \brief The StanzaFilter struct describes stanzas an extension handles.
+    ///
+    /// A stanza matches if its kind is one of types, its recipient is one of
+    /// targets and one of its child elements has the namespace xmlns. An
+    /// empty xmlns matches any payload.
+    ///
+    /// \since QXmpp 1.6
+    ///
+    struct StanzaFilter
+    {
+        /// Kinds of stanzas matched by the filter.
+        StanzaTypes types = AnyStanza;
+        /// Payload namespace matched by the filter, empty for any payload.
+        QString xmlns;
+        /// Recipients matched by the filter.
+        Targets targets = AnyTarget;
+    };
+
     QXmppServerExtension();
     ~QXmppServerExtension() override;
     virtual QString extensionName() const;
@@ -37,9 +83,11 @@ public:
 
     virtual QStringList discoveryFeatures() const;
     virtual QStringList discoveryItems() const;
+    virtual QVector<StanzaFilter> stanzaFilters() const;
     virtual bool handleStanza(const QDomElement &stanza);
     virtual QSet<QString> presenceSubscribers(const QString &jid);
     virtual QSet<QString> presenceSubscriptions(const QString &jid);
+    virtual qint64 memoryUsage() const;
 
     virtual bool start();
     virtual void stop();
@@ -54,4 +102,7 @@ private:
     friend class QXmppServer;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(QXmppServerExtension::StanzaTypes)
+Q_DECLARE_OPERATORS_FOR_FLAGS(QXmppServerExtension::Targets)
+
 #endif
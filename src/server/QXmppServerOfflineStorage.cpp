@@ -0,0 +1,1085 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppServerOfflineStorage.h"
+
+#include "QXmppMessage.h"
+#include "QXmppPasswordChecker.h"
+#include "QXmppServer.h"
+#include "QXmppUtils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QDomElement>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSet>
+#include <QThreadPool>
+#include <QTimer>
+#include <QXmlStreamWriter>
+#include <QtEndian>
+
+// Segment file layout, all integers little-endian:
+//
+//   header: "QXOL" | version (u8) | JID length (u16) | bare JID (UTF-8)
+//   record: payload length (u32) | payload (serialized message)
+//
+// Index file layout (QDataStream):
+//
+//   magic (u32) | version (u32) | count (u32) | count * entry
+//   entry: bare JID | first segment | head offset | last segment |
+//          last segment size | message count
+//
+// The message count is the number of undelivered messages up to the given
+// size of the last segment.
+
+static const QByteArray SEGMENT_MAGIC = QByteArrayLiteral("QXOL");
+constexpr quint8 SEGMENT_VERSION = 1;
+constexpr quint32 INDEX_MAGIC = 0x51584f49;
+constexpr quint32 INDEX_VERSION = 2;
+constexpr qint64 RECORD_HEADER_SIZE = 4;
+constexpr qint64 DEFAULT_SEGMENT_SIZE = 4 * 1024 * 1024;
+constexpr qint64 DEFAULT_MAX_MESSAGES_PER_USER = 10000;
+constexpr int MAX_UNCHECKED_MESSAGES_PER_USER = 100;
+constexpr qint64 BATCH_SIZE = 64 * 1024;
+constexpr int INDEX_SAVE_DELAY = 1000;
+
+struct OfflineUserLog
+{
+    quint32 firstSegment = 0;
+    // read position in the first segment, 0 means after the header
+    qint64 headOffset = 0;
+    quint32 lastSegment = 0;
+    // size of the last segment up to the last message written
+    qint64 lastSegmentSize = 0;
+    // whether the last segment was checked for a torn record since startup
+    bool tailChecked = false;
+    // written messages
+    qint64 messageCount = 0;
+    // messages queued for or being written by the writer
+    qint64 pendingCount = 0;
+    bool delivering = false;
+    // the delivery waits for the writer to write the queued messages
+    bool waitingForWrites = false;
+    QString deliveryJid;
+};
+
+class QXmppServerOfflineStoragePrivate
+{
+public:
+    QXmppServerOfflineStoragePrivate(QXmppServerOfflineStorage *qq);
+
+    QString usersDirectory() const;
+    QString userDirectory(const QString &bareJid) const;
+    QString segmentPath(const QString &bareJid, quint32 segment) const;
+    static QByteArray segmentHeader(const QString &bareJid);
+    static qint64 readSegmentHeader(const uchar *data, qint64 size, QString *bareJid = nullptr);
+    static qint64 scanRecords(const uchar *data, qint64 size, qint64 pos, qint64 *count = nullptr);
+
+    bool store(const QString &bareJid, const QByteArray &data);
+    void userChecked(const QString &bareJid, QXmppPasswordReply::Error error);
+    bool append(const QString &bareJid, const QByteArray &data);
+    void writePending();
+    void writesCommitted(const QString &bareJid);
+    qint64 checkTail(QFile &file, qint64 from = 0, qint64 *count = nullptr);
+    qint64 countRecords(const QString &bareJid, quint32 segment, qint64 from, qint64 *count);
+    qint64 compactSegment(const QString &bareJid, quint32 segment, qint64 from, qint64 end);
+    void deliver(const QString &jid);
+    void deliverBatch(const QString &jid);
+
+    bool loadIndex();
+    void rebuildIndex();
+    void rebuildUser(const QString &entry);
+    void saveIndex();
+    void scheduleSave();
+
+    void info(const QString &message);
+    void warning(const QString &message);
+
+    struct PendingMessage
+    {
+        QString bareJid;
+        QByteArray data;
+    };
+
+    QXmppServer *server;
+    QString directory;
+    std::atomic<qint64> segmentSize;
+    qint64 maxMessagesPerUser;
+    QString domain;
+
+    // messages of users whose account is being looked up, by bare JID
+    QHash<QString, QVector<QByteArray>> uncheckedMessages;
+    qint64 uncheckedBytes = 0;
+
+    // guards the index and the queued messages, which are shared with the
+    // writer thread
+    mutable QMutex mutex;
+    QHash<QString, OfflineUserLog> users;
+    QVector<PendingMessage> pending;
+    qint64 pendingBytes = 0;
+    bool writeScheduled = false;
+
+    QTimer *saveTimer;
+
+    // a single thread, so the messages are appended in order
+    QThreadPool writer;
+
+private:
+    bool writeUser(const QString &bareJid, const PendingMessage *const *messages, int count);
+
+    QXmppServerOfflineStorage *q;
+};
+
+QXmppServerOfflineStoragePrivate::QXmppServerOfflineStoragePrivate(QXmppServerOfflineStorage *qq)
+    : server(nullptr),
+      segmentSize(DEFAULT_SEGMENT_SIZE),
+      maxMessagesPerUser(DEFAULT_MAX_MESSAGES_PER_USER),
+      saveTimer(new QTimer(qq)),
+      q(qq)
+{
+    writer.setMaxThreadCount(1);
+    saveTimer->setSingleShot(true);
+    saveTimer->setInterval(INDEX_SAVE_DELAY);
+    QObject::connect(saveTimer, &QTimer::timeout, qq, [this]() {
+        writer.start([this]() { saveIndex(); });
+    });
+}
+
+QString QXmppServerOfflineStoragePrivate::usersDirectory() const
+{
+    return directory + QStringLiteral("/users");
+}
+
+QString QXmppServerOfflineStoragePrivate::userDirectory(const QString &bareJid) const
+{
+    const auto hash = QCryptographicHash::hash(bareJid.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return usersDirectory() + u'/' + QString::fromLatin1(hash);
+}
+
+QString QXmppServerOfflineStoragePrivate::segmentPath(const QString &bareJid, quint32 segment) const
+{
+    return userDirectory(bareJid) + QStringLiteral("/%1.seg").arg(segment, 8, 10, QLatin1Char('0'));
+}
+
+QByteArray QXmppServerOfflineStoragePrivate::segmentHeader(const QString &bareJid)
+{
+    const QByteArray jid = bareJid.toUtf8();
+    QByteArray header = SEGMENT_MAGIC;
+    header.append(char(SEGMENT_VERSION));
+    const quint16 length = qToLittleEndian<quint16>(quint16(jid.size()));
+    header.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    header.append(jid);
+    return header;
+}
+
+/// Returns the size of the segment header or -1 if it is invalid.
+
+qint64 QXmppServerOfflineStoragePrivate::readSegmentHeader(const uchar *data, qint64 size, QString *bareJid)
+{
+    const qint64 fixedSize = SEGMENT_MAGIC.size() + 1 + 2;
+    if (size < fixedSize ||
+        memcmp(data, SEGMENT_MAGIC.constData(), SEGMENT_MAGIC.size()) != 0 ||
+        data[SEGMENT_MAGIC.size()] != SEGMENT_VERSION) {
+        return -1;
+    }
+
+    const qint64 length = qFromLittleEndian<quint16>(data + SEGMENT_MAGIC.size() + 1);
+    if (size < fixedSize + length) {
+        return -1;
+    }
+    if (bareJid) {
+        *bareJid = QString::fromUtf8(reinterpret_cast<const char *>(data + fixedSize), int(length));
+    }
+    return fixedSize + length;
+}
+
+/// Skips the complete records starting at pos and returns the position after
+/// the last one.
+
+qint64 QXmppServerOfflineStoragePrivate::scanRecords(const uchar *data, qint64 size, qint64 pos, qint64 *count)
+{
+    while (pos + RECORD_HEADER_SIZE <= size) {
+        const qint64 length = qFromLittleEndian<quint32>(data + pos);
+        if (pos + RECORD_HEADER_SIZE + length > size) {
+            break;
+        }
+        pos += RECORD_HEADER_SIZE + length;
+        if (count) {
+            (*count)++;
+        }
+    }
+    return pos;
+}
+
+/// Stores a message if the recipient's account exists.
+///
+/// Users without stored messages are looked up using the server's password
+/// checker first, so that no logs are created for nonexistent users. Their
+/// messages wait for the lookup in memory, in a queue of bounded size.
+
+bool QXmppServerOfflineStoragePrivate::store(const QString &bareJid, const QByteArray &data)
+{
+    bool known;
+    {
+        QMutexLocker locker(&mutex);
+        known = users.contains(bareJid);
+    }
+    if (known) {
+        return append(bareJid, data);
+    }
+
+    auto *checker = server->passwordChecker();
+    if (!checker || !checker->hasGetPassword()) {
+        return false;
+    }
+
+    auto &messages = uncheckedMessages[bareJid];
+    if (messages.size() >= MAX_UNCHECKED_MESSAGES_PER_USER) {
+        info(QStringLiteral("Offline storage for %1 is full").arg(bareJid));
+        return false;
+    }
+    messages << data;
+    uncheckedBytes += data.size();
+    if (messages.size() > 1) {
+        return true;
+    }
+
+    QXmppPasswordRequest request;
+    request.setDomain(domain);
+    request.setUsername(QXmppUtils::jidToUser(bareJid));
+
+    QXmppPasswordReply *reply = checker->getDigest(request);
+    reply->setParent(q);
+    QObject::connect(reply, &QXmppPasswordReply::finished, q, [this, reply, bareJid]() {
+        reply->deleteLater();
+        userChecked(bareJid, reply->error());
+    });
+    return true;
+}
+
+/// Stores the messages which waited for the lookup of a user.
+
+void QXmppServerOfflineStoragePrivate::userChecked(const QString &bareJid, QXmppPasswordReply::Error error)
+{
+    const auto messages = uncheckedMessages.take(bareJid);
+    if (messages.isEmpty()) {
+        return;
+    }
+    for (const auto &data : messages) {
+        uncheckedBytes -= data.size();
+    }
+
+    if (error == QXmppPasswordReply::AuthorizationError) {
+        info(QStringLiteral("Dropping %1 offline messages for unknown user %2").arg(QString::number(messages.size()), bareJid));
+        return;
+    } else if (error != QXmppPasswordReply::NoError) {
+        warning(QStringLiteral("Dropping %1 offline messages, could not look up user %2").arg(QString::number(messages.size()), bareJid));
+        return;
+    }
+
+    for (const auto &data : messages) {
+        append(bareJid, data);
+    }
+}
+
+/// Queues a message for a user's log.
+///
+/// The messages are written by the writer thread, so the server thread never
+/// waits for the disk while routing messages.
+
+bool QXmppServerOfflineStoragePrivate::append(const QString &bareJid, const QByteArray &data)
+{
+    QMutexLocker locker(&mutex);
+    auto &log = users[bareJid];
+    if (maxMessagesPerUser > 0 && log.messageCount + log.pendingCount >= maxMessagesPerUser) {
+        locker.unlock();
+        info(QStringLiteral("Offline storage for %1 is full").arg(bareJid));
+        return false;
+    }
+
+    log.pendingCount++;
+    pending.append({ bareJid, data });
+    pendingBytes += data.size();
+    if (!writeScheduled) {
+        writeScheduled = true;
+        writer.start([this]() { writePending(); });
+    }
+    return true;
+}
+
+/// Writes the queued messages, runs on the writer thread.
+
+void QXmppServerOfflineStoragePrivate::writePending()
+{
+    QVector<PendingMessage> messages;
+    {
+        QMutexLocker locker(&mutex);
+        messages.swap(pending);
+        pendingBytes = 0;
+        writeScheduled = false;
+    }
+
+    // group the batch by user, keeping the order of each user's messages
+    QHash<QString, QVector<const PendingMessage *>> batches;
+    QStringList bareJids;
+    for (const auto &message : std::as_const(messages)) {
+        auto &batch = batches[message.bareJid];
+        if (batch.isEmpty()) {
+            bareJids << message.bareJid;
+        }
+        batch << &message;
+    }
+    for (const auto &bareJid : std::as_const(bareJids)) {
+        const auto &batch = batches[bareJid];
+        writeUser(bareJid, batch.constData(), batch.size());
+
+        QMetaObject::invokeMethod(q, [this, bareJid]() { writesCommitted(bareJid); });
+    }
+}
+
+/// Appends a batch of messages to a user's log, runs on the writer thread.
+///
+/// The messages are written with a single write per segment and only become
+/// visible to the delivery once written.
+
+bool QXmppServerOfflineStoragePrivate::writeUser(const QString &bareJid, const PendingMessage *const *messages, int count)
+{
+    OfflineUserLog log;
+    {
+        QMutexLocker locker(&mutex);
+        log = users.value(bareJid);
+    }
+
+    qint64 written = 0;
+    const auto commit = [&](bool success) {
+        QMutexLocker locker(&mutex);
+        const auto itr = users.find(bareJid);
+        if (itr != users.end()) {
+            itr->lastSegment = log.lastSegment;
+            itr->lastSegmentSize = log.lastSegmentSize;
+            // a failed write may have left a torn record
+            itr->tailChecked = success;
+            itr->messageCount += written;
+            itr->pendingCount -= count;
+        }
+        return success;
+    };
+
+    if (!log.tailChecked && !QDir().mkpath(userDirectory(bareJid))) {
+        warning(QStringLiteral("Could not create offline storage for %1").arg(bareJid));
+        return commit(false);
+    }
+
+    QFile file(segmentPath(bareJid, log.lastSegment));
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Append)) {
+        warning(QStringLiteral("Could not open offline storage %1").arg(file.fileName()));
+        return commit(false);
+    }
+    if (!log.tailChecked) {
+        checkTail(file);
+    }
+    log.lastSegmentSize = file.size();
+
+    QByteArray records;
+    qint64 recordCount = 0;
+    const auto flush = [&]() {
+        if (file.write(records) != records.size()) {
+            warning(QStringLiteral("Could not write offline storage %1").arg(file.fileName()));
+            return false;
+        }
+        log.lastSegmentSize += records.size();
+        written += recordCount;
+        records.clear();
+        recordCount = 0;
+        return true;
+    };
+
+    const qint64 maxSize = segmentSize;
+    for (int i = 0; i < count; ++i) {
+        const QByteArray &data = messages[i]->data;
+
+        // start a new segment when the current one is full
+        const qint64 size = log.lastSegmentSize + records.size();
+        if (size > 0 && size + RECORD_HEADER_SIZE + data.size() > maxSize) {
+            if (!flush()) {
+                return commit(false);
+            }
+            file.close();
+            file.setFileName(segmentPath(bareJid, log.lastSegment + 1));
+            if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                warning(QStringLiteral("Could not open offline storage %1").arg(file.fileName()));
+                return commit(false);
+            }
+            log.lastSegment++;
+            log.lastSegmentSize = 0;
+        }
+
+        if (log.lastSegmentSize + records.size() == 0) {
+            records = segmentHeader(bareJid);
+        }
+        const quint32 length = qToLittleEndian<quint32>(quint32(data.size()));
+        records.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        records.append(data);
+        recordCount++;
+    }
+
+    return commit(flush());
+}
+
+/// Saves the index and resumes a delivery waiting for the messages written
+/// for a user.
+
+void QXmppServerOfflineStoragePrivate::writesCommitted(const QString &bareJid)
+{
+    scheduleSave();
+
+    QString jid;
+    {
+        QMutexLocker locker(&mutex);
+        const auto itr = users.find(bareJid);
+        if (itr == users.end() || !itr->waitingForWrites) {
+            return;
+        }
+        itr->waitingForWrites = false;
+        jid = itr->deliveryJid;
+    }
+    deliverBatch(jid);
+}
+
+/// Truncates a record which was only partially written, for instance because
+/// of a crash, so that new records can be appended.
+///
+/// Returns the size of the segment. If \a count is given, the records after
+/// position \a from are added to it.
+
+qint64 QXmppServerOfflineStoragePrivate::checkTail(QFile &file, qint64 from, qint64 *count)
+{
+    const qint64 size = file.size();
+    if (size == 0) {
+        return 0;
+    }
+
+    uchar *data = file.map(0, size);
+    if (!data) {
+        return size;
+    }
+    const qint64 headerSize = readSegmentHeader(data, size);
+    qint64 end = 0;
+    if (headerSize >= 0) {
+        end = scanRecords(data, size, headerSize);
+        if (count && from <= end) {
+            scanRecords(data, end, std::max(from, headerSize), count);
+        }
+    }
+    file.unmap(data);
+
+    if (end < size) {
+        warning(QStringLiteral("Truncating offline storage %1 from %2 to %3 bytes").arg(file.fileName(), QString::number(size), QString::number(end)));
+        file.resize(end);
+    }
+    return end;
+}
+
+/// Checks a segment for a torn record and counts its records after position
+/// \a from. Returns the size of the segment.
+
+qint64 QXmppServerOfflineStoragePrivate::countRecords(const QString &bareJid, quint32 segment, qint64 from, qint64 *count)
+{
+    QFile file(segmentPath(bareJid, segment));
+    if (!file.exists() || !file.open(QIODevice::ReadWrite)) {
+        return 0;
+    }
+    return checkTail(file, from, count);
+}
+
+/// Rewrites a segment without the records before position \a from, which were
+/// delivered already. Returns the new size of the segment or -1 on error.
+
+qint64 QXmppServerOfflineStoragePrivate::compactSegment(const QString &bareJid, quint32 segment, qint64 from, qint64 end)
+{
+    QFile file(segmentPath(bareJid, segment));
+    const qint64 size = file.open(QIODevice::ReadOnly) ? std::min(file.size(), end) : 0;
+    uchar *data = size > 0 ? file.map(0, size) : nullptr;
+    if (!data || from > size) {
+        return -1;
+    }
+
+    QSaveFile compacted(file.fileName());
+    const QByteArray header = segmentHeader(bareJid);
+    const bool written = compacted.open(QIODevice::WriteOnly) &&
+        compacted.write(header) == header.size() &&
+        compacted.write(reinterpret_cast<const char *>(data + from), size - from) == size - from;
+    file.unmap(data);
+    file.close();
+
+    if (!written || !compacted.commit()) {
+        warning(QStringLiteral("Could not compact offline storage %1").arg(file.fileName()));
+        return -1;
+    }
+    return header.size() + size - from;
+}
+
+/// Starts delivering the stored messages to a resource which became available.
+
+void QXmppServerOfflineStoragePrivate::deliver(const QString &jid)
+{
+    {
+        QMutexLocker locker(&mutex);
+        const auto itr = users.find(QXmppUtils::jidToBareJid(jid));
+        if (itr == users.end() || itr->delivering) {
+            return;
+        }
+        itr->delivering = true;
+        itr->deliveryJid = jid;
+    }
+    deliverBatch(jid);
+}
+
+/// Delivers the next batch of written messages with a single write and
+/// schedules the following batch.
+
+void QXmppServerOfflineStoragePrivate::deliverBatch(const QString &jid)
+{
+    const QString bareJid = QXmppUtils::jidToBareJid(jid);
+
+    // read from a copy of the log position, which is committed once sent
+    OfflineUserLog log;
+    {
+        QMutexLocker locker(&mutex);
+        const auto itr = users.constFind(bareJid);
+        if (itr == users.cend()) {
+            return;
+        }
+        log = *itr;
+    }
+
+    QList<quint32> consumedSegments;
+    QByteArray batch;
+    qint64 messages = 0;
+    bool reachedEnd = false;
+
+    while (batch.size() < BATCH_SIZE) {
+        const bool isLast = log.firstSegment == log.lastSegment;
+        QFile file(segmentPath(bareJid, log.firstSegment));
+        qint64 size = file.open(QIODevice::ReadOnly) ? file.size() : 0;
+        if (isLast) {
+            // the writer may be appending to the last segment
+            size = std::min(size, log.lastSegmentSize);
+        }
+        uchar *data = size > 0 ? file.map(0, size) : nullptr;
+
+        qint64 pos = log.headOffset;
+        bool segmentDone = true;
+        if (data) {
+            if (pos == 0) {
+                pos = readSegmentHeader(data, size);
+            }
+            if (pos < 0) {
+                warning(QStringLiteral("Skipping invalid offline storage %1").arg(file.fileName()));
+                pos = size;
+            } else {
+                while (pos + RECORD_HEADER_SIZE <= size && batch.size() < BATCH_SIZE) {
+                    const qint64 length = qFromLittleEndian<quint32>(data + pos);
+                    if (pos + RECORD_HEADER_SIZE + length > size) {
+                        break;
+                    }
+                    batch.append(reinterpret_cast<const char *>(data + pos + RECORD_HEADER_SIZE), int(length));
+                    pos += RECORD_HEADER_SIZE + length;
+                    messages++;
+                }
+                segmentDone = scanRecords(data, size, pos) == pos;
+            }
+            file.unmap(data);
+        }
+
+        if (!segmentDone || isLast) {
+            // the batch is full or all written messages are read
+            log.headOffset = pos;
+            reachedEnd = segmentDone;
+            break;
+        }
+
+        consumedSegments << log.firstSegment;
+        log.firstSegment++;
+        log.headOffset = 0;
+    }
+
+    if (!batch.isEmpty() && !server->sendData(jid, batch)) {
+        // the resource is gone, keep the messages
+        QMutexLocker locker(&mutex);
+        if (const auto itr = users.find(bareJid); itr != users.end()) {
+            itr->delivering = false;
+        }
+        return;
+    }
+
+    bool drained = false;
+    bool waiting = false;
+    {
+        QMutexLocker locker(&mutex);
+        const auto itr = users.find(bareJid);
+        if (itr == users.end()) {
+            return;
+        }
+
+        // the writer only changes the end of the log
+        itr->firstSegment = log.firstSegment;
+        itr->headOffset = log.headOffset;
+        itr->messageCount = qMax<qint64>(0, itr->messageCount - messages);
+        if (reachedEnd) {
+            const bool written = itr->lastSegment != log.lastSegment || itr->lastSegmentSize != log.lastSegmentSize;
+            if (itr->pendingCount > 0) {
+                itr->waitingForWrites = true;
+                waiting = true;
+            } else if (!written) {
+                // all messages were read and none are queued, which are only
+                // queued in this thread
+                users.erase(itr);
+                drained = true;
+            }
+        }
+    }
+
+    if (drained) {
+        QDir(userDirectory(bareJid)).removeRecursively();
+        scheduleSave();
+        info(QStringLiteral("Delivered all offline messages to %1").arg(jid));
+        return;
+    }
+
+    for (const auto segment : std::as_const(consumedSegments)) {
+        QFile::remove(segmentPath(bareJid, segment));
+    }
+    scheduleSave();
+
+    if (!waiting) {
+        QTimer::singleShot(0, q, [this, jid]() { deliverBatch(jid); });
+    }
+}
+
+/// Loads the index and checks it against the segments on disk.
+
+bool QXmppServerOfflineStoragePrivate::loadIndex()
+{
+    QFile file(directory + QStringLiteral("/index"));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if (stream.status() != QDataStream::Ok || magic != INDEX_MAGIC || version != INDEX_VERSION) {
+        return false;
+    }
+
+    QHash<QString, OfflineUserLog> loaded;
+    loaded.reserve(int(count));
+    for (quint32 i = 0; i < count; ++i) {
+        QString bareJid;
+        OfflineUserLog log;
+        stream >> bareJid >> log.firstSegment >> log.headOffset >> log.lastSegment >> log.lastSegmentSize >> log.messageCount;
+        if (stream.status() != QDataStream::Ok) {
+            return false;
+        }
+
+        // messages may have been written to the last segment and to new
+        // segments after the index was saved
+        log.lastSegmentSize = countRecords(bareJid, log.lastSegment, log.lastSegmentSize, &log.messageCount);
+        while (QFile::exists(segmentPath(bareJid, log.lastSegment + 1))) {
+            log.lastSegment++;
+            log.lastSegmentSize = countRecords(bareJid, log.lastSegment, 0, &log.messageCount);
+        }
+        log.tailChecked = true;
+        loaded.insert(bareJid, log);
+    }
+
+    users = std::move(loaded);
+
+    // users may have been added or removed after the index was saved, only
+    // their entries are rebuilt
+    bool changed = false;
+    QSet<QString> indexed;
+    for (auto itr = users.begin(); itr != users.end();) {
+        const QString entry = QFileInfo(userDirectory(itr.key())).fileName();
+        if (QFileInfo::exists(usersDirectory() + u'/' + entry)) {
+            indexed.insert(entry);
+            ++itr;
+        } else {
+            itr = users.erase(itr);
+            changed = true;
+        }
+    }
+    const auto entries = QDir(usersDirectory()).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const auto &entry : entries) {
+        if (!indexed.contains(entry)) {
+            rebuildUser(entry);
+            changed = true;
+        }
+    }
+    if (changed) {
+        info(QStringLiteral("Updated offline storage index for %1 users").arg(users.size()));
+        scheduleSave();
+    }
+    return true;
+}
+
+/// Rebuilds the index from the segments. Messages of partially delivered
+/// segments are delivered again.
+
+void QXmppServerOfflineStoragePrivate::rebuildIndex()
+{
+    users.clear();
+
+    const auto entries = QDir(usersDirectory()).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const auto &entry : entries) {
+        rebuildUser(entry);
+    }
+
+    info(QStringLiteral("Rebuilt offline storage index for %1 users").arg(users.size()));
+    saveIndex();
+}
+
+/// Adds a user to the index from the segments in the given user directory.
+/// Directories without messages are removed.
+
+void QXmppServerOfflineStoragePrivate::rebuildUser(const QString &entry)
+{
+    QDir userDir(usersDirectory() + u'/' + entry);
+    const auto segments = userDir.entryList({ QStringLiteral("*.seg") }, QDir::Files, QDir::Name);
+
+    QString bareJid;
+    OfflineUserLog log;
+    bool first = true;
+    for (const auto &segment : segments) {
+        QFile file(userDir.filePath(segment));
+        const qint64 size = file.open(QIODevice::ReadOnly) ? file.size() : 0;
+        uchar *data = size > 0 ? file.map(0, size) : nullptr;
+        if (!data) {
+            continue;
+        }
+
+        QString segmentJid;
+        const qint64 headerSize = readSegmentHeader(data, size, &segmentJid);
+        if (headerSize >= 0) {
+            log.lastSegmentSize = scanRecords(data, size, headerSize, &log.messageCount);
+            const auto number = segment.left(8).toUInt();
+            if (first) {
+                bareJid = segmentJid;
+                log.firstSegment = number;
+                first = false;
+            }
+            log.lastSegment = number;
+        }
+        file.unmap(data);
+    }
+
+    if (bareJid.isEmpty() || log.messageCount == 0) {
+        userDir.removeRecursively();
+    } else {
+        users.insert(bareJid, log);
+    }
+}
+
+/// Writes the index, runs on the writer thread while the extension is running.
+
+void QXmppServerOfflineStoragePrivate::saveIndex()
+{
+    if (directory.isEmpty()) {
+        return;
+    }
+
+    QHash<QString, OfflineUserLog> snapshot;
+    {
+        QMutexLocker locker(&mutex);
+        snapshot = users;
+    }
+
+    QSaveFile file(directory + QStringLiteral("/index"));
+    if (!file.open(QIODevice::WriteOnly)) {
+        warning(QStringLiteral("Could not write offline storage index %1").arg(file.fileName()));
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << INDEX_MAGIC << INDEX_VERSION << quint32(snapshot.size());
+    for (auto itr = snapshot.cbegin(); itr != snapshot.cend(); ++itr) {
+        stream << itr.key() << itr->firstSegment << itr->headOffset << itr->lastSegment << itr->lastSegmentSize << itr->messageCount;
+    }
+    if (!file.commit()) {
+        warning(QStringLiteral("Could not write offline storage index %1").arg(file.fileName()));
+    }
+}
+
+void QXmppServerOfflineStoragePrivate::scheduleSave()
+{
+    if (!saveTimer->isActive()) {
+        saveTimer->start();
+    }
+}
+
+void QXmppServerOfflineStoragePrivate::info(const QString &message)
+{
+    q->log(QXmppLogger::InformationMessage, message);
+}
+
+void QXmppServerOfflineStoragePrivate::warning(const QString &message)
+{
+    // the writer logs through the extension's thread
+    QMetaObject::invokeMethod(q, [q = q, message]() {
+        q->log(QXmppLogger::WarningMessage, message);
+    });
+}
+
+QXmppServerOfflineStorage::QXmppServerOfflineStorage()
+    : d(std::make_unique<QXmppServerOfflineStoragePrivate>(this))
+{
+}
+
+QXmppServerOfflineStorage::~QXmppServerOfflineStorage()
+{
+    d->writer.waitForDone();
+}
+
+///
+/// Returns the directory in which the messages are stored.
+///
+QString QXmppServerOfflineStorage::directory() const
+{
+    return d->directory;
+}
+
+///
+/// Sets the directory in which the messages are stored.
+///
+/// This must be set before the extension is started.
+///
+/// \param directory
+///
+void QXmppServerOfflineStorage::setDirectory(const QString &directory)
+{
+    d->directory = directory;
+}
+
+///
+/// Returns the maximum size of a segment file in bytes.
+///
+qint64 QXmppServerOfflineStorage::segmentSize() const
+{
+    return d->segmentSize;
+}
+
+///
+/// Sets the maximum size of a segment file in bytes, the default is 4 MiB.
+///
+/// A single message larger than this gets a segment of its own.
+///
+/// \param size
+///
+void QXmppServerOfflineStorage::setSegmentSize(qint64 size)
+{
+    d->segmentSize = size;
+}
+
+///
+/// Returns the maximum number of messages stored per user.
+///
+qint64 QXmppServerOfflineStorage::maxMessagesPerUser() const
+{
+    return d->maxMessagesPerUser;
+}
+
+///
+/// Sets the maximum number of messages stored per user, the default is 10000.
+///
+/// Further messages are not stored. Zero disables the limit.
+///
+/// \param count
+///
+void QXmppServerOfflineStorage::setMaxMessagesPerUser(qint64 count)
+{
+    d->maxMessagesPerUser = qMax<qint64>(0, count);
+}
+
+///
+/// Returns the number of messages stored for a user.
+///
+/// \param bareJid
+///
+qint64 QXmppServerOfflineStorage::storedMessageCount(const QString &bareJid) const
+{
+    QMutexLocker locker(&d->mutex);
+    const auto log = d->users.value(bareJid);
+    return log.messageCount + log.pendingCount;
+}
+
+///
+/// Reclaims disk space and writes the index.
+///
+/// Delivered segments are deleted right away, so this removes segments and
+/// users left behind by an interrupted delivery and rewrites the segments
+/// whose messages were delivered partially without the delivered messages.
+///
+void QXmppServerOfflineStorage::compact()
+{
+    // the writer only appends to users with queued messages, which are kept
+    QMutexLocker locker(&d->mutex);
+    for (auto itr = d->users.begin(); itr != d->users.end();) {
+        const QString bareJid = itr.key();
+        if (itr->messageCount == 0 && itr->pendingCount == 0 && !itr->delivering) {
+            QDir(d->userDirectory(bareJid)).removeRecursively();
+            itr = d->users.erase(itr);
+            continue;
+        }
+
+        const QDir userDir(d->userDirectory(bareJid));
+        const auto segments = userDir.entryList({ QStringLiteral("*.seg") }, QDir::Files);
+        for (const auto &segment : segments) {
+            if (segment.left(8).toUInt() < itr->firstSegment) {
+                QFile::remove(userDir.filePath(segment));
+            }
+        }
+
+        // the writer may only append to the last segment if messages are queued
+        const bool isLast = itr->firstSegment == itr->lastSegment;
+        if (itr->headOffset > 0 && !itr->delivering && (!isLast || itr->pendingCount == 0)) {
+            const qint64 end = isLast ? itr->lastSegmentSize : std::numeric_limits<qint64>::max();
+            const qint64 size = d->compactSegment(bareJid, itr->firstSegment, itr->headOffset, end);
+            if (size >= 0) {
+                itr->headOffset = 0;
+                if (isLast) {
+                    itr->lastSegmentSize = size;
+                }
+            }
+        }
+        ++itr;
+    }
+    locker.unlock();
+    d->writer.start([this]() { d->saveIndex(); });
+}
+
+int QXmppServerOfflineStorage::extensionPriority() const
+{
+    // messages must be stored before other extensions drop them
+    return 10;
+}
+
+QVector<QXmppServerExtension::StanzaFilter> QXmppServerOfflineStorage::stanzaFilters() const
+{
+    // initial presences and messages to local users
+    return {
+        { PresenceStanza, {}, ServerTarget },
+        { MessageStanza, {}, LocalTarget },
+    };
+}
+
+bool QXmppServerOfflineStorage::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() == QLatin1String("presence")) {
+        // deliver on initial presence, the presence itself is left to others;
+        // the server addresses client stanzas without a recipient to its domain
+        const QString to = element.attribute(QStringLiteral("to"));
+        if (!element.hasAttribute(QStringLiteral("type")) && (to.isEmpty() || to == d->domain)) {
+            const QString from = element.attribute(QStringLiteral("from"));
+            if (QXmppUtils::jidToDomain(from) == d->domain) {
+                d->deliver(from);
+            }
+        }
+        return false;
+    }
+
+    if (element.tagName() != QLatin1String("message")) {
+        return false;
+    }
+
+    const QString to = element.attribute(QStringLiteral("to"));
+    const QString bareTo = QXmppUtils::jidToBareJid(to);
+    if (QXmppUtils::jidToDomain(to) != d->domain || QXmppUtils::jidToUser(to).isEmpty()) {
+        return false;
+    }
+
+    const QString type = element.attribute(QStringLiteral("type"));
+    if (!type.isEmpty() && type != QLatin1String("normal") && type != QLatin1String("chat")) {
+        return false;
+    }
+    if (element.firstChildElement(QStringLiteral("body")).isNull()) {
+        return false;
+    }
+
+    // only store if the message can't be delivered
+    if (d->directory.isEmpty() || server()->hasClientConnection(bareTo)) {
+        return false;
+    }
+
+    QXmppMessage message;
+    message.parse(element);
+    if (!message.stamp().isValid()) {
+        message.setStamp(QDateTime::currentDateTimeUtc());
+    }
+
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    message.toXml(&writer);
+    return d->store(bareTo, data);
+}
+
+qint64 QXmppServerOfflineStorage::memoryUsage() const
+{
+    // the messages are stored on disk, only the index and the messages
+    // waiting for the writer are kept in memory
+    QMutexLocker locker(&d->mutex);
+    qint64 bytes = d->pendingBytes + d->uncheckedBytes;
+    for (auto it = d->users.cbegin(); it != d->users.cend(); ++it) {
+        bytes += it.key().capacity() * qint64(sizeof(QChar)) + qint64(sizeof(OfflineUserLog));
+    }
+    return bytes;
+}
+
+bool QXmppServerOfflineStorage::start()
+{
+    d->server = server();
+    d->domain = server()->domain();
+    if (d->directory.isEmpty()) {
+        warning(QStringLiteral("No offline storage directory was specified"));
+        return false;
+    }
+    if (!QDir().mkpath(d->usersDirectory())) {
+        warning(QStringLiteral("Could not create offline storage directory %1").arg(d->directory));
+        return false;
+    }
+
+    if (!server()->passwordChecker() || !server()->passwordChecker()->hasGetPassword()) {
+        warning(QStringLiteral("Offline messages are only stored if the password checker can look up users"));
+    }
+
+    if (!d->loadIndex()) {
+        d->rebuildIndex();
+    }
+    return true;
+}
+
+void QXmppServerOfflineStorage::stop()
+{
+    d->saveTimer->stop();
+    d->writer.waitForDone();
+    d->saveIndex();
+
+    d->uncheckedMessages.clear();
+    d->uncheckedBytes = 0;
+
+    QMutexLocker locker(&d->mutex);
+    d->users.clear();
+}
@@ -0,0 +1,74 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSERVEROFFLINESTORAGE_H
+#define QXMPPSERVEROFFLINESTORAGE_H
+
+#include "QXmppServerExtension.h"
+
+#include <memory>
+
+class QXmppServerOfflineStoragePrivate;
+
+///
+/// \brief The QXmppServerOfflineStorage class is a server extension storing
+/// messages for local users who are offline.
+///
+/// Messages of type normal or chat with a body, addressed to a local user
+/// without any connected resource, are stamped with their delay (\xep{0203})
+/// and appended to the user's log in directory() by a writer thread, so the
+/// server thread never waits for the disk. When a resource of the user
+/// sends its initial presence, the stored messages are delivered in batches
+/// read from the memory-mapped log, yielding to the event loop between
+/// batches.
+///
+/// Messages are only stored for users with an account, which is checked by
+/// retrieving the user's digest from the server's password checker. This
+/// requires a password checker implementing getPassword(), for example
+/// QXmppAsyncPasswordChecker, which also caches the lookups.
+///
+/// Each user's log is split into segment files of at most segmentSize()
+/// bytes. Segments are deleted as soon as all their messages have been
+/// delivered. The in-memory index only holds a small record per user with
+/// stored messages, so the number of stored messages is only limited by the
+/// disk. The index is saved to disk shortly after changes and rebuilt from
+/// the segments if it is missing.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppServerOfflineStorage : public QXmppServerExtension
+{
+    Q_OBJECT
+    Q_CLASSINFO("ExtensionName", "offline")
+
+public:
+    QXmppServerOfflineStorage();
+    ~QXmppServerOfflineStorage() override;
+
+    QString directory() const;
+    void setDirectory(const QString &directory);
+
+    qint64 segmentSize() const;
+    void setSegmentSize(qint64 size);
+
+    qint64 maxMessagesPerUser() const;
+    void setMaxMessagesPerUser(qint64 count);
+
+    qint64 storedMessageCount(const QString &bareJid) const;
+    void compact();
+
+    /// \cond
+    int extensionPriority() const override;
+    QVector<StanzaFilter> stanzaFilters() const override;
+    bool handleStanza(const QDomElement &element) override;
+    qint64 memoryUsage() const override;
+    bool start() override;
+    void stop() override;
+    /// \endcond
+
+private:
+    const std::unique_ptr<QXmppServerOfflineStoragePrivate> d;
+};
+
+#endif
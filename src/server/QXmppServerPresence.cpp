@@ -0,0 +1,379 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppServerPresence.h"
+
+#include "QXmppPresence.h"
+#include "QXmppServer.h"
+#include "QXmppUtils.h"
+
+#include <utility>
+
+#include <QDomElement>
+#include <QHash>
+#include <QSet>
+#include <QXmlStreamWriter>
+
+class QXmppServerPresencePrivate
+{
+public:
+    QXmppServerPresencePrivate(QXmppServerPresence *qq);
+
+    bool isLocal(const QString &jid) const;
+    QSet<QString> collectSubscribers(const QString &bareJid) const;
+    QSet<QString> collectSubscriptions(const QString &bareJid) const;
+    const QSet<QString> &subscribers(const QString &bareJid);
+
+    void broadcast(const QXmppPresence &presence);
+    void probe(const QString &jid);
+    void deliver(const QString &bareJid, const QByteArray &data, const QString &except = {});
+    void queue(const QString &to, const QByteArray &data);
+    void flush();
+
+    QXmppServer *server;
+    QString domain;
+
+    // available presences of local users: bare JID -> full JID -> presence
+    QHash<QString, QHash<QString, QXmppPresence>> presences;
+    // subscribers of local users with available resources
+    QHash<QString, QSet<QString>> subscriberIndex;
+    // data to be written per recipient, flushed after each handled stanza
+    QHash<QString, QByteArray> pendingData;
+
+private:
+    QXmppServerPresence *q;
+};
+
+// Serializes a presence without recipient, see addressed().
+static QByteArray serializeUnaddressed(QXmppPresence presence)
+{
+    presence.setTo({});
+
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    presence.toXml(&writer);
+    return data;
+}
+
+// Inserts the recipient into presence data created by serializeUnaddressed().
+static QByteArray addressed(const QByteArray &data, const QString &to)
+{
+    static const QByteArray startTag = QByteArrayLiteral("<presence");
+    Q_ASSERT(data.startsWith(startTag));
+
+    return startTag + " to=\"" + to.toHtmlEscaped().toUtf8() + '"' + data.mid(startTag.size());
+}
+
+QXmppServerPresencePrivate::QXmppServerPresencePrivate(QXmppServerPresence *qq)
+    : server(nullptr),
+      q(qq)
+{
+}
+
+bool QXmppServerPresencePrivate::isLocal(const QString &jid) const
+{
+    return QXmppUtils::jidToDomain(jid) == domain;
+}
+
+/// Returns the subscribers reported by the other extensions.
+
+QSet<QString> QXmppServerPresencePrivate::collectSubscribers(const QString &bareJid) const
+{
+    QSet<QString> result;
+    const auto extensions = server->extensions();
+    for (auto *extension : extensions) {
+        if (extension != q) {
+            result.unite(extension->presenceSubscribers(bareJid));
+        }
+    }
+    return result;
+}
+
+/// Returns the subscriptions reported by the other extensions.
+
+QSet<QString> QXmppServerPresencePrivate::collectSubscriptions(const QString &bareJid) const
+{
+    QSet<QString> result;
+    const auto extensions = server->extensions();
+    for (auto *extension : extensions) {
+        if (extension != q) {
+            result.unite(extension->presenceSubscriptions(bareJid));
+        }
+    }
+    return result;
+}
+
+/// Returns the indexed subscribers of a local user with available resources.
+
+const QSet<QString> &QXmppServerPresencePrivate::subscribers(const QString &bareJid)
+{
+    auto itr = subscriberIndex.find(bareJid);
+    if (itr == subscriberIndex.end()) {
+        itr = subscriberIndex.insert(bareJid, collectSubscribers(bareJid));
+    }
+    return *itr;
+}
+
+/// Sends a presence of a local user to their subscribers and to their own
+/// other available resources.
+
+void QXmppServerPresencePrivate::broadcast(const QXmppPresence &presence)
+{
+    const QString from = presence.from();
+    const QString bareFrom = QXmppUtils::jidToBareJid(from);
+    const QByteArray data = serializeUnaddressed(presence);
+
+    for (const auto &subscriber : subscribers(bareFrom)) {
+        if (subscriber != bareFrom) {
+            deliver(subscriber, data);
+        }
+    }
+    deliver(bareFrom, data, from);
+}
+
+/// Requests the presences of the subscriptions of a local user who just
+/// became available.
+
+void QXmppServerPresencePrivate::probe(const QString &jid)
+{
+    const QString bareJid = QXmppUtils::jidToBareJid(jid);
+    const QSet<QString> subscriptions = collectSubscriptions(bareJid);
+
+    for (const auto &contact : subscriptions) {
+        if (isLocal(contact)) {
+            // answer directly with the contact's available presences
+            const auto contactPresences = presences.value(contact);
+            for (const auto &presence : contactPresences) {
+                queue(jid, addressed(serializeUnaddressed(presence), jid));
+            }
+        } else {
+            QXmppPresence probe(QXmppPresence::Probe);
+            probe.setFrom(bareJid);
+            probe.setTo(contact);
+
+            QByteArray data;
+            QXmlStreamWriter writer(&data);
+            probe.toXml(&writer);
+            queue(contact, data);
+        }
+    }
+}
+
+/// Addresses presence data to a bare JID. Local users receive it on each of
+/// their available resources, remote users through their server.
+
+void QXmppServerPresencePrivate::deliver(const QString &bareJid, const QByteArray &data, const QString &except)
+{
+    if (!isLocal(bareJid)) {
+        queue(bareJid, addressed(data, bareJid));
+        return;
+    }
+
+    const auto itr = presences.constFind(bareJid);
+    if (itr == presences.constEnd()) {
+        return;
+    }
+    for (auto resource = itr->keyBegin(); resource != itr->keyEnd(); ++resource) {
+        if (*resource != except) {
+            queue(*resource, addressed(data, *resource));
+        }
+    }
+}
+
+void QXmppServerPresencePrivate::queue(const QString &to, const QByteArray &data)
+{
+    pendingData[to] += data;
+}
+
+/// Writes the queued data, one write per recipient.
+
+void QXmppServerPresencePrivate::flush()
+{
+    const auto pending = std::exchange(pendingData, {});
+    for (auto itr = pending.cbegin(); itr != pending.cend(); ++itr) {
+        server->sendData(itr.key(), itr.value());
+    }
+}
+
+QXmppServerPresence::QXmppServerPresence()
+    : d(std::make_unique<QXmppServerPresencePrivate>(this))
+{
+}
+
+QXmppServerPresence::~QXmppServerPresence() = default;
+
+///
+/// Returns the available presences of a local user's resources.
+///
+/// \param bareJid
+///
+QList<QXmppPresence> QXmppServerPresence::availablePresences(const QString &bareJid) const
+{
+    return d->presences.value(bareJid).values();
+}
+
+///
+/// Drops the indexed subscribers of a local user, so they are queried again
+/// from the other extensions on the next presence broadcast.
+///
+/// Call this when a user's subscribers changed without a subscription stanza
+/// passing the server, for instance after editing the roster storage.
+///
+/// \param bareJid
+///
+void QXmppServerPresence::invalidateSubscribers(const QString &bareJid)
+{
+    d->subscriberIndex.remove(bareJid);
+}
+
+QVector<QXmppServerExtension::StanzaFilter> QXmppServerPresence::stanzaFilters() const
+{
+    return { { PresenceStanza, {}, AnyTarget } };
+}
+
+bool QXmppServerPresence::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() != QLatin1String("presence")) {
+        return false;
+    }
+
+    QXmppPresence presence;
+    presence.parse(element);
+
+    const QString from = presence.from();
+    const QString to = presence.to();
+    const QString bareFrom = QXmppUtils::jidToBareJid(from);
+
+    switch (presence.type()) {
+    case QXmppPresence::Subscribe:
+    case QXmppPresence::Subscribed:
+    case QXmppPresence::Unsubscribe:
+    case QXmppPresence::Unsubscribed:
+        // the subscription state is about to change, let the roster handle it
+        invalidateSubscribers(bareFrom);
+        invalidateSubscribers(QXmppUtils::jidToBareJid(to));
+        return false;
+
+    case QXmppPresence::Probe: {
+        const QString bareTo = QXmppUtils::jidToBareJid(to);
+        if (!d->isLocal(bareTo)) {
+            return false;
+        }
+
+        // answer on behalf of the local user if the sender is a subscriber
+        const bool isSubscriber = d->subscriberIndex.contains(bareTo)
+            ? d->subscriberIndex.value(bareTo).contains(bareFrom)
+            : d->collectSubscribers(bareTo).contains(bareFrom);
+        if (isSubscriber) {
+            const auto available = d->presences.value(bareTo);
+            for (const auto &item : available) {
+                d->queue(from, addressed(serializeUnaddressed(item), from));
+            }
+            d->flush();
+        }
+        return true;
+    }
+
+    case QXmppPresence::Available:
+    case QXmppPresence::Unavailable: {
+        // only handle broadcasts of local users, directed presences are routed;
+        // the server addresses client stanzas without a recipient to its domain
+        const bool isBroadcast = to.isEmpty() || to == d->domain || to == bareFrom;
+        if (!d->isLocal(from) || QXmppUtils::jidToResource(from).isEmpty() || !isBroadcast) {
+            return false;
+        }
+
+        auto &resources = d->presences[bareFrom];
+        if (presence.type() == QXmppPresence::Available) {
+            const bool initial = !resources.contains(from);
+            resources.insert(from, presence);
+            d->broadcast(presence);
+            if (initial) {
+                d->probe(from);
+            }
+        } else {
+            resources.remove(from);
+            d->broadcast(presence);
+            if (resources.isEmpty()) {
+                d->presences.remove(bareFrom);
+                d->subscriberIndex.remove(bareFrom);
+            }
+        }
+        d->flush();
+
+        reportGauge(QStringLiteral("presence.available"), d->presences.size());
+        Q_EMIT presenceChanged(presence);
+        return true;
+    }
+
+    case QXmppPresence::Error:
+        return false;
+    }
+    return false;
+}
+
+qint64 QXmppServerPresence::memoryUsage() const
+{
+    qint64 bytes = 0;
+    for (auto it = d->presences.cbegin(); it != d->presences.cend(); ++it) {
+        bytes += it.key().capacity() * qint64(sizeof(QChar));
+        for (auto resource = it->cbegin(); resource != it->cend(); ++resource) {
+            bytes += resource.key().capacity() * qint64(sizeof(QChar)) + qint64(sizeof(QXmppPresence)) +
+                resource->statusText().capacity() * qint64(sizeof(QChar));
+        }
+    }
+    for (auto it = d->subscriberIndex.cbegin(); it != d->subscriberIndex.cend(); ++it) {
+        bytes += it.key().capacity() * qint64(sizeof(QChar));
+        for (const auto &subscriber : *it) {
+            bytes += subscriber.capacity() * qint64(sizeof(QChar));
+        }
+    }
+    for (auto it = d->pendingData.cbegin(); it != d->pendingData.cend(); ++it) {
+        bytes += it.key().capacity() * qint64(sizeof(QChar)) + it->capacity();
+    }
+    return bytes;
+}
+
+bool QXmppServerPresence::start()
+{
+    d->server = server();
+    d->domain = server()->domain();
+    connect(server(), &QXmppServer::clientDisconnected,
+            this, &QXmppServerPresence::onClientDisconnected);
+    return true;
+}
+
+void QXmppServerPresence::stop()
+{
+    disconnect(server(), &QXmppServer::clientDisconnected,
+               this, &QXmppServerPresence::onClientDisconnected);
+    d->presences.clear();
+    d->subscriberIndex.clear();
+    d->pendingData.clear();
+}
+
+void QXmppServerPresence::onClientDisconnected(const QString &jid)
+{
+    const QString bareJid = QXmppUtils::jidToBareJid(jid);
+    const auto itr = d->presences.constFind(bareJid);
+    if (itr == d->presences.constEnd() || !itr->contains(jid)) {
+        return;
+    }
+
+    // the resource went offline without sending unavailable presence
+    QXmppPresence presence(QXmppPresence::Unavailable);
+    presence.setFrom(jid);
+
+    auto &resources = d->presences[bareJid];
+    resources.remove(jid);
+    d->broadcast(presence);
+    if (resources.isEmpty()) {
+        d->presences.remove(bareJid);
+        d->subscriberIndex.remove(bareJid);
+    }
+    d->flush();
+
+    reportGauge(QStringLiteral("presence.available"), d->presences.size());
+    Q_EMIT presenceChanged(presence);
+}
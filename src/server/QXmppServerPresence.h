@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef QXMPPSERVERPRESENCE_H
+#define QXMPPSERVERPRESENCE_H
+
+#include "QXmppPresence.h"
+#include "QXmppServerExtension.h"
+
+#include <memory>
+
+class QXmppServerPresencePrivate;
+
+///
+/// \brief The QXmppServerPresence class is a server extension broadcasting
+/// the presence of local users to their subscribers.
+///
+/// The subscribers and subscriptions of a user are queried from the other
+/// extensions' presenceSubscribers() and presenceSubscriptions(), typically
+/// implemented by a roster extension. The subscribers of users with available
+/// resources are kept in an index, which is dropped when the user's last
+/// resource goes offline or a subscription stanza is exchanged.
+///
+/// When a user becomes available, the presences of their subscriptions are
+/// probed: local contacts are answered directly from the available presences,
+/// remote contacts receive a probe.
+///
+/// A presence change is serialized once and only addressed per recipient.
+/// All data for a connection resulting from one presence stanza is delivered
+/// with a single write.
+///
+/// \since QXmpp 1.6
+///
+class QXMPP_EXPORT QXmppServerPresence : public QXmppServerExtension
+{
+    Q_OBJECT
+    Q_CLASSINFO("ExtensionName", "presence")
+
+public:
+    QXmppServerPresence();
+    ~QXmppServerPresence() override;
+
+    QList<QXmppPresence> availablePresences(const QString &bareJid) const;
+    void invalidateSubscribers(const QString &bareJid);
+
+    /// \cond
+    QVector<StanzaFilter> stanzaFilters() const override;
+    bool handleStanza(const QDomElement &element) override;
+    qint64 memoryUsage() const override;
+    bool start() override;
+    void stop() override;
+    /// \endcond
+
+    /// This signal is emitted when the available presence of a local user's
+    /// resource changed, including when it went offline.
+    Q_SIGNAL void presenceChanged(const QXmppPresence &presence);
+
+private:
+    void onClientDisconnected(const QString &jid);
+
+    const std::unique_ptr<QXmppServerPresencePrivate> d;
+};
+
+#endif
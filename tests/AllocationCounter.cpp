@@ -0,0 +1,122 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "AllocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define ALLOCATION_COUNTING_DISABLED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ALLOCATION_COUNTING_DISABLED
+#endif
+#endif
+
+static std::atomic<qint64> totalAllocations { 0 };
+static std::atomic<qint64> totalBytes { 0 };
+
+static inline void countAllocation(std::size_t size)
+{
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    totalBytes.fetch_add(qint64(size), std::memory_order_relaxed);
+}
+
+#if defined(ALLOCATION_COUNTING_DISABLED)
+
+// the sanitizer's allocation functions are used
+
+#elif defined(__GLIBC__)
+
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *pointer, std::size_t size);
+
+void *malloc(std::size_t size)
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size)
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, std::size_t size)
+{
+    countAllocation(size);
+    return __libc_realloc(pointer, size);
+}
+}
+
+#else
+
+void *operator new(std::size_t size)
+{
+    countAllocation(size);
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+#endif
+
+AllocationCounter::AllocationCounter()
+    : m_startAllocations(totalAllocations.load(std::memory_order_relaxed)),
+      m_startBytes(totalBytes.load(std::memory_order_relaxed))
+{
+}
+
+// Returns whether allocations are counted in this build.
+bool AllocationCounter::isSupported()
+{
+#if defined(ALLOCATION_COUNTING_DISABLED)
+    return false;
+#else
+    return true;
+#endif
+}
+
+// Returns the number of allocations since the construction.
+qint64 AllocationCounter::allocations() const
+{
+    return totalAllocations.load(std::memory_order_relaxed) - m_startAllocations;
+}
+
+// Returns the number of bytes allocated since the construction.
+qint64 AllocationCounter::bytes() const
+{
+    return totalBytes.load(std::memory_order_relaxed) - m_startBytes;
+}
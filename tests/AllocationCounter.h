@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef ALLOCATIONCOUNTER_H
+#define ALLOCATIONCOUNTER_H
+
+#include <QDebug>
+#include <QtGlobal>
+
+// Counts the heap allocations made by all threads since its construction.
+//
+// With glibc, malloc(), calloc() and realloc() are interposed, so that the
+// buffers of Qt's containers are counted as well. Elsewhere only the global
+// operator new is replaced. Counting is disabled with AddressSanitizer, which
+// replaces the allocation functions itself.
+//
+// The counting hooks are linked into every executable using this class, it
+// must not be used by the library.
+class AllocationCounter
+{
+public:
+    // Average allocations of an operation.
+    struct Result
+    {
+        qint64 allocations = 0;
+        qint64 bytes = 0;
+    };
+
+    AllocationCounter();
+
+    static bool isSupported();
+
+    qint64 allocations() const;
+    qint64 bytes() const;
+
+    // Returns the average allocations of an operation over the given number
+    // of iterations. The operation runs once before, so that lazily
+    // initialized state is not counted.
+    template<typename Operation>
+    static Result measure(Operation operation, int iterations = 100)
+    {
+        operation();
+
+        AllocationCounter counter;
+        for (int i = 0; i < iterations; ++i) {
+            operation();
+        }
+        return { counter.allocations() / iterations, counter.bytes() / iterations };
+    }
+
+private:
+    qint64 m_startAllocations;
+    qint64 m_startBytes;
+};
+
+#define SKIP_IF_ALLOCATION_COUNTING_UNSUPPORTED()                            \
+    if (!AllocationCounter::isSupported()) {                                 \
+        QSKIP("Allocations cannot be counted with AddressSanitizer enabled"); \
+    }
+
+// Reports the allocations of an operation and fails the test if they exceed
+// the budget.
+#define QVERIFY_ALLOCATIONS(operation, maxAllocations, maxBytes)                                       \
+    {                                                                                                  \
+        const auto result = AllocationCounter::measure(operation);                                     \
+        qInfo("%s: %lld allocations/op (budget %lld), %lld bytes/op (budget %lld)",                    \
+              #operation, result.allocations, qint64(maxAllocations), result.bytes, qint64(maxBytes)); \
+        QVERIFY2(result.allocations <= (maxAllocations), "Allocation count exceeds the budget");       \
+        QVERIFY2(result.bytes <= (maxBytes), "Allocated bytes exceed the budget");                     \
+    }
+
+#endif  // ALLOCATIONCOUNTER_H
@@ -43,6 +43,19 @@ public:
         resetIdCount();
     }
 
+    // Passes data to the stream as if it had been read from the socket.
+    void injectData(const QString &data)
+    {
+        d->stream->processData(data);
+    }
+
+    bool injectStanza(const QDomElement &element)
+    {
+        bool handled = false;
+        _q_elementReceived(element, handled);
+        return handled;
+    }
+
     void expect(QString &&packet)
     {
         QVERIFY2(!m_sentPackets.empty(), "No packet was sent!");
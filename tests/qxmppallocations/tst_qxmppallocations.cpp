@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppClient.h"
+#include "QXmppMessage.h"
+#include "QXmppServer.h"
+#include "QXmppStream.h"
+
+#include "AllocationCounter.h"
+#include "TestClient.h"
+#include "util.h"
+
+#include <QSslSocket>
+#include <QTcpServer>
+
+// Allocation budgets per operation.
+//
+// The budgets are upper bounds with some headroom over the counts measured
+// with glibc and Qt 5.15. Lower them when an optimization reduces the counts,
+// so that regressions are caught.
+constexpr qint64 RECEIVE_MESSAGE_ALLOCATIONS = 250;
+constexpr qint64 RECEIVE_MESSAGE_BYTES = 32 * 1024;
+constexpr qint64 SEND_MESSAGE_ALLOCATIONS = 120;
+constexpr qint64 SEND_MESSAGE_BYTES = 16 * 1024;
+constexpr qint64 ROUTE_MESSAGE_ALLOCATIONS = 150;
+constexpr qint64 ROUTE_MESSAGE_BYTES = 16 * 1024;
+
+class AllocationStream : public QXmppStream
+{
+    Q_OBJECT
+
+public:
+    AllocationStream(QObject *parent)
+        : QXmppStream(parent)
+    {
+    }
+
+    void handleStart() override
+    {
+        QXmppStream::handleStart();
+        Q_EMIT started();
+    }
+
+    void handleStream(const QDomElement &) override { }
+    void handleStanza(const QDomElement &) override { }
+
+    using QXmppStream::enableStreamManagement;
+    using QXmppStream::setAcknowledgedSequenceNumber;
+    using QXmppStream::setSocket;
+
+    Q_SIGNAL void started();
+};
+
+class tst_QXmppAllocations : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void init();
+    Q_SLOT void testReceiveMessage();
+    Q_SLOT void testSendMessage();
+    Q_SLOT void testRouteMessage();
+};
+
+void tst_QXmppAllocations::init()
+{
+    SKIP_IF_ALLOCATION_COUNTING_UNSUPPORTED();
+}
+
+void tst_QXmppAllocations::testReceiveMessage()
+{
+    TestClient client;
+    // log formatting is not part of the budget
+    client.setLogger(nullptr);
+
+    int received = 0;
+    connect(&client, &QXmppClient::messageReceived, this, [&received](const QXmppMessage &) {
+        received++;
+    });
+
+    client.injectData(QStringLiteral("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+                                     "id='allocations' from='localhost' version='1.0'>"));
+
+    // parsed by the stream, handed to the extensions and emitted
+    const auto receiveMessage = [&client]() {
+        client.injectData(QStringLiteral("<message from='bob@localhost/allocations' to='alice@localhost/allocations' "
+                                         "type='chat' id='a4b5c6d7'><body>Hello Alice</body></message>"));
+    };
+    QVERIFY_ALLOCATIONS(receiveMessage, RECEIVE_MESSAGE_ALLOCATIONS, RECEIVE_MESSAGE_BYTES);
+    QCOMPARE(received, 101);
+}
+
+void tst_QXmppAllocations::testSendMessage()
+{
+    QTcpServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    QSslSocket socket;
+    AllocationStream stream(this);
+    stream.setSocket(&socket);
+
+    QSignalSpy onStarted(&stream, &AllocationStream::started);
+    socket.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    QVERIFY(onStarted.wait());
+    QVERIFY(server.waitForNewConnection(1000));
+    stream.enableStreamManagement(true);
+
+    // serialized, written, queued until acknowledged and acknowledged
+    const QXmppMessage message(QStringLiteral("alice@localhost/allocations"),
+                               QStringLiteral("bob@localhost/allocations"),
+                               QStringLiteral("Hello Bob"));
+    unsigned int sequenceNumber = 0;
+    const auto sendMessage = [&stream, &message, &sequenceNumber]() {
+        stream.sendPacket(message);
+        stream.setAcknowledgedSequenceNumber(++sequenceNumber);
+    };
+    QVERIFY_ALLOCATIONS(sendMessage, SEND_MESSAGE_ALLOCATIONS, SEND_MESSAGE_BYTES);
+}
+
+void tst_QXmppAllocations::testRouteMessage()
+{
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("bob", "testpwd");
+
+    QXmppServer server;
+    server.setDomain(QStringLiteral("localhost"));
+    server.setLogger(nullptr);
+    server.setPasswordChecker(&passwordChecker);
+
+    QXmppClient bob;
+    bob.setLogger(nullptr);
+    connectInMemory(server, bob, QStringLiteral("bob"), QStringLiteral("allocations"));
+    QVERIFY(bob.isConnected());
+
+    // looked up in the routing table and written to bob's stream
+    const auto element = xmlToDom(QStringLiteral("<message from='alice@localhost/allocations' to='bob@localhost/allocations' "
+                                                 "type='chat' id='a4b5c6d7'><body>Hello Bob</body></message>"));
+    const auto routeMessage = [&server, &element]() {
+        server.handleElement(element);
+    };
+    QVERIFY_ALLOCATIONS(routeMessage, ROUTE_MESSAGE_ALLOCATIONS, ROUTE_MESSAGE_BYTES);
+
+    // the messages were delivered
+    int received = 0;
+    connect(&bob, &QXmppClient::messageReceived, this, [&received](const QXmppMessage &) {
+        received++;
+    });
+    QTRY_COMPARE(received, 101);
+}
+
+QTEST_MAIN(tst_QXmppAllocations)
+#include "tst_qxmppallocations.moc"
@@ -13,6 +13,8 @@ private:
     Q_SLOT void testInfo();
     Q_SLOT void testItems();
     Q_SLOT void testRequests();
+    Q_SLOT void testCoalescedInfo();
+    Q_SLOT void testExtensionStatistics();
 };
 
 void tst_QXmppDiscoveryManager::testInfo()
@@ -80,6 +82,77 @@ void tst_QXmppDiscoveryManager::testRequests()
     test.expect("<iq id='info1' to='romeo@montague.net/orchard' type='result'><query xmlns='http://jabber.org/protocol/disco#info'><identity category='client' name='tst_qxmppdiscoverymanager ' type='pc'/><feature var='jabber:x:data'/><feature var='http://jabber.org/protocol/rsm'/><feature var='jabber:x:oob'/><feature var='http://jabber.org/protocol/xhtml-im'/><feature var='http://jabber.org/protocol/chatstates'/><feature var='http://jabber.org/protocol/caps'/><feature var='urn:xmpp:ping'/><feature var='jabber:x:conference'/><feature var='urn:xmpp:message-correct:0'/><feature var='urn:xmpp:chat-markers:0'/><feature var='urn:xmpp:hints'/><feature var='urn:xmpp:sid:0'/><feature var='urn:xmpp:message-attaching:1'/><feature var='urn:xmpp:eme:0'/><feature var='urn:xmpp:spoiler:0'/><feature var='urn:xmpp:fallback:0'/><feature var='urn:xmpp:reactions:0'/><feature var='http://jabber.org/protocol/disco#info'/></query></iq>");
 }
 
+void tst_QXmppDiscoveryManager::testCoalescedInfo()
+{
+    TestClient test;
+    test.setIqCoalescingEnabled(true);
+    auto *discoManager = test.addNewExtension<QXmppDiscoveryManager>();
+
+    auto future1 = discoManager->requestDiscoInfo("user@example.org");
+    auto future2 = discoManager->requestDiscoInfo("user@example.org");
+    auto future3 = discoManager->requestDiscoInfo("user@example.org", "urn:xmpp:node");
+    test.expect("<iq id='qxmpp1' to='user@example.org' type='get'><query xmlns='http://jabber.org/protocol/disco#info'/></iq>");
+    test.expect("<iq id='qxmpp3' to='user@example.org' type='get'><query xmlns='http://jabber.org/protocol/disco#info' node='urn:xmpp:node'/></iq>");
+
+    test.inject<QString>(R"(
+<iq id='qxmpp1' from='user@example.org' type='result'>
+    <query xmlns='http://jabber.org/protocol/disco#info'>
+        <feature var='urn:xmpp:mix:core:1'/>
+    </query>
+</iq>)");
+
+    const auto info1 = expectFutureVariant<QXmppDiscoveryIq>(future1.toFuture(this));
+    const auto info2 = expectFutureVariant<QXmppDiscoveryIq>(future2.toFuture(this));
+    QCOMPARE(info1.features(), QStringList { "urn:xmpp:mix:core:1" });
+    QCOMPARE(info2.features(), QStringList { "urn:xmpp:mix:core:1" });
+    QVERIFY(!future3.isFinished());
+
+    // a new request is sent once the previous one has finished
+    auto future4 = discoManager->requestDiscoInfo("user@example.org");
+    QVERIFY(!future4.isFinished());
+    test.takePacket();
+}
+
+void tst_QXmppDiscoveryManager::testExtensionStatistics()
+{
+    TestClient test;
+    test.configuration().setJid("user@qxmpp.org/a");
+    test.addNewExtension<QXmppDiscoveryManager>();
+    QVERIFY(!test.isExtensionStatisticsEnabled());
+    test.setExtensionStatisticsEnabled(true);
+
+    QVERIFY(test.injectStanza(xmlToDom(R"(
+<iq type='get' from='romeo@montague.net/orchard' to='user@qxmpp.org/a' id='info1'>
+  <query xmlns='http://jabber.org/protocol/disco#info'/>
+</iq>)")));
+    QVERIFY(!test.injectStanza(xmlToDom(R"(
+<iq type='get' from='romeo@montague.net/orchard' to='user@qxmpp.org/a' id='ping1'>
+  <ping xmlns='urn:xmpp:ping'/>
+</iq>)")));
+
+    const auto stats = test.extensionStatistics().value("QXmppDiscoveryManager").toMap();
+    QCOMPARE(stats.value("invocations").toInt(), 2);
+    QCOMPARE(stats.value("claimed").toInt(), 1);
+    QVERIFY(stats.contains("total-time-us"));
+    QVERIFY(stats.contains("p99-time-us"));
+
+    test.setExtensionStatisticsEnabled(false);
+    QVERIFY(test.extensionStatistics().isEmpty());
+
+    // a second instance of the same class gets its own entry
+    test.addNewExtension<QXmppDiscoveryManager>();
+    test.setExtensionStatisticsEnabled(true);
+    QVERIFY(!test.injectStanza(xmlToDom(R"(
+<iq type='get' from='romeo@montague.net/orchard' to='user@qxmpp.org/a' id='ping2'>
+  <ping xmlns='urn:xmpp:ping'/>
+</iq>)")));
+
+    const auto allStats = test.extensionStatistics();
+    QCOMPARE(allStats.size(), 2);
+    QCOMPARE(allStats.value("QXmppDiscoveryManager").toMap().value("invocations").toInt(), 1);
+    QCOMPARE(allStats.value("QXmppDiscoveryManager#2").toMap().value("invocations").toInt(), 1);
+}
+
 QTEST_MAIN(tst_QXmppDiscoveryManager)
 
 #include "tst_qxmppdiscoverymanager.moc"
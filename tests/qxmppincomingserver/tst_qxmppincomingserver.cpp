@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppIncomingServer.h"
+
+#include "util.h"
+
+#include <QSslSocket>
+#include <QTcpServer>
+
+// Accepts connections as QSslSocket, as QXmppIncomingServer expects.
+class SslServer : public QTcpServer
+{
+protected:
+    void incomingConnection(qintptr socketDescriptor) override
+    {
+        auto *socket = new QSslSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        addPendingConnection(socket);
+    }
+};
+
+class tst_QXmppIncomingServer : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void testDialbackResult_data();
+    Q_SLOT void testDialbackResult();
+};
+
+void tst_QXmppIncomingServer::testDialbackResult_data()
+{
+    QTest::addColumn<QString>("key");
+
+    QTest::newRow("empty") << QString();
+    QTest::newRow("unknown") << QStringLiteral("0123456789abcdef");
+}
+
+void tst_QXmppIncomingServer::testDialbackResult()
+{
+    QFETCH(QString, key);
+
+    SslServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    QTcpSocket remote;
+    remote.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    QVERIFY(server.waitForNewConnection(1000));
+    auto *socket = qobject_cast<QSslSocket *>(server.nextPendingConnection());
+    QVERIFY(socket);
+    QVERIFY(remote.waitForConnected(1000));
+
+    QXmppIncomingServer stream(socket, QStringLiteral("localhost"), nullptr);
+
+    remote.write("<?xml version='1.0'?><stream:stream xmlns='jabber:server' "
+                 "xmlns:db='jabber:server:dialback' xmlns:stream='http://etherx.jabber.org/streams' "
+                 "from='remote.example' to='localhost' version='1.0'>");
+    remote.write(QStringLiteral("<db:result from='remote.example' to='localhost'>%1</db:result>").arg(key).toUtf8());
+
+    // the stream header and features are sent, but no dialback result
+    QByteArray received;
+    QTRY_VERIFY((received += remote.readAll()).contains("stream:features"));
+    QTest::qWait(200);
+    received += remote.readAll();
+    QVERIFY(!received.contains("valid"));
+    QVERIFY(!stream.isConnected());
+}
+
+QTEST_MAIN(tst_QXmppIncomingServer)
+#include "tst_qxmppincomingserver.moc"
@@ -0,0 +1,302 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppLogger.h"
+#include "QXmppMetrics.h"
+
+#include "util.h"
+
+#include <QFileInfo>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QThread>
+
+class tst_QXmppLogger : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void testFile_data();
+    Q_SLOT void testFile();
+    Q_SLOT void testRotation_data();
+    Q_SLOT void testRotation();
+    Q_SLOT void testOverflow_data();
+    Q_SLOT void testOverflow();
+    Q_SLOT void testLoggableSink();
+    Q_SLOT void testLoggableSignals();
+    Q_SLOT void testLoggableThread();
+
+    static QStringList readLines(const QString &path);
+};
+
+QStringList tst_QXmppLogger::readLines(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return {};
+    }
+    return QString::fromUtf8(file.readAll()).split(u'\n', Qt::SkipEmptyParts);
+}
+
+void tst_QXmppLogger::testFile_data()
+{
+    QTest::addColumn<bool>("asynchronous");
+
+    QTest::newRow("synchronous") << false;
+    QTest::newRow("asynchronous") << true;
+}
+
+void tst_QXmppLogger::testFile()
+{
+    QFETCH(bool, asynchronous);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("test.log");
+
+    QXmppLogger logger;
+    logger.setLogFilePath(path);
+    logger.setLoggingType(QXmppLogger::FileLogging);
+    logger.setMessageTypes(QXmppLogger::AnyMessage);
+    logger.setAsynchronous(asynchronous);
+
+    for (int i = 0; i < 1000; ++i) {
+        logger.log(QXmppLogger::SentMessage, QStringLiteral("message %1").arg(i));
+    }
+    logger.log(QXmppLogger::DebugMessage, QStringLiteral("umlaut ä"));
+    logger.flush();
+
+    const auto lines = readLines(path);
+    QCOMPARE(lines.size(), 1001);
+    for (int i = 0; i < 1000; ++i) {
+        QVERIFY(lines[i].endsWith(QStringLiteral(" SENT message %1").arg(i)));
+    }
+    QVERIFY(lines.last().endsWith(QStringLiteral(" DEBUG umlaut ä")));
+    QCOMPARE(logger.droppedMessageCount(), qint64(0));
+}
+
+void tst_QXmppLogger::testRotation_data()
+{
+    QTest::addColumn<bool>("asynchronous");
+
+    QTest::newRow("synchronous") << false;
+    QTest::newRow("asynchronous") << true;
+}
+
+void tst_QXmppLogger::testRotation()
+{
+    QFETCH(bool, asynchronous);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("test.log");
+
+    QXmppLogger logger;
+    logger.setLogFilePath(path);
+    logger.setLoggingType(QXmppLogger::FileLogging);
+    logger.setAsynchronous(asynchronous);
+    logger.setMaxLogFileSize(4096);
+    logger.setMaxRotatedFiles(2);
+
+    for (int i = 0; i < 1000; ++i) {
+        logger.log(QXmppLogger::InformationMessage, QStringLiteral("message %1").arg(i));
+        if (asynchronous && i % 50 == 0) {
+            // write in several batches
+            logger.flush();
+        }
+    }
+    logger.flush();
+
+    QVERIFY(QFile::exists(path));
+    QVERIFY(QFile::exists(path + ".1"));
+    QVERIFY(QFile::exists(path + ".2"));
+    QVERIFY(!QFile::exists(path + ".3"));
+    QVERIFY(QFileInfo(path).size() <= 4096);
+
+    // the newest messages are kept in order
+    const auto lines = readLines(path + ".2") + readLines(path + ".1") + readLines(path);
+    QVERIFY(!lines.isEmpty());
+    QVERIFY(lines.last().endsWith(QStringLiteral("message 999")));
+    const int first = 1000 - lines.size();
+    for (int i = 0; i < lines.size(); ++i) {
+        QVERIFY(lines[i].endsWith(QStringLiteral("INFO message %1").arg(first + i)));
+    }
+}
+
+void tst_QXmppLogger::testOverflow_data()
+{
+    QTest::addColumn<QXmppLogger::OverflowPolicy>("policy");
+
+    QTest::newRow("drop") << QXmppLogger::DropOnOverflow;
+    QTest::newRow("block") << QXmppLogger::BlockOnOverflow;
+}
+
+void tst_QXmppLogger::testOverflow()
+{
+    QFETCH(QXmppLogger::OverflowPolicy, policy);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.filePath("test.log");
+
+    const int count = 20000;
+    qint64 dropped;
+    {
+        QXmppLogger logger;
+        logger.setLogFilePath(path);
+        logger.setLoggingType(QXmppLogger::FileLogging);
+        logger.setAsynchronous(true);
+        logger.setBufferCapacity(4);
+        logger.setOverflowPolicy(policy);
+
+        for (int i = 0; i < count; ++i) {
+            logger.log(QXmppLogger::SentMessage, QStringLiteral("message %1").arg(i));
+        }
+        // pending messages are written on destruction
+        dropped = logger.droppedMessageCount();
+    }
+
+    const auto lines = readLines(path);
+    int written = 0;
+    qint64 reportedDropped = 0;
+    int last = -1;
+    for (const auto &line : lines) {
+        if (line.endsWith(QStringLiteral(" log messages were dropped"))) {
+            reportedDropped += line.section(u' ', 0, 0).toLongLong();
+            continue;
+        }
+        const int index = line.section(u' ', -1).toInt();
+        QVERIFY(index > last);
+        last = index;
+        written++;
+    }
+
+    QCOMPARE(written + dropped, qint64(count));
+    QCOMPARE(reportedDropped, dropped);
+    if (policy == QXmppLogger::BlockOnOverflow) {
+        QCOMPARE(dropped, qint64(0));
+    }
+}
+
+void tst_QXmppLogger::testLoggableSink()
+{
+    QXmppLogger logger;
+    logger.setLoggingType(QXmppLogger::SignalLogging);
+    QSignalSpy spy(&logger, &QXmppLogger::message);
+
+    QXmppLoggable root;
+    auto *child = new QXmppLoggable(&root);
+    auto *grandChild = new QXmppLoggable(child);
+    QXmppLoggable detached;
+
+    // nothing is reached without a sink
+    grandChild->log(QXmppLogger::InformationMessage, QStringLiteral("lost"));
+    QVERIFY(!grandChild->loggingSink());
+    QCOMPARE(spy.size(), 0);
+
+    // the sink of the nearest ancestor is used
+    root.setLoggingSink(&logger);
+    QCOMPARE(grandChild->loggingSink(), &logger);
+    grandChild->log(QXmppLogger::InformationMessage, QStringLiteral("nested"));
+    QCOMPARE(spy.size(), 1);
+    QCOMPARE(spy.last().at(1).toString(), QStringLiteral("nested"));
+
+    // reparenting is picked up
+    grandChild->setParent(&detached);
+    QVERIFY(!grandChild->loggingSink());
+    grandChild->log(QXmppLogger::InformationMessage, QStringLiteral("lost"));
+    QCOMPARE(spy.size(), 1);
+
+    // the logging parent is used if no ancestor has a sink
+    detached.setLoggingParent(child);
+    QCOMPARE(grandChild->loggingSink(), &logger);
+    grandChild->log(QXmppLogger::InformationMessage, QStringLiteral("logging parent"));
+    QCOMPARE(spy.size(), 2);
+
+    // a nearer sink takes precedence
+    QXmppLogger otherLogger;
+    detached.setLoggingSink(&otherLogger);
+    QCOMPARE(grandChild->loggingSink(), &otherLogger);
+
+    // metrics reach the sink too
+    child->reportCounter(QStringLiteral("test.counter"), 3);
+    child->reportGauge(QStringLiteral("test.gauge"), 2.5);
+    child->reportValue(QStringLiteral("test.histogram"), 7);
+    const auto snapshot = logger.metrics()->snapshot();
+    QCOMPARE(snapshot.counters.value(QStringLiteral("test.counter")), qint64(3));
+    QCOMPARE(snapshot.gauges.value(QStringLiteral("test.gauge")), 2.5);
+    QCOMPARE(snapshot.histograms.value(QStringLiteral("test.histogram")).count, qint64(1));
+}
+
+void tst_QXmppLogger::testLoggableSignals()
+{
+    QXmppLogger logger;
+    logger.setLoggingType(QXmppLogger::SignalLogging);
+    QSignalSpy loggerSpy(&logger, &QXmppLogger::message);
+
+    QXmppLoggable root;
+    root.setLoggingSink(&logger);
+    auto *child = new QXmppLoggable(&root);
+
+    // ancestors with receivers emit the compatibility signals
+    QSignalSpy rootSpy(&root, &QXmppLoggable::logMessage);
+    QSignalSpy childSpy(child, &QXmppLoggable::updateCounter);
+    child->log(QXmppLogger::WarningMessage, QStringLiteral("warning"));
+    child->reportCounter(QStringLiteral("test.counter"));
+    QCOMPARE(loggerSpy.size(), 1);
+    QCOMPARE(rootSpy.size(), 1);
+    QCOMPARE(rootSpy.last().at(0).value<QXmppLogger::MessageType>(), QXmppLogger::WarningMessage);
+    QCOMPARE(rootSpy.last().at(1).toString(), QStringLiteral("warning"));
+    QCOMPARE(childSpy.size(), 1);
+
+    // emitting the signals only notifies their receivers
+    Q_EMIT child->logMessage(QXmppLogger::WarningMessage, QStringLiteral("signal"));
+    Q_EMIT child->updateCounter(QStringLiteral("test.counter"), 2);
+    QCOMPARE(loggerSpy.size(), 1);
+    QCOMPARE(rootSpy.size(), 1);
+    QCOMPARE(childSpy.size(), 2);
+    QCOMPARE(logger.metrics()->snapshot().counters.value(QStringLiteral("test.counter")), qint64(1));
+
+    // disconnected receivers are dropped right away
+    root.disconnect(&rootSpy);
+    child->disconnect();
+    child->log(QXmppLogger::WarningMessage, QStringLiteral("warning"));
+    child->reportCounter(QStringLiteral("test.counter"));
+    QCOMPARE(loggerSpy.size(), 2);
+    QCOMPARE(rootSpy.size(), 1);
+    QCOMPARE(childSpy.size(), 2);
+    QCOMPARE(logger.metrics()->snapshot().counters.value(QStringLiteral("test.counter")), qint64(2));
+}
+
+void tst_QXmppLogger::testLoggableThread()
+{
+    QXmppLogger logger;
+    logger.setLoggingType(QXmppLogger::SignalLogging);
+    QSignalSpy loggerSpy(&logger, &QXmppLogger::message);
+
+    QXmppLoggable root;
+    root.setLoggingSink(&logger);
+    QSignalSpy rootSpy(&root, &QXmppLoggable::logMessage);
+
+    QThread thread;
+    auto *worker = new QXmppLoggable;
+    worker->setLoggingParent(&root);
+    worker->moveToThread(&thread);
+    connect(&thread, &QThread::finished, worker, &QObject::deleteLater);
+    thread.start();
+
+    // the sink and the listeners receive the messages in their thread
+    QMetaObject::invokeMethod(worker, [worker]() {
+        worker->log(QXmppLogger::InformationMessage, QStringLiteral("worker"));
+    });
+    QTRY_COMPARE(loggerSpy.size(), 1);
+    QTRY_COMPARE(rootSpy.size(), 1);
+    QCOMPARE(rootSpy.last().at(1).toString(), QStringLiteral("worker"));
+
+    thread.quit();
+    QVERIFY(thread.wait());
+}
+
+QTEST_MAIN(tst_QXmppLogger)
+#include "tst_qxmpplogger.moc"
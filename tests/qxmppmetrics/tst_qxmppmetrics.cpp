@@ -0,0 +1,178 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppClient.h"
+#include "QXmppLogger.h"
+#include "QXmppMessage.h"
+#include "QXmppMetrics.h"
+#include "QXmppServer.h"
+
+#include "util.h"
+
+#include <thread>
+#include <vector>
+
+using Histogram = QXmppMetrics::Histogram;
+
+class tst_QXmppMetrics : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void testBuckets();
+    Q_SLOT void testHistogram();
+    Q_SLOT void testConcurrentUpdates();
+    Q_SLOT void testPrometheus();
+    Q_SLOT void testLogger();
+    Q_SLOT void testStreamMetrics();
+};
+
+void tst_QXmppMetrics::testBuckets()
+{
+    // the buckets cover the whole range without gaps
+    for (int i = 0; i < Histogram::BucketCount; ++i) {
+        QVERIFY(Histogram::bucketLowerBound(i) <= Histogram::bucketUpperBound(i));
+        QCOMPARE(Histogram::bucketIndex(Histogram::bucketLowerBound(i)), i);
+        QCOMPARE(Histogram::bucketIndex(Histogram::bucketUpperBound(i)), i);
+        if (i > 0) {
+            QCOMPARE(Histogram::bucketLowerBound(i), Histogram::bucketUpperBound(i - 1) + 1);
+        }
+    }
+    QCOMPARE(Histogram::bucketLowerBound(0), qint64(0));
+    QCOMPARE(Histogram::bucketUpperBound(Histogram::BucketCount - 1), std::numeric_limits<qint64>::max());
+
+    // relative precision
+    for (qint64 value : { qint64(9), qint64(1000), qint64(123456789) }) {
+        const int index = Histogram::bucketIndex(value);
+        const auto width = Histogram::bucketUpperBound(index) - Histogram::bucketLowerBound(index);
+        QVERIFY(width * 8 <= Histogram::bucketLowerBound(index));
+    }
+}
+
+void tst_QXmppMetrics::testHistogram()
+{
+    QXmppMetrics metrics;
+    auto *histogram = metrics.histogram("latency");
+    QCOMPARE(metrics.histogram("latency"), histogram);
+
+    for (int i = 1; i <= 100; ++i) {
+        histogram->record(i * 10);
+    }
+    histogram->record(-5);
+
+    const auto values = metrics.snapshot().histograms.value("latency");
+    QCOMPARE(values.count, qint64(101));
+    QCOMPARE(values.sum, qint64(50500));
+    QCOMPARE(values.max, qint64(1000));
+    QCOMPARE(values.percentile(0), qint64(0));
+    QCOMPARE(values.percentile(100), qint64(1000));
+
+    const auto p50 = values.percentile(50);
+    QVERIFY(p50 >= 500 && p50 <= 500 * 9 / 8);
+    const auto p99 = values.percentile(99);
+    QVERIFY(p99 >= 990 && p99 <= 1000);
+
+    QCOMPARE(QXmppMetrics::HistogramSnapshot().percentile(50), qint64(0));
+}
+
+void tst_QXmppMetrics::testConcurrentUpdates()
+{
+    QXmppMetrics metrics;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&metrics, t]() {
+            auto *counter = metrics.counter("shared");
+            for (int i = 0; i < 10000; ++i) {
+                counter->add();
+                metrics.histogram("values")->record(t);
+                metrics.counter(QStringLiteral("thread-%1").arg(t))->add(2);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    const auto snapshot = metrics.snapshot();
+    QCOMPARE(snapshot.counters.value("shared"), qint64(40000));
+    QCOMPARE(snapshot.counters.value("thread-3"), qint64(20000));
+    QCOMPARE(snapshot.histograms.value("values").count, qint64(40000));
+    QCOMPARE(snapshot.histograms.value("values").max, qint64(3));
+}
+
+void tst_QXmppMetrics::testPrometheus()
+{
+    QXmppMetrics metrics;
+    metrics.counter("incoming-client.auth.success")->add(3);
+    metrics.gauge("incoming-client.count")->set(2);
+    metrics.histogram("stream.iq-round-trip-us")->record(3);
+    metrics.histogram("stream.iq-round-trip-us")->record(3);
+    metrics.histogram("stream.iq-round-trip-us")->record(20);
+
+    QCOMPARE(metrics.toPrometheus(),
+             QByteArray("# TYPE qxmpp_incoming_client_auth_success_total counter\n"
+                        "qxmpp_incoming_client_auth_success_total 3\n"
+                        "# TYPE qxmpp_incoming_client_count gauge\n"
+                        "qxmpp_incoming_client_count 2\n"
+                        "# TYPE qxmpp_stream_iq_round_trip_us histogram\n"
+                        "qxmpp_stream_iq_round_trip_us_bucket{le=\"3\"} 2\n"
+                        "qxmpp_stream_iq_round_trip_us_bucket{le=\"21\"} 3\n"
+                        "qxmpp_stream_iq_round_trip_us_bucket{le=\"+Inf\"} 3\n"
+                        "qxmpp_stream_iq_round_trip_us_sum 26\n"
+                        "qxmpp_stream_iq_round_trip_us_count 3\n"));
+
+    QVERIFY(metrics.toPrometheus("server").startsWith("# TYPE server_incoming_client_auth_success_total counter\n"));
+}
+
+void tst_QXmppMetrics::testLogger()
+{
+    QXmppLogger logger;
+    QXmppClient client;
+    client.setLogger(&logger);
+
+    client.reportCounter("test.counter");
+    client.reportCounter("test.counter", 4);
+    client.reportGauge("test.gauge", 1.5);
+    client.reportValue("test.histogram", 42);
+
+    const auto snapshot = logger.metrics()->snapshot();
+    QCOMPARE(snapshot.counters.value("test.counter"), qint64(5));
+    QCOMPARE(snapshot.gauges.value("test.gauge"), 1.5);
+    QCOMPARE(snapshot.histograms.value("test.histogram").count, qint64(1));
+}
+
+void tst_QXmppMetrics::testStreamMetrics()
+{
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+
+    QXmppLogger logger;
+    QXmppServer server;
+    server.setDomain(QStringLiteral("localhost"));
+    server.setPasswordChecker(&passwordChecker);
+    server.setLogger(&logger);
+
+    QXmppClient alice;
+    alice.setLogger(nullptr);
+    connectInMemory(server, alice, "alice");
+    QVERIFY(alice.isConnected());
+
+    const auto receivedMessages = [](QXmppLogger &logger) {
+        return logger.metrics()->snapshot().counters.value("stream.stanzas-received.message");
+    };
+    alice.sendMessage("localhost", "hello");
+    QTRY_COMPARE(receivedMessages(logger), qint64(1));
+    QVERIFY(logger.metrics()->snapshot().counters.value("stream.bytes-received") > 0);
+
+    // the metrics are looked up again in the registry of a new sink
+    QXmppLogger otherLogger;
+    server.setLogger(&otherLogger);
+    alice.sendMessage("localhost", "hello");
+    QTRY_COMPARE(receivedMessages(otherLogger), qint64(1));
+    QCOMPARE(receivedMessages(logger), qint64(1));
+}
+
+QTEST_MAIN(tst_QXmppMetrics)
+#include "tst_qxmppmetrics.moc"
@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppOutgoingServer.h"
+
+#include "util.h"
+
+class tst_QXmppOutgoingServer : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void initTestCase();
+    Q_SLOT void testQueueLimit();
+    Q_SLOT void testQueueTimeout();
+};
+
+void tst_QXmppOutgoingServer::initTestCase()
+{
+    qRegisterMetaType<QXmppStanza::Error::Condition>();
+}
+
+void tst_QXmppOutgoingServer::testQueueLimit()
+{
+    QXmppOutgoingServer stream("example.com", nullptr);
+    QCOMPARE(stream.queueLimit(), qint64(1024 * 1024));
+    stream.setQueueLimit(100);
+
+    QSignalSpy droppedSpy(&stream, &QXmppOutgoingServer::queuedDataDropped);
+
+    const QByteArray presence = R"(<presence to="a@remote.example" from="b@example.com"/>)";
+    const QByteArray iq = R"(<iq id="1" type="get" to="remote.example" from="b@example.com"/>)";
+
+    stream.queueData(presence);
+    QCOMPARE(droppedSpy.size(), 0);
+
+    // the presence is dropped to make room for the IQ
+    stream.queueData(iq);
+    QCOMPARE(droppedSpy.size(), 1);
+    QCOMPARE(droppedSpy.at(0).at(0).toByteArray(), presence);
+    QCOMPARE(droppedSpy.at(0).at(1).value<QXmppStanza::Error::Condition>(), QXmppStanza::Error::ResourceConstraint);
+
+    // the new IQ does not fit anymore
+    stream.queueData(iq);
+    QCOMPARE(droppedSpy.size(), 2);
+    QCOMPARE(droppedSpy.at(1).at(0).toByteArray(), iq);
+}
+
+void tst_QXmppOutgoingServer::testQueueTimeout()
+{
+    QXmppOutgoingServer stream("example.com", nullptr);
+    stream.setQueueTimeout(50);
+
+    QSignalSpy droppedSpy(&stream, &QXmppOutgoingServer::queuedDataDropped);
+
+    const QByteArray iq = R"(<iq id="1" type="get" to="remote.example" from="b@example.com"/>)";
+    stream.queueData(iq);
+    QCOMPARE(droppedSpy.size(), 0);
+
+    QVERIFY(droppedSpy.wait());
+    QCOMPARE(droppedSpy.at(0).at(0).toByteArray(), iq);
+    QCOMPARE(droppedSpy.at(0).at(1).value<QXmppStanza::Error::Condition>(), QXmppStanza::Error::RemoteServerTimeout);
+}
+
+QTEST_MAIN(tst_QXmppOutgoingServer)
+#include "tst_qxmppoutgoingserver.moc"
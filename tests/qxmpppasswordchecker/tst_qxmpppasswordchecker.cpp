@@ -0,0 +1,235 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppAsyncPasswordChecker.h"
+
+#include "util.h"
+
+#include <atomic>
+
+#include <QCryptographicHash>
+#include <QThread>
+
+Q_DECLARE_METATYPE(QXmppPasswordReply::Error)
+
+class TestAsyncPasswordChecker : public QXmppAsyncPasswordChecker
+{
+public:
+    using QXmppAsyncPasswordChecker::QXmppAsyncPasswordChecker;
+
+    std::atomic<int> lookups { 0 };
+    std::atomic<int> running { 0 };
+    std::atomic<int> maxRunning { 0 };
+
+protected:
+    QXmppPasswordReply::Error getPassword(const QXmppPasswordRequest &request, QString &password) override
+    {
+        lookups++;
+        const int count = ++running;
+        int expected = maxRunning;
+        while (count > expected && !maxRunning.compare_exchange_weak(expected, count)) {
+        }
+
+        // simulate a slow backend
+        QThread::msleep(20);
+        running--;
+
+        if (request.username() == QStringLiteral("testuser")) {
+            password = QStringLiteral("testpwd");
+            return QXmppPasswordReply::NoError;
+        }
+        return QXmppPasswordReply::AuthorizationError;
+    }
+};
+
+class tst_QXmppPasswordChecker : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void testAsyncCheckPassword_data();
+    Q_SLOT void testAsyncCheckPassword();
+    Q_SLOT void testAsyncCache();
+    Q_SLOT void testAsyncLookupsPerAddress();
+    Q_SLOT void testAsyncCoalescing();
+    Q_SLOT void testAsyncShutdown();
+    Q_SLOT void testAsyncScramKeys();
+};
+
+static QXmppPasswordRequest passwordRequest(const QString &username, const QString &password, const QString &address = QStringLiteral("127.0.0.1"))
+{
+    QXmppPasswordRequest request;
+    request.setDomain(QStringLiteral("example.com"));
+    request.setUsername(username);
+    request.setPassword(password);
+    request.setRemoteAddress(address);
+    return request;
+}
+
+static QXmppPasswordReply::Error waitForReply(QXmppPasswordReply *reply)
+{
+    QSignalSpy spy(reply, &QXmppPasswordReply::finished);
+    if (!reply->isFinished() && !spy.wait()) {
+        return QXmppPasswordReply::TemporaryError;
+    }
+    const auto error = reply->error();
+    delete reply;
+    return error;
+}
+
+void tst_QXmppPasswordChecker::testAsyncCheckPassword_data()
+{
+    QTest::addColumn<QString>("username");
+    QTest::addColumn<QString>("password");
+    QTest::addColumn<QXmppPasswordReply::Error>("error");
+
+    QTest::newRow("good") << "testuser"
+                          << "testpwd" << QXmppPasswordReply::NoError;
+    QTest::newRow("bad-username") << "baduser"
+                                  << "testpwd" << QXmppPasswordReply::AuthorizationError;
+    QTest::newRow("bad-password") << "testuser"
+                                  << "badpwd" << QXmppPasswordReply::AuthorizationError;
+}
+
+void tst_QXmppPasswordChecker::testAsyncCheckPassword()
+{
+    QFETCH(QString, username);
+    QFETCH(QString, password);
+    QFETCH(QXmppPasswordReply::Error, error);
+
+    TestAsyncPasswordChecker checker;
+    QVERIFY(checker.hasGetPassword());
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest(username, password))), error);
+
+    auto *reply = checker.getDigest(passwordRequest(username, {}));
+    QSignalSpy spy(reply, &QXmppPasswordReply::finished);
+    QVERIFY(spy.wait());
+    if (username == QStringLiteral("testuser")) {
+        QCOMPARE(reply->error(), QXmppPasswordReply::NoError);
+        QCOMPARE(reply->digest(), QCryptographicHash::hash("testuser:example.com:testpwd", QCryptographicHash::Md5));
+    } else {
+        QCOMPARE(reply->error(), QXmppPasswordReply::AuthorizationError);
+    }
+    delete reply;
+}
+
+void tst_QXmppPasswordChecker::testAsyncCache()
+{
+    TestAsyncPasswordChecker checker;
+
+    // positive results are cached
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("testuser", "testpwd"))), QXmppPasswordReply::NoError);
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("testuser", "badpwd"))), QXmppPasswordReply::AuthorizationError);
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("testuser", "testpwd"))), QXmppPasswordReply::NoError);
+    QCOMPARE(checker.lookups.load(), 1);
+
+    // negative results are cached
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("baduser", "testpwd"))), QXmppPasswordReply::AuthorizationError);
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("baduser", "testpwd"))), QXmppPasswordReply::AuthorizationError);
+    QCOMPARE(checker.lookups.load(), 2);
+
+    checker.clearCache();
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("testuser", "testpwd"))), QXmppPasswordReply::NoError);
+    QCOMPARE(checker.lookups.load(), 3);
+}
+
+void tst_QXmppPasswordChecker::testAsyncLookupsPerAddress()
+{
+    TestAsyncPasswordChecker checker;
+    checker.setCacheTimeout(0);
+    checker.setNegativeCacheTimeout(0);
+    checker.setMaxThreadCount(4);
+    checker.setMaxLookupsPerAddress(1);
+
+    QList<QXmppPasswordReply *> replies;
+    for (int i = 0; i < 4; ++i) {
+        replies << checker.checkPassword(passwordRequest(QStringLiteral("user%1").arg(i), "testpwd"));
+    }
+    for (auto *reply : std::as_const(replies)) {
+        QCOMPARE(waitForReply(reply), QXmppPasswordReply::AuthorizationError);
+    }
+
+    QCOMPARE(checker.lookups.load(), 4);
+    QCOMPARE(checker.maxRunning.load(), 1);
+}
+
+void tst_QXmppPasswordChecker::testAsyncCoalescing()
+{
+    TestAsyncPasswordChecker checker;
+    checker.setCacheTimeout(0);
+    checker.setMaxLookupsPerAddress(0);
+
+    // concurrent requests of the same user share one lookup
+    QList<QXmppPasswordReply *> replies;
+    for (int i = 0; i < 4; ++i) {
+        replies << checker.checkPassword(passwordRequest("testuser", i % 2 ? "badpwd" : "testpwd", QStringLiteral("127.0.0.%1").arg(i)));
+    }
+    for (int i = 0; i < replies.size(); ++i) {
+        QCOMPARE(waitForReply(replies[i]), i % 2 ? QXmppPasswordReply::AuthorizationError : QXmppPasswordReply::NoError);
+    }
+    QCOMPARE(checker.lookups.load(), 1);
+
+    // a finished lookup is not joined, with the cache disabled
+    QCOMPARE(waitForReply(checker.checkPassword(passwordRequest("testuser", "testpwd"))), QXmppPasswordReply::NoError);
+    QCOMPARE(checker.lookups.load(), 2);
+}
+
+void tst_QXmppPasswordChecker::testAsyncShutdown()
+{
+    // the checker is owned by its parent, which stops the lookups before the
+    // members of the subclass are destroyed
+    auto parent = std::make_unique<QObject>();
+    auto *checker = new TestAsyncPasswordChecker(parent.get());
+    checker->setMaxThreadCount(2);
+    checker->setMaxLookupsPerAddress(1);
+
+    QList<QXmppPasswordReply *> replies;
+    for (int i = 0; i < 4; ++i) {
+        replies << checker->checkPassword(passwordRequest(QStringLiteral("user%1").arg(i), "testpwd"));
+    }
+
+    // destroyed with lookups running and waiting
+    QTRY_VERIFY(checker->running.load() > 0);
+    parent.reset();
+
+    // all requests are answered
+    for (auto *reply : std::as_const(replies)) {
+        const auto error = waitForReply(reply);
+        QVERIFY(error == QXmppPasswordReply::AuthorizationError || error == QXmppPasswordReply::TemporaryError);
+    }
+}
+
+void tst_QXmppPasswordChecker::testAsyncScramKeys()
+{
+    // the synchronous derivation is not offered by default
+    QVERIFY(!QXmppPasswordChecker().hasGetScramKeys());
+
+    TestAsyncPasswordChecker checker;
+    QVERIFY(checker.hasGetScramKeys());
+
+    auto getKeys = [&](const QString &username) {
+        auto *reply = checker.getScramKeys(passwordRequest(username, {}), QCryptographicHash::Sha256);
+        QSignalSpy spy(reply, &QXmppPasswordReply::finished);
+        spy.wait();
+        return std::unique_ptr<QXmppPasswordReply>(reply);
+    };
+
+    const auto first = getKeys(QStringLiteral("testuser"));
+    QCOMPARE(first->error(), QXmppPasswordReply::NoError);
+    QCOMPARE(int(first->salt().size()), 16);
+    QCOMPARE(first->iterationCount(), 4096);
+    QCOMPARE(int(first->storedKey().size()), 32);
+    QCOMPARE(int(first->serverKey().size()), 32);
+
+    // the keys are cached
+    const auto second = getKeys(QStringLiteral("testuser"));
+    QCOMPARE(second->salt(), first->salt());
+    QCOMPARE(second->storedKey(), first->storedKey());
+    QCOMPARE(checker.lookups.load(), 1);
+
+    QCOMPARE(getKeys(QStringLiteral("baduser"))->error(), QXmppPasswordReply::AuthorizationError);
+}
+
+QTEST_MAIN(tst_QXmppPasswordChecker)
+#include "tst_qxmpppasswordchecker.moc"
@@ -43,6 +43,8 @@ private:
     Q_SLOT void testServerDigestMd5();
     Q_SLOT void testServerPlain();
     Q_SLOT void testServerPlainChallenge();
+    Q_SLOT void testServerScramSha1();
+    Q_SLOT void testServerScramSha1_bad();
 };
 
 void tst_QXmppSasl::testParsing()
@@ -531,5 +533,65 @@ void tst_QXmppSasl::testServerPlainChallenge()
     delete server;
 }
 
+void tst_QXmppSasl::testServerScramSha1()
+{
+    QXmppSaslDigestMd5::setNonce("3rfcNHYJY1ZVvWVs7j");
+
+    QXmppSaslServer *server = QXmppSaslServer::create("SCRAM-SHA-1");
+    QVERIFY(server != 0);
+    QCOMPARE(server->mechanism(), QLatin1String("SCRAM-SHA-1"));
+
+    // first step needs the stored keys
+    QByteArray response;
+    QCOMPARE(server->respond(QByteArray("n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL"), response), QXmppSaslServer::InputNeeded);
+    QCOMPARE(server->username(), QLatin1String("user"));
+
+    const QByteArray salt = QByteArray::fromBase64("QSXCR+Q6sek8bf92");
+    const auto keys = QXmpp::Private::deriveScramKeys(QCryptographicHash::Sha1, "pencil", salt, 4096);
+    dynamic_cast<QXmppSaslServerScram *>(server)->setKeys(salt, 4096, keys.storedKey, keys.serverKey);
+
+    QCOMPARE(server->respond(QByteArray("n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL"), response), QXmppSaslServer::Challenge);
+    QCOMPARE(response, QByteArray("r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,s=QSXCR+Q6sek8bf92,i=4096"));
+
+    // second step
+    QCOMPARE(server->respond(QByteArray("c=biws,r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,p=v0X8v3Bz2T0CJGbJQyF0X+HI4Ts="), response), QXmppSaslServer::Challenge);
+    QCOMPARE(response, QByteArray("v=rmF9pqV8S7suAoZWja4dJRkFsKQ="));
+
+    // third step
+    QCOMPARE(server->respond(QByteArray(), response), QXmppSaslServer::Succeeded);
+    QCOMPARE(response, QByteArray());
+
+    // any further step is an error
+    QCOMPARE(server->respond(QByteArray(), response), QXmppSaslServer::Failed);
+
+    delete server;
+}
+
+void tst_QXmppSasl::testServerScramSha1_bad()
+{
+    QXmppSaslDigestMd5::setNonce("3rfcNHYJY1ZVvWVs7j");
+
+    QXmppSaslServer *server = QXmppSaslServer::create("SCRAM-SHA-1");
+    QVERIFY(server != 0);
+
+    // channel binding is not supported
+    QByteArray response;
+    QCOMPARE(server->respond(QByteArray("p=tls-unique,,n=user,r=fyko+d2lbbFgONRv9qkxdawL"), response), QXmppSaslServer::Failed);
+    delete server;
+
+    server = QXmppSaslServer::create("SCRAM-SHA-1");
+    QCOMPARE(server->respond(QByteArray("n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL"), response), QXmppSaslServer::InputNeeded);
+
+    const QByteArray salt = QByteArray::fromBase64("QSXCR+Q6sek8bf92");
+    const auto keys = QXmpp::Private::deriveScramKeys(QCryptographicHash::Sha1, "wrong", salt, 4096);
+    dynamic_cast<QXmppSaslServerScram *>(server)->setKeys(salt, 4096, keys.storedKey, keys.serverKey);
+    QCOMPARE(server->respond(QByteArray("n,,n=user,r=fyko+d2lbbFgONRv9qkxdawL"), response), QXmppSaslServer::Challenge);
+
+    // the proof does not match the stored key
+    QCOMPARE(server->respond(QByteArray("c=biws,r=fyko+d2lbbFgONRv9qkxdawL3rfcNHYJY1ZVvWVs7j,p=v0X8v3Bz2T0CJGbJQyF0X+HI4Ts="), response), QXmppSaslServer::Failed);
+
+    delete server;
+}
+
 QTEST_MAIN(tst_QXmppSasl)
 #include "tst_qxmppsasl.moc"
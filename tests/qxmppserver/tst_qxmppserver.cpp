@@ -3,10 +3,76 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include "QXmppClient.h"
+#include "QXmppMemoryTransport.h"
+#include "QXmppMessage.h"
 #include "QXmppServer.h"
+#include "QXmppServerExtension.h"
 
 #include "util.h"
 
+class FilteredExtension : public QXmppServerExtension
+{
+public:
+    FilteredExtension(int priority, const QVector<StanzaFilter> &filters, bool consume)
+        : m_priority(priority), m_filters(filters), m_consume(consume)
+    {
+    }
+
+    int extensionPriority() const override { return m_priority; }
+    QVector<StanzaFilter> stanzaFilters() const override { return m_filters; }
+    bool handleStanza(const QDomElement &element) override
+    {
+        handled << element.attribute(QStringLiteral("id"));
+        return m_consume;
+    }
+
+    QStringList handled;
+
+private:
+    int m_priority;
+    QVector<StanzaFilter> m_filters;
+    bool m_consume;
+};
+
+// Rewrites the body of the messages it sees in place.
+class RewritingExtension : public QXmppServerExtension
+{
+public:
+    bool handleStanza(const QDomElement &element) override
+    {
+        auto body = element.firstChildElement(QStringLiteral("body"));
+        if (!body.isNull()) {
+            body.firstChild().setNodeValue(body.text().toUpper());
+        }
+        return false;
+    }
+};
+
+// A message written as is, to send attributes QXmppMessage would omit.
+class RawMessage : public QXmppNonza
+{
+public:
+    RawMessage(const QString &from, const QString &to, const QString &body)
+        : m_from(from), m_to(to), m_body(body)
+    {
+    }
+
+    void parse(const QDomElement &) override { }
+    void toXml(QXmlStreamWriter *writer) const override
+    {
+        writer->writeStartElement(QStringLiteral("message"));
+        writer->writeAttribute(QStringLiteral("from"), m_from);
+        writer->writeAttribute(QStringLiteral("to"), m_to);
+        writer->writeTextElement(QStringLiteral("body"), m_body);
+        writer->writeEndElement();
+    }
+
+private:
+    QString m_from;
+    QString m_to;
+    QString m_body;
+};
+
 class tst_QXmppServer : public QObject
 {
     Q_OBJECT
@@ -14,6 +80,15 @@ class tst_QXmppServer : public QObject
 private:
     Q_SLOT void testConnect_data();
     Q_SLOT void testConnect();
+    Q_SLOT void testWorkerThreads_data();
+    Q_SLOT void testWorkerThreads();
+    Q_SLOT void testInMemory_data();
+    Q_SLOT void testInMemory();
+    Q_SLOT void testEmptyFrom();
+    Q_SLOT void testModifiedStanza();
+    Q_SLOT void testMemoryAccounting();
+    Q_SLOT void testReceiveBufferLimit();
+    Q_SLOT void testStanzaFilters();
 };
 
 void tst_QXmppServer::testConnect_data()
@@ -42,6 +117,19 @@ void tst_QXmppServer::testConnect_data()
     QTest::newRow("digest-bad-password") << "testuser"
                                          << "badpwd"
                                          << "DIGEST-MD5" << false;
+
+    QTest::newRow("scram-sha1-good") << "testuser"
+                                     << "testpwd"
+                                     << "SCRAM-SHA-1" << true;
+    QTest::newRow("scram-sha256-good") << "testuser"
+                                       << "testpwd"
+                                       << "SCRAM-SHA-256" << true;
+    QTest::newRow("scram-sha256-bad-username") << "baduser"
+                                               << "testpwd"
+                                               << "SCRAM-SHA-256" << false;
+    QTest::newRow("scram-sha256-bad-password") << "testuser"
+                                               << "badpwd"
+                                               << "SCRAM-SHA-256" << false;
 }
 
 void tst_QXmppServer::testConnect()
@@ -90,5 +178,330 @@ void tst_QXmppServer::testConnect()
     QCOMPARE(client.isConnected(), connected);
 }
 
+void tst_QXmppServer::testWorkerThreads_data()
+{
+    QTest::addColumn<bool>("reusePort");
+    QTest::addColumn<quint16>("testPort");
+
+    QTest::newRow("single-listener") << false << quint16(12346);
+    QTest::newRow("reuse-port") << true << quint16(12347);
+}
+
+void tst_QXmppServer::testWorkerThreads()
+{
+    QFETCH(bool, reusePort);
+    QFETCH(quint16, testPort);
+
+    const QString testDomain("localhost");
+    const QHostAddress testHost(QHostAddress::LocalHost);
+
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.setWorkerThreadCount(2);
+    QCOMPARE(server.workerThreadCount(), 2);
+    server.setReusePortEnabled(reusePort);
+    if (reusePort && !server.isReusePortEnabled()) {
+        QSKIP("SO_REUSEPORT is not supported on this platform");
+    }
+    QVERIFY(server.listenForClients(testHost, testPort));
+
+    auto connectClient = [&](QXmppClient &client, const QString &user) {
+        QEventLoop loop;
+        connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+        connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+        QXmppConfiguration config;
+        config.setDomain(testDomain);
+        config.setHost(testHost.toString());
+        config.setPort(testPort);
+        config.setUser(user);
+        config.setPassword("testpwd");
+        config.setResource("worker");
+        client.connectToServer(config);
+        loop.exec();
+    };
+
+    QXmppClient alice;
+    QXmppClient bob;
+    connectClient(alice, "alice");
+    connectClient(bob, "bob");
+    QVERIFY(alice.isConnected());
+    QVERIFY(bob.isConnected());
+    QCOMPARE(server.statistics().value("incoming-clients").toInt(), 2);
+
+    // messages are routed between connections hosted by different workers
+    QString received;
+    QEventLoop loop;
+    connect(&bob, &QXmppClient::messageReceived, &loop, [&](const QXmppMessage &message) {
+        received = message.body();
+        loop.quit();
+    });
+    alice.sendMessage("bob@localhost/worker", "hello");
+    loop.exec();
+    QCOMPARE(received, QStringLiteral("hello"));
+}
+
+void tst_QXmppServer::testInMemory_data()
+{
+    QTest::addColumn<int>("workerThreadCount");
+
+    QTest::newRow("server-thread") << 0;
+    QTest::newRow("worker-threads") << 2;
+}
+
+void tst_QXmppServer::testInMemory()
+{
+    QFETCH(int, workerThreadCount);
+
+    const QString testDomain("localhost");
+
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+
+    // the server doesn't listen on any socket
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.setWorkerThreadCount(workerThreadCount);
+
+    auto connectClient = [&](QXmppClient &client, const QString &user) {
+        QEventLoop loop;
+        connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+        connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+        QXmppConfiguration config;
+        config.setDomain(testDomain);
+        config.setUser(user);
+        config.setPassword("testpwd");
+        config.setResource("memory");
+        client.connectToServer(config, server.connectInMemory());
+        loop.exec();
+    };
+
+    QXmppClient alice;
+    QXmppClient bob;
+    connectClient(alice, "alice");
+    connectClient(bob, "bob");
+    QVERIFY(alice.isConnected());
+    QVERIFY(bob.isConnected());
+    QCOMPARE(alice.state(), QXmppClient::ConnectedState);
+    QCOMPARE(server.statistics().value("incoming-clients").toInt(), 2);
+
+    QString received;
+    QEventLoop loop;
+    connect(&bob, &QXmppClient::messageReceived, &loop, [&](const QXmppMessage &message) {
+        received = message.body();
+        loop.quit();
+    });
+    alice.sendMessage("bob@localhost/memory", "hello");
+    loop.exec();
+    QCOMPARE(received, QStringLiteral("hello"));
+
+    // closing the client end disconnects the server end
+    QSignalSpy disconnectedSpy(&server, &QXmppServer::clientDisconnected);
+    alice.disconnectFromServer();
+    QCOMPARE(alice.state(), QXmppClient::DisconnectedState);
+    QVERIFY(disconnectedSpy.wait());
+    QCOMPARE(disconnectedSpy.first().first().toString(), QStringLiteral("alice@localhost/memory"));
+}
+
+void tst_QXmppServer::testEmptyFrom()
+{
+    const QString testDomain("localhost");
+
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+
+    auto connectClient = [&](QXmppClient &client, const QString &user) {
+        QEventLoop loop;
+        connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+        connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+        QXmppConfiguration config;
+        config.setDomain(testDomain);
+        config.setUser(user);
+        config.setPassword("testpwd");
+        config.setResource("memory");
+        client.connectToServer(config, server.connectInMemory());
+        loop.exec();
+    };
+
+    QXmppClient alice;
+    QXmppClient bob;
+    connectClient(alice, "alice");
+    connectClient(bob, "bob");
+    QVERIFY(alice.isConnected());
+    QVERIFY(bob.isConnected());
+
+    // the empty sender is replaced instead of being duplicated
+    QList<QXmppMessage> received;
+    connect(&bob, &QXmppClient::messageReceived, this, [&](const QXmppMessage &message) {
+        received << message;
+    });
+    QSignalSpy bobDisconnectedSpy(&bob, &QXmppClient::disconnected);
+    QVERIFY(alice.sendPacket(RawMessage(QString(), "bob@localhost/memory", "hello")));
+    QTRY_COMPARE(received.size(), 1);
+
+    QCOMPARE(received.first().from(), QStringLiteral("alice@localhost/memory"));
+    QCOMPARE(received.first().body(), QStringLiteral("hello"));
+    QVERIFY(bob.isConnected());
+    QCOMPARE(bobDisconnectedSpy.size(), 0);
+}
+
+void tst_QXmppServer::testModifiedStanza()
+{
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+
+    QXmppServer server;
+    server.setDomain(QStringLiteral("localhost"));
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(new RewritingExtension);
+
+    QXmppClient alice;
+    QXmppClient bob;
+    connectInMemory(server, alice, "alice", "memory");
+    connectInMemory(server, bob, "bob", "memory");
+    QVERIFY(alice.isConnected());
+    QVERIFY(bob.isConnected());
+
+    // the stanza modified in place is forwarded instead of the received XML
+    QList<QXmppMessage> received;
+    connect(&bob, &QXmppClient::messageReceived, this, [&](const QXmppMessage &message) {
+        received << message;
+    });
+    alice.sendMessage("bob@localhost/memory", "hello");
+    QTRY_COMPARE(received.size(), 1);
+    QCOMPARE(received.first().body(), QStringLiteral("HELLO"));
+}
+
+void tst_QXmppServer::testMemoryAccounting()
+{
+    const QString testDomain("localhost");
+
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.setMemoryAccountingInterval(20);
+    QCOMPARE(server.memoryAccountingInterval(), 20);
+
+    QXmppClient client;
+    QEventLoop loop;
+    connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+    connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+    QXmppConfiguration config;
+    config.setDomain(testDomain);
+    config.setUser("alice");
+    config.setPassword("testpwd");
+    config.setResource("memory");
+    client.connectToServer(config, server.connectInMemory());
+    loop.exec();
+    QVERIFY(client.isConnected());
+
+    // the connection is listed once it has been measured
+    auto largestConnections = [&]() {
+        return server.statistics().value("memory").toMap().value("largest-connections").toList();
+    };
+    QTRY_COMPARE(largestConnections().size(), 1);
+    const auto connection = largestConnections().first().toMap();
+    QCOMPARE(connection.value("jid").toString(), QStringLiteral("alice@localhost/memory"));
+    QVERIFY(connection.value("total").toLongLong() > 0);
+
+    // connections exceeding the limit are closed
+    QSignalSpy disconnectedSpy(&client, &QXmppClient::disconnected);
+    server.setConnectionMemoryLimit(1);
+    QCOMPARE(server.connectionMemoryLimit(), qint64(1));
+    QVERIFY(disconnectedSpy.wait());
+    QTRY_VERIFY(largestConnections().isEmpty());
+}
+
+void tst_QXmppServer::testReceiveBufferLimit()
+{
+    const QString testDomain("localhost");
+
+    TestPasswordChecker passwordChecker;
+    passwordChecker.addCredentials("alice", "testpwd");
+
+    // no accounting passes, the limit is checked when reading
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.setMemoryAccountingInterval(0);
+    server.setConnectionMemoryLimit(64 * 1024);
+
+    QXmppClient client;
+    QEventLoop loop;
+    connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+    connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+    QXmppConfiguration config;
+    config.setDomain(testDomain);
+    config.setUser("alice");
+    config.setPassword("testpwd");
+    config.setResource("memory");
+    auto *transport = server.connectInMemory();
+    client.connectToServer(config, transport);
+    loop.exec();
+    QVERIFY(client.isConnected());
+
+    // an unterminated stanza exceeding the limit closes the connection
+    QSignalSpy disconnectedSpy(&server, &QXmppServer::clientDisconnected);
+    transport->write("<message to='alice@localhost'><body>" + QByteArray(100 * 1024, 'a'));
+    QVERIFY(disconnectedSpy.wait());
+    QCOMPARE(disconnectedSpy.first().first().toString(), QStringLiteral("alice@localhost/memory"));
+}
+
+void tst_QXmppServer::testStanzaFilters()
+{
+    using Extension = QXmppServerExtension;
+
+    QXmppServer server;
+    server.setDomain(QStringLiteral("localhost"));
+
+    auto *catchAll = new FilteredExtension(0, { Extension::StanzaFilter() }, false);
+    auto *pings = new FilteredExtension(10, { { Extension::IqStanza, QStringLiteral("urn:xmpp:ping"), Extension::ServerTarget } }, true);
+    auto *messages = new FilteredExtension(20, {
+                                                   { Extension::MessageStanza, {}, Extension::LocalTarget },
+                                                   { Extension::MessageStanza, QStringLiteral("urn:test"), Extension::AnyTarget },
+                                               },
+                                           false);
+    server.addExtension(catchAll);
+    server.addExtension(pings);
+
+    server.handleElement(xmlToDom(QStringLiteral("<iq id=\"1\" type=\"get\" from=\"a@localhost/r\"><ping xmlns=\"urn:xmpp:ping\"/></iq>")));
+    QCOMPARE(pings->handled, QStringList { "1" });
+    QVERIFY(catchAll->handled.isEmpty());
+
+    // the index is rebuilt when extensions are added
+    server.addExtension(messages);
+
+    server.handleElement(xmlToDom(QStringLiteral("<iq id=\"2\" type=\"get\" to=\"b@localhost\"><ping xmlns=\"urn:xmpp:ping\"/></iq>")));
+    server.handleElement(xmlToDom(QStringLiteral("<message id=\"3\" to=\"b@localhost\"><body>hi</body></message>")));
+    server.handleElement(xmlToDom(QStringLiteral("<message id=\"4\" to=\"b@example.com\"><body>hi</body></message>")));
+    server.handleElement(xmlToDom(QStringLiteral("<message id=\"5\" to=\"b@localhost\"><x xmlns=\"urn:test\"/></message>")));
+    server.handleElement(xmlToDom(QStringLiteral("<presence id=\"6\"/>")));
+
+    QCOMPARE(pings->handled, QStringList { "1" });
+    // matched by both filters, but handled once
+    QCOMPARE(messages->handled, (QStringList { "3", "5" }));
+    QCOMPARE(catchAll->handled, (QStringList { "2", "3", "4", "5", "6" }));
+}
+
 QTEST_MAIN(tst_QXmppServer)
 #include "tst_qxmppserver.moc"
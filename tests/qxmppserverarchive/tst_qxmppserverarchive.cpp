@@ -0,0 +1,200 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppClient.h"
+#include "QXmppMamManager.h"
+#include "QXmppMessage.h"
+#include "QXmppServer.h"
+#include "QXmppServerArchive.h"
+#include "QXmppTask.h"
+
+#include "util.h"
+
+#include <QTemporaryDir>
+
+using RetrievedMessages = QXmppMamManager::RetrievedMessages;
+
+class tst_QXmppServerArchive : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void initTestCase();
+    Q_SLOT void init();
+    Q_SLOT void cleanup();
+    Q_SLOT void testArchive();
+    Q_SLOT void testPaging();
+    Q_SLOT void testWith();
+    Q_SLOT void testQueryAfterSend();
+    Q_SLOT void testForbidden();
+
+    RetrievedMessages retrieve(const QString &to, const QString &with, const QXmppResultSetQuery &query);
+
+    const QString testDomain = QStringLiteral("localhost");
+    TestPasswordChecker passwordChecker;
+
+    std::unique_ptr<QTemporaryDir> dir;
+    std::unique_ptr<QXmppServer> server;
+    QXmppServerArchive *archive = nullptr;
+    std::unique_ptr<QXmppClient> alice;
+    QXmppMamManager *mamManager = nullptr;
+};
+
+void tst_QXmppServerArchive::initTestCase()
+{
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+}
+
+void tst_QXmppServerArchive::init()
+{
+    dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(dir->isValid());
+
+    archive = new QXmppServerArchive;
+    archive->setDirectory(dir->path());
+    archive->setMaxPageSize(50);
+
+    server = std::make_unique<QXmppServer>();
+    server->setDomain(testDomain);
+    server->setPasswordChecker(&passwordChecker);
+    server->addExtension(archive);
+
+    alice = std::make_unique<QXmppClient>();
+    mamManager = new QXmppMamManager;
+    alice->addExtension(mamManager);
+    connectInMemory(*server, *alice, "alice");
+    QVERIFY(alice->isConnected());
+
+    // messages to bob and carol, with a message without body in between
+    for (int i = 0; i < 10; ++i) {
+        alice->sendMessage("bob@localhost", QStringLiteral("message %1").arg(i));
+    }
+    alice->sendPacket(QXmppMessage(QString(), "bob@localhost"));
+    for (int i = 0; i < 3; ++i) {
+        alice->sendMessage("carol@localhost", QStringLiteral("carol %1").arg(i));
+    }
+    QTRY_COMPARE(archive->archivedMessageCount("alice@localhost"), qint64(13));
+}
+
+void tst_QXmppServerArchive::cleanup()
+{
+    alice.reset();
+    server.reset();
+    dir.reset();
+}
+
+RetrievedMessages tst_QXmppServerArchive::retrieve(const QString &to, const QString &with, const QXmppResultSetQuery &query)
+{
+    auto task = mamManager->retrieveMessages(to, {}, with, {}, {}, query);
+    [&]() { QTRY_VERIFY(task.isFinished()); }();
+    return expectFutureVariant<RetrievedMessages>(task);
+}
+
+void tst_QXmppServerArchive::testArchive()
+{
+    // both local parties have a copy, bob is offline
+    QCOMPARE(archive->archivedMessageCount("bob@localhost"), qint64(10));
+    QCOMPARE(archive->archivedMessageCount("carol@localhost"), qint64(3));
+
+    const auto result = retrieve({}, {}, {});
+    QCOMPARE(result.messages.size(), 13);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("message 0"));
+    QCOMPARE(result.messages.first().from(), QStringLiteral("alice@localhost/QXmpp"));
+    QCOMPARE(result.messages.first().to(), QStringLiteral("bob@localhost"));
+    QVERIFY(result.messages.first().stamp().isValid());
+    QCOMPARE(result.messages.last().body(), QStringLiteral("carol 2"));
+    QVERIFY(result.result.complete());
+    QCOMPARE(result.result.resultSetReply().count(), 13);
+    QCOMPARE(result.result.resultSetReply().first(), QStringLiteral("0"));
+    QCOMPARE(result.result.resultSetReply().last(), QStringLiteral("12"));
+
+    // addressed to the own bare JID
+    const auto ownResult = retrieve("alice@localhost", {}, {});
+    QCOMPARE(ownResult.messages.size(), 13);
+    QVERIFY(ownResult.result.complete());
+}
+
+void tst_QXmppServerArchive::testPaging()
+{
+    // forwards
+    QXmppResultSetQuery query;
+    query.setMax(4);
+    auto result = retrieve({}, {}, query);
+    QCOMPARE(result.messages.size(), 4);
+    QVERIFY(!result.result.complete());
+    QCOMPARE(result.result.resultSetReply().index(), 0);
+
+    query.setAfter(result.result.resultSetReply().last());
+    result = retrieve({}, {}, query);
+    QCOMPARE(result.messages.size(), 4);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("message 4"));
+    QCOMPARE(result.result.resultSetReply().index(), 4);
+
+    // last page
+    query = {};
+    query.setMax(5);
+    query.setBefore(QStringLiteral(""));
+    result = retrieve({}, {}, query);
+    QCOMPARE(result.messages.size(), 5);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("message 8"));
+    QCOMPARE(result.messages.last().body(), QStringLiteral("carol 2"));
+    QVERIFY(!result.result.complete());
+
+    // backwards to the start
+    query.setBefore(result.result.resultSetReply().first());
+    query.setMax(10);
+    result = retrieve({}, {}, query);
+    QCOMPARE(result.messages.size(), 8);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("message 0"));
+    QVERIFY(result.result.complete());
+
+    // page size is capped
+    archive->setMaxPageSize(2);
+    result = retrieve({}, {}, {});
+    QCOMPARE(result.messages.size(), 2);
+    QCOMPARE(result.result.resultSetReply().count(), 13);
+    QVERIFY(!result.result.complete());
+}
+
+void tst_QXmppServerArchive::testQueryAfterSend()
+{
+    // the query is answered once the message sent before it is written
+    alice->sendMessage("bob@localhost", QStringLiteral("last"));
+    const auto result = retrieve({}, {}, {});
+    QCOMPARE(result.messages.size(), 14);
+    QCOMPARE(result.messages.last().body(), QStringLiteral("last"));
+    QCOMPARE(archive->archivedMessageCount("alice@localhost"), qint64(14));
+}
+
+void tst_QXmppServerArchive::testWith()
+{
+    auto result = retrieve({}, "carol@localhost", {});
+    QCOMPARE(result.messages.size(), 3);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("carol 0"));
+    QCOMPARE(result.result.resultSetReply().first(), QStringLiteral("10"));
+    QVERIFY(result.result.complete());
+
+    QXmppResultSetQuery query;
+    query.setAfter(QStringLiteral("10"));
+    result = retrieve({}, "carol@localhost", query);
+    QCOMPARE(result.messages.size(), 2);
+    QCOMPARE(result.messages.first().body(), QStringLiteral("carol 1"));
+
+    // unknown archive ID
+    query.setAfter(QStringLiteral("100"));
+    auto task = mamManager->retrieveMessages({}, {}, {}, {}, {}, query);
+    QTRY_VERIFY(task.isFinished());
+    expectFutureVariant<QXmppError>(task);
+}
+
+void tst_QXmppServerArchive::testForbidden()
+{
+    auto task = mamManager->retrieveMessages("bob@localhost");
+    QTRY_VERIFY(task.isFinished());
+    expectFutureVariant<QXmppError>(task);
+}
+
+QTEST_MAIN(tst_QXmppServerArchive)
+#include "tst_qxmppserverarchive.moc"
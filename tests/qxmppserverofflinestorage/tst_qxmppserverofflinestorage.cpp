@@ -0,0 +1,319 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppClient.h"
+#include "QXmppMessage.h"
+#include "QXmppServer.h"
+#include "QXmppServerExtension.h"
+#include "QXmppServerOfflineStorage.h"
+#include "QXmppUtils.h"
+
+#include "util.h"
+
+#include <functional>
+#include <utility>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QDomElement>
+#include <QTemporaryDir>
+
+// Calls a function on the first presence of a user, after the storage has
+// handled it.
+class PresenceHook : public QXmppServerExtension
+{
+    Q_OBJECT
+
+public:
+    bool handleStanza(const QDomElement &stanza) override
+    {
+        if (stanza.tagName() == QLatin1String("presence") && callback &&
+            QXmppUtils::jidToBareJid(stanza.attribute(QStringLiteral("from"))) == bareJid) {
+            std::exchange(callback, nullptr)();
+        }
+        return false;
+    }
+
+    QString bareJid;
+    std::function<void()> callback;
+};
+
+static bool copyDirectory(const QString &source, const QString &destination)
+{
+    const QDir sourceDir(source);
+    if (!QDir().mkpath(destination)) {
+        return false;
+    }
+    const auto entries = sourceDir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot);
+    for (const auto &entry : entries) {
+        const QString target = destination + "/" + entry.fileName();
+        if (entry.isDir() ? !copyDirectory(entry.filePath(), target) : !QFile::copy(entry.filePath(), target)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class tst_QXmppServerOfflineStorage : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void initTestCase();
+    Q_SLOT void testDeliver();
+    Q_SLOT void testUnknownUser();
+    Q_SLOT void testRestart_data();
+    Q_SLOT void testRestart();
+    Q_SLOT void testRestartPartialDelivery();
+
+    void sendMessages(QXmppServer &server, int count, const QString &to = QStringLiteral("bob@localhost"), int padding = 0);
+
+    const QString testDomain = QStringLiteral("localhost");
+    TestPasswordChecker passwordChecker;
+};
+
+void tst_QXmppServerOfflineStorage::initTestCase()
+{
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+}
+
+void tst_QXmppServerOfflineStorage::sendMessages(QXmppServer &server, int count, const QString &to, int padding)
+{
+    QXmppClient alice;
+    connectInMemory(server, alice, "alice");
+    QVERIFY(alice.isConnected());
+    for (int i = 0; i < count; ++i) {
+        QXmppMessage message(QString(), to, QStringLiteral("message %1").arg(i));
+        if (padding > 0) {
+            message.setSubject(QString(padding, QLatin1Char('x')));
+        }
+        alice.sendPacket(message);
+    }
+    alice.disconnectFromServer();
+}
+
+void tst_QXmppServerOfflineStorage::testDeliver()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    auto *storage = new QXmppServerOfflineStorage;
+    storage->setDirectory(dir.path());
+    // spread the messages over several segments
+    storage->setSegmentSize(512);
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(storage);
+
+    sendMessages(server, 20);
+    QTRY_COMPARE(storage->storedMessageCount("bob@localhost"), qint64(20));
+    // the messages are written by the writer thread
+    QTRY_COMPARE(int(QDir(dir.path() + "/users").entryList(QDir::Dirs | QDir::NoDotAndDotDot).size()), 1);
+
+    // messages are delivered in order on initial presence
+    QList<QXmppMessage> received;
+    QXmppClient bob;
+    connect(&bob, &QXmppClient::messageReceived, this, [&](const QXmppMessage &message) {
+        received << message;
+    });
+    connectInMemory(server, bob, "bob");
+    QVERIFY(bob.isConnected());
+    QTRY_COMPARE(received.size(), 20);
+    for (int i = 0; i < received.size(); ++i) {
+        QCOMPARE(received[i].body(), QStringLiteral("message %1").arg(i));
+        QCOMPARE(received[i].from(), QStringLiteral("alice@localhost/QXmpp"));
+        QVERIFY(received[i].stamp().isValid());
+    }
+
+    // the log is removed once delivered
+    QCOMPARE(storage->storedMessageCount("bob@localhost"), qint64(0));
+    QVERIFY(QDir(dir.path() + "/users").entryList(QDir::Dirs | QDir::NoDotAndDotDot).isEmpty());
+
+    // messages to connected users are not stored
+    received.clear();
+    sendMessages(server, 1);
+    QTRY_COMPARE(received.size(), 1);
+    QCOMPARE(storage->storedMessageCount("bob@localhost"), qint64(0));
+}
+
+void tst_QXmppServerOfflineStorage::testUnknownUser()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    auto *storage = new QXmppServerOfflineStorage;
+    storage->setDirectory(dir.path());
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(storage);
+
+    // the accounts are looked up in order, so carol's lookup is done once
+    // bob's message is stored
+    sendMessages(server, 1, QStringLiteral("carol@localhost"));
+    sendMessages(server, 1);
+    QTRY_COMPARE(storage->storedMessageCount("bob@localhost"), qint64(1));
+    QCOMPARE(storage->storedMessageCount("carol@localhost"), qint64(0));
+    QTRY_COMPARE(int(QDir(dir.path() + "/users").entryList(QDir::Dirs | QDir::NoDotAndDotDot).size()), 1);
+}
+
+void tst_QXmppServerOfflineStorage::testRestart_data()
+{
+    QTest::addColumn<bool>("removeIndex");
+    QTest::addColumn<bool>("addDirectory");
+
+    QTest::newRow("index") << false << false;
+    QTest::newRow("rebuild-index") << true << false;
+    QTest::newRow("unindexed-directory") << false << true;
+}
+
+void tst_QXmppServerOfflineStorage::testRestart()
+{
+    QFETCH(bool, removeIndex);
+    QFETCH(bool, addDirectory);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    {
+        auto *storage = new QXmppServerOfflineStorage;
+        storage->setDirectory(dir.path());
+
+        QXmppServer server;
+        server.setDomain(testDomain);
+        server.setPasswordChecker(&passwordChecker);
+        server.addExtension(storage);
+    
+        sendMessages(server, 5);
+        QTRY_COMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+    }
+
+    if (removeIndex) {
+        QVERIFY(QFile::remove(dir.path() + "/index"));
+    }
+    if (addDirectory) {
+        QVERIFY(QDir().mkpath(dir.path() + "/users/unindexed"));
+    }
+
+    auto *storage = new QXmppServerOfflineStorage;
+    storage->setDirectory(dir.path());
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(storage);
+
+    // the storage is started with the first connection
+    QXmppClient alice;
+    connectInMemory(server, alice, "alice");
+    QCOMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+
+    // the directory without messages is dropped, the indexed users are kept
+    QVERIFY(!QFileInfo::exists(dir.path() + "/users/unindexed"));
+
+    QList<QXmppMessage> received;
+    QXmppClient bob;
+    connect(&bob, &QXmppClient::messageReceived, this, [&](const QXmppMessage &message) {
+        received << message;
+    });
+    connectInMemory(server, bob, "bob");
+    QTRY_COMPARE(received.size(), 5);
+    QCOMPARE(received.last().body(), QStringLiteral("message 4"));
+}
+
+void tst_QXmppServerOfflineStorage::testRestartPartialDelivery()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString copyPath = dir.path() + "/copy";
+    const QString segmentPath = copyPath + "/users/" + QString::fromLatin1(QCryptographicHash::hash("bob@localhost", QCryptographicHash::Sha1).toHex()) + "/00000000.seg";
+
+    // the first batch of 64 KiB holds two of the messages, the storage is
+    // stopped before the next batch and its files are copied
+    {
+        auto *storage = new QXmppServerOfflineStorage;
+        storage->setDirectory(dir.path() + "/storage");
+        auto *hook = new PresenceHook;
+        hook->bareJid = QStringLiteral("bob@localhost");
+        hook->callback = [&]() {
+            storage->stop();
+            QVERIFY(copyDirectory(dir.path() + "/storage", copyPath));
+        };
+
+        QXmppServer server;
+        server.setDomain(testDomain);
+        server.setPasswordChecker(&passwordChecker);
+        server.addExtension(storage);
+        server.addExtension(hook);
+
+        sendMessages(server, 5, QStringLiteral("bob@localhost"), 40000);
+        QTRY_COMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+
+        QXmppClient bob;
+        connectInMemory(server, bob, "bob");
+        QTRY_VERIFY(QFileInfo::exists(copyPath + "/index"));
+    }
+    QVERIFY(QFile::copy(copyPath + "/index", dir.path() + "/stale-index"));
+
+    // messages written after the index was saved are counted on restart
+    {
+        auto *storage = new QXmppServerOfflineStorage;
+        storage->setDirectory(copyPath);
+
+        QXmppServer server;
+        server.setDomain(testDomain);
+        server.setPasswordChecker(&passwordChecker);
+        server.addExtension(storage);
+
+        sendMessages(server, 2);
+        QTRY_COMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+    }
+    QVERIFY(QFile::remove(copyPath + "/index"));
+    QVERIFY(QFile::copy(dir.path() + "/stale-index", copyPath + "/index"));
+
+    // the delivered messages are removed from the segment
+    {
+        auto *storage = new QXmppServerOfflineStorage;
+        storage->setDirectory(copyPath);
+
+        QXmppServer server;
+        server.setDomain(testDomain);
+        server.setPasswordChecker(&passwordChecker);
+        server.addExtension(storage);
+
+        // the storage is started with the first connection
+        QXmppClient alice;
+        connectInMemory(server, alice, "alice");
+        QCOMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+
+        const qint64 size = QFileInfo(segmentPath).size();
+        storage->compact();
+        QVERIFY(QFileInfo(segmentPath).size() < size - 80000);
+        QCOMPARE(storage->storedMessageCount("bob@localhost"), qint64(5));
+    }
+
+    auto *storage = new QXmppServerOfflineStorage;
+    storage->setDirectory(copyPath);
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(storage);
+
+    QStringList received;
+    QXmppClient bob;
+    connect(&bob, &QXmppClient::messageReceived, this, [&](const QXmppMessage &message) {
+        received << message.body();
+    });
+    connectInMemory(server, bob, "bob");
+    QTRY_COMPARE(received.size(), 5);
+    QCOMPARE(received, QStringList({ "message 2", "message 3", "message 4", "message 0", "message 1" }));
+}
+
+QTEST_MAIN(tst_QXmppServerOfflineStorage)
+#include "tst_qxmppserverofflinestorage.moc"
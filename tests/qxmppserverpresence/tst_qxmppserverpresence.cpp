@@ -0,0 +1,157 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppClient.h"
+#include "QXmppServer.h"
+#include "QXmppServerPresence.h"
+
+#include "util.h"
+
+#include <algorithm>
+
+class TestRoster : public QXmppServerExtension
+{
+public:
+    void addSubscription(const QString &user, const QString &contact)
+    {
+        m_subscribers[contact].insert(user);
+    }
+
+    QSet<QString> presenceSubscribers(const QString &jid) override
+    {
+        return m_subscribers.value(jid);
+    }
+
+    QSet<QString> presenceSubscriptions(const QString &jid) override
+    {
+        QSet<QString> subscriptions;
+        for (auto itr = m_subscribers.cbegin(); itr != m_subscribers.cend(); ++itr) {
+            if (itr->contains(jid)) {
+                subscriptions.insert(itr.key());
+            }
+        }
+        return subscriptions;
+    }
+
+private:
+    QHash<QString, QSet<QString>> m_subscribers;
+};
+
+class tst_QXmppServerPresence : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void initTestCase();
+    Q_SLOT void testBroadcastTarget_data();
+    Q_SLOT void testBroadcastTarget();
+    Q_SLOT void testBroadcast();
+
+
+    const QString testDomain = QStringLiteral("localhost");
+    TestPasswordChecker passwordChecker;
+};
+
+void tst_QXmppServerPresence::initTestCase()
+{
+    passwordChecker.addCredentials("alice", "testpwd");
+    passwordChecker.addCredentials("bob", "testpwd");
+    passwordChecker.addCredentials("carol", "testpwd");
+}
+
+void tst_QXmppServerPresence::testBroadcastTarget_data()
+{
+    QTest::addColumn<QString>("xml");
+    QTest::addColumn<bool>("broadcast");
+
+    QTest::newRow("no-to") << "<presence from=\"alice@localhost/r\"/>" << true;
+    QTest::newRow("domain") << "<presence from=\"alice@localhost/r\" to=\"localhost\"/>" << true;
+    QTest::newRow("bare-jid") << "<presence from=\"alice@localhost/r\" to=\"alice@localhost\"/>" << true;
+    QTest::newRow("directed") << "<presence from=\"alice@localhost/r\" to=\"bob@localhost\"/>" << false;
+}
+
+void tst_QXmppServerPresence::testBroadcastTarget()
+{
+    QFETCH(QString, xml);
+    QFETCH(bool, broadcast);
+
+    auto *presenceEngine = new QXmppServerPresence;
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.addExtension(presenceEngine);
+    QVERIFY(presenceEngine->start());
+
+    QCOMPARE(presenceEngine->handleStanza(xmlToDom(xml)), broadcast);
+    QCOMPARE(int(presenceEngine->availablePresences("alice@localhost").size()), broadcast ? 1 : 0);
+}
+
+void tst_QXmppServerPresence::testBroadcast()
+{
+    auto *roster = new TestRoster;
+    roster->addSubscription("alice@localhost", "bob@localhost");
+    roster->addSubscription("bob@localhost", "alice@localhost");
+
+    auto *presenceEngine = new QXmppServerPresence;
+
+    QXmppServer server;
+    server.setDomain(testDomain);
+    server.setPasswordChecker(&passwordChecker);
+    server.addExtension(roster);
+    server.addExtension(presenceEngine);
+
+    QMap<QString, QList<QXmppPresence>> received;
+    auto recordPresences = [&](QXmppClient &client, const QString &user) {
+        connect(&client, &QXmppClient::presenceReceived, this, [&received, user](const QXmppPresence &presence) {
+            received[user] << presence;
+        });
+    };
+    auto hasPresence = [&](const QString &user, const QString &from, QXmppPresence::Type type) {
+        const auto presences = received.value(user);
+        return std::any_of(presences.cbegin(), presences.cend(), [&](const QXmppPresence &presence) {
+            return presence.from() == from && presence.type() == type;
+        });
+    };
+
+    // alice logs in first
+    QXmppClient alice;
+    recordPresences(alice, "alice");
+    connectInMemory(server, alice, "alice", "presence");
+    QVERIFY(alice.isConnected());
+    QTRY_COMPARE(presenceEngine->availablePresences("alice@localhost").size(), 1);
+
+    // bob is answered the probe for alice and alice receives bob's presence
+    QXmppClient bob;
+    recordPresences(bob, "bob");
+    connectInMemory(server, bob, "bob", "presence");
+    QVERIFY(bob.isConnected());
+    QTRY_VERIFY(hasPresence("bob", "alice@localhost/presence", QXmppPresence::Available));
+    QTRY_VERIFY(hasPresence("alice", "bob@localhost/presence", QXmppPresence::Available));
+
+    // carol is not subscribed to anybody
+    QXmppClient carol;
+    recordPresences(carol, "carol");
+    connectInMemory(server, carol, "carol", "presence");
+    QVERIFY(carol.isConnected());
+    QTRY_COMPARE(presenceEngine->availablePresences("carol@localhost").size(), 1);
+
+    // availability changes are broadcast
+    QXmppPresence away;
+    away.setAvailableStatusType(QXmppPresence::Away);
+    alice.setClientPresence(away);
+    QTRY_VERIFY(std::any_of(received["bob"].cbegin(), received["bob"].cend(), [](const QXmppPresence &presence) {
+        return presence.from() == QStringLiteral("alice@localhost/presence") &&
+            presence.availableStatusType() == QXmppPresence::Away;
+    }));
+
+    // going offline is broadcast as well
+    alice.disconnectFromServer();
+    QTRY_VERIFY(hasPresence("bob", "alice@localhost/presence", QXmppPresence::Unavailable));
+    QTRY_VERIFY(presenceEngine->availablePresences("alice@localhost").isEmpty());
+
+    QVERIFY(received.value("carol").isEmpty());
+}
+
+QTEST_MAIN(tst_QXmppServerPresence)
+#include "tst_qxmppserverpresence.moc"
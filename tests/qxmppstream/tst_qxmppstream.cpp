@@ -2,10 +2,15 @@
 //
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
+#include "QXmppMessage.h"
+#include "QXmppPresence.h"
 #include "QXmppStream.h"
 
 #include "util.h"
 
+#include <QSslSocket>
+#include <QTcpServer>
+
 Q_DECLARE_METATYPE(QDomElement)
 
 class TestStream : public QXmppStream
@@ -31,9 +36,14 @@ public:
 
     void handleStanza(const QDomElement &element) override
     {
+        rawStanzas << rawStanzaData();
         Q_EMIT stanzaReceived(element);
     }
 
+    using QXmppStream::setRawStanzaCaptureEnabled;
+
+    QList<QByteArray> rawStanzas;
+
     Q_SIGNAL void started();
     Q_SIGNAL void streamReceived(const QDomElement &element);
     Q_SIGNAL void stanzaReceived(const QDomElement &element);
@@ -46,6 +56,11 @@ class tst_QXmppStream : public QObject
 private:
     Q_SLOT void initTestCase();
     Q_SLOT void testProcessData();
+    Q_SLOT void testRawStanzaData();
+    Q_SLOT void testRateLimit();
+    Q_SLOT void testStanzaTrace();
+    Q_SLOT void testCompactMemory();
+    Q_SLOT void testNormalizedHeader();
 };
 
 void tst_QXmppStream::initTestCase()
@@ -118,5 +133,201 @@ void tst_QXmppStream::testProcessData()
     stream.processData(R"(</stream:stream>)");
 }
 
+void tst_QXmppStream::testRawStanzaData()
+{
+    TestStream stream(this);
+
+    // disabled by default
+    stream.processData(R"(<stream:stream xmlns='jabber:server' xmlns:stream='http://etherx.jabber.org/streams' xmlns:db='jabber:server:dialback'>)");
+    stream.processData(R"(<message to="a@b"/>)");
+    QCOMPARE(stream.rawStanzas, QList<QByteArray>() << QByteArray());
+
+    stream.rawStanzas.clear();
+    stream.setRawStanzaCaptureEnabled(true);
+    stream.processData(R"(<message to="juliet@example.com" xml:lang="en"><body>Moin &amp; Tschüss</body></message> )"
+                       R"(<db:result to="example.com">key</db:result>)"
+                       R"(<iq xmlns="jabber:server" id="1" type="get"/>)"
+                       R"(<presence><x:y xmlns:x="urn:x"/></presence>)");
+
+    QCOMPARE(stream.rawStanzas.size(), 4);
+    QCOMPARE(stream.rawStanzas.at(0), QStringLiteral(R"(<message to="juliet@example.com" xml:lang="en"><body>Moin &amp; Tschüss</body></message>)").toUtf8());
+    // relies on a prefix declared by the stream
+    QVERIFY(stream.rawStanzas.at(1).isEmpty());
+    // declares the stream's default namespace
+    QVERIFY(stream.rawStanzas.at(2).isEmpty());
+    QCOMPARE(stream.rawStanzas.at(3), QByteArray(R"(<presence><x:y xmlns:x="urn:x"/></presence>)"));
+}
+
+void tst_QXmppStream::testRateLimit()
+{
+    QTcpServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    QSslSocket socket;
+    TestStream stream(this);
+    stream.setSocket(&socket);
+
+    QSignalSpy onStarted(&stream, &TestStream::started);
+    socket.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    QVERIFY(onStarted.wait());
+    QVERIFY(server.waitForNewConnection(1000));
+
+    stream.setRateLimit(QXmppStream::MessageTraffic, 20, 2);
+    for (int i = 0; i < 5; i++) {
+        QVERIFY(stream.sendPacket(QXmppMessage({}, "juliet@example.org", "Hi")));
+    }
+    QCOMPARE(stream.queuedPacketCount(), 3);
+
+    // other traffic classes are not limited
+    QVERIFY(stream.sendPacket(QXmppPresence()));
+    QCOMPARE(stream.queuedPacketCount(), 3);
+
+    // queued packets are sent as the budget allows it
+    QTRY_COMPARE(stream.queuedPacketCount(), 0);
+
+    // disabling the limit releases all packets immediately
+    stream.setRateLimit(QXmppStream::MessageTraffic, 1, 1);
+    for (int i = 0; i < 3; i++) {
+        stream.sendPacket(QXmppMessage({}, "juliet@example.org", "Hi"));
+    }
+    QCOMPARE(stream.queuedPacketCount(), 2);
+    stream.setRateLimit(QXmppStream::MessageTraffic, 0, 0);
+    QCOMPARE(stream.queuedPacketCount(), 0);
+
+    // a slow class does not delay the packets of a faster one
+    stream.setRateLimit(QXmppStream::MessageTraffic, 0.1, 1);
+    stream.setRateLimit(QXmppStream::PresenceTraffic, 50, 1);
+    for (int i = 0; i < 2; i++) {
+        stream.sendPacket(QXmppMessage({}, "juliet@example.org", "Hi"));
+        stream.sendPacket(QXmppPresence());
+    }
+    QCOMPARE(stream.queuedPacketCount(), 2);
+    QTRY_COMPARE_WITH_TIMEOUT(stream.queuedPacketCount(), 1, 1000);
+}
+
+void tst_QXmppStream::testStanzaTrace()
+{
+    QTcpServer server;
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+
+    QSslSocket socket;
+    TestStream stream(this);
+    stream.setSocket(&socket);
+
+    QSignalSpy onStarted(&stream, &TestStream::started);
+    socket.connectToHost(QHostAddress::LocalHost, server.serverPort());
+    QVERIFY(onStarted.wait());
+    QVERIFY(server.waitForNewConnection(1000));
+
+    QVector<QXmppStanzaTrace> traces;
+    stream.setStanzaTraceSink([&traces](const QXmppStanzaTrace &trace) {
+        traces << trace;
+    },
+                              2);
+
+    const auto stages = [](const QXmppStanzaTrace &trace) {
+        QVector<QXmppStanzaTrace::Stage> stages;
+        for (const auto &span : trace.spans) {
+            stages << span.stage;
+        }
+        return stages;
+    };
+
+    // incoming: every second stanza is traced
+    stream.processData(R"(<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>)");
+    stream.processData(R"(<message id="m1"/><message id="m2"/><presence id="p1"/>)");
+    QCOMPARE(traces.size(), 2);
+    QCOMPARE(traces[0].direction, QXmppStanzaTrace::Incoming);
+    QCOMPARE(traces[0].tagName, QStringLiteral("message"));
+    QCOMPARE(traces[0].id, QStringLiteral("m1"));
+    QCOMPARE(traces[1].tagName, QStringLiteral("presence"));
+    QCOMPARE(traces[1].id, QStringLiteral("p1"));
+    QCOMPARE(stages(traces[0]), (QVector<QXmppStanzaTrace::Stage> { QXmppStanzaTrace::Parse, QXmppStanzaTrace::StreamManagement, QXmppStanzaTrace::IqResponse, QXmppStanzaTrace::Dispatch }));
+    for (const auto &span : std::as_const(traces[0].spans)) {
+        QVERIFY(span.start <= span.end);
+        QVERIFY(span.start >= traces[0].start);
+    }
+    QVERIFY(traces[0].duration() >= 0);
+
+    // outgoing, including the time spent waiting for the rate limit
+    traces.clear();
+    stream.setRateLimit(QXmppStream::MessageTraffic, 20, 1);
+    QXmppMessage message({}, QStringLiteral("juliet@example.org"), QStringLiteral("Hi"));
+    for (const auto id : { "a", "b", "c" }) {
+        message.setId(QString::fromLatin1(id));
+        QVERIFY(stream.sendPacket(message));
+    }
+    QCOMPARE(traces.size(), 1);
+    QCOMPARE(traces[0].direction, QXmppStanzaTrace::Outgoing);
+    QCOMPARE(traces[0].tagName, QStringLiteral("message"));
+    QCOMPARE(traces[0].id, QStringLiteral("a"));
+    QCOMPARE(stages(traces[0]), QVector<QXmppStanzaTrace::Stage> { QXmppStanzaTrace::SocketWrite });
+
+    QTRY_COMPARE(traces.size(), 2);
+    QCOMPARE(traces[1].id, QStringLiteral("c"));
+    QCOMPARE(stages(traces[1]), (QVector<QXmppStanzaTrace::Stage> { QXmppStanzaTrace::Queue, QXmppStanzaTrace::SocketWrite }));
+
+    // disabled
+    stream.setStanzaTraceSink({});
+    stream.processData(R"(<message id="m3"/><message id="m4"/>)");
+    QCOMPARE(traces.size(), 2);
+}
+
+void tst_QXmppStream::testCompactMemory()
+{
+    const auto header = QStringLiteral("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>");
+    const auto headerSize = qint64(header.size() * sizeof(QChar));
+
+    TestStream stream(this);
+    QSignalSpy onStanzaReceived(&stream, &TestStream::stanzaReceived);
+
+    stream.processData(header);
+    stream.processData(R"(<message to="juliet@example.com">)");
+    stream.processData(R"(<body>)");
+    const auto before = stream.memoryUsage().receiveBuffer;
+    QVERIFY(before > headerSize);
+
+    stream.compactMemory();
+    QVERIFY(stream.memoryUsage().receiveBuffer <= before);
+
+    // the partial stanza is kept
+    stream.processData(R"(Moin</body></message>)");
+    QCOMPARE(onStanzaReceived.size(), 1);
+    const auto message = onStanzaReceived[0][0].value<QDomElement>();
+    QCOMPARE(message.firstChildElement("body").text(), QStringLiteral("Moin"));
+
+    // only the shared stream header is left
+    stream.compactMemory();
+    QCOMPARE(stream.memoryUsage().receiveBuffer, headerSize);
+}
+
+void tst_QXmppStream::testNormalizedHeader()
+{
+    const auto normalized = QStringLiteral("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='example.com'>");
+    const auto normalizedSize = qint64(normalized.size() * sizeof(QChar));
+
+    // the headers only differ in their session attributes
+    const QStringList headers = {
+        QStringLiteral("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' from='juliet@example.com' to='example.com' id='a1'>"),
+        QStringLiteral("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' from=\"romeo@example.com\" to='example.com'>"),
+    };
+    for (const auto &header : headers) {
+        TestStream stream(this);
+        QSignalSpy onStreamReceived(&stream, &TestStream::streamReceived);
+        QSignalSpy onStanzaReceived(&stream, &TestStream::stanzaReceived);
+
+        stream.processData(header);
+        QCOMPARE(onStreamReceived.size(), 1);
+        QVERIFY(onStreamReceived[0][0].value<QDomElement>().hasAttribute(QStringLiteral("from")));
+
+        // the following stanzas are parsed with the normalized header
+        stream.processData(R"(<message to="juliet@example.com"><body>Moin</body></message>)");
+        QCOMPARE(onStanzaReceived.size(), 1);
+
+        stream.compactMemory();
+        QCOMPARE(stream.memoryUsage().receiveBuffer, normalizedSize);
+    }
+}
+
 QTEST_MAIN(tst_QXmppStream)
 #include "tst_qxmppstream.moc"
@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: 2023 agent <agent@local>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "QXmppStreamCapture.h"
+
+#include "util.h"
+
+#include <QBuffer>
+
+class tst_QXmppStreamCapture : public QObject
+{
+    Q_OBJECT
+
+private:
+    Q_SLOT void testRoundTrip();
+    Q_SLOT void testInvalid_data();
+    Q_SLOT void testInvalid();
+    Q_SLOT void testTruncated();
+};
+
+void tst_QXmppStreamCapture::testRoundTrip()
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::ReadWrite);
+
+    // large enough for a multi-byte length
+    const QByteArray large(70000, 'x');
+    {
+        QXmppStreamCapture capture(&buffer);
+        capture.record(QXmppStreamCapture::Inbound, "<stream:stream>");
+        capture.record(QXmppStreamCapture::Outbound, "<stream:features/>");
+        capture.record(QXmppStreamCapture::Inbound, QByteArray());
+        QTest::qWait(5);
+        capture.record(QXmppStreamCapture::Inbound, large);
+    }
+
+    buffer.seek(0);
+    QXmppStreamCaptureReader reader(&buffer);
+    QVERIFY(reader.isValid());
+
+    QXmppStreamCaptureReader::Record record;
+    QVERIFY(reader.readNext(record));
+    QCOMPARE(record.direction, QXmppStreamCapture::Inbound);
+    QCOMPARE(record.data, QByteArray("<stream:stream>"));
+    const qint64 first = record.timestamp;
+
+    QVERIFY(reader.readNext(record));
+    QCOMPARE(record.direction, QXmppStreamCapture::Outbound);
+    QCOMPARE(record.data, QByteArray("<stream:features/>"));
+    QVERIFY(record.timestamp >= first);
+
+    QVERIFY(reader.readNext(record));
+    QCOMPARE(record.direction, QXmppStreamCapture::Inbound);
+    QVERIFY(record.data.isEmpty());
+    const qint64 third = record.timestamp;
+
+    QVERIFY(reader.readNext(record));
+    QCOMPARE(record.data, large);
+    QVERIFY(record.timestamp - third >= 5000);
+
+    QVERIFY(!reader.readNext(record));
+    QVERIFY(buffer.atEnd());
+}
+
+void tst_QXmppStreamCapture::testInvalid_data()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    QTest::newRow("empty") << QByteArray();
+    QTest::newRow("magic") << QByteArray("QXCX\x01");
+    QTest::newRow("version") << QByteArray("QXCP\x02");
+}
+
+void tst_QXmppStreamCapture::testInvalid()
+{
+    QFETCH(QByteArray, data);
+
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    QXmppStreamCaptureReader reader(&buffer);
+    QVERIFY(!reader.isValid());
+
+    QXmppStreamCaptureReader::Record record;
+    QVERIFY(!reader.readNext(record));
+}
+
+void tst_QXmppStreamCapture::testTruncated()
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::ReadWrite);
+    {
+        QXmppStreamCapture capture(&buffer);
+        capture.record(QXmppStreamCapture::Inbound, "<presence/>");
+        capture.record(QXmppStreamCapture::Outbound, "<presence/>");
+    }
+
+    QByteArray data = buffer.data();
+    data.chop(1);
+    QBuffer truncated(&data);
+    truncated.open(QIODevice::ReadOnly);
+
+    QXmppStreamCaptureReader reader(&truncated);
+    QVERIFY(reader.isValid());
+    QXmppStreamCaptureReader::Record record;
+    QVERIFY(reader.readNext(record));
+    QCOMPARE(record.data, QByteArray("<presence/>"));
+    QVERIFY(!reader.readNext(record));
+}
+
+QTEST_MAIN(tst_QXmppStreamCapture)
+#include "tst_qxmppstreamcapture.moc"
@@ -7,6 +7,7 @@
 #include "QXmppHash.h"
 #include "QXmppHashing_p.h"
 #include "QXmppUtils.h"
+#include "QXmppUtils_p.h"
 
 #include "util.h"
 #include <QObject>
@@ -29,6 +30,7 @@ private:
     Q_SLOT void testStanzaHash();
     Q_SLOT void testCalculateHashes_data();
     Q_SLOT void testCalculateHashes();
+    Q_SLOT void testSharedString();
 };
 
 void tst_QXmppUtils::testCrc32()
@@ -201,5 +203,28 @@ void tst_QXmppUtils::testCalculateHashes()
     QCOMPARE(hashes.front().hash(), hash);
 }
 
+void tst_QXmppUtils::testSharedString()
+{
+    // equal strings share their data
+    const auto first = sharedString(QStringLiteral("<stream:stream xmlns='jabber:client'>").left(30));
+    const auto second = sharedString(QStringLiteral("<stream:stream xmlns='jabber:client'>").left(30));
+    QCOMPARE(first, second);
+    QCOMPARE(first.constData(), second.constData());
+
+    // empty and large strings are not pooled
+    QVERIFY(sharedString(QString()).isNull());
+    const QString large(2048, u'a');
+    QCOMPARE(sharedString(large).constData(), large.constData());
+
+    // the pool is cleared once full, strings are pooled again afterwards
+    for (int i = 0; i < 100; ++i) {
+        sharedString(QStringLiteral("header %1").arg(i));
+    }
+    const auto third = sharedString(QStringLiteral("<stream:stream xmlns='jabber:client'>").left(30));
+    QCOMPARE(third, first);
+    const auto fourth = sharedString(QStringLiteral("<stream:stream xmlns='jabber:client'>").left(30));
+    QCOMPARE(fourth.constData(), third.constData());
+}
+
 QTEST_MAIN(tst_QXmppUtils)
 #include "tst_qxmpputils.moc"
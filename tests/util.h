@@ -7,7 +7,10 @@
 #ifndef TESTS_UTIL_H
 #define TESTS_UTIL_H
 
+#include "QXmppClient.h"
+#include "QXmppMemoryTransport.h"
 #include "QXmppPasswordChecker.h"
+#include "QXmppServer.h"
 #include "QXmppTask.h"
 
 #include <memory>
@@ -150,8 +153,33 @@ public:
         return true;
     };
 
+    /// Returns whether SCRAM keys are derived, which is fine for tests.
+    bool hasGetScramKeys() const override
+    {
+        return true;
+    };
+
 private:
     QMap<QString, QString> m_credentials;
 };
 
+// Connects a client to the server over an in-memory transport, so tests don't
+// need a free port, and waits until the client is connected or disconnected.
+inline void connectInMemory(QXmppServer &server, QXmppClient &client, const QString &user, const QString &resource = {})
+{
+    QEventLoop loop;
+    QObject::connect(&client, &QXmppClient::connected, &loop, &QEventLoop::quit);
+    QObject::connect(&client, &QXmppClient::disconnected, &loop, &QEventLoop::quit);
+
+    QXmppConfiguration config;
+    config.setDomain(server.domain());
+    config.setUser(user);
+    config.setPassword(QStringLiteral("testpwd"));
+    if (!resource.isEmpty()) {
+        config.setResource(resource);
+    }
+    client.connectToServer(config, server.connectInMemory());
+    loop.exec();
+}
+
 #endif  // TESTS_UTIL_H